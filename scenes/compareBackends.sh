@@ -0,0 +1,48 @@
+#!/bin/sh
+# Checks that the CPU backend renders what the CUDA pipeline renders: every scene is rendered
+# headless with --backend cuda, then with --backend cpu compared against that image. Fails when
+# the mean or the RMSE of any scene differs by more than the tolerances, as fractions of the CUDA
+# image's mean.
+#
+#   scenes/compareBackends.sh [PATH_TRACER] [ITERATIONS]
+#
+# PATH_TRACER defaults to build/bin/cis565_path_tracer, ITERATIONS to 64. MEAN_TOLERANCE (0.02)
+# and RMSE_TOLERANCE (0.5, the noise of two independent 64 sample images stays well below it)
+# override the tolerances, SCENES the scene files. The images and logs are kept in a temporary
+# directory, which is printed.
+
+absolute() { echo "$(cd "$(dirname "$1")" && pwd)/$(basename "$1")"; }
+
+tracer=$(absolute "${1:-build/bin/cis565_path_tracer}")
+iterations=${2:-64}
+meanTolerance=${MEAN_TOLERANCE:-0.02}
+rmseTolerance=${RMSE_TOLERANCE:-0.5}
+scenes=${SCENES:-"scenes/DisneyBRDF.json scenes/PT_veachScene.json scenes/test.json"}
+out=$(mktemp -d)
+echo "Images and logs in $out"
+
+failed=0
+for scene in $scenes; do
+    name=$(basename "$scene" .json)
+    scene=$(absolute "$scene")
+    # the renders save their PNGs into the working directory
+    if ! (cd "$out" && "$tracer" "$scene" --headless --backend cuda --iterations "$iterations" \
+        --save-hdr "$name" --timing "$name.cuda.json" > "$name.cuda.log" 2>&1); then
+        echo "$name: CUDA render failed, see $out/$name.cuda.log"
+        failed=1
+        continue
+    fi
+    (cd "$out" && "$tracer" "$scene" --headless --backend cpu --iterations "$iterations" --compare "$name.hdr" \
+        --tolerance "$meanTolerance" --rmse-tolerance "$rmseTolerance" --timing "$name.cpu.json" > "$name.cpu.log" 2>&1)
+    status=$?
+    grep "^Compared with\|^Cannot compare\|^Mean differs\|^RMSE is" "$out/$name.cpu.log" | sed "s|^|$name: |"
+    if [ $status -ne 0 ]; then
+        echo "$name: FAILED, see $out/$name.cpu.log"
+        failed=1
+    fi
+done
+
+if [ $failed -eq 0 ]; then
+    echo "CPU and CUDA backends agree within mean $meanTolerance, RMSE $rmseTolerance"
+fi
+exit $failed
@@ -1,6 +1,25 @@
 #pragma once
 #define JITTER 0.5
 #define USE_BVH
+#define BVH_BUILD_THREADS 0 // 0 : all hardware threads, n : build the BVH on n threads
+#define BVH_RADIX_BITS 8 // bits per morton radix sort pass: 6, 8 or 11
+#define BVH_SAH_BINS 16 // default bins per axis for the SAH builder, a scene can override it with "BVH": {"BINS": n}
+#define USE_BVH_CACHE // reuse <scene>.bvhcache when the scene geometry hasn't changed
+#define USE_INSTANCING // meshes placed more than once share one object space BVH through a top level BVH
+#define INSTANCING_MIN_TRIANGLES 256 // meshes with fewer triangles are baked into the scene BVH even when placed more than once
+//#define QUANTIZED_BVH uint8_t // render through the world BVH compressed to uint8_t or uint16_t child boxes, only the compressed nodes are uploaded
+#define CPU_BVH_WIDTH 4 // the CPU backend traverses the world BVH collapsed to 4 or 8 wide SSE nodes, 0 : the binary nodes
+#define BVH_REFIT_REBUILD_RATIO 1.5f // moving a mesh refits the BVH until its SAH cost exceeds ratio * the cost as built, then rebuilds
+#define USE_LIGHT_BVH // pick the light a hit samples by importance through a light BVH
+#define USE_POWER_LIGHT_SELECTION // without USE_LIGHT_BVH, pick lights in proportion to their power through an alias table, otherwise uniformly
+#define SAMPLER SamplerType::Sobol // sequence every pixel's samples come from: Independent, Stratified, Sobol or BlueNoise
+#define SHADE_MATERIAL_QUEUES // shade each MaterialType from its own queue with a kernel compiled for that type only
+#define READBACK_INTERVAL 0 // copy the image, albedo and normal to the host every n iterations in the background, 0 : only when saving
+#define SORT_BY_MATERIAL 65536 // sort a bounce's paths by (hit, material type, material) when at least this many are active
+#define CPU_TILE_SIZE 16 // pixels per side of the CPU backend's tiles, the work items its threads steal
+#define ADAPTIVE_SAMPLING 0 // a pixel stops taking samples once the standard error of its mean luminance is this fraction of the mean (0.01 is a good start), 0 : every pixel takes ITERATIONS samples; a scene overrides it with "Camera": {"ADAPTIVE": t}
+#define ADAPTIVE_MIN_SAMPLES 16 // samples every pixel takes before its variance is trusted
+#define ADAPTIVE_MAX_SAMPLES 8 // times ITERATIONS, the most samples a noisy pixel takes; a render ends once it has spent ITERATIONS samples per pixel
 //#define DEBUG_NORMAL 0 // 1 : clamped, 0 : unclamped
 //#define DEBUG_THROUGHPUT
 //#define DEBUG_RADIANCE
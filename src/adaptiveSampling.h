@@ -0,0 +1,135 @@
+#pragma once
+#include "utilities.h"
+#include "PTDirectives.h"
+#include <algorithm>
+#include <vector>
+
+// remainingBounces of a pixel that takes no sample this iteration, set by the camera stage so the
+// gather knows which pixels have a new sample
+constexpr int PIXEL_SKIPPED = -1;
+
+// Adaptive sampling: every pixel keeps a running mean and variance of the luminance of its samples
+// (Welford) next to the sums of its radiance, albedo and normal. A pixel takes samples until it has
+// minSamples, then until the standard error of its mean and of its neighbours' means drops below
+// threshold times the mean, or it reaches maxSamples. The gather writes the pixel's mean times iter to the image, which is what
+// the image holds when every pixel takes a sample each iteration, so the display, saving and the
+// denoiser divide by iter as before. Passed by value like PathState, threshold 0 turns it off.
+struct AdaptiveSampling
+{
+	int* samples = nullptr;        // samples each pixel took
+	float* mean = nullptr;         // running mean of their luminance
+	float* m2 = nullptr;           // sum of squared differences from it
+	glm::vec3* radiance = nullptr; // sums of the pixel's samples
+	glm::vec3* albedo = nullptr;
+	glm::vec3* normal = nullptr;
+	float threshold = 0.0f;
+	int minSamples = 0;
+	int maxSamples = 0;
+	int width = 0;  // of the image, pixel indices are x + y * width
+	int height = 0;
+
+	static constexpr size_t bytesPerPixel = sizeof(int) + 2 * sizeof(float) + 3 * sizeof(glm::vec3);
+
+	__inline__ __host__ __device__ bool enabled() const { return threshold > 0.0f; }
+
+	// the standard error of the pixel's mean is within threshold of the mean. Dark pixels are held to
+	// the error of a 0.02 luminance one, not to a fraction of almost nothing
+	__inline__ __host__ __device__ bool converged(int pixel) const
+	{
+		int n = samples[pixel];
+		if (n < minSamples)
+			return false;
+		float variance = m2[pixel] / (n - 1);
+		float target = threshold * glm::max(mean[pixel], 0.02f);
+		return variance / n <= target * target;
+	}
+
+	// A few samples can miss what makes a pixel noisy, so a pixel goes on while any of its neighbours
+	// does, as Cycles dilates its adaptive sampling mask
+	__inline__ __host__ __device__ bool wantsSample(int pixel) const
+	{
+		if (samples[pixel] < minSamples)
+			return true;
+		if (samples[pixel] >= maxSamples)
+			return false;
+		int x = pixel % width, y = pixel / width;
+		for (int dy = -1; dy <= 1; ++dy)
+		{
+			for (int dx = -1; dx <= 1; ++dx)
+			{
+				int nx = x + dx, ny = y + dy;
+				if (nx >= 0 && nx < width && ny >= 0 && ny < height && !converged(nx + ny * width))
+					return true;
+			}
+		}
+		return false;
+	}
+
+	__inline__ __host__ __device__ void addSample(int pixel, glm::vec3 col, const glm::vec3& sampleAlbedo, const glm::vec3& sampleNormal) const
+	{
+		// a sample that isn't finite counts as black, as the plain gather drops it
+		if (glm::any(glm::isnan(col)) || glm::any(glm::isinf(col)))
+			col = glm::vec3(0.0f);
+		int n = ++samples[pixel];
+		float luminance = glm::dot(col, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+		float delta = luminance - mean[pixel];
+		mean[pixel] += delta / n;
+		m2[pixel] += delta * (luminance - mean[pixel]);
+		radiance[pixel] += col;
+		albedo[pixel] += sampleAlbedo;
+		normal[pixel] += sampleNormal;
+	}
+
+	// the pixel's means times iter into the accumulation buffers
+	__inline__ __host__ __device__ void resolve(int pixel, int iter, glm::vec3* image, glm::vec3* imageAlbedo, glm::vec3* imageNormal) const
+	{
+		int n = samples[pixel];
+		float scale = n > 0 ? (float)iter / n : 0.0f;
+		image[pixel] = radiance[pixel] * scale;
+		imageAlbedo[pixel] = albedo[pixel] * scale;
+		imageNormal[pixel] = normal[pixel] * scale;
+	}
+};
+
+// adaptive sampling settings for a render of iterations samples per pixel, threshold <= 0 is off
+__inline__ AdaptiveSampling makeAdaptiveSampling(float threshold, int iterations, int width, int height)
+{
+	AdaptiveSampling adaptive;
+	adaptive.width = width;
+	adaptive.height = height;
+	adaptive.threshold = glm::max(threshold, 0.0f);
+	adaptive.minSamples = glm::max(glm::min(ADAPTIVE_MIN_SAMPLES, iterations), 2);
+	adaptive.maxSamples = glm::max(ADAPTIVE_MAX_SAMPLES * iterations, adaptive.minSamples);
+	return adaptive;
+}
+
+// Host storage behind an AdaptiveSampling, for the CPU backend. The sample counts are the render
+// state's, so the viewer can save them as a heat map.
+class HostAdaptiveSampling
+{
+public:
+	AdaptiveSampling view(AdaptiveSampling settings, std::vector<int>& sampleCounts)
+	{
+		int nPixels = sampleCounts.size();
+		mean.assign(nPixels, 0.0f);
+		m2.assign(nPixels, 0.0f);
+		radiance.assign(nPixels, glm::vec3(0.0f));
+		albedo.assign(nPixels, glm::vec3(0.0f));
+		normal.assign(nPixels, glm::vec3(0.0f));
+		std::fill(sampleCounts.begin(), sampleCounts.end(), 0);
+		settings.samples = sampleCounts.data();
+		settings.mean = mean.data();
+		settings.m2 = m2.data();
+		settings.radiance = radiance.data();
+		settings.albedo = albedo.data();
+		settings.normal = normal.data();
+		return settings;
+	}
+
+private:
+	std::vector<float> mean;
+	std::vector<float> m2;
+	std::vector<glm::vec3> radiance;
+	std::vector<glm::vec3> albedo;
+	std::vector<glm::vec3> normal;
+};
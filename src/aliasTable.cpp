@@ -0,0 +1,43 @@
+#include "aliasTable.h"
+
+std::vector<AliasBin> buildAliasTable(const std::vector<float>& weights)
+{
+	const int n = weights.size();
+	double sum = 0.0;
+	for (float w : weights)
+		sum += w;
+	if (n == 0 || sum <= 0.0)
+		return std::vector<AliasBin>();
+
+	// each bin's share of n equal bins, bins below 1 are topped up by those above
+	std::vector<AliasBin> bins(n);
+	std::vector<double> scaled(n);
+	std::vector<int> small, large;
+	for (int i = 0; i < n; ++i)
+	{
+		bins[i].pmf = (float)(weights[i] / sum);
+		bins[i].alias = i;
+		scaled[i] = weights[i] / sum * n;
+		(scaled[i] < 1.0 ? small : large).push_back(i);
+	}
+	while (!small.empty() && !large.empty())
+	{
+		int s = small.back();
+		small.pop_back();
+		int l = large.back();
+		bins[s].q = (float)scaled[s];
+		bins[s].alias = l;
+		scaled[l] -= 1.0 - scaled[s];
+		if (scaled[l] < 1.0)
+		{
+			large.pop_back();
+			small.push_back(l);
+		}
+	}
+	// what is left is 1 up to rounding
+	for (int i : small)
+		bins[i].q = 1.0f;
+	for (int i : large)
+		bins[i].q = 1.0f;
+	return bins;
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include "utilities.h"
+#include <vector>
+
+// Walker's alias method: n bins of equal probability, bin i keeps its own index with probability
+// q and gives the rest to its alias, so a draw from a discrete distribution is one lookup however
+// many entries it has.
+struct AliasBin
+{
+	float q;   // probability of keeping the bin's own index
+	int alias; // taken otherwise
+	float pmf; // probability of drawing the bin's own index
+};
+
+// draws an index for u in [0, 1); uRemapped, when given, receives a fresh number in [0, 1) from what
+// the draw didn't use of u, for the caller's next decision
+__inline__ __host__ __device__ int sampleAlias(const AliasBin* bins, int n, float u, float& pmf, float* uRemapped = nullptr)
+{
+	const float oneMinusEpsilon = 0.99999994f; // largest float below 1
+	float scaled = u * n;
+	int i = glm::min((int)scaled, n - 1);
+	float up = glm::min(scaled - i, oneMinusEpsilon);
+	const AliasBin& bin = bins[i];
+	if (up < bin.q)
+	{
+		pmf = bin.pmf;
+		if (uRemapped) *uRemapped = glm::min(up / bin.q, oneMinusEpsilon);
+		return i;
+	}
+	pmf = bins[bin.alias].pmf;
+	if (uRemapped) *uRemapped = glm::min((up - bin.q) / (1.0f - bin.q), oneMinusEpsilon);
+	return bin.alias;
+}
+
+// Vose's construction of the bins for weights >= 0, which needn't sum to 1. Empty when they sum to 0.
+std::vector<AliasBin> buildAliasTable(const std::vector<float>& weights);
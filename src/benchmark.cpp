@@ -0,0 +1,1425 @@
+#include "benchmark.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <random>
+#include "bvh.h"
+#include "bvhInstance.h"
+#include "bvhQuantized.h"
+#include "bvhStats.h"
+#include "bvhWide.h"
+#include "cpuPathTracer.h"
+#include "disneybsdf.h"
+#include "intersections.h"
+#include "json.hpp"
+#include "light.h"
+#include "sampler.h"
+#include "scene.h"
+#include "texture.h"
+#include "tiny_obj_loader.h"
+#include "wavefront.h"
+
+using MortonPrimitive = BVHAccel::MortonPrimitive;
+using BenchClock = std::chrono::high_resolution_clock;
+
+static float msSince(BenchClock::time_point start)
+{
+	return std::chrono::duration<float, std::milli>(BenchClock::now() - start).count();
+}
+
+// best of nRuns, each run sorts a fresh copy of the input
+template<typename SortFunc>
+static float timeSort(const std::vector<MortonPrimitive>& input, int nRuns, SortFunc sort)
+{
+	float best = FLT_MAX;
+	std::vector<MortonPrimitive> v;
+	for (int run = 0; run < nRuns; ++run)
+	{
+		v = input;
+		auto start = BenchClock::now();
+		sort(v);
+		best = std::min(best, msSince(start));
+		for (size_t i = 1; i < v.size(); ++i)
+		{
+			if (v[i - 1].mortonCode > v[i].mortonCode)
+			{
+				printf("  sort produced unsorted output at %zu\n", i);
+				break;
+			}
+		}
+	}
+	return best;
+}
+
+// --bench sort [n ...]: morton radix sort against the single threaded RadixSort and std::sort
+static int benchmarkMortonSort(int argc, char** argv)
+{
+	std::vector<size_t> sizes = { 1000000, 10000000, 50000000 };
+	if (argc > 0)
+	{
+		sizes.clear();
+		for (int i = 0; i < argc; ++i)
+			sizes.push_back(strtoull(argv[i], nullptr, 10));
+	}
+
+	ThreadPool pool;
+	std::vector<MortonPrimitive> scratch;
+	printf("morton sort benchmark, %d threads, best of 3 (ms)\n", pool.size());
+	printf("%12s %12s %12s %12s %12s %12s\n", "n", "RadixSort", "std::sort", "parallel 6", "parallel 8", "parallel 11");
+	for (size_t n : sizes)
+	{
+		// 30 bit codes like updateMortonCodes produces
+		std::mt19937 rng(565);
+		std::uniform_int_distribution<uint32_t> code(0, (1u << 30) - 1);
+		std::vector<MortonPrimitive> input(n);
+		for (size_t i = 0; i < n; ++i)
+			input[i] = { (int)i, code(rng) };
+
+		int nRuns = n > 20000000 ? 1 : 3;
+		float serialMs = timeSort(input, nRuns, [](std::vector<MortonPrimitive>& v) { BVHAccel::RadixSort(&v); });
+		float stdMs = timeSort(input, nRuns, [](std::vector<MortonPrimitive>& v) {
+			std::sort(v.begin(), v.end(), [](const MortonPrimitive& a, const MortonPrimitive& b) { return a.mortonCode < b.mortonCode; });
+		});
+		float parallelMs[3];
+		const int digits[3] = { 6, 8, 11 };
+		for (int d = 0; d < 3; ++d)
+		{
+			parallelMs[d] = timeSort(input, nRuns, [&](std::vector<MortonPrimitive>& v) {
+				BVHAccel::ParallelRadixSort(pool, &v, scratch, digits[d]);
+			});
+		}
+		printf("%12zu %12.2f %12.2f %12.2f %12.2f %12.2f\n", n, serialMs, stdMs, parallelMs[0], parallelMs[1], parallelMs[2]);
+	}
+	return 0;
+}
+
+// options shared by the scene based BVH benchmarks:
+//     scene.json [--builder HLBVH|SAH] [--bins n] [--rays WxH] [--out file.json]
+struct SceneBenchOptions
+{
+	int width = 256;
+	int height = 256;
+	const char* outPath = nullptr;
+	int frames = 120; // refit
+	int geom = -1;    // refit, -1 -> the geom with the most triangles
+};
+
+// loads the scene named by argv[0] and builds its BVH on the host, nullptr on bad arguments
+static Scene* loadBenchScene(const char* usage, int argc, char** argv, SceneBenchOptions& options)
+{
+	if (argc < 1)
+	{
+		printf("usage: %s\n", usage);
+		return nullptr;
+	}
+	Scene* scene = new Scene(argv[0]);
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		std::string option = argv[i];
+		if (option == "--builder")
+			scene->bvhSplitMethod = strcmp(argv[i + 1], "SAH") == 0 ? BVHAccel::SplitMethod::SAH : BVHAccel::SplitMethod::HLBVH;
+		else if (option == "--bins")
+			scene->bvhSAHBins = atoi(argv[i + 1]);
+		else if (option == "--rays")
+			sscanf(argv[i + 1], "%dx%d", &options.width, &options.height);
+		else if (option == "--out")
+			options.outPath = argv[i + 1];
+		else if (option == "--frames")
+			options.frames = atoi(argv[i + 1]);
+		else if (option == "--geom")
+			options.geom = atoi(argv[i + 1]);
+		else
+			printf("ignoring unknown option %s\n", option.c_str());
+	}
+	scene->createBVH(false);
+	return scene;
+}
+
+// --bench bvhstats scene.json [options]: tree quality plus a CPU ray replay
+static int benchmarkBVHStats(int argc, char** argv)
+{
+	SceneBenchOptions options;
+	std::unique_ptr<Scene> scene(loadBenchScene("--bench bvhstats scene.json [--builder HLBVH|SAH] [--bins n] [--rays WxH] [--out stats.json]",
+		argc, argv, options));
+	if (!scene)
+		return 1;
+
+	std::vector<Triangle> triangles = scene->expandTriangles();
+	ThreadPool pool;
+	BVHStats stats;
+	auto start = BenchClock::now();
+	computeBVHStats(stats, scene->bvh->nodes, scene->bvh->bvhNodes, triangles.data(), triangles.size(), pool);
+	printf("tree analysis %.2f ms\n", msSince(start));
+	start = BenchClock::now();
+	ReplayRays replay;
+	makeReplayRays(replay, scene->bvh->nodes, triangles.data(), scene->state.camera, options.width, options.height, pool);
+	replayBVHRays(stats, scene->bvh->nodes, triangles.data(), replay, pool);
+	printf("ray replay %.2f ms\n", msSince(start));
+	stats.print();
+
+	if (options.outPath)
+	{
+		std::ofstream out(options.outPath);
+		out << stats.toJSON() << std::endl;
+		if (!out)
+		{
+			printf("Failed to write %s\n", options.outPath);
+			return 1;
+		}
+		printf("wrote %s\n", options.outPath);
+	}
+	return 0;
+}
+
+// best of nRuns single threaded passes of intersect over the replay rays, checked against the reference hits
+template<typename IntersectFunc>
+static float timeTraversal(const ReplayRays& replay, const std::vector<float>& referenceT, int nRuns, IntersectFunc intersect)
+{
+	float best = FLT_MAX;
+	int mismatches = 0;
+	for (int run = 0; run < nRuns; ++run)
+	{
+		mismatches = 0;
+		auto start = BenchClock::now();
+		for (size_t i = 0; i < replay.rays.size(); ++i)
+		{
+			ShadeableIntersection isect;
+			float t = intersect(replay.rays[i], isect) ? isect.t : -1.f;
+			if (!referenceT.empty() && fabs(t - referenceT[i]) > 1e-4f * std::max(1.f, fabs(referenceT[i])))
+				mismatches++;
+		}
+		best = std::min(best, msSince(start));
+	}
+	if (mismatches)
+		printf("  %d of %zu rays disagree with the binary BVH\n", mismatches, replay.rays.size());
+	return best;
+}
+
+// --bench widebvh scene.json [options]: binary BVH against the 4 and 8 wide collapse on the host
+static int benchmarkWideBVH(int argc, char** argv)
+{
+	SceneBenchOptions options;
+	std::unique_ptr<Scene> scene(loadBenchScene("--bench widebvh scene.json [--builder HLBVH|SAH] [--bins n] [--rays WxH]",
+		argc, argv, options));
+	if (!scene)
+		return 1;
+	const LinearBVHNode* nodes = scene->bvh->nodes;
+	int nNodes = scene->bvh->bvhNodes;
+	std::vector<Triangle> expanded = scene->expandTriangles();
+	const Triangle* triangles = expanded.data();
+
+	ThreadPool pool;
+	ReplayRays replay;
+	makeReplayRays(replay, nodes, triangles, scene->state.camera, options.width, options.height, pool);
+
+	std::vector<float> referenceT(replay.rays.size());
+	for (size_t i = 0; i < replay.rays.size(); ++i)
+	{
+		ShadeableIntersection isect;
+		referenceT[i] = BVHIntersect(replay.rays[i], const_cast<LinearBVHNode*>(nodes), const_cast<Triangle*>(triangles), &isect) ? isect.t : -1.f;
+	}
+
+	auto start = BenchClock::now();
+	WideBVH<4> bvh4;
+	bvh4.collapse(nodes, nNodes);
+	float collapse4Ms = msSince(start);
+	start = BenchClock::now();
+	WideBVH<8> bvh8;
+	bvh8.collapse(nodes, nNodes);
+	float collapse8Ms = msSince(start);
+
+	const int nRuns = 3;
+	float binaryMs = timeTraversal(replay, std::vector<float>(), nRuns, [&](const Ray& ray, ShadeableIntersection& isect) {
+		return BVHIntersect(ray, const_cast<LinearBVHNode*>(nodes), const_cast<Triangle*>(triangles), &isect);
+	});
+	float wide4Ms = timeTraversal(replay, referenceT, nRuns, [&](const Ray& ray, ShadeableIntersection& isect) {
+		return bvh4.intersect(ray, triangles, &isect);
+	});
+	float wide8Ms = timeTraversal(replay, referenceT, nRuns, [&](const Ray& ray, ShadeableIntersection& isect) {
+		return bvh8.intersect(ray, triangles, &isect);
+	});
+
+	size_t nRays = replay.rays.size();
+	printf("wide BVH benchmark, %zu rays (%d camera), single thread, best of %d\n", nRays, replay.nCamera, nRuns);
+	printf("%8s %10s %12s %12s %12s %10s\n", "layout", "nodes", "bytes", "collapse ms", "trace ms", "Mrays/s");
+	printf("%8s %10d %12zu %12s %12.2f %10.2f\n", "binary", nNodes, nNodes * sizeof(LinearBVHNode), "-", binaryMs, nRays / (binaryMs * 1000.f));
+	printf("%8s %10zu %12zu %12.2f %12.2f %10.2f\n", "BVH4", bvh4.nodes.size(), bvh4.memoryBytes(), collapse4Ms, wide4Ms, nRays / (wide4Ms * 1000.f));
+	printf("%8s %10zu %12zu %12.2f %12.2f %10.2f\n", "BVH8", bvh8.nodes.size(), bvh8.memoryBytes(), collapse8Ms, wide8Ms, nRays / (wide8Ms * 1000.f));
+	return 0;
+}
+
+// triangle soup of an OBJ file, positions only
+static bool loadBenchMesh(const char* path, std::vector<Triangle>& triangles)
+{
+	tinyobj::attrib_t attrib;
+	std::vector<tinyobj::shape_t> shapes;
+	std::vector<tinyobj::material_t> materials;
+	std::string warn, err;
+	if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, path))
+	{
+		printf("Failed to load %s: %s\n", path, (warn + err).c_str());
+		return false;
+	}
+	triangles.clear();
+	for (const auto& shape : shapes)
+	{
+		for (size_t f = 0; f + 2 < shape.mesh.indices.size(); f += 3)
+		{
+			Triangle tri;
+			for (int v = 0; v < 3; ++v)
+			{
+				int idx = shape.mesh.indices[f + v].vertex_index;
+				tri.vertices[v] = glm::vec3(attrib.vertices[3 * idx + 0], attrib.vertices[3 * idx + 1], attrib.vertices[3 * idx + 2]);
+			}
+			triangles.push_back(tri);
+		}
+	}
+	return !triangles.empty();
+}
+
+// 45 degree camera looking at bounds from the front right
+static Camera frameBenchCamera(const AABB& bounds, int width, int height)
+{
+	Camera camera;
+	glm::vec3 center = bounds.centroid();
+	float radius = 0.5f * glm::length(bounds.max - bounds.min);
+	camera.resolution = glm::ivec2(width, height);
+	camera.lookAt = center;
+	camera.position = center + glm::normalize(glm::vec3(0.6f, 0.4f, 1.f)) * radius * 2.5f;
+	camera.view = glm::normalize(camera.lookAt - camera.position);
+	camera.up = glm::vec3(0, 1, 0);
+	camera.right = glm::normalize(glm::cross(camera.view, camera.up));
+	float yscaled = tan(45.f * (PI / 180));
+	float xscaled = (yscaled * width) / height;
+	camera.fov = glm::vec2(atan(xscaled) * 180 / PI, 45.f);
+	camera.pixelLength = glm::vec2(2 * xscaled / (float)width, 2 * yscaled / (float)height);
+	return camera;
+}
+
+// --bench quantbvh [--builder HLBVH|SAH] [--rays WxH] [mesh.obj ...]: memory and traversal speed of the
+// 8 and 16 bit quantized BVH against LinearBVHNode, by default on the bundled meshes in scenes/objs
+static int benchmarkQuantizedBVH(int argc, char** argv)
+{
+	std::vector<std::string> meshes;
+	BVHAccel::SplitMethod splitMethod = BVHAccel::SplitMethod::HLBVH;
+	int width = 256, height = 256;
+	for (int i = 0; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (arg == "--builder" && i + 1 < argc)
+			splitMethod = strcmp(argv[++i], "SAH") == 0 ? BVHAccel::SplitMethod::SAH : BVHAccel::SplitMethod::HLBVH;
+		else if (arg == "--rays" && i + 1 < argc)
+			sscanf(argv[++i], "%dx%d", &width, &height);
+		else
+			meshes.push_back(arg);
+	}
+	if (meshes.empty())
+		meshes = { "scenes/objs/wahoo.obj", "scenes/objs/sphere.obj", "scenes/objs/manyfaces.obj" };
+
+	ThreadPool pool;
+	const int nRuns = 3;
+	printf("quantized BVH benchmark, single thread, best of %d\n", nRuns);
+	printf("%-28s %8s %8s %12s %8s %10s %10s\n", "mesh", "tris", "format", "bytes", "saved", "trace ms", "slowdown");
+	for (const std::string& mesh : meshes)
+	{
+		std::vector<Triangle> triangles;
+		if (!loadBenchMesh(mesh.c_str(), triangles))
+			continue;
+		BVHAccel bvh(triangles, triangles.size(), 4);
+		bvh.splitMethod = splitMethod;
+		bvh.build(triangles, triangles.size());
+		const LinearBVHNode* nodes = bvh.nodes;
+
+		ReplayRays replay;
+		makeReplayRays(replay, nodes, triangles.data(), frameBenchCamera(nodes[0].bounds, width, height), width, height, pool);
+		std::vector<float> referenceT(replay.rays.size());
+		for (size_t i = 0; i < replay.rays.size(); ++i)
+		{
+			ShadeableIntersection isect;
+			referenceT[i] = BVHIntersect(replay.rays[i], bvh.nodes, triangles.data(), &isect) ? isect.t : -1.f;
+		}
+
+		QuantizedBVH<uint8_t> bvh8;
+		bvh8.compress(nodes, bvh.bvhNodes);
+		QuantizedBVH<uint16_t> bvh16;
+		bvh16.compress(nodes, bvh.bvhNodes);
+		if (bvh8.nUncoveredChildren > 0 || bvh16.nUncoveredChildren > 0)
+			printf("%s: decoded boxes not conservative, 8 bit %d, 16 bit %d children\n", mesh.c_str(),
+				bvh8.nUncoveredChildren, bvh16.nUncoveredChildren);
+
+		float binaryMs = timeTraversal(replay, std::vector<float>(), nRuns, [&](const Ray& ray, ShadeableIntersection& isect) {
+			return BVHIntersect(ray, bvh.nodes, triangles.data(), &isect);
+		});
+		float q8Ms = timeTraversal(replay, referenceT, nRuns, [&](const Ray& ray, ShadeableIntersection& isect) {
+			return bvh8.intersect(ray, triangles.data(), &isect);
+		});
+		float q16Ms = timeTraversal(replay, referenceT, nRuns, [&](const Ray& ray, ShadeableIntersection& isect) {
+			return bvh16.intersect(ray, triangles.data(), &isect);
+		});
+
+		size_t binaryBytes = bvh.bvhNodes * sizeof(LinearBVHNode);
+		std::string name = mesh.substr(mesh.find_last_of("/\\") + 1);
+		printf("%-28s %8zu %8s %12zu %8s %10.2f %10s\n", name.c_str(), triangles.size(), "float", binaryBytes, "-", binaryMs, "-");
+		printf("%-28s %8s %8s %12zu %7.1f%% %10.2f %9.2fx\n", "", "", "16 bit", bvh16.memoryBytes(),
+			100.f * (1.f - (float)bvh16.memoryBytes() / binaryBytes), q16Ms, q16Ms / binaryMs);
+		printf("%-28s %8s %8s %12zu %7.1f%% %10.2f %9.2fx\n", "", "", "8 bit", bvh8.memoryBytes(),
+			100.f * (1.f - (float)bvh8.memoryBytes() / binaryBytes), q8Ms, q8Ms / binaryMs);
+	}
+	return 0;
+}
+
+// --bench refit scene.json [--builder HLBVH|SAH] [--frames n] [--geom i]: sweeps one mesh inside the scene, then drags
+// it out of the scene bounds, and compares Scene::updateGeomTransform (refit, rebuild past BVH_REFIT_REBUILD_RATIO)
+// against a full build every frame
+static int benchmarkRefit(int argc, char** argv)
+{
+	SceneBenchOptions options;
+	std::unique_ptr<Scene> scene(loadBenchScene("--bench refit scene.json [--builder HLBVH|SAH] [--frames n] [--geom i]",
+		argc, argv, options));
+	if (!scene)
+		return 1;
+	if (scene->geoms.empty() || scene->bvh->bvhNodes == 0)
+	{
+		printf("scene has no baked meshes to move\n");
+		return 1;
+	}
+	int geomIndex = options.geom;
+	if (geomIndex < 0 || geomIndex >= (int)scene->geoms.size())
+	{
+		geomIndex = 0;
+		for (int i = 1; i < (int)scene->geoms.size(); ++i)
+		{
+			const Geom& g = scene->geoms[i];
+			const Geom& best = scene->geoms[geomIndex];
+			if (g.triangleEndIdx - g.triangleStartIdx > best.triangleEndIdx - best.triangleStartIdx)
+				geomIndex = i;
+		}
+	}
+
+	// full build reference on an uncached copy
+	std::vector<Triangle> copy = scene->expandTriangles();
+	BVHAccel fresh(copy, copy.size(), 4);
+	fresh.splitMethod = scene->bvhSplitMethod;
+	fresh.nSAHBins = scene->bvhSAHBins;
+	auto start = BenchClock::now();
+	fresh.build(copy, copy.size());
+	float buildMs = msSince(start);
+	delete[] fresh.nodes;
+
+	const Geom initial = scene->geoms[geomIndex];
+	glm::vec3 extent = scene->bvh->nodes[0].bounds.max - scene->bvh->nodes[0].bounds.min;
+	printf("refit benchmark: geom %d (%d of %zu triangles), %d frames\n", geomIndex,
+		initial.triangleEndIdx - initial.triangleStartIdx, scene->triangleHits.size(), options.frames);
+	printf("  full build          %10.3f ms\n", buildMs);
+
+	// moves the mesh to translation(frame) and rotation(frame) every frame, times refits and rebuilds separately
+	auto animate = [&](const char* name, std::function<glm::vec3(float)> translation, std::function<glm::vec3(float)> rotation) {
+		float refitMs = 0.f, rebuildMs = 0.f;
+		int nRebuilds = 0;
+		float worstCost = 0.f;
+		for (int frame = 1; frame <= options.frames; ++frame)
+		{
+			float t = (float)frame / options.frames;
+			auto start = BenchClock::now();
+			bool rebuilt = scene->updateGeomTransform(geomIndex, translation(t), rotation(t), initial.scale, false);
+			float ms = msSince(start);
+			if (rebuilt)
+			{
+				++nRebuilds;
+				rebuildMs += ms;
+			}
+			else
+				refitMs += ms;
+			worstCost = std::max(worstCost, scene->bvh->sahCost());
+		}
+		int nRefits = options.frames - nRebuilds;
+		scene->bvh->prepareRefit();
+		printf("%s\n", name);
+		printf("  refit               %10.3f ms avg over %d frames\n", nRefits ? refitMs / nRefits : 0.f, nRefits);
+		printf("  rebuild             %10.3f ms avg over %d frames (ratio %.2f)\n", nRebuilds ? rebuildMs / nRebuilds : 0.f, nRebuilds,
+			BVH_REFIT_REBUILD_RATIO);
+		printf("  SAH cost            %10.2f built, %.2f worst, %.2f final\n", scene->bvh->builtSAHCost, worstCost, scene->bvh->sahCost());
+		printf("  per frame speedup   %10.1fx\n", buildMs * options.frames / std::max(refitMs + rebuildMs, 1e-3f));
+	};
+
+	// sweep the mesh across the scene and spin it, it stays inside the bounds the BVH was built for
+	animate("sweep inside the scene bounds",
+		[&](float t) { return initial.translation + glm::vec3(0.25f * extent.x * std::sin(2.f * PI * t), 0.f, 0.f); },
+		[&](float t) { return initial.rotation + glm::vec3(0.f, 360.f * t, 0.f); });
+	// drag it out to twice the scene size, the root grows with it
+	animate("drag out of the scene bounds",
+		[&](float t) { return initial.translation + glm::vec3(2.f * extent.x * t, 0.f, 0.f); },
+		[&](float t) { return initial.rotation; });
+	return 0;
+}
+
+// --bench shadow scene.json [--builder HLBVH|SAH] [--rays WxH]: light visibility for one area light sample per
+// replay hit, closest hit plus light id check (the old Sample_Li path) against the SceneOccluded any-hit query
+static int benchmarkShadowRays(int argc, char** argv)
+{
+	SceneBenchOptions options;
+	std::unique_ptr<Scene> scene(loadBenchScene("--bench shadow scene.json [--builder HLBVH|SAH] [--rays WxH]", argc, argv, options));
+	if (!scene)
+		return 1;
+	std::vector<int> areaLights;
+	for (size_t i = 0; i < scene->lights.size(); ++i)
+	{
+		if (scene->lights[i].lightType == AREALIGHT)
+			areaLights.push_back(i);
+	}
+	if (areaLights.empty())
+	{
+		printf("scene has no area lights\n");
+		return 1;
+	}
+
+	ThreadPool pool;
+	SceneAccel accel = scene->hostAccel();
+	ReplayRays replay;
+	std::vector<Triangle> triangles = scene->expandTriangles();
+	makeReplayRays(replay, scene->bvh->nodes, triangles.data(), scene->state.camera, options.width, options.height, pool);
+
+	// one shadow ray from every hit towards a uniform point on an area light, like DirectSampleAreaLight
+	struct ShadowRay { Ray ray; float distance; int light; };
+	std::vector<ShadowRay> shadowRays;
+	std::mt19937 rng(565);
+	std::uniform_real_distribution<float> u(-1.f, 1.f);
+	for (size_t i = 0; i < replay.rays.size(); ++i)
+	{
+		const Ray& ray = replay.rays[i];
+		ShadeableIntersection isect;
+		if (!SceneIntersect(ray, accel, &isect))
+			continue;
+		glm::vec3 p = ray.origin + ray.direction * isect.t;
+		int light = areaLights[i % areaLights.size()];
+		glm::vec3 target = glm::vec3(scene->lights[light].transform * glm::vec4(u(rng), u(rng), 0.f, 1.f));
+		glm::vec3 wi = target - p;
+		float distance = glm::length(wi);
+		shadowRays.push_back({ Ray{ p, wi / distance }, distance, light });
+	}
+
+	const int nRuns = 3;
+	std::vector<char> visibleClosest(shadowRays.size()), visibleAny(shadowRays.size());
+	float closestMs = FLT_MAX, anyMs = FLT_MAX;
+	for (int run = 0; run < nRuns; ++run)
+	{
+		auto start = BenchClock::now();
+		for (size_t i = 0; i < shadowRays.size(); ++i)
+		{
+			ShadeableIntersection isect;
+			visibleClosest[i] = SceneIntersect(shadowRays[i].ray, accel, &isect) && isect.lightId == shadowRays[i].light;
+		}
+		closestMs = std::min(closestMs, msSince(start));
+		start = BenchClock::now();
+		for (size_t i = 0; i < shadowRays.size(); ++i)
+			visibleAny[i] = !SceneOccluded(shadowRays[i].ray, accel, shadowRays[i].distance * (1.f - SHADOW_RAY_EPSILON));
+		anyMs = std::min(anyMs, msSince(start));
+	}
+
+	int nVisible = 0, nMismatch = 0;
+	for (size_t i = 0; i < shadowRays.size(); ++i)
+	{
+		nVisible += visibleAny[i];
+		nMismatch += visibleAny[i] != visibleClosest[i];
+	}
+	printf("shadow ray benchmark, single thread, best of %d\n", nRuns);
+	printf("  %zu shadow rays from %zu replay rays, %.1f%% unoccluded, %d visibility mismatches\n", shadowRays.size(),
+		replay.rays.size(), 100.f * nVisible / std::max<size_t>(shadowRays.size(), 1), nMismatch);
+	printf("  closest hit  %10.2f ms\n", closestMs);
+	printf("  any hit      %10.2f ms  %.2fx\n", anyMs, closestMs / anyMs);
+	return 0;
+}
+
+// --bench hotcold scene.json [--builder HLBVH|SAH] [--rays WxH]: closest hit over the full Triangle records
+// against the TriangleHit traversal array plus one Triangle fetch per hit, world BVH only
+static int benchmarkHotCold(int argc, char** argv)
+{
+	SceneBenchOptions options;
+	std::unique_ptr<Scene> scene(loadBenchScene("--bench hotcold scene.json [--builder HLBVH|SAH] [--rays WxH]", argc, argv, options));
+	if (!scene)
+		return 1;
+	LinearBVHNode* nodes = scene->bvh->nodes;
+	std::vector<Triangle> expanded = scene->expandTriangles();
+	Triangle* triangles = expanded.data();
+
+	ThreadPool pool;
+	ReplayRays replay;
+	makeReplayRays(replay, nodes, triangles, scene->state.camera, options.width, options.height, pool);
+	BVHStats stats;
+	replayBVHRays(stats, nodes, triangles, replay, pool);
+	std::vector<float> referenceT(replay.rays.size());
+	int nHits = 0;
+	for (size_t i = 0; i < replay.rays.size(); ++i)
+	{
+		ShadeableIntersection isect;
+		referenceT[i] = BVHIntersect(replay.rays[i], nodes, triangles, &isect) ? isect.t : -1.f;
+		nHits += referenceT[i] >= 0.f;
+	}
+
+	SceneAccel accel = scene->hostAccel();
+	accel.numInstances = 0;
+
+	const int nRuns = 3;
+	float fullMs = timeTraversal(replay, std::vector<float>(), nRuns, [&](const Ray& ray, ShadeableIntersection& isect) {
+		return BVHIntersect(ray, nodes, triangles, &isect);
+	});
+	float splitMs = timeTraversal(replay, referenceT, nRuns, [&](const Ray& ray, ShadeableIntersection& isect) {
+		return SceneIntersect(ray, accel, &isect);
+	});
+
+	// every visited node and tested triangle is one record fetch, the split layout adds one Triangle per hit
+	float hitRate = (float)nHits / replay.rays.size();
+	float nodeBytes = stats.avgNodeVisits * sizeof(LinearBVHNode);
+	float fullBytes = nodeBytes + stats.avgTriangleTests * sizeof(Triangle);
+	float splitBytes = nodeBytes + stats.avgTriangleTests * sizeof(TriangleHit) + hitRate * sizeof(Triangle);
+	printf("hot/cold triangle benchmark, %zu rays, single thread, best of %d\n", replay.rays.size(), nRuns);
+	printf("  %.1f node visits, %.1f triangle tests, %.2f hits per ray\n", stats.avgNodeVisits, stats.avgTriangleTests, hitRate);
+	printf("  %-22s %8s %14s %10s\n", "layout", "record", "bytes / ray", "trace ms");
+	printf("  %-22s %7zuB %14.0f %10.2f\n", "Triangle", sizeof(Triangle), fullBytes, fullMs);
+	printf("  %-22s %7zuB %14.0f %10.2f\n", "TriangleHit + Triangle", sizeof(TriangleHit), splitBytes, splitMs);
+	printf("  %.1f%% fewer bytes, %.2fx speedup\n", 100.f * (1.f - splitBytes / fullBytes), fullMs / splitMs);
+	return 0;
+}
+
+// the scene camera at the benchmark resolution, with the basis the viewer builds from view and up
+static Camera benchCamera(const Scene& scene, const SceneBenchOptions& options)
+{
+	Camera cam = scene.state.camera;
+	cam.view = glm::normalize(cam.view);
+	cam.right = glm::normalize(glm::cross(cam.view, cam.up));
+	cam.up = glm::cross(cam.right, cam.view);
+	cam.pixelLength *= glm::vec2(cam.resolution) / glm::vec2(options.width, options.height);
+	cam.resolution = glm::ivec2(options.width, options.height);
+	return cam;
+}
+
+// --bench wavefront scene.json [--builder HLBVH|SAH] [--rays WxH]: the host wavefront loop over PathSegment
+// records against the PathState arrays, bytes of path state moved per path and bounce
+static int benchmarkWavefront(int argc, char** argv)
+{
+	SceneBenchOptions options;
+	std::unique_ptr<Scene> scene(loadBenchScene("--bench wavefront scene.json [--builder HLBVH|SAH] [--rays WxH]", argc, argv, options));
+	if (!scene)
+		return 1;
+	SceneAccel accel = scene->hostAccel();
+
+	Camera cam = benchCamera(*scene, options);
+	int traceDepth = scene->state.traceDepth;
+
+	ThreadPool pool;
+	const PathLayout layouts[2] = { PathLayout::AoS, PathLayout::SoA };
+	const char* names[2] = { "PathSegment", "PathState" };
+	const size_t recordBytes[2] = { sizeof(PathSegment), PathState::bytesPerPath };
+	WavefrontStats stats[2];
+	std::vector<glm::vec3> images[2];
+	for (int l = 0; l < 2; ++l)
+		stats[l] = traceWavefront(layouts[l], cam, accel, scene->materials.data(), traceDepth, 1, images[l], pool);
+
+	float maxDifference = 0.f;
+	for (size_t i = 0; i < images[0].size(); ++i)
+	{
+		glm::vec3 d = glm::abs(images[0][i] - images[1][i]);
+		maxDifference = std::max(maxDifference, std::max(d.x, std::max(d.y, d.z)));
+	}
+
+	printf("wavefront path state benchmark, %dx%d paths, depth %d, %d threads\n", cam.resolution.x, cam.resolution.y, traceDepth, pool.size());
+	printf("  %d bounces, %lld path bounces, max image difference %g\n", stats[0].bounces, (long long)stats[0].pathBounces, maxDifference);
+	printf("  %-12s %7s %28s %16s %28s\n", "layout", "record", "bytes intersect/shade/compact", "bytes / bounce", "ms intersect/shade/compact");
+	for (int l = 0; l < 2; ++l)
+	{
+		const WavefrontStats& s = stats[l];
+		double n = (double)std::max<int64_t>(s.pathBounces, 1);
+		printf("  %-12s %6zuB %10.0f %8.0f %8.0f %16.1f %10.2f %8.2f %8.2f\n", names[l], recordBytes[l], s.intersectBytes / n,
+			s.shadeBytes / n, s.compactBytes / n, s.bytesPerPathBounce(), s.intersectMs, s.shadeMs, s.compactMs);
+	}
+	printf("  %.1f%% fewer bytes per path bounce\n", 100.f * (1.f - stats[1].bytesPerPathBounce() / stats[0].bytesPerPathBounce()));
+	return 0;
+}
+
+// --bench matsort scene.json [--builder HLBVH|SAH] [--rays WxH]: per bounce cost of sorting the paths by
+// materialSortKey and how coherent shading gets. The host shading stand-in does not diverge, so
+// the materials per warp say what a GPU bounce saves and the sort time what it costs.
+static int benchmarkMaterialSort(int argc, char** argv)
+{
+	SceneBenchOptions options;
+	std::unique_ptr<Scene> scene(loadBenchScene("--bench matsort scene.json [--builder HLBVH|SAH] [--rays WxH]", argc, argv, options));
+	if (!scene)
+		return 1;
+	SceneAccel accel = scene->hostAccel();
+	Camera cam = benchCamera(*scene, options);
+	int traceDepth = scene->state.traceDepth;
+
+	ThreadPool pool;
+	WavefrontStats stats[2];
+	std::vector<glm::vec3> images[2];
+	for (int sorted = 0; sorted < 2; ++sorted)
+		stats[sorted] = traceWavefront(PathLayout::SoA, cam, accel, scene->materials.data(), traceDepth, 1, images[sorted], pool, sorted ? 0 : -1);
+
+	float maxDifference = 0.f;
+	for (size_t i = 0; i < images[0].size(); ++i)
+	{
+		glm::vec3 d = glm::abs(images[0][i] - images[1][i]);
+		maxDifference = std::max(maxDifference, std::max(d.x, std::max(d.y, d.z)));
+	}
+
+	printf("material sort benchmark, %dx%d paths, %zu materials, %d threads, max image difference %g\n", cam.resolution.x, cam.resolution.y,
+		scene->materials.size(), pool.size(), maxDifference);
+	printf("  %6s %9s %22s %22s %9s %22s\n", "bounce", "paths", "materials/warp", "types/warp", "sort ms", "shade ms");
+	printf("  %6s %9s %11s %10s %11s %10s %9s %11s %10s\n", "", "", "unsorted", "sorted", "unsorted", "sorted", "", "unsorted", "sorted");
+	for (size_t b = 0; b < stats[1].perBounce.size(); ++b)
+	{
+		const WavefrontBounce& u = stats[0].perBounce[b];
+		const WavefrontBounce& s = stats[1].perBounce[b];
+		printf("  %6zu %9d %11.2f %10.2f %11.2f %10.2f %9.2f %11.2f %10.2f\n", b + 1, s.paths, u.materialsPerWarp, s.materialsPerWarp,
+			u.typesPerWarp, s.typesPerWarp, s.sortMs, u.shadeMs, s.shadeMs);
+	}
+	return 0;
+}
+
+// BSDF sample and evaluation of one hit, the material specific part of MIS; type ANY goes through the
+// MaterialType dispatch like shadeMaterialNaive, the others are the queue kernels' specializations
+template<MaterialType type>
+static float sampleBSDF(const Material& m, const glm::vec3& wo, int hit)
+{
+	PathSampler rng(Sampler(), hit, 0, 1, SAMPLE_BSDF);
+	glm::vec3 wi(0.f);
+	bool isRefract, isReflect;
+	float pdf = 0.f;
+	BSDF_setUp<type>(m, wi, wo, rng, isRefract, isReflect);
+	glm::vec3 f = Evaluate_disneyBSDF<type>(m, wi, wo, pdf, isRefract, isReflect);
+	return pdf > 1e-6f ? (f.x + f.y + f.z) * AbsCosTheta(wi) / pdf : 0.f;
+}
+
+static float sampleBSDFDispatch(const Material& m, const glm::vec3& wo, int hit)
+{
+	PathSampler rng(Sampler(), hit, 0, 1, SAMPLE_BSDF);
+	glm::vec3 wi(0.f);
+	bool isRefract, isReflect;
+	float pdf = 0.f;
+	BSDF_setUp(m, wi, wo, rng, isRefract, isReflect);
+	glm::vec3 f = Evaluate_disneyBSDF(m, wi, wo, pdf, isRefract, isReflect);
+	return pdf > 1e-6f ? (f.x + f.y + f.z) * AbsCosTheta(wi) / pdf : 0.f;
+}
+
+template<MaterialType type>
+static void shadeBSDFQueue(const std::vector<int>& queue, const std::vector<int>& hitMaterials, const std::vector<glm::vec3>& hitWo,
+	const std::vector<Material>& materials, std::vector<float>& out)
+{
+	for (int hit : queue)
+		out[hit] = sampleBSDF<type>(materials[hitMaterials[hit]], hitWo[hit], hit);
+}
+
+// --bench bsdfqueue scene.json [n]: the BSDFs of n hits on the scene's non emissive materials in
+// mixed order through the MaterialType dispatch, against per type queues shaded by the
+// specialized routines (queue building included)
+static int benchmarkBSDFQueues(int argc, char** argv)
+{
+	if (argc < 1)
+	{
+		printf("usage: --bench bsdfqueue scene.json [n]\n");
+		return 1;
+	}
+	std::unique_ptr<Scene> scene(new Scene(argv[0]));
+	int n = argc > 1 ? atoi(argv[1]) : 1 << 20;
+	const std::vector<Material>& materials = scene->materials;
+	std::vector<int> surfaces;
+	for (size_t i = 0; i < materials.size(); ++i)
+	{
+		if (materials[i].emittance <= 0.f)
+			surfaces.push_back(i);
+	}
+	if (surfaces.empty())
+	{
+		printf("%s has no non emissive materials\n", argv[0]);
+		return 1;
+	}
+
+	// random hits, wo in the local shading frame like MIS passes it
+	std::mt19937 rng(565);
+	std::uniform_int_distribution<int> pick(0, surfaces.size() - 1);
+	std::uniform_real_distribution<float> u01(0.f, 1.f);
+	std::vector<int> hitMaterials(n);
+	std::vector<glm::vec3> hitWo(n);
+	int typeCounts[3] = { 0, 0, 0 };
+	for (int i = 0; i < n; ++i)
+	{
+		hitMaterials[i] = surfaces[pick(rng)];
+		float z = 2.f * u01(rng) - 1.f, phi = TWO_PI * u01(rng), r = std::sqrt(std::max(0.f, 1.f - z * z));
+		hitWo[i] = glm::vec3(r * std::cos(phi), r * std::sin(phi), materials[hitMaterials[i]].type == MaterialType::TRANSMIT ? z : std::abs(z));
+		typeCounts[(int)materials[hitMaterials[i]].type]++;
+	}
+
+	const int nRuns = 5;
+	std::vector<float> dispatched(n), queued(n);
+	std::vector<int> queues[3];
+	float dispatchMs = FLT_MAX, queueMs = FLT_MAX;
+	for (int run = 0; run < nRuns; ++run)
+	{
+		auto start = BenchClock::now();
+		for (int i = 0; i < n; ++i)
+			dispatched[i] = sampleBSDFDispatch(materials[hitMaterials[i]], hitWo[i], i);
+		dispatchMs = std::min(dispatchMs, msSince(start));
+
+		start = BenchClock::now();
+		for (std::vector<int>& queue : queues)
+			queue.clear();
+		for (int i = 0; i < n; ++i)
+			queues[(int)materials[hitMaterials[i]].type].push_back(i);
+		shadeBSDFQueue<MaterialType::DIFFUSE>(queues[(int)MaterialType::DIFFUSE], hitMaterials, hitWo, materials, queued);
+		shadeBSDFQueue<MaterialType::MICROFACET>(queues[(int)MaterialType::MICROFACET], hitMaterials, hitWo, materials, queued);
+		shadeBSDFQueue<MaterialType::TRANSMIT>(queues[(int)MaterialType::TRANSMIT], hitMaterials, hitWo, materials, queued);
+		queueMs = std::min(queueMs, msSince(start));
+	}
+
+	int mismatches = 0;
+	for (int i = 0; i < n; ++i)
+		mismatches += !(dispatched[i] == queued[i] || (std::isnan(dispatched[i]) && std::isnan(queued[i])));
+	printf("BSDF queue benchmark, %d hits on %zu materials, single thread, best of %d\n", n, surfaces.size(), nRuns);
+	printf("  hits per type: diffuse %d, microfacet %d, transmit %d\n", typeCounts[0], typeCounts[1], typeCounts[2]);
+	printf("  %-28s %10.2f ms\n", "mixed, MaterialType dispatch", dispatchMs);
+	printf("  %-28s %10.2f ms\n", "per type queues", queueMs);
+	printf("  %.2fx speedup, %d mismatches\n", dispatchMs / queueMs, mismatches);
+	return 0;
+}
+
+// --bench compact [n]: one bounce of stream compaction at several path survival ratios. The
+// PathSegment copy_if + remove_if pair of the old device loop against the slot list, compacted
+// with std::remove_if and with the parallel single pass compactActivePaths.
+static int benchmarkCompaction(int argc, char** argv)
+{
+	int n = argc > 0 ? atoi(argv[0]) : 1 << 20;
+	const float survival[] = { 0.05f, 0.25f, 0.5f, 0.75f, 0.95f };
+	const int nRuns = 5;
+
+	ThreadPool pool;
+	HostPathState storage;
+	storage.resize(n);
+	PathState paths = storage.view();
+	std::vector<PathSegment> segments(n), segmentsIn(n), terminated;
+	std::vector<int> slotsIn(n), slots(n), scratch(n), reference;
+	terminated.reserve(n);
+
+	printf("stream compaction benchmark, %d paths, %d threads, best of %d (ms)\n", n, pool.size(), nRuns);
+	printf("  %9s %24s %18s %18s %10s\n", "survival", "PathSegment copy+remove", "slots remove_if", "slots parallel", "speedup");
+	for (float ratio : survival)
+	{
+		// shuffled slots, like the list after a few bounces, and a random survivor set
+		std::mt19937 rng(565);
+		std::uniform_real_distribution<float> u01(0.f, 1.f);
+		for (int i = 0; i < n; ++i)
+			slotsIn[i] = i;
+		std::shuffle(slotsIn.begin(), slotsIn.end(), rng);
+		for (int i = 0; i < n; ++i)
+		{
+			paths.remainingBounces[i] = u01(rng) < ratio ? 1 : 0;
+			segmentsIn[i].pixelIndex = slotsIn[i];
+			segmentsIn[i].remainingBounces = paths.remainingBounces[slotsIn[i]];
+		}
+		auto isTerminated = [](const PathSegment& path) { return path.isTerminated(); };
+
+		float segmentMs = FLT_MAX, removeMs = FLT_MAX, parallelMs = FLT_MAX;
+		int nRemove = 0, nParallel = 0;
+		for (int run = 0; run < nRuns; ++run)
+		{
+			segments = segmentsIn;
+			terminated.clear();
+			auto start = BenchClock::now();
+			std::copy_if(segments.begin(), segments.end(), std::back_inserter(terminated), isTerminated);
+			std::remove_if(segments.begin(), segments.end(), isTerminated);
+			segmentMs = std::min(segmentMs, msSince(start));
+
+			slots = slotsIn;
+			start = BenchClock::now();
+			nRemove = std::remove_if(slots.begin(), slots.end(), PathTerminated{ paths }) - slots.begin();
+			removeMs = std::min(removeMs, msSince(start));
+			reference.assign(slots.begin(), slots.begin() + nRemove);
+
+			slots = slotsIn;
+			start = BenchClock::now();
+			nParallel = compactActivePaths(pool, slots.data(), n, scratch.data(), paths);
+			parallelMs = std::min(parallelMs, msSince(start));
+		}
+		if (nParallel != nRemove || !std::equal(reference.begin(), reference.end(), slots.begin()))
+			printf("  compactActivePaths does not match remove_if at survival %.2f\n", ratio);
+		printf("  %9.2f %24.2f %18.2f %18.2f %9.2fx\n", ratio, segmentMs, removeMs, parallelMs, segmentMs / parallelMs);
+	}
+	return 0;
+}
+
+static float luminance(const glm::vec3& c)
+{
+	return glm::dot(c, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+// --bench envmap [W H]: irradiance at an upward facing point under a synthetic sky with a small
+// sun, estimated with the old uniform environment sample and with the luminance CDF. The reference
+// is the CDF estimate over 4M samples; relative RMSE is over 4096 estimates per sample count.
+static int benchmarkEnvSampling(int argc, char** argv)
+{
+	int width = argc > 1 ? atoi(argv[0]) : 1024;
+	int height = argc > 1 ? atoi(argv[1]) : 512;
+	const int nTrials = 4096;
+	const int sampleCounts[] = { 1, 4, 16, 64 };
+
+	// dim blue sky, 0.5 degree sun 40 degrees from the zenith carrying most of the energy
+	std::vector<float4> pixels(width * height);
+	const glm::vec3 sunDirection = glm::normalize(glm::vec3(glm::sin(glm::radians(40.f)), glm::cos(glm::radians(40.f)), 0.f));
+	for (int y = 0; y < height; ++y)
+	{
+		for (int x = 0; x < width; ++x)
+		{
+			float theta = (y + 0.5f) / height * PI;
+			float phi = (x + 0.5f) / width * 2.f * PI;
+			glm::vec3 dir(glm::sin(theta) * glm::cos(phi), glm::cos(theta), glm::sin(theta) * glm::sin(phi));
+			glm::vec3 radiance = glm::vec3(0.2f, 0.3f, 0.5f) * (0.5f + 0.5f * glm::max(dir.y, 0.f));
+			if (glm::dot(dir, sunDirection) > glm::cos(glm::radians(0.5f)))
+				radiance = glm::vec3(20000.f, 18000.f, 15000.f);
+			pixels[y * width + x] = float4{ radiance.x, radiance.y, radiance.z, 1.f };
+		}
+	}
+
+	auto start = BenchClock::now();
+	EnvMapTables tables;
+	if (!tables.build(pixels.data(), width, height))
+	{
+		printf("environment map is black\n");
+		return 1;
+	}
+	float buildMs = msSince(start);
+	EnvMap envMap;
+	envMap.pixels = pixels.data();
+	envMap.width = width;
+	envMap.height = height;
+	envMap.hostDistribution = tables.view();
+
+	const glm::vec3 normal(0.f, 1.f, 0.f);
+	const glm::mat3 ltw = LocalToWorld(normal);
+	thrust::default_random_engine rng(565);
+	thrust::uniform_real_distribution<float> u01(0.f, 1.f);
+	thrust::uniform_real_distribution<float> u11(-1.f, 1.f);
+	auto uniformSample = [&]() {
+		glm::vec3 wi = ltw * glm::normalize(glm::vec3(u11(rng), u11(rng), 1.f));
+		glm::vec2 uv = EnvMap::directionToUV(wi);
+		return luminance(envMap.lookup(uv.x, uv.y)) * AbsDot(wi, normal) * (2.f * PI);
+	};
+	auto cdfSample = [&]() {
+		float pdf;
+		glm::vec3 wi = envMap.sample(glm::vec2(u01(rng), u01(rng)), pdf);
+		if (pdf <= 0.f || glm::dot(wi, normal) <= 0.f)
+			return 0.f;
+		glm::vec2 uv = EnvMap::directionToUV(wi);
+		return luminance(envMap.lookup(uv.x, uv.y)) * glm::dot(wi, normal) / pdf;
+	};
+
+	double reference = 0.0;
+	const int nReference = 1 << 22;
+	for (int i = 0; i < nReference; ++i)
+		reference += cdfSample();
+	reference /= nReference;
+
+	printf("environment sampling benchmark, %dx%d map, tables built in %.2f ms (%zu KB)\n", width, height, buildMs,
+		(tables.marginalCdf.size() + tables.conditionalCdf.size() + tables.texelPdf.size()) * sizeof(float) / 1024);
+	printf("  irradiance luminance %.2f\n", reference);
+	printf("  %8s %14s %14s %14s %14s %16s\n", "samples", "uniform mean", "uniform rRMSE", "CDF mean", "CDF rRMSE", "equal error spp");
+	for (int nSamples : sampleCounts)
+	{
+		double uniformMean = 0.0, uniformSq = 0.0, cdfMean = 0.0, cdfSq = 0.0;
+		for (int trial = 0; trial < nTrials; ++trial)
+		{
+			double uniformEstimate = 0.0, cdfEstimate = 0.0;
+			for (int i = 0; i < nSamples; ++i)
+			{
+				uniformEstimate += uniformSample();
+				cdfEstimate += cdfSample();
+			}
+			uniformEstimate /= nSamples;
+			cdfEstimate /= nSamples;
+			uniformMean += uniformEstimate;
+			cdfMean += cdfEstimate;
+			uniformSq += (uniformEstimate - reference) * (uniformEstimate - reference);
+			cdfSq += (cdfEstimate - reference) * (cdfEstimate - reference);
+		}
+		double uniformRmse = std::sqrt(uniformSq / nTrials) / reference;
+		double cdfRmse = std::sqrt(cdfSq / nTrials) / reference;
+		printf("  %8d %14.2f %14.4f %14.2f %14.4f %15.1fx\n", nSamples, uniformMean / nTrials, uniformRmse, cdfMean / nTrials, cdfRmse,
+			cdfRmse > 0.0 ? (uniformRmse * uniformRmse) / (cdfRmse * cdfRmse) : 0.0);
+	}
+	return 0;
+}
+
+// Writes a scene lit by nLights small area lights scattered at random positions, orientations and
+// sizes over a 40x40 floor with a grid of pillars, most of them far from any given shading point.
+// Emission takes one of 16 colors and levels so the lights share a few materials.
+static void writeManyLightsScene(const std::string& path, int nLights, uint32_t seed)
+{
+	using json = nlohmann::json;
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<float> u01(0.f, 1.f);
+
+	json scene;
+	scene["Materials"]["floor"] = { { "TYPE", "Diffuse" }, { "RGB", { 0.8, 0.8, 0.8 } } };
+	scene["Materials"]["pillar"] = { { "TYPE", "Diffuse" }, { "RGB", { 0.6, 0.5, 0.4 } } };
+	scene["Camera"] = { { "RES", { 800, 600 } }, { "FOVY", 45.0 }, { "ITERATIONS", 1000 }, { "DEPTH", 4 }, { "FILE", "manylights" },
+		{ "EYE", { 0.0, 14.0, 24.0 } }, { "LOOKAT", { 0.0, 0.0, 0.0 } }, { "UP", { 0.0, 1.0, 0.0 } } };
+
+	json objects = json::array();
+	objects.push_back({ { "TYPE", "cube" }, { "MATERIAL", "floor" }, { "TRANS", { 0, 0, 0 } }, { "ROTAT", { 0, 0, 0 } }, { "SCALE", { 20, 0.005, 20 } } });
+	for (int x = -15; x <= 15; x += 6)
+	{
+		for (int z = -15; z <= 15; z += 6)
+			objects.push_back({ { "TYPE", "cube" }, { "MATERIAL", "pillar" }, { "TRANS", { x, 2, z } }, { "ROTAT", { 0, 0, 0 } }, { "SCALE", { 0.5, 2, 0.5 } } });
+	}
+	scene["Objects"] = objects;
+
+	const float colors[4][3] = { { 1.0f, 1.0f, 1.0f }, { 1.0f, 0.6f, 0.3f }, { 0.4f, 0.6f, 1.0f }, { 0.5f, 1.0f, 0.5f } };
+	const float emittances[4] = { 2.f, 10.f, 50.f, 250.f };
+	json lights = json::array();
+	for (int i = 0; i < nLights; ++i)
+	{
+		const float* color = colors[rng() % 4];
+		lights.push_back({ { "TYPE", "Area" },
+			{ "TRANS", { -18.f + 36.f * u01(rng), 0.5f + 6.f * u01(rng), -18.f + 36.f * u01(rng) } },
+			{ "ROTAT", { 360.f * u01(rng), 360.f * u01(rng), 0.f } },
+			{ "SCALE", { 0.05f + 0.2f * u01(rng), 0.05f + 0.2f * u01(rng), 1.f } },
+			{ "MATERIAL", { { "RGB", { color[0], color[1], color[2] } }, { "EMITTANCE", emittances[rng() % 4] }, { "ROUGHNESS", 1.0 } } } });
+	}
+	scene["Lights"] = lights;
+
+	std::ofstream file(path);
+	file << scene.dump(4);
+}
+
+// Direct light at the first non emissive hit of each camera ray, with each light selection
+// strategy picking the light Sample_Li samples: rRMSE against a 1024 sample light BVH estimate
+// at 1, 4, 16 and 64 samples, and how many times the samples uniform picking needs for the same
+// error (the ratio of the variances).
+static void compareLightSelection(Scene& scene, const SceneBenchOptions& options)
+{
+	SceneAccel accel = scene.hostAccel();
+	EnvMap envMap = scene.envMap != nullptr ? scene.envMap->view() : EnvMap();
+	AABB sceneBounds;
+	if (!scene.triangleHits.empty())
+		sceneBounds = scene.bvh->nodes[0].bounds;
+
+	const char* names[3] = { "uniform", "power", "BVH" };
+	const LightBVH::Strategy strategies[3] = { LightBVH::Strategy::Uniform, LightBVH::Strategy::Power, LightBVH::Strategy::BVH };
+	LightBVH selections[3];
+	LightSampler samplers[3];
+	float buildMs[3];
+	for (int k = 0; k < 3; ++k)
+	{
+		auto start = BenchClock::now();
+		selections[k].build(scene.lights, envMap, sceneBounds, strategies[k]);
+		buildMs[k] = msSince(start);
+		samplers[k] = selections[k].hostView();
+	}
+
+	struct ShadingPoint { glm::vec3 p, n; };
+	std::vector<ShadingPoint> points;
+	Camera cam = benchCamera(scene, options);
+	for (int y = 0; y < cam.resolution.y; ++y)
+	{
+		for (int x = 0; x < cam.resolution.x; ++x)
+		{
+			Ray ray = cameraRay(cam, x, y, 1);
+			ShadeableIntersection isect;
+			if (!SceneIntersect(ray, accel, &isect) || scene.materials[isect.materialId].emittance > 0.f)
+				continue;
+			glm::vec3 n = glm::dot(isect.surfaceNormal, ray.direction) > 0.f ? -isect.surfaceNormal : isect.surfaceNormal;
+			points.push_back({ getPointOnRay(ray, isect.t) + n * 1e-3f, n });
+		}
+	}
+	if (points.empty())
+	{
+		printf("no camera ray hits the scene\n");
+		return;
+	}
+
+	// luminance of the cosine weighted direct light at a point from nSamples light samples
+	Light* lights = scene.lights.data();
+	int numLights = envMap.valid() ? scene.lights.size() + 1 : scene.lights.size();
+	auto estimate = [&](const LightSampler& sampler, int point, int nSamples, int seed) {
+		const ShadingPoint& sp = points[point];
+		// independent samples, the runs of a point differ in their pixel
+		PathSampler rng(Sampler(), sampling::hash(point, seed, nSamples), 0, 1, SAMPLE_LIGHT_PICK);
+		thrust::uniform_real_distribution<float> u01(0.f, 1.f);
+		glm::mat3 ltw = LocalToWorld(sp.n);
+		glm::mat3 wtl = glm::transpose(ltw);
+		double sum = 0.0;
+		for (int i = 0; i < nSamples; ++i)
+		{
+			rng.sampleIndex = i;
+			rng.startDimension(1, SAMPLE_LIGHT_PICK);
+			float pmf;
+			int light = sampler.sample(sp.p, u01(rng), pmf);
+			if (light < 0)
+				continue;
+			rng.startDimension(1, SAMPLE_LIGHT);
+			glm::vec3 wi;
+			float pdf = 0.f;
+			glm::vec3 Li = Sample_Li(sp.p, sp.n, wi, pdf, light, pmf, numLights, envMap, rng, accel, lights, ltw, wtl);
+			if (pdf > 0.f)
+				sum += luminance(Li) * glm::max(glm::dot(wi, sp.n), 0.f) / pdf;
+		}
+		return sum / nSamples;
+	};
+
+	ThreadPool pool;
+	const int nPoints = points.size();
+	std::vector<double> reference(nPoints);
+	pool.parallelFor(nPoints, 16, [&](int64_t i0, int64_t i1, int) {
+		for (int64_t i = i0; i < i1; ++i)
+			reference[i] = estimate(samplers[2], i, 1024, 0);
+	});
+	double referenceMean = 0.0;
+	for (double r : reference)
+		referenceMean += r;
+	referenceMean /= nPoints;
+
+	printf("  %d lights, %d shading points, mean direct light luminance %.4f\n", (int)scene.lights.size(), nPoints, referenceMean);
+	printf("  light BVH: %zu nodes, depth %d, %.1f KB\n", selections[2].nodes.size(), selections[2].depth(), selections[2].memoryBytes() / 1024.0);
+	for (int k = 0; k < 3; ++k)
+	{
+		// single thread cost of picking a light
+		const int nPicks = 1 << 20;
+		float sink = 0.f;
+		auto start = BenchClock::now();
+		for (int i = 0; i < nPicks; ++i)
+		{
+			float pmf;
+			sink += samplers[k].sample(points[i % nPoints].p, (i * 0.618034f) - (int)(i * 0.618034f), pmf) + pmf;
+		}
+		float pickNs = msSince(start) * 1e6f / nPicks + (sink == -1.f ? 1.f : 0.f);
+		printf("  %-8s built in %.2f ms, %.1f ns per pick\n", names[k], buildMs[k], pickNs);
+	}
+
+	printf("  %8s %12s %12s %12s %13s %13s %13s %13s %13s\n", "samples", "uniform mean", "power mean", "BVH mean",
+		"uniform rRMSE", "power rRMSE", "BVH rRMSE", "power eq spp", "BVH eq spp");
+	const int sampleCounts[] = { 1, 4, 16, 64 };
+	for (int nSamples : sampleCounts)
+	{
+		double mean[3] = {}, rmse[3] = {};
+		for (int k = 0; k < 3; ++k)
+		{
+			std::vector<double> estimates(nPoints);
+			pool.parallelFor(nPoints, 16, [&](int64_t i0, int64_t i1, int) {
+				for (int64_t i = i0; i < i1; ++i)
+					estimates[i] = estimate(samplers[k], i, nSamples, 1);
+			});
+			double sq = 0.0;
+			for (int i = 0; i < nPoints; ++i)
+			{
+				mean[k] += estimates[i];
+				sq += (estimates[i] - reference[i]) * (estimates[i] - reference[i]);
+			}
+			mean[k] /= nPoints;
+			rmse[k] = std::sqrt(sq / nPoints) / referenceMean;
+		}
+		printf("  %8d %12.4f %12.4f %12.4f %13.4f %13.4f %13.4f %12.1fx %12.1fx\n", nSamples, mean[0], mean[1], mean[2], rmse[0], rmse[1], rmse[2],
+			rmse[1] > 0.0 ? (rmse[0] * rmse[0]) / (rmse[1] * rmse[1]) : 0.0, rmse[2] > 0.0 ? (rmse[0] * rmse[0]) / (rmse[2] * rmse[2]) : 0.0);
+	}
+}
+
+// --bench manylights [n] [--out scene.json] [--rays WxH]: writes a scene with n area lights (default 4096, to
+// scenes/manylights.json so the bundled objs resolve) and compares the light selection strategies on it
+static int benchmarkManyLights(int argc, char** argv)
+{
+	int nLights = 4096;
+	std::string path = "scenes/manylights.json";
+	SceneBenchOptions options;
+	options.width = 64;
+	options.height = 64;
+	for (int i = 0; i < argc; ++i)
+	{
+		std::string option = argv[i];
+		if (option == "--out" && i + 1 < argc)
+			path = argv[++i];
+		else if (option == "--rays" && i + 1 < argc)
+			sscanf(argv[++i], "%dx%d", &options.width, &options.height);
+		else
+			nLights = atoi(argv[i]);
+	}
+	if (nLights < 1 || nLights >= 0xffff)
+	{
+		printf("light count has to be in [1, 65534]\n");
+		return 1;
+	}
+	writeManyLightsScene(path, nLights, 565);
+	std::unique_ptr<Scene> scene(new Scene(path));
+	scene->createBVH(false);
+	printf("many lights benchmark, %s\n", path.c_str());
+	compareLightSelection(*scene, options);
+	return 0;
+}
+
+// --bench lightselect scene.json... [--rays WxH]: the light selection strategies on each scene
+static int benchmarkLightSelection(int argc, char** argv)
+{
+	SceneBenchOptions options;
+	options.width = 64;
+	options.height = 64;
+	std::vector<std::string> paths;
+	for (int i = 0; i < argc; ++i)
+	{
+		std::string option = argv[i];
+		if (option == "--rays" && i + 1 < argc)
+			sscanf(argv[++i], "%dx%d", &options.width, &options.height);
+		else
+			paths.push_back(option);
+	}
+	if (paths.empty())
+	{
+		printf("usage: --bench lightselect scene.json... [--rays WxH]\n");
+		return 1;
+	}
+	for (const std::string& path : paths)
+	{
+		std::unique_ptr<Scene> scene(new Scene(path));
+		scene->loadEnvMap(false);
+		scene->createBVH(false);
+		printf("light selection, %s\n", path.c_str());
+		compareLightSelection(*scene, options);
+	}
+	return 0;
+}
+
+// renders scene's camera at the benchmark resolution on the host, nSamples samples per pixel from
+// sample firstSample on, and returns the luminance of each pixel clamped to the displayed range; the
+// emitters and the fireflies next to them would otherwise make up most of the error. With an adaptive
+// threshold the pixels share the same budget of samples, which always start at the pixel's first one,
+// and sampleCounts gets how many each pixel took.
+static std::vector<double> renderLuminance(Scene& scene, SamplerType samplerType, int nSamples, int firstSample,
+	float adaptiveThreshold = 0.0f, std::vector<int>* sampleCounts = nullptr)
+{
+	RenderState& state = scene.state;
+	const int pixelcount = state.camera.resolution.x * state.camera.resolution.y;
+	state.iterations = nSamples;
+	state.image.assign(pixelcount, glm::vec3(0.f));
+	state.albedo.assign(pixelcount, glm::vec3(0.f));
+	state.normal.assign(pixelcount, glm::vec3(0.f));
+	CpuPathTracer tracer(&scene, 0, samplerType, adaptiveThreshold);
+	std::vector<double> result(pixelcount);
+	if (adaptiveThreshold > 0.0f)
+	{
+		// the image holds each pixel's mean times the last iteration
+		const int64_t budget = (int64_t)nSamples * pixelcount;
+		int64_t samplesTaken = 0;
+		int iter = 0;
+		while (samplesTaken < budget)
+		{
+			int samples = tracer.pathtrace(++iter);
+			samplesTaken += samples;
+			if (samples == 0)
+				break;
+		}
+		for (int i = 0; i < pixelcount; ++i)
+			result[i] = std::min(luminance(state.image[i]) / iter, 1.0f);
+		if (sampleCounts != nullptr)
+			sampleCounts->swap(state.sampleCounts);
+		state.sampleCounts.clear();
+		return result;
+	}
+	for (int i = 0; i < nSamples; ++i)
+		tracer.pathtrace(firstSample + i + 1);
+	for (int i = 0; i < pixelcount; ++i)
+		result[i] = std::min(luminance(state.image[i]) / nSamples, 1.0f);
+	return result;
+}
+
+// --bench samplers scene.json [--rays WxH] [--ref n] [--trials n]: error of the CPU backend's image with each
+// sampler against an independent reference of n samples per pixel (default 1024), at equal sample counts. The
+// squared error is averaged over trials (default 4) that draw the next samplesPerPixel samples each, so a
+// few fireflies don't decide the ranking.
+static int benchmarkSamplers(int argc, char** argv)
+{
+	SceneBenchOptions options;
+	options.width = 64;
+	options.height = 64;
+	int referenceSamples = 1024;
+	int nTrials = 4;
+	std::string path;
+	for (int i = 0; i < argc; ++i)
+	{
+		std::string option = argv[i];
+		if (option == "--rays" && i + 1 < argc)
+			sscanf(argv[++i], "%dx%d", &options.width, &options.height);
+		else if (option == "--ref" && i + 1 < argc)
+			referenceSamples = atoi(argv[++i]);
+		else if (option == "--trials" && i + 1 < argc)
+			nTrials = std::max(1, atoi(argv[++i]));
+		else
+			path = option;
+	}
+	if (path.empty())
+	{
+		printf("usage: --bench samplers scene.json [--rays WxH] [--ref n] [--trials n]\n");
+		return 1;
+	}
+	std::unique_ptr<Scene> scene(new Scene(path));
+	scene->loadEnvMap(false);
+	scene->createBVH(false);
+	scene->state.camera = benchCamera(*scene, options);
+
+	auto start = BenchClock::now();
+	blueNoiseMask();
+	float maskMs = msSince(start);
+
+	// the reference's samples start far past the ones being measured, so it shares none of them
+	start = BenchClock::now();
+	std::vector<double> reference = renderLuminance(*scene, SamplerType::Independent, referenceSamples, 1 << 20);
+	double referenceMean = 0.0;
+	for (double r : reference)
+		referenceMean += r;
+	referenceMean /= reference.size();
+	printf("sampler convergence, %s\n", path.c_str());
+	printf("  %dx%d pixels, reference %d spp in %.0f ms, mean luminance %.4f, blue noise mask made in %.0f ms, %d trials\n",
+		options.width, options.height, referenceSamples, msSince(start), referenceMean, maskMs, nTrials);
+
+	// the ratio is the independent sampler's squared error over the sampler's, the samples it saves at equal error
+	const SamplerType types[4] = { SamplerType::Independent, SamplerType::Stratified, SamplerType::Sobol, SamplerType::BlueNoise };
+	printf("  %8s", "spp");
+	for (SamplerType type : types)
+		printf(" %11s rRMSE", samplerName(type));
+	for (int k = 1; k < 4; ++k)
+		printf(" %11s ratio", samplerName(types[k]));
+	printf("\n");
+	const int sampleCounts[] = { 1, 4, 16, 64 };
+	for (int nSamples : sampleCounts)
+	{
+		double rmse[4];
+		for (int k = 0; k < 4; ++k)
+		{
+			double sq = 0.0;
+			for (int trial = 0; trial < nTrials; ++trial)
+			{
+				std::vector<double> image = renderLuminance(*scene, types[k], nSamples, trial * nSamples);
+				for (size_t i = 0; i < image.size(); ++i)
+					sq += (image[i] - reference[i]) * (image[i] - reference[i]);
+			}
+			rmse[k] = std::sqrt(sq / (reference.size() * nTrials)) / referenceMean;
+		}
+		printf("  %8d", nSamples);
+		for (int k = 0; k < 4; ++k)
+			printf(" %17.4f", rmse[k]);
+		for (int k = 1; k < 4; ++k)
+			printf(" %16.2fx", rmse[k] > 0.0 ? (rmse[0] * rmse[0]) / (rmse[k] * rmse[k]) : 0.0);
+		printf("\n");
+	}
+	return 0;
+}
+
+// --bench adaptive scene.json [--rays WxH] [--ref n] [--threshold t]: error of the CPU backend's image when
+// every pixel takes the same number of samples and when adaptive sampling spends that many samples per pixel
+// on average where the luminance varies most, both with the default sampler against an independent
+// reference of n samples per pixel (default 1024). Adaptive sampling gives a pixel's samples the same
+// indices in every render, so each sample count is one render rather than several trials.
+static int benchmarkAdaptiveSampling(int argc, char** argv)
+{
+	SceneBenchOptions options;
+	options.width = 64;
+	options.height = 64;
+	int referenceSamples = 1024;
+	float threshold = ADAPTIVE_SAMPLING > 0.0f ? ADAPTIVE_SAMPLING : 0.01f;
+	std::string path;
+	for (int i = 0; i < argc; ++i)
+	{
+		std::string option = argv[i];
+		if (option == "--rays" && i + 1 < argc)
+			sscanf(argv[++i], "%dx%d", &options.width, &options.height);
+		else if (option == "--ref" && i + 1 < argc)
+			referenceSamples = atoi(argv[++i]);
+		else if (option == "--threshold" && i + 1 < argc)
+			threshold = (float)atof(argv[++i]);
+		else
+			path = option;
+	}
+	if (path.empty() || threshold <= 0.0f)
+	{
+		printf("usage: --bench adaptive scene.json [--rays WxH] [--ref n] [--threshold t > 0]\n");
+		return 1;
+	}
+	std::unique_ptr<Scene> scene(new Scene(path));
+	scene->loadEnvMap(false);
+	scene->createBVH(false);
+	scene->state.camera = benchCamera(*scene, options);
+
+	auto start = BenchClock::now();
+	std::vector<double> reference = renderLuminance(*scene, SamplerType::Independent, referenceSamples, 1 << 20);
+	double referenceMean = 0.0;
+	for (double r : reference)
+		referenceMean += r;
+	referenceMean /= reference.size();
+	printf("adaptive sampling, %s\n", path.c_str());
+	printf("  %dx%d pixels, reference %d spp in %.0f ms, mean luminance %.4f, %s sampler, threshold %.3f\n",
+		options.width, options.height, referenceSamples, msSince(start), referenceMean, samplerName(SAMPLER), threshold);
+
+	// the ratio is the uniform image's squared error over the adaptive one's, the samples it saves at equal error
+	printf("  %8s %13s %14s %9s %10s %10s %12s\n", "spp", "uniform rRMSE", "adaptive rRMSE", "ratio", "min spp", "max spp", "adaptive ms");
+	const int sampleCounts[] = { 16, 32, 64, 128 };
+	for (int nSamples : sampleCounts)
+	{
+		double rmse[2];
+		float ms = 0.0f;
+		std::vector<int> sampleCounts;
+		for (int k = 0; k < 2; ++k)
+		{
+			start = BenchClock::now();
+			std::vector<double> image = renderLuminance(*scene, SAMPLER, nSamples, 0, k == 0 ? 0.0f : threshold, &sampleCounts);
+			ms = msSince(start);
+			double sq = 0.0;
+			for (size_t i = 0; i < image.size(); ++i)
+				sq += (image[i] - reference[i]) * (image[i] - reference[i]);
+			rmse[k] = std::sqrt(sq / reference.size()) / referenceMean;
+		}
+		int minSamples = *std::min_element(sampleCounts.begin(), sampleCounts.end());
+		int maxSamples = *std::max_element(sampleCounts.begin(), sampleCounts.end());
+		printf("  %8d %13.4f %14.4f %8.2fx %10d %10d %12.0f\n", nSamples, rmse[0], rmse[1],
+			rmse[1] > 0.0 ? (rmse[0] * rmse[0]) / (rmse[1] * rmse[1]) : 0.0, minSamples, maxSamples, ms);
+	}
+	return 0;
+}
+
+struct BenchmarkEntry
+{
+	const char* name;
+	int (*run)(int argc, char** argv);
+	const char* description;
+};
+
+static const BenchmarkEntry benchmarks[] = {
+	{ "sort", benchmarkMortonSort, "[n ...]  morton code radix sort (default 1M 10M 50M codes)" },
+	{ "bvhstats", benchmarkBVHStats, "scene.json [--builder HLBVH|SAH] [--bins n] [--rays WxH] [--out stats.json]  BVH quality report" },
+	{ "widebvh", benchmarkWideBVH, "scene.json [--builder HLBVH|SAH] [--bins n] [--rays WxH]  binary vs 4/8 wide BVH host traversal" },
+	{ "quantbvh", benchmarkQuantizedBVH, "[--builder HLBVH|SAH] [--rays WxH] [mesh.obj ...]  8/16 bit quantized BVH size and speed (default: bundled meshes)" },
+	{ "refit", benchmarkRefit, "scene.json [--builder HLBVH|SAH] [--frames n] [--geom i]  animated mesh: BVH refit vs full build per frame" },
+	{ "shadow", benchmarkShadowRays, "scene.json [--builder HLBVH|SAH] [--rays WxH]  shadow ray visibility: closest hit vs any-hit occlusion query" },
+	{ "hotcold", benchmarkHotCold, "scene.json [--builder HLBVH|SAH] [--rays WxH]  bytes per ray and speed of the TriangleHit traversal array" },
+	{ "wavefront", benchmarkWavefront, "scene.json [--builder HLBVH|SAH] [--rays WxH]  bytes per bounce of the PathSegment and PathState wavefront loops" },
+	{ "matsort", benchmarkMaterialSort, "scene.json [--builder HLBVH|SAH] [--rays WxH]  per bounce material sort cost and shading coherence" },
+	{ "bsdfqueue", benchmarkBSDFQueues, "scene.json [n]  BSDFs of n hits through the material type dispatch vs per type queues" },
+	{ "compact", benchmarkCompaction, "[n]  stream compaction of n paths (default 1M) at several survival ratios" },
+	{ "envmap", benchmarkEnvSampling, "[W H]  environment light sample error: uniform directions vs the luminance CDF (default 1024x512)" },
+	{ "manylights", benchmarkManyLights, "[n] [--out scene.json] [--rays WxH]  writes a scene with n area lights (default 4096) and compares the light selection strategies on it" },
+	{ "lightselect", benchmarkLightSelection, "scene.json... [--rays WxH]  direct light error with uniform, power (alias table) and light BVH selection" },
+	{ "samplers", benchmarkSamplers, "scene.json [--rays WxH] [--ref n] [--trials n]  image error of the independent, stratified, Sobol and blue noise samplers at equal spp" },
+	{ "adaptive", benchmarkAdaptiveSampling, "scene.json [--rays WxH] [--ref n] [--threshold t]  image error of uniform and adaptive per pixel sampling at equal sample budgets" },
+};
+
+int runBenchmark(const std::string& name, int argc, char** argv)
+{
+	for (const BenchmarkEntry& entry : benchmarks)
+	{
+		if (name == entry.name)
+			return entry.run(argc, argv);
+	}
+	printf("Unknown benchmark '%s', available:\n", name.c_str());
+	for (const BenchmarkEntry& entry : benchmarks)
+		printf("  --bench %s %s\n", entry.name, entry.description);
+	return 1;
+}
@@ -0,0 +1,7 @@
+#pragma once
+#include <string>
+
+// Host side micro benchmarks and tools, run with
+//     cis565_path_tracer --bench <name> [args...]
+// An unknown name lists the available benchmarks.
+int runBenchmark(const std::string& name, int argc, char** argv);
@@ -0,0 +1,60 @@
+#pragma once
+#include <cuda_runtime.h>
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+
+// Device buffers that live across pathtraceInit calls. Each buffer is looked up by name, so
+// asking again at the same resolution hands back the allocation made the first time and
+// resetting the render is a lookup plus whatever the caller clears. A buffer is only freed and
+// reallocated when a larger size is asked for, and everything is freed by releaseAll().
+class DeviceBufferPool {
+public:
+    struct Stats {
+        int allocations = 0; // cudaMalloc calls
+        int reuses = 0;      // acquires served by an existing allocation
+        size_t bytes = 0;    // device memory held by the pool
+    };
+
+    ~DeviceBufferPool() { releaseAll(); }
+
+    // count elements of T under name, contents are undefined after a reallocation
+    template<typename T>
+    T* acquire(const std::string& name, size_t count) {
+        size_t nBytes = count * sizeof(T);
+        Buffer& buffer = buffers[name];
+        if (buffer.ptr && buffer.bytes >= nBytes) {
+            ++stats.reuses;
+            return static_cast<T*>(buffer.ptr);
+        }
+        if (buffer.ptr) {
+            cudaFree(buffer.ptr);
+            stats.bytes -= buffer.bytes;
+        }
+        buffer.ptr = nullptr;
+        buffer.bytes = 0;
+        if (nBytes > 0 && cudaMalloc(&buffer.ptr, nBytes) == cudaSuccess) {
+            buffer.bytes = nBytes;
+            stats.bytes += nBytes;
+            ++stats.allocations;
+        }
+        return static_cast<T*>(buffer.ptr);
+    }
+
+    void releaseAll() {
+        for (auto& entry : buffers)
+            cudaFree(entry.second.ptr);
+        buffers.clear();
+        stats.bytes = 0;
+    }
+
+    const Stats& getStats() const { return stats; }
+
+private:
+    struct Buffer {
+        void* ptr = nullptr;
+        size_t bytes = 0;
+    };
+    std::unordered_map<std::string, Buffer> buffers;
+    Stats stats;
+};
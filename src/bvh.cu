@@ -1,17 +1,47 @@
 ﻿#include "bvh.h"
+#include "bvhCache.h"
+#include <chrono>
 LinearBVHNode* dev_nodes = NULL;
 
-void BVHAccel::updateMortonCodes(std::vector<MortonPrimitive>& mortonPrims, const std::vector<BVHPrimitiveInfo>& primitiveInfo, AABB& bounds, int chunkSize) const
+// milliseconds since lap was last reset, and resets it
+static float lapMs(std::chrono::high_resolution_clock::time_point& lap)
 {
-	for (int i = 0; i < mortonPrims.size(); i++)
+	auto now = std::chrono::high_resolution_clock::now();
+	float ms = std::chrono::duration<float, std::milli>(now - lap).count();
+	lap = now;
+	return ms;
+}
+
+void BVHAccel::BVHBuildStats::print() const
+{
+	if (builder == SplitMethod::SAH)
 	{
-		// << Update mortonPrims[i] for ith primitive >>
-		constexpr int mortonBits = 10; // use 10 bits for each spatial dimension: x, y, z
-		constexpr int mortonScale = 1 << mortonBits;
-		mortonPrims[i].primitiveIndex = primitiveInfo[i].primitiveNumber;
-		glm::vec3 centroidOffset = bounds.Offset(primitiveInfo[i].centroid);
-		mortonPrims[i].mortonCode = EncodeMorton3(centroidOffset * static_cast<float>(mortonScale));
+		printf("BVH build (SAH): %d subtrees, %d nodes, %d threads\n", nTreelets, totalNodes, nThreads);
+		printf("  primitive info %.2f ms | upper splits %.2f ms | subtrees %.2f ms | reorder %.2f ms | flatten %.2f ms\n",
+			primitiveInfoMs, upperSAHMs, treeletMs, reorderMs, flattenMs);
 	}
+	else
+	{
+		printf("BVH build (HLBVH): %d treelets, %d nodes, %d threads\n", nTreelets, totalNodes, nThreads);
+		printf("  primitive info %.2f ms | morton %.2f ms | sort %.2f ms | treelets %.2f ms | upper SAH %.2f ms | reorder %.2f ms | flatten %.2f ms\n",
+			primitiveInfoMs, mortonMs, sortMs, treeletMs, upperSAHMs, reorderMs, flattenMs);
+	}
+	printf("  total %.2f ms\n", totalMs);
+}
+
+void BVHAccel::updateMortonCodes(ThreadPool& pool, std::vector<MortonPrimitive>& mortonPrims, const std::vector<BVHPrimitiveInfo>& primitiveInfo, AABB& bounds, int chunkSize) const
+{
+	pool.parallelFor(mortonPrims.size(), chunkSize, [&](int64_t begin, int64_t end, int threadIndex) {
+		for (int64_t i = begin; i < end; i++)
+		{
+			// << Update mortonPrims[i] for ith primitive >>
+			constexpr int mortonBits = 10; // use 10 bits for each spatial dimension: x, y, z
+			constexpr int mortonScale = 1 << mortonBits;
+			mortonPrims[i].primitiveIndex = primitiveInfo[i].primitiveNumber;
+			glm::vec3 centroidOffset = bounds.Offset(primitiveInfo[i].centroid);
+			mortonPrims[i].mortonCode = EncodeMorton3(centroidOffset * static_cast<float>(mortonScale));
+		}
+	});
 }
 
 BVHAccel::BVHBuildNode* BVHAccel::emitLBVH(BVHBuildNode*& buildNodes,
@@ -139,131 +169,62 @@ void BVHAccel::RadixSort(std::vector<MortonPrimitive>* v) {
 
 }
 
-BVHAccel::BVHBuildNode* BVHAccel::recursiveBuild(MemoryArena& arena,
-	std::vector<BVHPrimitiveInfo>& primitiveInfo, int start,
-	int end, int* totalNodes,
-	std::vector<Triangle*>& orderedPrims) {
-	BVHBuildNode* node = arena.Alloc<BVHBuildNode>();
-	(*totalNodes)++;
-
-	// compute bounds of all primitives in BVH node
-	AABB bounds;
-	for (int i = start; i < end; ++i)
-		bounds = AABB::AABB::Union(bounds, primitiveInfo[i].bounds);
-
-	int nPrimitives = end - start;
-	if (nPrimitives < maxPrimsInNode) {
-		// create leaf node
-		int firstPrimOffset = orderedPrims.size();
-		for (int i = start; i < end; ++i) {
-			int primNum = primitiveInfo[i].primitiveNumber;
-			orderedPrims.push_back(primitives[primNum]);
-		}
-		node->initLeaf(firstPrimOffset, nPrimitives, bounds);
-		return node;
-	}
-	else {
-		// Compute bound of primitive centroids, choose split dimension dim
-		AABB centroidBounds; // initialize?
-		for (int i = start; i < end; ++i)
-			centroidBounds = AABB::AABB::Union(centroidBounds, primitiveInfo[i].centroid);
-		int dim = centroidBounds.maxExtent();
-
-		//Partition primitives into two sets and build children
-		int mid = (start + end) / 2;
-		if (centroidBounds.max[dim] == centroidBounds.min[dim]) {
-			// Create leaf BVHBuildNode 
-			int firstPrimOffset = orderedPrims.size();
-			for (int i = start; i < end; ++i) {
-				int primNum = primitiveInfo[i].primitiveNumber;
-				orderedPrims.push_back(primitives[primNum]);
-			}
-			node->initLeaf(firstPrimOffset, nPrimitives, bounds);
-			return node;
-		}
-		else {
-
-			// Allocate BucketInfo for SAH partition buckets
-			constexpr int nBuckets = 12;
-			struct BucketInfo {
-				int count = 0;
-				AABB bounds;
-			};
-			BucketInfo buckets[nBuckets];
-
-			// Initialize BucketInfo for SAH partition buckets
-			for (int i = start; i < end; ++i) {
-				int b = nBuckets *
-					centroidBounds.Offset(primitiveInfo[i].centroid)[dim];
-				if (b == nBuckets) b = nBuckets - 1;
-				buckets[b].count++;
-				buckets[b].bounds = AABB::AABB::Union(buckets[b].bounds, primitiveInfo[i].bounds);
-			}
-
-			// Compute costs for splitting after each bucket
-			float cost[nBuckets - 1];
-			for (int i = 0; i < nBuckets - 1; ++i) {
-				AABB b0, b1;
-				int count0 = 0, count1 = 0;
-				for (int j = 0; j <= i; ++j) {
-					b0 = AABB::AABB::Union(b0, buckets[j].bounds);
-					count0 += buckets[j].count;
-				}
-				for (int j = i + 1; j < nBuckets; ++j) {
-					b1 = AABB::AABB::Union(b1, buckets[j].bounds);
-					count1 += buckets[j].count;
-				}
-				cost[i] = 0.125f + (count0 * b0.SurfaceArea() +
-					count1 * b1.SurfaceArea()) / bounds.SurfaceArea();
-			}
+void BVHAccel::ParallelRadixSort(ThreadPool& pool, std::vector<MortonPrimitive>* v,
+	std::vector<MortonPrimitive>& scratch, int bitsPerPass)
+{
+	constexpr int nBits = 30;
+	bitsPerPass = glm::clamp(bitsPerPass, 1, 16);
+	const int nPasses = (nBits + bitsPerPass - 1) / bitsPerPass;
+	const int nBuckets = 1 << bitsPerPass;
+	const uint32_t bitMask = nBuckets - 1;
+	const int64_t n = v->size();
+	scratch.resize(v->size()); // only reallocates when the capacity is too small
+
+	// every thread owns one contiguous block, which keeps the scatter stable
+	const int nBlocks = n < 65536 ? 1 : pool.size();
+	const int64_t blockSize = (n + nBlocks - 1) / nBlocks;
+	std::vector<int> offsets(nBlocks * nBuckets);
+
+	MortonPrimitive* in = v->data();
+	MortonPrimitive* out = scratch.data();
+	for (int pass = 0; pass < nPasses; ++pass) {
+		int lowBit = pass * bitsPerPass;
 
-			// Find bucket to split at that minimizes SAH metric
-			float minCost = cost[0];
-			int minCostSplitBucket = 0;
-			for (int i = 1; i < nBuckets - 1; ++i) {
-				if (cost[i] < minCost) {
-					minCost = cost[i];
-					minCostSplitBucket = i;
-				}
+		// Count bucket sizes of each block
+		pool.parallelFor(nBlocks, 1, [&](int64_t b0, int64_t b1, int threadIndex) {
+			for (int64_t b = b0; b < b1; ++b) {
+				int* count = &offsets[b * nBuckets];
+				std::fill(count, count + nBuckets, 0);
+				int64_t end = std::min(n, (b + 1) * blockSize);
+				for (int64_t i = b * blockSize; i < end; ++i)
+					++count[(in[i].mortonCode >> lowBit) & bitMask];
 			}
+		});
 
-			// Either create leaf or interior BVHBuildNode
-			float leafCost = nPrimitives;
-			if (nPrimitives > maxPrimsInNode || minCost < leafCost) {
-				BVHPrimitiveInfo* pmid = std::partition(&primitiveInfo[start],
-					&primitiveInfo[end - 1] + 1,
-					[=](const BVHPrimitiveInfo& pi) {
-						int b = nBuckets * centroidBounds.Offset(pi.centroid)[dim];
-						if (b == nBuckets) b = nBuckets - 1;
-						return b <= minCostSplitBucket;
-					});
-				mid = pmid - &primitiveInfo[0];
-			}
-			else {
-				// Create leaf BVHBuildNode
-				int firstPrimOffset = orderedPrims.size();
-				for (int i = start; i < end; ++i) {
-					int primNum = primitiveInfo[i].primitiveNumber;
-					orderedPrims.push_back(primitives[primNum]);
-				}
-				node->initLeaf(firstPrimOffset, nPrimitives, bounds);
-				return node;
+		// Exclusive scan in bucket-major, block-minor order gives each block its output slots
+		int sum = 0;
+		for (int bucket = 0; bucket < nBuckets; ++bucket) {
+			for (int b = 0; b < nBlocks; ++b) {
+				int count = offsets[b * nBuckets + bucket];
+				offsets[b * nBuckets + bucket] = sum;
+				sum += count;
 			}
+		}
 
-			if (start == mid || mid == end) {
-				mid = start + (end - start) / 2;
+		// Scatter each block into its slots
+		pool.parallelFor(nBlocks, 1, [&](int64_t b0, int64_t b1, int threadIndex) {
+			for (int64_t b = b0; b < b1; ++b) {
+				int* outIndex = &offsets[b * nBuckets];
+				int64_t end = std::min(n, (b + 1) * blockSize);
+				for (int64_t i = b * blockSize; i < end; ++i)
+					out[outIndex[(in[i].mortonCode >> lowBit) & bitMask]++] = in[i];
 			}
-
-			// Partition primitives based on splitMethod
-			node->InitInterior(dim,
-				recursiveBuild(arena, primitiveInfo, start, mid,
-					totalNodes, orderedPrims),
-				recursiveBuild(arena, primitiveInfo, mid, end,
-					totalNodes, orderedPrims));
-			return node;
-		}
+		});
+		std::swap(in, out);
 	}
-	return nullptr;
+	// after an odd number of passes the sorted keys are in scratch
+	if (nPasses & 1)
+		v->swap(scratch);
 }
 
 BVHAccel::BVHBuildNode* BVHAccel::buildUpperSAH(MemoryArena& arena,
@@ -366,11 +327,14 @@ BVHAccel::BVHBuildNode* BVHAccel::buildUpperSAH(MemoryArena& arena,
 
 
 BVHAccel::BVHBuildNode* BVHAccel::HLBVHBuild(MemoryArena& arena,
+	std::vector<std::unique_ptr<MemoryArena>>& threadArenas,
+	ThreadPool& pool,
 	const std::vector<BVHPrimitiveInfo>& primitiveInfo,
 	int* totalNodes,
-	std::vector<Triangle*>& orderedPrims) const
+	std::vector<Triangle*>& orderedPrims)
 
 {
+	auto lap = std::chrono::high_resolution_clock::now();
 	// Compute bounding box of all primitive centroids
 	AABB bounds;
 	for (const BVHPrimitiveInfo& pi : primitiveInfo)
@@ -380,10 +344,13 @@ BVHAccel::BVHBuildNode* BVHAccel::HLBVHBuild(MemoryArena& arena,
 	//printf("bounds: %f %f %f %f %f %f\n", bounds.min.x, bounds.min.y, bounds.min.z, bounds.max.x, bounds.max.y, bounds.max.z);
 	// Compute Morton indices of primitives 
 	std::vector<MortonPrimitive> mortonPrims(primitiveInfo.size());
-	updateMortonCodes(mortonPrims, primitiveInfo, bounds, 512);
+	updateMortonCodes(pool, mortonPrims, primitiveInfo, bounds, 512);
+	buildStats.mortonMs = lapMs(lap);
 
 	// apply radix sort to morton codes
-	RadixSort(&mortonPrims);
+	std::vector<MortonPrimitive> localScratch;
+	ParallelRadixSort(pool, &mortonPrims, mortonScratch != nullptr ? *mortonScratch : localScratch, BVH_RADIX_BITS);
+	buildStats.sortMs = lapMs(lap);
 
 	// Create LBVH treelet at bottom of the BVH
 	std::vector<LBVHTreelet> treeletsToBuild;
@@ -392,110 +359,61 @@ BVHAccel::BVHBuildNode* BVHAccel::HLBVHBuild(MemoryArena& arena,
 		if (end == (int)mortonPrims.size() ||
 			((mortonPrims[start].mortonCode & mask) !=
 				(mortonPrims[end].mortonCode & mask))) {
-			// Add entry to treeletsToBuild for this treelet
+			// Add entry to treeletsToBuild for this treelet, its nodes are allocated by the thread that emits it
 			int nPrimitives = end - start;
-			int maxBVHNodes = 2 * nPrimitives - 1;
-			BVHBuildNode* nodes = arena.Alloc<BVHBuildNode>(maxBVHNodes, false);
-			treeletsToBuild.push_back({ start, nPrimitives, nodes });
+			treeletsToBuild.push_back({ start, nPrimitives, nullptr });
 			start = end;
 		}
 	}
 
 	std::atomic<int> atomicTotal(0), orderedPrimsOffset(0);
 	orderedPrims.resize(primitives.size());
-	// Create LBVHs for treelets in sequential
-
-	for (int i = 0; i < treeletsToBuild.size(); ++i) {
-		// Generate LBVH for treelet
-		int nodesCreated = 0;
-		const int firstBitIndex = 29 - 12; // the first 12 bits have already been used for a larger partitioning
-		LBVHTreelet& tr = treeletsToBuild[i];
-		tr.buildNodes =
-			emitLBVH(tr.buildNodes, primitiveInfo, &mortonPrims[tr.startIndex],
-				tr.nPrimitives, &nodesCreated, orderedPrims,
-				&orderedPrimsOffset, firstBitIndex);
-		atomicTotal += nodesCreated;
-	}
+	// Create LBVHs for treelets in parallel, each thread carves node storage out of its own arena
+	pool.parallelFor(treeletsToBuild.size(), 1, [&](int64_t begin, int64_t end, int threadIndex) {
+		MemoryArena& threadArena = *threadArenas[threadIndex];
+		for (int64_t i = begin; i < end; ++i) {
+			// Generate LBVH for treelet
+			int nodesCreated = 0;
+			const int firstBitIndex = 29 - 12; // the first 12 bits have already been used for a larger partitioning
+			LBVHTreelet& tr = treeletsToBuild[i];
+			int maxBVHNodes = 2 * tr.nPrimitives - 1;
+			BVHBuildNode* buildNodes = threadArena.Alloc<BVHBuildNode>(maxBVHNodes, false);
+			tr.buildNodes =
+				emitLBVH(buildNodes, primitiveInfo, &mortonPrims[tr.startIndex],
+					tr.nPrimitives, &nodesCreated, orderedPrims,
+					&orderedPrimsOffset, firstBitIndex);
+			atomicTotal += nodesCreated;
+		}
+	});
 	*totalNodes = atomicTotal;
+	buildStats.nTreelets = treeletsToBuild.size();
+	buildStats.treeletMs = lapMs(lap);
+
 	std::vector<BVHBuildNode*> finishedTreelets;
 	for (LBVHTreelet& treelet : treeletsToBuild)
 		finishedTreelets.push_back(treelet.buildNodes);
 
-	return buildUpperSAH(arena, finishedTreelets, 0,
+	BVHBuildNode* root = buildUpperSAH(arena, finishedTreelets, 0,
 		finishedTreelets.size(), totalNodes);
+	buildStats.upperSAHMs = lapMs(lap);
+	return root;
 }
 
-bool __device__ BVHIntersect(const Ray& ray, LinearBVHNode* dev_nodes, Triangle* dev_triangles, ShadeableIntersection* isect) {
-	bool hit = false;
-	glm::vec3 invDir(1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z);
-	int dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
-	// Follow ray through BVH nodes to find primitive intersections 
-	int toVisitOffset = 0, currentNodeIndex = 0;
-	int nodesToVisit[64];
-	float tmin = FLT_MAX;
-	Triangle* hitTriangle = nullptr;
-	while (true) {
-		LinearBVHNode node = dev_nodes[currentNodeIndex];
-		// Check ray against BVH node
-	
-		if (node.bounds.IntersectP(ray)) {
-#ifdef DEBUG_BVH
-			isect->hitBVH += 0.002f;
-#endif
-			if (node.nPrimitives > 0) {
-				// Intersect ray with primitives in leaf BVH node
-				for (int i = 0; i < node.nPrimitives; ++i)
-				{
-#ifdef DEBUG_BVH
-					isect->hitBVH += 0.002f;
-#endif
-					float tempt = dev_triangles[node.primitivesOffset + i].intersect(ray);
-					if (tempt > 0)
-						hit = true;
-					if (tempt < tmin && tempt > 0)
-					{
-						tmin = tempt;
-						hitTriangle = &dev_triangles[node.primitivesOffset + i];
-					}
-				}
-
-				if (toVisitOffset == 0) break;
-				currentNodeIndex = nodesToVisit[--toVisitOffset];
-
-			}
-			else {
-				// Put far BVH node on nodesToVisit stack, advance to near node
-				if (dirIsNeg[node.axis]) {
-					nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
-					currentNodeIndex = node.secondChildOffset;
-				}
-				else {
-					nodesToVisit[toVisitOffset++] = node.secondChildOffset;
-					currentNodeIndex = currentNodeIndex + 1;
-				}
-
-			}
-		}
-		else {
-			if (toVisitOffset == 0) break;
-
-			currentNodeIndex = nodesToVisit[--toVisitOffset];
-		}
-
-	}
-
-	if (hit && isect)
+bool __host__ __device__ BVHIntersect(const Ray& ray, LinearBVHNode* dev_nodes, Triangle* dev_triangles, ShadeableIntersection* isect) {
+	float tmin;
+	int hit = BVHClosestHit(ray, dev_nodes, dev_triangles, 0, &tmin, isect ? &isect->hitBVH : NULL);
+	if (hit < 0)
+		return false;
+	if (isect && (tmin < isect->t || isect->t == -1.f))
 	{
-		if (tmin < isect->t || isect->t == -1.f)
-		{
-			isect->t = tmin;
-			isect->surfaceNormal = hitTriangle->getNormal(ray.origin + ray.direction * tmin);
-			isect->uv = hitTriangle->getUV(ray.origin + ray.direction * tmin);
-			isect->materialId = hitTriangle->materialid;
-			isect->lightId = hitTriangle->lightid;
-		}
+		const Triangle& hitTriangle = dev_triangles[hit];
+		isect->t = tmin;
+		isect->surfaceNormal = hitTriangle.getNormal(ray.origin + ray.direction * tmin);
+		isect->uv = hitTriangle.getUV(ray.origin + ray.direction * tmin);
+		isect->materialId = hitTriangle.materialid;
+		isect->lightId = hitTriangle.lightid;
 	}
-	return hit;
+	return true;
 }
 
 // pre-order tranversal
@@ -555,26 +473,70 @@ void BVHAccel::build(std::vector<Triangle>& triangles, int numTriangles) {
 	if (primitives.empty())
 		return;
 
+	auto buildStart = std::chrono::high_resolution_clock::now();
+	auto lap = buildStart;
+	buildStats = BVHBuildStats();
+	// before the cache key, so settings that build the same tree share a cache file
+	nSAHBins = glm::clamp(nSAHBins, 2, maxSAHBins);
+
+#ifdef USE_BVH_CACHE
+	uint64_t cacheKey = 0;
+	if (!cachePath.empty())
+	{
+		// the builder settings are part of the key so switching builders forces a rebuild
+		uint32_t buildParams = maxPrimsInNode | (uint32_t)splitMethod << 8;
+		if (splitMethod == SplitMethod::SAH)
+			buildParams |= (uint32_t)nSAHBins << 16;
+		cacheKey = BVHCache::hashInput(triangles, buildParams);
+		if (loadFromCache(triangles, cacheKey))
+		{
+			printf("BVH loaded from %s: %d nodes in %.2f ms\n", cachePath.c_str(), bvhNodes, lapMs(buildStart));
+			return;
+		}
+	}
+#endif
+
+	ThreadPool pool(nBuildThreads);
+	buildStats.nThreads = pool.size();
+
 	// calculate AABB and centroid for each primitive
 	std::vector<BVHPrimitiveInfo> primitiveInfo(primitives.size());
-	for (size_t i = 0; i < primitives.size(); ++i) {
-		AABB bounds = primitives[i]->getBounds(); 
-		primitiveInfo[i] = { static_cast<int>(i), (bounds.min + bounds.max) * 0.5f, bounds };
-	}
+	pool.parallelFor(primitives.size(), 4096, [&](int64_t begin, int64_t end, int threadIndex) {
+		for (int64_t i = begin; i < end; ++i) {
+			AABB bounds = primitives[i]->getBounds();
+			primitiveInfo[i] = { static_cast<int>(i), (bounds.min + bounds.max) * 0.5f, bounds };
+		}
+	});
+	buildStats.primitiveInfoMs = lapMs(lap);
 
 	// construct BVH tree
-	MemoryArena arena(256 * numTriangles);
+	// the upper tree lives in the shared arena, every worker gets its own slab for treelet nodes
+	MemoryArena arena;
+	std::vector<std::unique_ptr<MemoryArena>> threadArenas;
+	for (int i = 0; i < pool.size(); ++i)
+		threadArenas.emplace_back(new MemoryArena(256 * numTriangles / pool.size() + 262144));
 	int totalNodes = 0;
 	std::vector<Triangle*> orderedPrims;
 	orderedPrims.reserve(primitives.size());
 
-	BVHBuildNode* root = HLBVHBuild(arena, primitiveInfo, &totalNodes, orderedPrims);
-	//BVHBuildNode* root = recursiveBuild(arena, primitiveInfo, 0, primitives.size(), &totalNodes, orderedPrims);
+	BVHBuildNode* root = nullptr;
+	if (splitMethod == SplitMethod::SAH)
+	{
+		buildStats.builder = SplitMethod::SAH;
+		root = SAHBuild(arena, threadArenas, pool, primitiveInfo, &totalNodes, orderedPrims);
+	}
+	else
+		root = HLBVHBuild(arena, threadArenas, pool, primitiveInfo, &totalNodes, orderedPrims);
+	lap = std::chrono::high_resolution_clock::now();
 	// swap orderedPrims with primitives
 	primitives.swap(orderedPrims);
 
 	//traverseBVH(root, &totalNodes);
 
+	triangleOrder.resize(primitives.size());
+	for (size_t i = 0; i < primitives.size(); ++i)
+		triangleOrder[i] = primitives[i] - triangles.data();
+
 	// Create a temporary array to hold the reordered triangles
 	std::vector<Triangle> tempTriangles(primitives.size());
 
@@ -590,18 +552,134 @@ void BVHAccel::build(std::vector<Triangle>& triangles, int numTriangles) {
 		// Update the pointer in primitives to point to the new location
 		//primitives[i] = &triangles[i];
 	}
+	buildStats.reorderMs = lapMs(lap);
 	//traverseBVH(root, &totalNodes, 0);
 	// linearize BVH tree
 	nodes = new LinearBVHNode[totalNodes];
 	int offset = 0;
 	flattenBVHTree(root, &offset, totalNodes);
 	//traverseLBVH(nodes, totalNodes);
+	buildStats.flattenMs = lapMs(lap);
 
 	bvhNodes = totalNodes;
+	buildStats.totalNodes = totalNodes;
+	buildStats.totalMs = lapMs(buildStart);
+	buildStats.print();
+
+#ifdef USE_BVH_CACHE
+	if (!cachePath.empty() && !BVHCache::save(cachePath, cacheKey, nodes, totalNodes, triangleOrder))
+		printf("Failed to write BVH cache %s\n", cachePath.c_str());
+#endif
+}
+
+bool BVHAccel::loadFromCache(std::vector<Triangle>& triangles, uint64_t cacheKey)
+{
+	LinearBVHNode* cachedNodes = nullptr;
+	int numCachedNodes = 0;
+	if (!BVHCache::load(cachePath, cacheKey, primitives.size(), cachedNodes, numCachedNodes, triangleOrder))
+		return false;
+
+	// apply the cached triangle order
+	std::vector<Triangle> tempTriangles(triangleOrder.size());
+	for (size_t i = 0; i < triangleOrder.size(); ++i)
+		tempTriangles[i] = triangles[triangleOrder[i]];
+	std::copy(tempTriangles.begin(), tempTriangles.end(), triangles.begin());
+	for (size_t i = 0; i < primitives.size(); ++i)
+		primitives[i] = &triangles[i];
+
+	bvhNodes = numCachedNodes;
+	nodes = cachedNodes;
+	buildStats.totalNodes = bvhNodes;
+	return true;
+}
+
+void BVHAccel::uploadNodes()
+{
+	// a rebuild replaces the previous tree
+	if (dev_nodes)
+		cudaFree(dev_nodes);
 	// copy linearized BVH tree to device memory
-	cudaMalloc(&dev_nodes, totalNodes * sizeof(LinearBVHNode));
-	cudaMemcpy(dev_nodes, nodes, totalNodes * sizeof(LinearBVHNode), cudaMemcpyHostToDevice);
-	
+	cudaMalloc(&dev_nodes, bvhNodes * sizeof(LinearBVHNode));
+	cudaMemcpy(dev_nodes, nodes, bvhNodes * sizeof(LinearBVHNode), cudaMemcpyHostToDevice);
+
 	// check for CUDA errors
 	checkCUDAError("BVHAccel::build");
 }
+
+void BVHAccel::uploadNodeRange(int first, int last)
+{
+	if (last < first)
+		return;
+	cudaMemcpy(dev_nodes + first, nodes + first, (last - first + 1) * sizeof(LinearBVHNode), cudaMemcpyHostToDevice);
+	checkCUDAError("BVHAccel::uploadNodeRange");
+}
+
+void BVHAccel::prepareRefit()
+{
+	if (!parentIndex.empty() || bvhNodes == 0)
+		return;
+	parentIndex.assign(bvhNodes, -1);
+	leafOfSlot.assign(triangleOrder.size(), -1);
+	for (int i = 0; i < bvhNodes; ++i)
+	{
+		const LinearBVHNode& node = nodes[i];
+		if (node.nPrimitives > 0)
+		{
+			for (int k = 0; k < node.nPrimitives; ++k)
+				leafOfSlot[node.primitivesOffset + k] = i;
+		}
+		else
+		{
+			parentIndex[i + 1] = i;
+			parentIndex[node.secondChildOffset] = i;
+		}
+	}
+	slotOfTriangle.resize(triangleOrder.size());
+	for (size_t slot = 0; slot < triangleOrder.size(); ++slot)
+		slotOfTriangle[triangleOrder[slot]] = slot;
+	builtRootArea = nodes[0].bounds.SurfaceArea();
+	builtSAHCost = sahCost();
+}
+
+void BVHAccel::refit(const TriangleHit* triangleHits, const std::vector<int>& slots, int* firstNode, int* lastNode)
+{
+	*firstNode = bvhNodes;
+	*lastNode = -1;
+	// mark the owning leaves and walk up until an already marked ancestor
+	std::vector<char> dirty(bvhNodes, 0);
+	for (int slot : slots)
+	{
+		for (int i = leafOfSlot[slot]; i >= 0 && !dirty[i]; i = parentIndex[i])
+		{
+			dirty[i] = 1;
+			*firstNode = std::min(*firstNode, i);
+			*lastNode = std::max(*lastNode, i);
+		}
+	}
+	// children always follow their parent in the depth first layout, so a backwards sweep is bottom-up
+	for (int i = *lastNode; i >= *firstNode; --i)
+	{
+		if (!dirty[i])
+			continue;
+		LinearBVHNode& node = nodes[i];
+		AABB bounds;
+		if (node.nPrimitives > 0)
+		{
+			for (int k = 0; k < node.nPrimitives; ++k)
+				bounds = AABB::Union(bounds, triangleHits[node.primitivesOffset + k].getBounds());
+		}
+		else
+			bounds = AABB::Union(nodes[i + 1].bounds, nodes[node.secondChildOffset].bounds);
+		node.bounds = bounds;
+	}
+}
+
+float BVHAccel::sahCost() const
+{
+	if (bvhNodes == 0)
+		return 0.f;
+	float cost = 0.f;
+	for (int i = 0; i < bvhNodes; ++i)
+		cost += nodes[i].bounds.SurfaceArea() * (nodes[i].nPrimitives > 0 ? nodes[i].nPrimitives : 0.125f);
+	return cost / (builtRootArea > 0.f ? builtRootArea : nodes[0].bounds.SurfaceArea());
+}
@@ -2,8 +2,10 @@
 #include "utilities.h"
 #include "sceneStructs.h"
 #include "memoryArena.h"
+#include "threadPool.h"
 #include <stack>
 #include <queue>
+#include <memory>
 #include "PTDirectives.h"
 class BVHAccel
 {
@@ -11,7 +13,16 @@ public:
 	std::vector<Triangle*> primitives;
 	const int maxPrimsInNode;
 	int bvhNodes;
-	BVHAccel(std::vector<Triangle>& triangles, int numTriangles, int maxPrimsInNode = 4) : maxPrimsInNode(maxPrimsInNode), bvhNodes(0)
+	int nBuildThreads; // 0 -> use every hardware thread
+
+	enum class SplitMethod { HLBVH, SAH };
+	static constexpr int maxSAHBins = 64;
+	SplitMethod splitMethod;
+	int nSAHBins;      // SAH builder: bins per axis, build() clamps it to [2, maxSAHBins]
+	int sahTaskCutoff; // SAH builder: ranges with at most this many primitives become subtree tasks
+
+	BVHAccel(std::vector<Triangle>& triangles, int numTriangles, int maxPrimsInNode = 4) : maxPrimsInNode(maxPrimsInNode), bvhNodes(0), nBuildThreads(BVH_BUILD_THREADS),
+		splitMethod(SplitMethod::HLBVH), nSAHBins(BVH_SAH_BINS), sahTaskCutoff(16384)
 	{
 		primitives.reserve(numTriangles);
 		for (int i = 0; i < numTriangles; ++i)
@@ -62,6 +73,25 @@ public:
 
 	};
 
+	// timings of the last build(), printed at the end of build()
+	struct BVHBuildStats
+	{
+		SplitMethod builder = SplitMethod::HLBVH;
+		int nThreads = 1;
+		int nTreelets = 0;      // SAH: subtree tasks
+		int totalNodes = 0;
+		float primitiveInfoMs = 0.f;
+		float mortonMs = 0.f;
+		float sortMs = 0.f;
+		float treeletMs = 0.f;  // SAH: parallel subtree builds
+		float upperSAHMs = 0.f; // SAH: serial upper splits with parallel binning
+		float reorderMs = 0.f;
+		float flattenMs = 0.f;
+		float totalMs = 0.f;
+		void print() const;
+	};
+	BVHBuildStats buildStats;
+
 	struct LBVHTreelet {
 		int startIndex, nPrimitives;
 		BVHBuildNode* buildNodes;
@@ -94,18 +124,36 @@ public:
 	}
 
 	static void RadixSort(std::vector<MortonPrimitive>* v);
+	// LSD radix sort over the 30 bit morton codes with per-thread histograms and a parallel scatter.
+	// bitsPerPass may be anything in [1, 16] (6, 8 and 11 give 5, 4 and 3 passes);
+	// scratch is resized to v->size() and may be swapped with *v; keep it around so repeated builds reuse its capacity.
+	static void ParallelRadixSort(ThreadPool& pool, std::vector<MortonPrimitive>* v,
+		std::vector<MortonPrimitive>& scratch, int bitsPerPass = 8);
+	// radix sort scratch of the HLBVH build, owned by whoever rebuilds the BVH so its capacity outlives
+	// this accelerator; a build without one sorts through a buffer of its own
+	std::vector<MortonPrimitive>* mortonScratch = nullptr;
 
-	BVHBuildNode* recursiveBuild(MemoryArena& arena,
+	// binned SAH build of [start, end), serial; see bvhBuildSAH.cpp
+	BVHBuildNode* buildSubtree(MemoryArena& arena,
 		std::vector<BVHPrimitiveInfo>& primitiveInfo, int start,
 		int end, int* totalNodes,
-		std::vector<Triangle*>& orderedPrims); 
+		std::vector<Triangle*>& orderedPrims, std::atomic<int>* orderedPrimsOffset) const;
+
+	BVHBuildNode* SAHBuild(MemoryArena& arena,
+		std::vector<std::unique_ptr<MemoryArena>>& threadArenas,
+		ThreadPool& pool,
+		std::vector<BVHPrimitiveInfo>& primitiveInfo,
+		int* totalNodes,
+		std::vector<Triangle*>& orderedPrims);
 
 	BVHBuildNode* HLBVHBuild(MemoryArena& arena,
+		std::vector<std::unique_ptr<MemoryArena>>& threadArenas,
+		ThreadPool& pool,
 		const std::vector<BVHPrimitiveInfo>& primitiveInfo,
 		int* totalNodes,
-		std::vector<Triangle*>& orderedPrims) const;
+		std::vector<Triangle*>& orderedPrims);
 
-	void updateMortonCodes(std::vector<MortonPrimitive>& mortonPrims, const std::vector<BVHPrimitiveInfo>& primitiveInfo, AABB& bounds, int chunkSize) const;
+	void updateMortonCodes(ThreadPool& pool, std::vector<MortonPrimitive>& mortonPrims, const std::vector<BVHPrimitiveInfo>& primitiveInfo, AABB& bounds, int chunkSize) const;
 
 	BVHBuildNode* emitLBVH(BVHBuildNode*& buildNodes,
 		const std::vector<BVHPrimitiveInfo>& primitiveInfo,
@@ -119,9 +167,33 @@ public:
 
 	int flattenBVHTree(BVHBuildNode* node, int* offset, int maxNodeNumber);
 
+	// builds (or loads from the cache) the host side nodes, uploadNodes() copies them to dev_nodes
 	void build(std::vector<Triangle>& trangles, int numTriangles);
 
 	LinearBVHNode* nodes = nullptr;
+	// reordered triangle slot -> index of the triangle before build()
+	std::vector<uint32_t> triangleOrder;
+	// BVH cache file, an empty path disables the cache
+	std::string cachePath;
+
+	bool loadFromCache(std::vector<Triangle>& triangles, uint64_t cacheKey);
+	void uploadNodes();
+	// copies nodes [first, last] into the existing dev_nodes
+	void uploadNodeRange(int first, int last);
+
+	// Refit support, filled by prepareRefit() before the first refit
+	std::vector<int> parentIndex;          // -1 for the root
+	std::vector<int> leafOfSlot;           // triangle slot -> leaf node
+	std::vector<uint32_t> slotOfTriangle;  // inverse of triangleOrder
+	float builtSAHCost = 0.f;              // cost of the tree as built, refits are compared against it
+	float builtRootArea = 0.f;             // root surface area as built, sahCost() divides by it
+	void prepareRefit();
+	// recomputes the bounds of the leaves holding the given triangle slots and of their ancestors from
+	// the traversal copy in BVH order, the topology is kept; the touched nodes lie in [*firstNode, *lastNode]
+	void refit(const TriangleHit* triangleHits, const std::vector<int>& slots, int* firstNode, int* lastNode);
+	// same cost model as the SAH builder, normalized by the root area as built so a refit that grows
+	// the root costs more instead of being divided back down
+	float sahCost() const;
 
 	void traverseBVH(BVHBuildNode* node, int* nodeTraversed,int depth = 0);
 	void traverseLBVH(BVHAccel::LinearBVHNode* node, int totalNodes, int depth = 0);
@@ -129,4 +201,110 @@ public:
 using LinearBVHNode = BVHAccel::LinearBVHNode;
 extern LinearBVHNode* dev_nodes;
 
-bool __device__ BVHIntersect(const Ray& ray, LinearBVHNode* dev_nodes, Triangle* dev_triangles, ShadeableIntersection* isect = NULL);
\ No newline at end of file
+// closest hit below nodes[rootIndex], returns the triangle slot or -1; tHit is only written on a hit.
+// Tri is Triangle or TriangleHit, anything with intersect(ray).
+template<typename Tri>
+__inline__ __host__ __device__ int BVHClosestHit(const Ray& ray, const LinearBVHNode* nodes, const Tri* triangles, int rootIndex,
+	float* tHit, float* hitBVH = NULL) {
+	glm::vec3 invDir(1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z);
+	int dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
+	// Follow ray through BVH nodes to find primitive intersections 
+	int toVisitOffset = 0, currentNodeIndex = rootIndex;
+	int nodesToVisit[64];
+	float tmin = FLT_MAX;
+	int hitTriangle = -1;
+	while (true) {
+		const LinearBVHNode& node = nodes[currentNodeIndex];
+		// Check ray against BVH node
+	
+		if (node.bounds.IntersectP(ray)) {
+#ifdef DEBUG_BVH
+			if (hitBVH) *hitBVH += 0.002f;
+#endif
+			if (node.nPrimitives > 0) {
+				// Intersect ray with primitives in leaf BVH node
+				for (int i = 0; i < node.nPrimitives; ++i)
+				{
+#ifdef DEBUG_BVH
+					if (hitBVH) *hitBVH += 0.002f;
+#endif
+					float tempt = triangles[node.primitivesOffset + i].intersect(ray);
+					if (tempt < tmin && tempt > 0)
+					{
+						tmin = tempt;
+						hitTriangle = node.primitivesOffset + i;
+					}
+				}
+
+				if (toVisitOffset == 0) break;
+				currentNodeIndex = nodesToVisit[--toVisitOffset];
+
+			}
+			else {
+				// Put far BVH node on nodesToVisit stack, advance to near node
+				if (dirIsNeg[node.axis]) {
+					nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+					currentNodeIndex = node.secondChildOffset;
+				}
+				else {
+					nodesToVisit[toVisitOffset++] = node.secondChildOffset;
+					currentNodeIndex = currentNodeIndex + 1;
+				}
+
+			}
+		}
+		else {
+			if (toVisitOffset == 0) break;
+
+			currentNodeIndex = nodesToVisit[--toVisitOffset];
+		}
+
+	}
+
+	if (hitTriangle >= 0)
+		*tHit = tmin;
+	return hitTriangle;
+}
+
+// any hit in (0, tMax) below nodes[rootIndex], for shadow rays; stops at the first blocker and computes no shading data
+template<typename Tri>
+__inline__ __host__ __device__ bool BVHOccluded(const Ray& ray, const LinearBVHNode* nodes, const Tri* triangles, int rootIndex, float tMax) {
+	glm::vec3 invDir(1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z);
+	int dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
+	int toVisitOffset = 0, currentNodeIndex = rootIndex;
+	int nodesToVisit[64];
+	while (true) {
+		const LinearBVHNode& node = nodes[currentNodeIndex];
+		float tBox;
+		if (node.bounds.IntersectP(ray, &tBox) && tBox < tMax) {
+			if (node.nPrimitives > 0) {
+				for (int i = 0; i < node.nPrimitives; ++i)
+				{
+					float t = triangles[node.primitivesOffset + i].intersect(ray);
+					if (t > 0 && t < tMax)
+						return true;
+				}
+				if (toVisitOffset == 0) break;
+				currentNodeIndex = nodesToVisit[--toVisitOffset];
+			}
+			else {
+				// near child first, it is the more likely blocker
+				if (dirIsNeg[node.axis]) {
+					nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+					currentNodeIndex = node.secondChildOffset;
+				}
+				else {
+					nodesToVisit[toVisitOffset++] = node.secondChildOffset;
+					currentNodeIndex = currentNodeIndex + 1;
+				}
+			}
+		}
+		else {
+			if (toVisitOffset == 0) break;
+			currentNodeIndex = nodesToVisit[--toVisitOffset];
+		}
+	}
+	return false;
+}
+
+bool __host__ __device__ BVHIntersect(const Ray& ray, LinearBVHNode* dev_nodes, Triangle* dev_triangles, ShadeableIntersection* isect = NULL);
\ No newline at end of file
@@ -0,0 +1,350 @@
+// Binned SAH builder for BVHAccel.
+// Primitives are binned along all three axes in one pass, the best split is found with a
+// forward and a backward sweep over the bins, and ranges below sahTaskCutoff primitives
+// are built as independent subtrees on the thread pool.
+#include "bvh.h"
+#include <chrono>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BVH_SAH_SSE
+#endif
+
+namespace
+{
+	using BVHPrimitiveInfo = BVHAccel::BVHPrimitiveInfo;
+	using BVHBuildNode = BVHAccel::BVHBuildNode;
+
+	constexpr int maxSAHBins = BVHAccel::maxSAHBins;
+	constexpr float traversalCost = 0.125f; // relative to one triangle test
+
+	// bin bounds are 4-wide float arrays so a union is a single SSE min and max
+	struct alignas(16) SAHBin
+	{
+		float min[4];
+		float max[4];
+		int count;
+
+		void reset()
+		{
+			for (int i = 0; i < 4; ++i)
+			{
+				min[i] = FLT_MAX;
+				max[i] = -FLT_MAX;
+			}
+			count = 0;
+		}
+
+		void grow(const AABB& b)
+		{
+#ifdef BVH_SAH_SSE
+			// loads min.xyz|max.x and min.z|max.xyz, the fourth lane is never read back
+			__m128 bmin = _mm_loadu_ps(&b.min.x);
+			__m128 bmax = _mm_loadu_ps(&b.min.z);
+			bmax = _mm_shuffle_ps(bmax, bmax, _MM_SHUFFLE(3, 3, 2, 1));
+			_mm_store_ps(min, _mm_min_ps(_mm_load_ps(min), bmin));
+			_mm_store_ps(max, _mm_max_ps(_mm_load_ps(max), bmax));
+#else
+			for (int i = 0; i < 3; ++i)
+			{
+				min[i] = std::min(min[i], b.min[i]);
+				max[i] = std::max(max[i], b.max[i]);
+			}
+#endif
+			++count;
+		}
+
+		void merge(const SAHBin& o)
+		{
+#ifdef BVH_SAH_SSE
+			_mm_store_ps(min, _mm_min_ps(_mm_load_ps(min), _mm_load_ps(o.min)));
+			_mm_store_ps(max, _mm_max_ps(_mm_load_ps(max), _mm_load_ps(o.max)));
+#else
+			for (int i = 0; i < 3; ++i)
+			{
+				min[i] = std::min(min[i], o.min[i]);
+				max[i] = std::max(max[i], o.max[i]);
+			}
+#endif
+			count += o.count;
+		}
+
+		float surfaceArea() const
+		{
+			if (count == 0) return 0.f;
+			float dx = max[0] - min[0], dy = max[1] - min[1], dz = max[2] - min[2];
+			return 2.f * (dx * dy + dx * dz + dy * dz);
+		}
+	};
+
+	// maps centroids to bins on all three axes, bins are laid out as [axis][bin]
+	struct SAHBinning
+	{
+		glm::vec3 origin;
+		glm::vec3 scale;
+		int nBins;
+
+		SAHBinning(const AABB& centroidBounds, int nBins) : origin(centroidBounds.min), nBins(nBins)
+		{
+			glm::vec3 extent = centroidBounds.max - centroidBounds.min;
+			for (int a = 0; a < 3; ++a)
+				scale[a] = extent[a] > 0.f ? nBins * (1.f - 1e-6f) / extent[a] : 0.f;
+		}
+
+		int binIndex(const glm::vec3& centroid, int axis) const
+		{
+			int b = (int)((centroid[axis] - origin[axis]) * scale[axis]);
+			return glm::clamp(b, 0, nBins - 1);
+		}
+
+		void binRange(const std::vector<BVHPrimitiveInfo>& primitiveInfo, int64_t start, int64_t end, SAHBin* bins) const
+		{
+			for (int i = 0; i < 3 * nBins; ++i)
+				bins[i].reset();
+			for (int64_t i = start; i < end; ++i)
+			{
+				const BVHPrimitiveInfo& pi = primitiveInfo[i];
+				for (int a = 0; a < 3; ++a)
+					bins[a * nBins + binIndex(pi.centroid, a)].grow(pi.bounds);
+			}
+		}
+	};
+
+	struct SAHSplit
+	{
+		int axis = -1;
+		int bin = 0;
+		float cost = FLT_MAX;
+	};
+
+	// the forward sweep stores the left cost of every split plane, the backward sweep adds the right side
+	SAHSplit findBestSplit(const SAHBin* bins, int nBins, const AABB& centroidBounds, float nodeArea)
+	{
+		SAHSplit best;
+		float leftCost[maxSAHBins];
+		for (int a = 0; a < 3; ++a)
+		{
+			if (centroidBounds.max[a] <= centroidBounds.min[a])
+				continue;
+			const SAHBin* axisBins = bins + a * nBins;
+
+			SAHBin left;
+			left.reset();
+			for (int i = 0; i < nBins - 1; ++i)
+			{
+				left.merge(axisBins[i]);
+				leftCost[i] = left.count * left.surfaceArea();
+			}
+
+			SAHBin right;
+			right.reset();
+			for (int i = nBins - 1; i > 0; --i)
+			{
+				right.merge(axisBins[i]);
+				float cost = traversalCost + (leftCost[i - 1] + right.count * right.surfaceArea()) / nodeArea;
+				if (cost < best.cost)
+				{
+					best.axis = a;
+					best.bin = i - 1;
+					best.cost = cost;
+				}
+			}
+		}
+		return best;
+	}
+
+	AABB rangeBounds(const std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end, AABB& centroidBounds)
+	{
+		AABB bounds;
+		centroidBounds = AABB();
+		for (int i = start; i < end; ++i)
+		{
+			bounds = AABB::Union(bounds, primitiveInfo[i].bounds);
+			centroidBounds = AABB::Union(centroidBounds, primitiveInfo[i].centroid);
+		}
+		return bounds;
+	}
+
+	BVHBuildNode* createLeaf(const BVHAccel& bvh, BVHBuildNode* node,
+		const std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end, const AABB& bounds,
+		std::vector<Triangle*>& orderedPrims, std::atomic<int>* orderedPrimsOffset)
+	{
+		int nPrimitives = end - start;
+		int firstPrimOffset = orderedPrimsOffset->fetch_add(nPrimitives);
+		for (int i = start; i < end; ++i)
+			orderedPrims[firstPrimOffset + i - start] = bvh.primitives[primitiveInfo[i].primitiveNumber];
+		node->initLeaf(firstPrimOffset, nPrimitives, bounds);
+		return node;
+	}
+
+	// partitions [start, end) at the cheapest split, returns the middle or -1 when a leaf is cheaper
+	int partitionSAH(const BVHAccel& bvh, std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end,
+		const AABB& bounds, const AABB& centroidBounds, const SAHBin* bins, int* axis)
+	{
+		int nPrimitives = end - start;
+		SAHSplit split = findBestSplit(bins, bvh.nSAHBins, centroidBounds, bounds.SurfaceArea());
+		// every centroid is in the same spot, nothing can separate them
+		if (split.axis < 0)
+			return -1;
+
+		float leafCost = nPrimitives;
+		if (nPrimitives <= bvh.maxPrimsInNode && split.cost >= leafCost)
+			return -1;
+
+		SAHBinning binning(centroidBounds, bvh.nSAHBins);
+		BVHPrimitiveInfo* pmid = std::partition(&primitiveInfo[start], &primitiveInfo[end - 1] + 1,
+			[&](const BVHPrimitiveInfo& pi) { return binning.binIndex(pi.centroid, split.axis) <= split.bin; });
+		int mid = pmid - &primitiveInfo[0];
+		if (mid == start || mid == end)
+			mid = start + nPrimitives / 2;
+		*axis = split.axis;
+		return mid;
+	}
+
+	float msSince(std::chrono::high_resolution_clock::time_point start)
+	{
+		return std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+}
+
+BVHAccel::BVHBuildNode* BVHAccel::buildSubtree(MemoryArena& arena,
+	std::vector<BVHPrimitiveInfo>& primitiveInfo, int start,
+	int end, int* totalNodes,
+	std::vector<Triangle*>& orderedPrims, std::atomic<int>* orderedPrimsOffset) const
+{
+	// Depth first from an explicit stack with one set of bins for the whole subtree, so a deep or
+	// degenerate tree grows a heap vector instead of a worker's stack. Left ranges are popped first,
+	// the leaves take their slots of orderedPrims in the same order as a recursive build.
+	struct BuildRange
+	{
+		int start, end;
+		BVHBuildNode** slot;
+	};
+	std::vector<SAHBin> bins(3 * nSAHBins);
+	std::vector<BuildRange> pending;
+	BVHBuildNode* root = nullptr;
+	pending.push_back({ start, end, &root });
+	while (!pending.empty())
+	{
+		BuildRange range = pending.back();
+		pending.pop_back();
+		BVHBuildNode* node = arena.Alloc<BVHBuildNode>();
+		(*totalNodes)++;
+		*range.slot = node;
+
+		AABB centroidBounds;
+		AABB bounds = rangeBounds(primitiveInfo, range.start, range.end, centroidBounds);
+		if (range.end - range.start == 1)
+		{
+			createLeaf(*this, node, primitiveInfo, range.start, range.end, bounds, orderedPrims, orderedPrimsOffset);
+			continue;
+		}
+
+		int axis = 0;
+		SAHBinning(centroidBounds, nSAHBins).binRange(primitiveInfo, range.start, range.end, bins.data());
+		int mid = partitionSAH(*this, primitiveInfo, range.start, range.end, bounds, centroidBounds, bins.data(), &axis);
+		if (mid < 0)
+		{
+			createLeaf(*this, node, primitiveInfo, range.start, range.end, bounds, orderedPrims, orderedPrimsOffset);
+			continue;
+		}
+		// the children are filled in through their slots, the bounds are already known
+		node->bounds = bounds;
+		node->splitAxis = axis;
+		node->nPrimitives = 0;
+		pending.push_back({ mid, range.end, &node->children[1] });
+		pending.push_back({ range.start, mid, &node->children[0] });
+	}
+	return root;
+}
+
+BVHAccel::BVHBuildNode* BVHAccel::SAHBuild(MemoryArena& arena,
+	std::vector<std::unique_ptr<MemoryArena>>& threadArenas,
+	ThreadPool& pool,
+	std::vector<BVHPrimitiveInfo>& primitiveInfo,
+	int* totalNodes,
+	std::vector<Triangle*>& orderedPrims)
+{
+	auto phaseStart = std::chrono::high_resolution_clock::now();
+	orderedPrims.resize(primitives.size());
+	std::atomic<int> orderedPrimsOffset(0);
+	std::atomic<int> nodesCreated(0);
+
+	// a range of primitives whose subtree root is written to *slot
+	struct BuildRange
+	{
+		int start, end;
+		BVHBuildNode** slot;
+	};
+
+	// Upper levels: ranges above the cutoff are split here one at a time, with the binning
+	// spread over the pool. Smaller ranges are collected as subtree tasks.
+	std::vector<BuildRange> subtrees;
+	std::vector<BuildRange> pending;
+	std::vector<SAHBin> threadBins(pool.size() * 3 * nSAHBins);
+	BVHBuildNode* root = nullptr;
+	pending.push_back({ 0, (int)primitiveInfo.size(), &root });
+	while (!pending.empty())
+	{
+		BuildRange range = pending.back();
+		pending.pop_back();
+		if (range.end - range.start <= sahTaskCutoff)
+		{
+			subtrees.push_back(range);
+			continue;
+		}
+
+		AABB centroidBounds;
+		AABB bounds = rangeBounds(primitiveInfo, range.start, range.end, centroidBounds);
+		SAHBinning binning(centroidBounds, nSAHBins);
+		for (SAHBin& bin : threadBins)
+			bin.reset();
+		pool.parallelFor(range.end - range.start, 16384, [&](int64_t begin, int64_t end, int threadIndex) {
+			SAHBin local[3 * maxSAHBins];
+			binning.binRange(primitiveInfo, range.start + begin, range.start + end, local);
+			SAHBin* bins = &threadBins[threadIndex * 3 * nSAHBins];
+			for (int i = 0; i < 3 * nSAHBins; ++i)
+				bins[i].merge(local[i]);
+		});
+		SAHBin* bins = &threadBins[0];
+		for (int t = 1; t < pool.size(); ++t)
+			for (int i = 0; i < 3 * nSAHBins; ++i)
+				bins[i].merge(threadBins[t * 3 * nSAHBins + i]);
+
+		BVHBuildNode* node = arena.Alloc<BVHBuildNode>();
+		++nodesCreated;
+		*range.slot = node;
+		int axis = 0;
+		int mid = partitionSAH(*this, primitiveInfo, range.start, range.end, bounds, centroidBounds, bins, &axis);
+		if (mid < 0)
+		{
+			createLeaf(*this, node, primitiveInfo, range.start, range.end, bounds, orderedPrims, &orderedPrimsOffset);
+			continue;
+		}
+		// the children are filled in later through their slots, the bounds are already known
+		node->bounds = bounds;
+		node->splitAxis = axis;
+		node->nPrimitives = 0;
+		pending.push_back({ mid, range.end, &node->children[1] });
+		pending.push_back({ range.start, mid, &node->children[0] });
+	}
+	buildStats.upperSAHMs = msSince(phaseStart);
+	phaseStart = std::chrono::high_resolution_clock::now();
+
+	// Subtrees: each is a serial build into the arena of whichever thread picked it up
+	pool.parallelFor(subtrees.size(), 1, [&](int64_t begin, int64_t end, int threadIndex) {
+		for (int64_t i = begin; i < end; ++i)
+		{
+			int subtreeNodes = 0;
+			const BuildRange& range = subtrees[i];
+			*range.slot = buildSubtree(*threadArenas[threadIndex], primitiveInfo, range.start, range.end,
+				&subtreeNodes, orderedPrims, &orderedPrimsOffset);
+			nodesCreated += subtreeNodes;
+		}
+	});
+	buildStats.nTreelets = subtrees.size();
+	buildStats.treeletMs = msSince(phaseStart);
+
+	*totalNodes = nodesCreated;
+	return root;
+}
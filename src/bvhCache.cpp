@@ -0,0 +1,93 @@
+#include "bvhCache.h"
+#include <cstring>
+#include <fstream>
+
+namespace
+{
+	struct CacheHeader
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t nodeSize;
+		uint64_t key;
+		uint32_t numTriangles;
+		uint32_t numNodes;
+	};
+	const char cacheMagic[8] = { 'P', 'T', 'B', 'V', 'H', 'C', 'H', 'E' };
+}
+
+// 64 bit FNV-1a, fed 32 bit words at a time
+uint64_t BVHCache::hashInput(const std::vector<Triangle>& triangles, uint32_t buildParams)
+{
+	uint64_t hash = 14695981039346656037ull;
+	auto mix = [&hash](uint32_t word) {
+		hash ^= word;
+		hash *= 1099511628211ull;
+	};
+	mix(version);
+	mix(buildParams);
+	mix((uint32_t)triangles.size());
+	for (const Triangle& tri : triangles)
+	{
+		uint32_t words[9];
+		memcpy(words, tri.vertices, sizeof(words));
+		for (uint32_t w : words)
+			mix(w);
+	}
+	return hash;
+}
+
+bool BVHCache::load(const std::string& path, uint64_t key, int numTriangles,
+	LinearBVHNode*& nodes, int& numNodes, std::vector<uint32_t>& triangleOrder)
+{
+	std::ifstream in(path, std::ios::binary | std::ios::ate);
+	if (!in)
+		return false;
+	size_t fileSize = (size_t)in.tellg();
+	in.seekg(0);
+
+	CacheHeader header;
+	if (fileSize < sizeof(CacheHeader) || !in.read((char*)&header, sizeof(header)))
+		return false;
+	if (memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) != 0 || header.version != version ||
+		header.nodeSize != sizeof(LinearBVHNode) || header.key != key || header.numTriangles != (uint32_t)numTriangles)
+		return false;
+
+	size_t nodeBytes = (size_t)header.numNodes * sizeof(LinearBVHNode);
+	size_t orderBytes = (size_t)header.numTriangles * sizeof(uint32_t);
+	if (fileSize < sizeof(CacheHeader) + nodeBytes + orderBytes)
+		return false;
+
+	// straight into the buffers the BVH keeps
+	LinearBVHNode* loaded = new LinearBVHNode[header.numNodes];
+	triangleOrder.resize(header.numTriangles);
+	if (!in.read((char*)loaded, nodeBytes) || !in.read((char*)triangleOrder.data(), orderBytes))
+	{
+		delete[] loaded;
+		return false;
+	}
+	nodes = loaded;
+	numNodes = header.numNodes;
+	return true;
+}
+
+bool BVHCache::save(const std::string& path, uint64_t key, const LinearBVHNode* nodes, int numNodes,
+	const std::vector<uint32_t>& triangleOrder)
+{
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	if (!out)
+		return false;
+
+	CacheHeader header;
+	memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+	header.version = version;
+	header.nodeSize = sizeof(LinearBVHNode);
+	header.key = key;
+	header.numTriangles = (uint32_t)triangleOrder.size();
+	header.numNodes = (uint32_t)numNodes;
+
+	out.write((const char*)&header, sizeof(header));
+	out.write((const char*)nodes, (size_t)numNodes * sizeof(LinearBVHNode));
+	out.write((const char*)triangleOrder.data(), triangleOrder.size() * sizeof(uint32_t));
+	return (bool)out;
+}
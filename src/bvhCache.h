@@ -0,0 +1,24 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "bvh.h"
+
+// On-disk cache of a flattened BVH.
+// A cache file stores the LinearBVHNode array and, for every reordered triangle slot,
+// the index the triangle had before the build. It is keyed by a hash of the triangle
+// positions and the build parameters, so stale files are simply rebuilt and overwritten.
+namespace BVHCache
+{
+	constexpr uint32_t version = 1;
+
+	uint64_t hashInput(const std::vector<Triangle>& triangles, uint32_t buildParams);
+
+	// Reads the nodes into a new[] array of numNodes that the caller owns, and the triangle order.
+	// Returns false when the file is missing, truncated or was written for a different key.
+	bool load(const std::string& path, uint64_t key, int numTriangles,
+		LinearBVHNode*& nodes, int& numNodes, std::vector<uint32_t>& triangleOrder);
+
+	bool save(const std::string& path, uint64_t key, const LinearBVHNode* nodes, int numNodes,
+		const std::vector<uint32_t>& triangleOrder);
+}
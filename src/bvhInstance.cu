@@ -0,0 +1,352 @@
+#include "bvhInstance.h"
+#include <algorithm>
+#include <glm/gtc/matrix_inverse.hpp>
+
+SceneAccel dev_accel;
+
+// closest hit in the world BVH: the wide nodes on the host when there are any, else the quantized or binary ones
+__inline__ __host__ __device__ int WorldClosestHit(const Ray& ray, const SceneAccel& accel, float* tHit, float* hitBVH) {
+#if CPU_BVH_WIDTH > 0 && !defined(__CUDA_ARCH__)
+	if (accel.wideNodes != nullptr)
+		return WideBVHClosestHit(ray, accel.wideNodes, accel.triangleHits, tHit);
+#endif
+#ifdef QUANTIZED_BVH
+	return QuantizedBVHClosestHit(ray, accel.quantizedNodes, accel.triangleHits, tHit, hitBVH);
+#else
+	return BVHClosestHit(ray, accel.nodes, accel.triangleHits, 0, tHit, hitBVH);
+#endif
+}
+
+__inline__ __host__ __device__ bool WorldOccluded(const Ray& ray, const SceneAccel& accel, float tMax) {
+#if CPU_BVH_WIDTH > 0 && !defined(__CUDA_ARCH__)
+	if (accel.wideNodes != nullptr)
+		return WideBVHOccluded(ray, accel.wideNodes, accel.triangleHits, tMax);
+#endif
+#ifdef QUANTIZED_BVH
+	return QuantizedBVHOccluded(ray, accel.quantizedNodes, accel.triangleHits, tMax);
+#else
+	return BVHOccluded(ray, accel.nodes, accel.triangleHits, 0, tMax);
+#endif
+}
+
+bool __host__ __device__ SceneIntersect(const Ray& ray, const SceneAccel& accel, ShadeableIntersection* isect) {
+	float* hitBVH = isect ? &isect->hitBVH : NULL;
+	float tmin = FLT_MAX;
+	int hitTriangle = -1;
+	if (accel.numTriangles > 0)
+		hitTriangle = WorldClosestHit(ray, accel, &tmin, hitBVH);
+
+	// top level traversal, instance leaves restart the search in their BLAS with an object space ray
+	const MeshInstance* hitInstance = nullptr;
+	Ray hitRay = ray;
+	if (accel.numInstances > 0)
+	{
+		glm::vec3 invDir(1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z);
+		int dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
+		int toVisitOffset = 0, currentNodeIndex = 0;
+		int nodesToVisit[64];
+		while (true) {
+			const LinearBVHNode& node = accel.tlasNodes[currentNodeIndex];
+			float tBox;
+			if (node.bounds.IntersectP(ray, &tBox) && tBox < tmin) {
+				if (node.nPrimitives > 0) {
+					for (int i = 0; i < node.nPrimitives; ++i)
+					{
+						const MeshInstance& instance = accel.instances[node.primitivesOffset + i];
+						// the direction is not normalized so t stays a world space distance
+						Ray objectRay{ glm::vec3(instance.worldToObject * glm::vec4(ray.origin, 1.f)),
+							glm::vec3(instance.worldToObject * glm::vec4(ray.direction, 0.f)) };
+						float t;
+						int hit = BVHClosestHit(objectRay, accel.blasNodes, accel.blasTriangleHits, instance.blasRoot, &t, hitBVH);
+						if (hit >= 0 && t < tmin)
+						{
+							tmin = t;
+							hitTriangle = hit;
+							hitInstance = &instance;
+							hitRay = objectRay;
+						}
+					}
+					if (toVisitOffset == 0) break;
+					currentNodeIndex = nodesToVisit[--toVisitOffset];
+				}
+				else {
+					if (dirIsNeg[node.axis]) {
+						nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+						currentNodeIndex = node.secondChildOffset;
+					}
+					else {
+						nodesToVisit[toVisitOffset++] = node.secondChildOffset;
+						currentNodeIndex = currentNodeIndex + 1;
+					}
+				}
+			}
+			else {
+				if (toVisitOffset == 0) break;
+				currentNodeIndex = nodesToVisit[--toVisitOffset];
+			}
+		}
+	}
+
+	if (hitTriangle < 0)
+		return false;
+	if (isect && (tmin < isect->t || isect->t == -1.f))
+	{
+		const MeshPoolView& mesh = hitInstance ? accel.blasMesh : accel.mesh;
+		const TriangleIndices& tri = mesh.triangles[hitTriangle];
+		glm::vec3 p = hitRay.origin + hitRay.direction * tmin;
+		isect->t = tmin;
+		isect->uv = mesh.getUV(tri, p);
+		isect->lightId = tri.lightid;
+		if (hitInstance)
+		{
+			isect->surfaceNormal = glm::normalize(hitInstance->normalToWorld * mesh.getNormal(tri, p));
+			isect->materialId = hitInstance->materialid;
+		}
+		else
+		{
+			isect->surfaceNormal = mesh.getNormal(tri, p);
+			isect->materialId = tri.materialid;
+		}
+	}
+	return true;
+}
+
+bool __host__ __device__ SceneOccluded(const Ray& ray, const SceneAccel& accel, float tMax) {
+	if (accel.numTriangles > 0 && WorldOccluded(ray, accel, tMax))
+		return true;
+	if (accel.numInstances == 0)
+		return false;
+
+	glm::vec3 invDir(1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z);
+	int dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
+	int toVisitOffset = 0, currentNodeIndex = 0;
+	int nodesToVisit[64];
+	while (true) {
+		const LinearBVHNode& node = accel.tlasNodes[currentNodeIndex];
+		float tBox;
+		if (node.bounds.IntersectP(ray, &tBox) && tBox < tMax) {
+			if (node.nPrimitives > 0) {
+				for (int i = 0; i < node.nPrimitives; ++i)
+				{
+					const MeshInstance& instance = accel.instances[node.primitivesOffset + i];
+					Ray objectRay{ glm::vec3(instance.worldToObject * glm::vec4(ray.origin, 1.f)),
+						glm::vec3(instance.worldToObject * glm::vec4(ray.direction, 0.f)) };
+					if (BVHOccluded(objectRay, accel.blasNodes, accel.blasTriangleHits, instance.blasRoot, tMax))
+						return true;
+				}
+				if (toVisitOffset == 0) break;
+				currentNodeIndex = nodesToVisit[--toVisitOffset];
+			}
+			else {
+				if (dirIsNeg[node.axis]) {
+					nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+					currentNodeIndex = node.secondChildOffset;
+				}
+				else {
+					nodesToVisit[toVisitOffset++] = node.secondChildOffset;
+					currentNodeIndex = currentNodeIndex + 1;
+				}
+			}
+		}
+		else {
+			if (toVisitOffset == 0) break;
+			currentNodeIndex = nodesToVisit[--toVisitOffset];
+		}
+	}
+	return false;
+}
+
+int InstanceAccel::addMesh(const std::vector<IndexedMesh>& shapes, AABB& objectBounds)
+{
+	// instances take their material from the placement and are never lights
+	int triangleBase = blasPool.triangles.size();
+	for (const IndexedMesh& shape : shapes)
+		blasPool.append(shape, glm::mat4(1.f), -1, -1);
+	std::vector<Triangle> objectTriangles;
+	blasPool.expand(triangleBase, blasPool.triangles.size(), objectTriangles);
+
+	objectBounds = AABB();
+	for (const Triangle& tri : objectTriangles)
+		objectBounds = AABB::Union(objectBounds, tri.getBounds());
+
+	// built once and shared by every instance, so spend the time on the SAH builder
+	BVHAccel blas(objectTriangles, objectTriangles.size(), 4);
+	blas.splitMethod = BVHAccel::SplitMethod::SAH;
+	blas.build(objectTriangles, objectTriangles.size());
+
+	// move the mesh into the shared arrays, node and triangle offsets become global
+	int nodeBase = blasNodes.size();
+	blasPool.reorder(blas.triangleOrder, triangleBase);
+	for (int i = 0; i < blas.bvhNodes; ++i)
+	{
+		LinearBVHNode node = blas.nodes[i];
+		if (node.nPrimitives > 0)
+			node.primitivesOffset += triangleBase;
+		else
+			node.secondChildOffset += nodeBase;
+		blasNodes.push_back(node);
+	}
+	for (const Triangle& tri : objectTriangles)
+		blasTriangleHits.push_back(TriangleHit(tri));
+	delete[] blas.nodes;
+	return nodeBase;
+}
+
+static void setTransform(MeshInstance& instance, const AABB& objectBounds, const glm::mat4& transform)
+{
+	instance.worldToObject = glm::inverse(transform);
+	instance.normalToWorld = glm::mat3(glm::inverseTranspose(transform));
+	instance.bounds = AABB();
+	for (int corner = 0; corner < 8; ++corner)
+	{
+		glm::vec3 p((corner & 1) ? objectBounds.max.x : objectBounds.min.x,
+			(corner & 2) ? objectBounds.max.y : objectBounds.min.y,
+			(corner & 4) ? objectBounds.max.z : objectBounds.min.z);
+		instance.bounds = AABB::Union(instance.bounds, glm::vec3(transform * glm::vec4(p, 1.f)));
+	}
+}
+
+void InstanceAccel::addInstance(int blasRoot, const AABB& objectBounds, const Geom& placement, uint8_t materialid)
+{
+	MeshInstance instance;
+	setTransform(instance, objectBounds, placement.transform);
+	instance.blasRoot = blasRoot;
+	instance.materialid = materialid;
+	instances.push_back(instance);
+	placements.push_back(placement);
+	this->objectBounds.push_back(objectBounds);
+}
+
+void InstanceAccel::buildTLAS()
+{
+	tlasNodes.clear();
+	if (instances.empty())
+		return;
+	std::vector<int> order(instances.size());
+	for (size_t i = 0; i < order.size(); ++i)
+		order[i] = i;
+	tlasNodes.reserve(2 * instances.size());
+	buildTLASNode(order, 0, order.size());
+
+	// leaves reference contiguous instances
+	std::vector<MeshInstance> ordered(instances.size());
+	std::vector<Geom> orderedPlacements(instances.size());
+	std::vector<AABB> orderedBounds(instances.size());
+	for (size_t i = 0; i < order.size(); ++i)
+	{
+		ordered[i] = instances[order[i]];
+		orderedPlacements[i] = placements[order[i]];
+		orderedBounds[i] = objectBounds[order[i]];
+	}
+	instances.swap(ordered);
+	placements.swap(orderedPlacements);
+	objectBounds.swap(orderedBounds);
+}
+
+// The TLAS holds a few hundred nodes at most, refitting all of them is cheaper than finding the path to the leaf
+void InstanceAccel::setInstanceTransform(int i, const Geom& placement)
+{
+	placements[i] = placement;
+	setTransform(instances[i], objectBounds[i], placement.transform);
+	// children always follow their parent in the depth first layout, so a backwards sweep is bottom-up
+	for (int n = (int)tlasNodes.size() - 1; n >= 0; --n)
+	{
+		LinearBVHNode& node = tlasNodes[n];
+		AABB bounds;
+		if (node.nPrimitives > 0)
+		{
+			for (int k = 0; k < node.nPrimitives; ++k)
+				bounds = AABB::Union(bounds, instances[node.primitivesOffset + k].bounds);
+		}
+		else
+			bounds = AABB::Union(tlasNodes[n + 1].bounds, tlasNodes[node.secondChildOffset].bounds);
+		node.bounds = bounds;
+	}
+}
+
+// Instance counts are small, a midpoint split over the centroids is enough; falls back to
+// an equal count split when every centroid lands on one side
+int InstanceAccel::buildTLASNode(std::vector<int>& order, int start, int end)
+{
+	int nodeIndex = tlasNodes.size();
+	tlasNodes.emplace_back();
+	AABB bounds, centroidBounds;
+	for (int i = start; i < end; ++i)
+	{
+		bounds = AABB::Union(bounds, instances[order[i]].bounds);
+		centroidBounds = AABB::Union(centroidBounds, instances[order[i]].bounds.centroid());
+	}
+	tlasNodes[nodeIndex].bounds = bounds;
+
+	if (end - start <= 2)
+	{
+		tlasNodes[nodeIndex].primitivesOffset = start;
+		tlasNodes[nodeIndex].nPrimitives = end - start;
+		return nodeIndex;
+	}
+
+	int axis = centroidBounds.maxExtent();
+	float pmid = centroidBounds.centroid()[axis];
+	int mid = std::partition(order.begin() + start, order.begin() + end, [&](int i) {
+		return instances[i].bounds.centroid()[axis] < pmid;
+	}) - order.begin();
+	if (mid == start || mid == end)
+	{
+		mid = (start + end) / 2;
+		std::nth_element(order.begin() + start, order.begin() + mid, order.begin() + end, [&](int a, int b) {
+			return instances[a].bounds.centroid()[axis] < instances[b].bounds.centroid()[axis];
+		});
+	}
+
+	tlasNodes[nodeIndex].axis = axis;
+	tlasNodes[nodeIndex].nPrimitives = 0;
+	buildTLASNode(order, start, mid);
+	// tlasNodes may reallocate while the children are built
+	int second = buildTLASNode(order, mid, end);
+	tlasNodes[nodeIndex].secondChildOffset = second;
+	return nodeIndex;
+}
+
+size_t InstanceAccel::memoryBytes() const
+{
+	return instances.size() * sizeof(MeshInstance) + tlasNodes.size() * sizeof(LinearBVHNode) +
+		blasNodes.size() * sizeof(LinearBVHNode) + blasTriangleHits.size() * sizeof(TriangleHit) + blasPool.memoryBytes();
+}
+
+SceneAccel InstanceAccel::hostView() const
+{
+	SceneAccel accel;
+	accel.tlasNodes = const_cast<LinearBVHNode*>(tlasNodes.data());
+	accel.instances = const_cast<MeshInstance*>(instances.data());
+	accel.numInstances = instances.size();
+	accel.blasNodes = const_cast<LinearBVHNode*>(blasNodes.data());
+	accel.blasTriangleHits = const_cast<TriangleHit*>(blasTriangleHits.data());
+	accel.blasMesh = blasPool.hostView();
+	return accel;
+}
+
+void InstanceAccel::upload(SceneAccel& accel) const
+{
+	accel.numInstances = instances.size();
+	if (instances.empty())
+		return;
+	cudaMalloc(&accel.tlasNodes, tlasNodes.size() * sizeof(LinearBVHNode));
+	cudaMemcpy(accel.tlasNodes, tlasNodes.data(), tlasNodes.size() * sizeof(LinearBVHNode), cudaMemcpyHostToDevice);
+	cudaMalloc(&accel.instances, instances.size() * sizeof(MeshInstance));
+	cudaMemcpy(accel.instances, instances.data(), instances.size() * sizeof(MeshInstance), cudaMemcpyHostToDevice);
+	cudaMalloc(&accel.blasNodes, blasNodes.size() * sizeof(LinearBVHNode));
+	cudaMemcpy(accel.blasNodes, blasNodes.data(), blasNodes.size() * sizeof(LinearBVHNode), cudaMemcpyHostToDevice);
+	cudaMalloc(&accel.blasTriangleHits, blasTriangleHits.size() * sizeof(TriangleHit));
+	cudaMemcpy(accel.blasTriangleHits, blasTriangleHits.data(), blasTriangleHits.size() * sizeof(TriangleHit), cudaMemcpyHostToDevice);
+	blasPool.upload(accel.blasMesh);
+	checkCUDAError("InstanceAccel::upload");
+}
+
+void InstanceAccel::uploadTransforms(const SceneAccel& accel) const
+{
+	if (instances.empty() || accel.instances == nullptr)
+		return;
+	cudaMemcpy(accel.tlasNodes, tlasNodes.data(), tlasNodes.size() * sizeof(LinearBVHNode), cudaMemcpyHostToDevice);
+	cudaMemcpy(accel.instances, instances.data(), instances.size() * sizeof(MeshInstance), cudaMemcpyHostToDevice);
+	checkCUDAError("InstanceAccel::uploadTransforms");
+}
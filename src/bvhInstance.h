@@ -0,0 +1,80 @@
+#pragma once
+#include "bvh.h"
+#include "meshPool.h"
+#ifdef QUANTIZED_BVH
+#include "bvhQuantized.h"
+#endif
+#if CPU_BVH_WIDTH > 0
+#include "bvhWide.h"
+#endif
+
+// Two-level acceleration structure. Meshes that are placed more than once keep a single object
+// space copy of their triangles and BVH (the BLAS); every placement is a MeshInstance in a small
+// top level BVH (the TLAS). Rays are moved into object space at instance leaves, so memory scales
+// with unique geometry instead of instance count. Everything else stays baked in the world BVH.
+struct MeshInstance
+{
+	glm::mat4 worldToObject;
+	glm::mat3 normalToWorld; // inverse transpose of the object to world transform
+	AABB bounds;             // world space
+	int blasRoot;            // root node of the mesh in SceneAccel::blasNodes
+	uint8_t materialid;
+};
+
+// Device pointers for a closest hit query, passed to kernels by value
+struct SceneAccel
+{
+	LinearBVHNode* nodes = nullptr;    // world BVH over the baked triangles
+#ifdef QUANTIZED_BVH
+	QuantizedBVHNode<QUANTIZED_BVH>* quantizedNodes = nullptr; // the world BVH traversed instead of nodes
+#endif
+#if CPU_BVH_WIDTH > 0
+	const WideBVHNode<CPU_BVH_WIDTH>* wideNodes = nullptr; // host only, traversed instead of nodes when set
+#endif
+	TriangleHit* triangleHits = nullptr; // traversal data, mesh holds the shading attributes
+	MeshPoolView mesh;                 // triangles in world BVH order
+	int numTriangles = 0;
+	LinearBVHNode* tlasNodes = nullptr; // leaves index instances
+	MeshInstance* instances = nullptr;
+	int numInstances = 0;
+	LinearBVHNode* blasNodes = nullptr; // every BLAS, offsets are global
+	TriangleHit* blasTriangleHits = nullptr;
+	MeshPoolView blasMesh;             // object space, triangles in BLAS order
+};
+extern SceneAccel dev_accel;
+
+// BVHIntersect over the world BVH and every instance
+bool __host__ __device__ SceneIntersect(const Ray& ray, const SceneAccel& accel, ShadeableIntersection* isect = NULL);
+// BVHOccluded over the world BVH and every instance
+bool __host__ __device__ SceneOccluded(const Ray& ray, const SceneAccel& accel, float tMax = FLT_MAX);
+
+// Host side instancing data, built by Scene once all meshes are known
+class InstanceAccel
+{
+public:
+	std::vector<MeshInstance> instances;
+	std::vector<LinearBVHNode> tlasNodes;
+	std::vector<LinearBVHNode> blasNodes;
+	MeshPool blasPool;
+	std::vector<TriangleHit> blasTriangleHits;
+	// host only, in instances order: the transform of every placement and the object space bounds of its mesh
+	std::vector<Geom> placements;
+	std::vector<AABB> objectBounds;
+
+	// builds one BLAS over the object space shapes of a mesh and returns its root node, objectBounds receives the mesh bounds
+	int addMesh(const std::vector<IndexedMesh>& shapes, AABB& objectBounds);
+	void addInstance(int blasRoot, const AABB& objectBounds, const Geom& placement, uint8_t materialid);
+	void buildTLAS();
+	// moves instance i to placement's transform and refits the TLAS above it, the instance order is kept
+	void setInstanceTransform(int i, const Geom& placement);
+
+	size_t memoryBytes() const;
+	// host view for tools, the device pointers in dev_accel come from upload()
+	SceneAccel hostView() const;
+	void upload(SceneAccel& accel) const;
+	// copies the instances and the TLAS into the buffers upload() allocated, after setInstanceTransform
+	void uploadTransforms(const SceneAccel& accel) const;
+
+private:
+	int buildTLASNode(std::vector<int>& order, int start, int end);
+};
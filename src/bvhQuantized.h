@@ -0,0 +1,357 @@
+#pragma once
+#include "bvh.h"
+#include "cudaUtilities.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+// Compressed binary BVH. Only interior nodes are stored; each one keeps its own box as a float
+// origin plus a power-of-two step per axis, and the boxes of its two children as Q (uint8_t or
+// uint16_t) multiples of that step. Child boxes are rounded outwards so they always contain the
+// original box. Leaves live in the child slots of their parent.
+//     LinearBVHNode: 32 bytes * (2 * interior + 1)
+//     uint8_t: 40 bytes * interior, uint16_t: 52 bytes * interior
+template<typename Q>
+struct QuantizedBVHNode
+{
+	glm::vec3 origin;
+	int8_t exponent[3];     // step along each axis is 2^exponent
+	uint8_t axis;           // split axis, picks the near child like LinearBVHNode::axis
+	Q qmin[2][3];
+	Q qmax[2][3];
+	int child[2];           // interior: node index, leaf: first triangle, empty: -1
+	uint16_t nPrimitives[2]; // 0 -> interior child
+};
+
+// 2^e as a float for e in [-126, 127]
+__inline__ __host__ __device__ float exp2i(int e)
+{
+	uint32_t bits = (uint32_t)(e + 127) << 23;
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+template<typename Q>
+__inline__ __host__ __device__ AABB decodeChildBounds(const QuantizedBVHNode<Q>& node, int c)
+{
+	AABB b;
+	for (int a = 0; a < 3; ++a)
+	{
+		float step = exp2i(node.exponent[a]);
+		b.min[a] = node.origin[a] + node.qmin[c][a] * step;
+		b.max[a] = node.origin[a] + node.qmax[c][a] * step;
+	}
+	return b;
+}
+
+// closest hit over a quantized tree, returns the triangle slot or -1; tHit is only written on a hit.
+// Tri is Triangle or TriangleHit, like BVHClosestHit.
+template<typename Q, typename Tri>
+__inline__ __host__ __device__ int QuantizedBVHClosestHit(const Ray& ray, const QuantizedBVHNode<Q>* nodes, const Tri* triangles,
+	float* tHit, float* hitBVH = NULL)
+{
+	glm::vec3 invDir(1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z);
+	int dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
+	int toVisitOffset = 0, currentNodeIndex = 0;
+	int nodesToVisit[64];
+	float tmin = FLT_MAX;
+	int hitTriangle = -1;
+	while (true)
+	{
+		const QuantizedBVHNode<Q>& node = nodes[currentNodeIndex];
+		int next[2];
+		int nNext = 0;
+		// near child first
+		int first = dirIsNeg[node.axis];
+		for (int k = 0; k < 2; ++k)
+		{
+			int c = first ^ k;
+			if (node.child[c] < 0 || !decodeChildBounds(node, c).IntersectP(ray))
+				continue;
+#ifdef DEBUG_BVH
+			if (hitBVH) *hitBVH += 0.002f;
+#endif
+			if (node.nPrimitives[c] > 0)
+			{
+				for (int i = 0; i < node.nPrimitives[c]; ++i)
+				{
+					float t = triangles[node.child[c] + i].intersect(ray);
+					if (t > 0 && t < tmin)
+					{
+						tmin = t;
+						hitTriangle = node.child[c] + i;
+					}
+				}
+			}
+			else
+				next[nNext++] = node.child[c];
+		}
+		if (nNext == 2)
+			nodesToVisit[toVisitOffset++] = next[1];
+		if (nNext > 0)
+			currentNodeIndex = next[0];
+		else if (toVisitOffset > 0)
+			currentNodeIndex = nodesToVisit[--toVisitOffset];
+		else
+			break;
+	}
+
+	if (hitTriangle >= 0)
+		*tHit = tmin;
+	return hitTriangle;
+}
+
+// any hit in (0, tMax) over a quantized tree, like BVHOccluded
+template<typename Q, typename Tri>
+__inline__ __host__ __device__ bool QuantizedBVHOccluded(const Ray& ray, const QuantizedBVHNode<Q>* nodes, const Tri* triangles, float tMax)
+{
+	glm::vec3 invDir(1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z);
+	int dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
+	int toVisitOffset = 0, currentNodeIndex = 0;
+	int nodesToVisit[64];
+	while (true)
+	{
+		const QuantizedBVHNode<Q>& node = nodes[currentNodeIndex];
+		int next[2];
+		int nNext = 0;
+		int first = dirIsNeg[node.axis];
+		for (int k = 0; k < 2; ++k)
+		{
+			int c = first ^ k;
+			float tBox;
+			if (node.child[c] < 0 || !decodeChildBounds(node, c).IntersectP(ray, &tBox) || tBox >= tMax)
+				continue;
+			if (node.nPrimitives[c] > 0)
+			{
+				for (int i = 0; i < node.nPrimitives[c]; ++i)
+				{
+					float t = triangles[node.child[c] + i].intersect(ray);
+					if (t > 0 && t < tMax)
+						return true;
+				}
+			}
+			else
+				next[nNext++] = node.child[c];
+		}
+		if (nNext == 2)
+			nodesToVisit[toVisitOffset++] = next[1];
+		if (nNext > 0)
+			currentNodeIndex = next[0];
+		else if (toVisitOffset > 0)
+			currentNodeIndex = nodesToVisit[--toVisitOffset];
+		else
+			break;
+	}
+	return false;
+}
+
+// closest hit over a quantized tree, fills isect like BVHIntersect
+template<typename Q>
+__host__ __device__ bool QuantizedBVHIntersect(const Ray& ray, const QuantizedBVHNode<Q>* nodes, const Triangle* triangles,
+	ShadeableIntersection* isect = nullptr)
+{
+	float tmin = FLT_MAX;
+	int hitTriangle = QuantizedBVHClosestHit(ray, nodes, triangles, &tmin);
+	if (hitTriangle < 0)
+		return false;
+	if (isect && (tmin < isect->t || isect->t == -1.f))
+	{
+		const Triangle& tri = triangles[hitTriangle];
+		isect->t = tmin;
+		isect->surfaceNormal = tri.getNormal(ray.origin + ray.direction * tmin);
+		isect->uv = tri.getUV(ray.origin + ray.direction * tmin);
+		isect->materialId = tri.materialid;
+		isect->lightId = tri.lightid;
+	}
+	return true;
+}
+
+template<typename Q>
+class QuantizedBVH
+{
+public:
+	std::vector<QuantizedBVHNode<Q>> nodes;
+	// children whose decoded box does not contain their float box, the encoder keeps this at zero
+	int nUncoveredChildren = 0;
+
+	// compresses a flattened binary BVH, the triangle order is unchanged
+	void compress(const LinearBVHNode* binaryNodes, int nBinaryNodes);
+	// re-encodes the nodes of binary nodes [first, last] after BVHAccel::refit, the topology is kept;
+	// the rewritten nodes lie in [*firstNode, *lastNode]
+	void update(const LinearBVHNode* binaryNodes, int first, int last, int* firstNode, int* lastNode);
+	// frees *dev and uploads every node
+	void upload(QuantizedBVHNode<Q>*& dev) const;
+	// copies nodes [first, last] into the existing *dev
+	void uploadRange(QuantizedBVHNode<Q>* dev, int first, int last) const;
+
+	bool intersect(const Ray& ray, const Triangle* triangles, ShadeableIntersection* isect = nullptr) const
+	{
+		return !nodes.empty() && QuantizedBVHIntersect(ray, nodes.data(), triangles, isect);
+	}
+
+	size_t memoryBytes() const { return nodes.size() * sizeof(QuantizedBVHNode<Q>); }
+
+private:
+	std::vector<int> nodeOfBinary; // interior binary node (and a leaf root) -> its node, -1 for leaves
+	int compressNode(const LinearBVHNode* binaryNodes, int binaryIndex);
+	// frame and child boxes of nodes[nodeIndex] from binaryNodes[binaryIndex], children receives the
+	// binary children (-1 for none); returns how many child boxes came out uncovered
+	int encodeNode(const LinearBVHNode* binaryNodes, int binaryIndex, int nodeIndex, int children[2]);
+	static void setFrame(QuantizedBVHNode<Q>& node, const AABB& bounds);
+	static void encodeChild(QuantizedBVHNode<Q>& node, int c, const AABB& bounds);
+};
+
+template<typename Q>
+void QuantizedBVH<Q>::compress(const LinearBVHNode* binaryNodes, int nBinaryNodes)
+{
+	nodes.clear();
+	nUncoveredChildren = 0;
+	nodeOfBinary.assign(nBinaryNodes, -1);
+	if (nBinaryNodes == 0)
+		return;
+	nodes.reserve(nBinaryNodes / 2 + 1);
+	compressNode(binaryNodes, 0);
+}
+
+template<typename Q>
+void QuantizedBVH<Q>::update(const LinearBVHNode* binaryNodes, int first, int last, int* firstNode, int* lastNode)
+{
+	*firstNode = nodes.size();
+	*lastNode = -1;
+	// a refit touches a leaf and its ancestors, the leaf's box is encoded in its parent
+	for (int i = first; i <= last; ++i)
+	{
+		int nodeIndex = nodeOfBinary[i];
+		if (nodeIndex < 0)
+			continue;
+		int children[2];
+		encodeNode(binaryNodes, i, nodeIndex, children);
+		*firstNode = std::min(*firstNode, nodeIndex);
+		*lastNode = std::max(*lastNode, nodeIndex);
+	}
+}
+
+template<typename Q>
+void QuantizedBVH<Q>::upload(QuantizedBVHNode<Q>*& dev) const
+{
+	if (dev)
+		cudaFree(dev);
+	cudaMalloc(&dev, nodes.size() * sizeof(QuantizedBVHNode<Q>));
+	cudaMemcpy(dev, nodes.data(), nodes.size() * sizeof(QuantizedBVHNode<Q>), cudaMemcpyHostToDevice);
+	checkCUDAError("QuantizedBVH::upload");
+}
+
+template<typename Q>
+void QuantizedBVH<Q>::uploadRange(QuantizedBVHNode<Q>* dev, int first, int last) const
+{
+	if (last < first)
+		return;
+	cudaMemcpy(dev + first, nodes.data() + first, (last - first + 1) * sizeof(QuantizedBVHNode<Q>), cudaMemcpyHostToDevice);
+	checkCUDAError("QuantizedBVH::uploadRange");
+}
+
+// smallest power-of-two step that covers the box in maxQ - 1 steps, the spare step absorbs rounding in the decoder.
+// The extent is widened by one ulp and the step grown until origin + maxQ * step, evaluated the way the decoder
+// does it, reaches the box max, so a child clamped to maxQ still decodes conservatively
+template<typename Q>
+void QuantizedBVH<Q>::setFrame(QuantizedBVHNode<Q>& node, const AABB& bounds)
+{
+	const float maxQ = (float)std::numeric_limits<Q>::max();
+	node.origin = bounds.min;
+	for (int a = 0; a < 3; ++a)
+	{
+		float extent = std::nextafter(bounds.max[a] - bounds.min[a], std::numeric_limits<float>::max());
+		int e = extent > 0.f ? (int)std::ceil(std::log2(extent / (maxQ - 1.f))) : -126;
+		e = glm::clamp(e, -126, 127);
+		while (e < 127 && node.origin[a] + maxQ * exp2i(e) < bounds.max[a])
+			++e;
+		node.exponent[a] = (int8_t)e;
+	}
+}
+
+template<typename Q>
+void QuantizedBVH<Q>::encodeChild(QuantizedBVHNode<Q>& node, int c, const AABB& bounds)
+{
+	const int maxQ = std::numeric_limits<Q>::max();
+	for (int a = 0; a < 3; ++a)
+	{
+		float step = exp2i(node.exponent[a]);
+		int lo = glm::clamp((int)std::floor((bounds.min[a] - node.origin[a]) / step), 0, maxQ);
+		int hi = glm::clamp((int)std::ceil((bounds.max[a] - node.origin[a]) / step), 0, maxQ);
+		// check against the decoder's own arithmetic and widen until the box is conservative
+		while (lo > 0 && node.origin[a] + lo * step > bounds.min[a])
+			--lo;
+		while (hi < maxQ && node.origin[a] + hi * step < bounds.max[a])
+			++hi;
+		node.qmin[c][a] = (Q)lo;
+		node.qmax[c][a] = (Q)hi;
+	}
+}
+
+template<typename Q>
+int QuantizedBVH<Q>::encodeNode(const LinearBVHNode* binaryNodes, int binaryIndex, int nodeIndex, int children[2])
+{
+	const LinearBVHNode& binary = binaryNodes[binaryIndex];
+	QuantizedBVHNode<Q>& node = nodes[nodeIndex];
+	setFrame(node, binary.bounds);
+	node.axis = binary.axis;
+
+	// a leaf root becomes a node with a single child
+	children[0] = binaryIndex;
+	children[1] = -1;
+	if (binary.nPrimitives == 0)
+	{
+		children[0] = binaryIndex + 1;
+		children[1] = binary.secondChildOffset;
+	}
+	int nUncovered = 0;
+	for (int c = 0; c < 2; ++c)
+	{
+		if (children[c] < 0)
+			continue;
+		const LinearBVHNode& child = binaryNodes[children[c]];
+		encodeChild(node, c, child.bounds);
+		AABB decoded = decodeChildBounds(node, c);
+		for (int a = 0; a < 3; ++a)
+		{
+			if (decoded.min[a] > child.bounds.min[a] || decoded.max[a] < child.bounds.max[a])
+			{
+				++nUncovered;
+				break;
+			}
+		}
+	}
+	return nUncovered;
+}
+
+template<typename Q>
+int QuantizedBVH<Q>::compressNode(const LinearBVHNode* binaryNodes, int binaryIndex)
+{
+	int nodeIndex = nodes.size();
+	nodes.emplace_back();
+	nodeOfBinary[binaryIndex] = nodeIndex;
+	int children[2];
+	nUncoveredChildren += encodeNode(binaryNodes, binaryIndex, nodeIndex, children);
+	for (int c = 0; c < 2; ++c)
+	{
+		if (children[c] < 0)
+		{
+			nodes[nodeIndex].child[c] = -1;
+			nodes[nodeIndex].nPrimitives[c] = 0;
+			continue;
+		}
+		const LinearBVHNode& child = binaryNodes[children[c]];
+		nodes[nodeIndex].nPrimitives[c] = child.nPrimitives;
+		if (child.nPrimitives > 0)
+			nodes[nodeIndex].child[c] = child.primitivesOffset;
+		else
+		{
+			// nodes may reallocate while the child is compressed
+			int childIndex = compressNode(binaryNodes, children[c]);
+			nodes[nodeIndex].child[c] = childIndex;
+		}
+	}
+	return nodeIndex;
+}
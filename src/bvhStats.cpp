@@ -0,0 +1,376 @@
+#include "bvhStats.h"
+#include "json.hpp"
+#include <cstdio>
+
+using json = nlohmann::json;
+
+namespace
+{
+	constexpr float nodeCost = 0.125f;
+	constexpr float triangleCost = 1.f;
+	constexpr int maxHistogramLeafSize = 64;
+
+	float overlapArea(const AABB& a, const AABB& b)
+	{
+		AABB o;
+		o.min = glm::max(a.min, b.min);
+		o.max = glm::min(a.max, b.max);
+		if (glm::any(glm::greaterThan(o.min, o.max)))
+			return 0.f;
+		return o.SurfaceArea();
+	}
+
+	bool overlaps(const AABB& a, const AABB& b)
+	{
+		return !glm::any(glm::greaterThan(a.min, b.max)) && !glm::any(glm::lessThan(a.max, b.min));
+	}
+
+	float polygonArea(const glm::vec3* p, int n)
+	{
+		glm::vec3 sum(0.f);
+		for (int i = 1; i + 1 < n; ++i)
+			sum += glm::cross(p[i] - p[0], p[i + 1] - p[0]);
+		return 0.5f * glm::length(sum);
+	}
+
+	// area of the part of triangle t inside box, Sutherland-Hodgman against the six slabs
+	float clippedTriangleArea(const Triangle& t, const AABB& box)
+	{
+		glm::vec3 poly[2][9];
+		int n = 3;
+		for (int i = 0; i < 3; ++i)
+			poly[0][i] = t.vertices[i];
+		int cur = 0;
+		for (int plane = 0; plane < 6 && n > 0; ++plane)
+		{
+			int axis = plane >> 1;
+			bool isMax = plane & 1;
+			float bound = isMax ? box.max[axis] : box.min[axis];
+			const glm::vec3* in = poly[cur];
+			glm::vec3* out = poly[cur ^ 1];
+			int m = 0;
+			for (int i = 0; i < n; ++i)
+			{
+				const glm::vec3& a = in[i];
+				const glm::vec3& b = in[(i + 1) % n];
+				float da = isMax ? bound - a[axis] : a[axis] - bound;
+				float db = isMax ? bound - b[axis] : b[axis] - bound;
+				if (da >= 0.f)
+					out[m++] = a;
+				if ((da >= 0.f) != (db >= 0.f))
+					out[m++] = a + (b - a) * (da / (da - db));
+			}
+			n = m;
+			cur ^= 1;
+		}
+		return n >= 3 ? polygonArea(poly[cur], n) : 0.f;
+	}
+
+	// per-thread ray replay counters
+	struct RayCounters
+	{
+		uint64_t nodeVisits = 0;
+		uint64_t triangleTests = 0;
+		uint64_t rays = 0;
+		uint64_t hits = 0;
+	};
+
+	// BVHIntersect with counters, returns the hit triangle slot or -1
+	int countingIntersect(const Ray& ray, const LinearBVHNode* nodes, const Triangle* triangles, float* tHit, RayCounters& counters)
+	{
+		glm::vec3 invDir(1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z);
+		int dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
+		int toVisitOffset = 0, currentNodeIndex = 0;
+		int nodesToVisit[64];
+		float tmin = FLT_MAX;
+		int hitTriangle = -1;
+		counters.rays++;
+		while (true)
+		{
+			const LinearBVHNode& node = nodes[currentNodeIndex];
+			counters.nodeVisits++;
+			if (node.bounds.IntersectP(ray))
+			{
+				if (node.nPrimitives > 0)
+				{
+					counters.triangleTests += node.nPrimitives;
+					for (int i = 0; i < node.nPrimitives; ++i)
+					{
+						float t = triangles[node.primitivesOffset + i].intersect(ray);
+						if (t > 0 && t < tmin)
+						{
+							tmin = t;
+							hitTriangle = node.primitivesOffset + i;
+						}
+					}
+					if (toVisitOffset == 0) break;
+					currentNodeIndex = nodesToVisit[--toVisitOffset];
+				}
+				else if (dirIsNeg[node.axis])
+				{
+					nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+					currentNodeIndex = node.secondChildOffset;
+				}
+				else
+				{
+					nodesToVisit[toVisitOffset++] = node.secondChildOffset;
+					currentNodeIndex = currentNodeIndex + 1;
+				}
+			}
+			else
+			{
+				if (toVisitOffset == 0) break;
+				currentNodeIndex = nodesToVisit[--toVisitOffset];
+			}
+		}
+		if (hitTriangle >= 0)
+			counters.hits++;
+		*tHit = tmin;
+		return hitTriangle;
+	}
+
+	// stateless hash so the replay does not depend on how rows are spread over threads
+	float hash01(uint32_t seed, uint32_t index, uint32_t dim)
+	{
+		uint32_t h = seed * 0x9E3779B9u ^ index * 0x85EBCA6Bu ^ dim * 0xC2B2AE35u;
+		h ^= h >> 16;
+		h *= 0x7FEB352Du;
+		h ^= h >> 15;
+		h *= 0x846CA68Bu;
+		h ^= h >> 16;
+		return (h >> 8) * (1.f / 16777216.f);
+	}
+
+	glm::vec3 cosineHemisphere(const glm::vec3& n, float u1, float u2)
+	{
+		float cosTheta = std::sqrt(u1);
+		float sinTheta = std::sqrt(1.f - u1);
+		float phi = u2 * TWO_PI;
+		glm::vec3 t = fabs(n.x) > 0.9f ? glm::vec3(0, 1, 0) : glm::vec3(1, 0, 0);
+		glm::vec3 b = glm::normalize(glm::cross(n, t));
+		t = glm::cross(b, n);
+		return glm::normalize(std::cos(phi) * sinTheta * t + std::sin(phi) * sinTheta * b + cosTheta * n);
+	}
+}
+
+void computeBVHStats(BVHStats& stats, const LinearBVHNode* nodes, int nNodes, const Triangle* triangles, int nTriangles, ThreadPool& pool)
+{
+	stats.nNodes = nNodes;
+	stats.nTriangles = nTriangles;
+	if (nNodes == 0)
+		return;
+
+	// subtree of node i is [i, subtreeEnd[i]) in the depth first layout
+	std::vector<int> subtreeEnd(nNodes), depth(nNodes, 0), triangleLeaf(nTriangles, -1);
+	for (int i = nNodes - 1; i >= 0; --i)
+		subtreeEnd[i] = nodes[i].nPrimitives > 0 ? i + 1 : subtreeEnd[nodes[i].secondChildOffset];
+
+	float rootArea = nodes[0].bounds.SurfaceArea();
+	double sah = 0.0, overlap = 0.0, leafDepthSum = 0.0;
+	stats.leafSizeHistogram.assign(maxHistogramLeafSize + 1, 0);
+	stats.depthHistogram.clear();
+	stats.nInterior = stats.nLeaves = 0;
+	stats.maxDepth = 0;
+	for (int i = 0; i < nNodes; ++i)
+	{
+		const LinearBVHNode& node = nodes[i];
+		stats.maxDepth = std::max(stats.maxDepth, depth[i]);
+		if (node.nPrimitives > 0)
+		{
+			stats.nLeaves++;
+			sah += node.bounds.SurfaceArea() * node.nPrimitives * triangleCost;
+			stats.leafSizeHistogram[std::min<int>(node.nPrimitives, maxHistogramLeafSize)]++;
+			if ((int)stats.depthHistogram.size() <= depth[i])
+				stats.depthHistogram.resize(depth[i] + 1, 0);
+			stats.depthHistogram[depth[i]]++;
+			leafDepthSum += depth[i];
+			for (int k = 0; k < node.nPrimitives; ++k)
+				triangleLeaf[node.primitivesOffset + k] = i;
+		}
+		else
+		{
+			stats.nInterior++;
+			sah += node.bounds.SurfaceArea() * nodeCost;
+			depth[i + 1] = depth[node.secondChildOffset] = depth[i] + 1;
+			float area = node.bounds.SurfaceArea();
+			if (area > 0.f)
+				overlap += overlapArea(nodes[i + 1].bounds, nodes[node.secondChildOffset].bounds) / area;
+		}
+	}
+	while (stats.leafSizeHistogram.size() > 1 && stats.leafSizeHistogram.back() == 0)
+		stats.leafSizeHistogram.pop_back();
+	stats.sahCost = rootArea > 0.f ? sah / rootArea : 0.f;
+	stats.avgChildOverlap = stats.nInterior ? overlap / stats.nInterior : 0.f;
+	stats.avgLeafSize = stats.nLeaves ? (float)nTriangles / stats.nLeaves : 0.f;
+	stats.avgLeafDepth = stats.nLeaves ? leafDepthSum / stats.nLeaves : 0.f;
+
+	// EPO: for every triangle, the nodes overlapping it that are not on its own root-to-leaf path
+	std::vector<double> epoArea(pool.size(), 0.0), triangleArea(pool.size(), 0.0);
+	pool.parallelFor(nTriangles, 1024, [&](int64_t begin, int64_t end, int threadIndex) {
+		std::vector<int> stack;
+		for (int64_t t = begin; t < end; ++t)
+		{
+			const Triangle& tri = triangles[t];
+			float area = polygonArea(tri.vertices, 3);
+			if (area <= 0.f || triangleLeaf[t] < 0)
+				continue;
+			triangleArea[threadIndex] += area;
+			AABB triBounds = tri.getBounds();
+			int leaf = triangleLeaf[t];
+			stack.assign(1, 0);
+			while (!stack.empty())
+			{
+				int i = stack.back();
+				stack.pop_back();
+				const LinearBVHNode& node = nodes[i];
+				if (!overlaps(node.bounds, triBounds))
+					continue;
+				bool ownsTriangle = i <= leaf && leaf < subtreeEnd[i];
+				if (!ownsTriangle)
+				{
+					float cost = node.nPrimitives > 0 ? node.nPrimitives * triangleCost : nodeCost;
+					epoArea[threadIndex] += cost * clippedTriangleArea(tri, node.bounds);
+				}
+				if (node.nPrimitives == 0)
+				{
+					stack.push_back(i + 1);
+					stack.push_back(node.secondChildOffset);
+				}
+			}
+		}
+	});
+	double epoSum = 0.0, areaSum = 0.0;
+	for (int i = 0; i < pool.size(); ++i)
+	{
+		epoSum += epoArea[i];
+		areaSum += triangleArea[i];
+	}
+	stats.epo = areaSum > 0.0 ? epoSum / areaSum : 0.f;
+}
+
+void makeReplayRays(ReplayRays& replay, const LinearBVHNode* nodes, const Triangle* triangles, const Camera& camera,
+	int width, int height, ThreadPool& pool, uint32_t seed)
+{
+	// same basis the viewer builds from view and up
+	glm::vec3 view = glm::normalize(camera.view);
+	glm::vec3 right = glm::normalize(glm::cross(view, camera.up));
+	glm::vec3 up = glm::cross(right, view);
+	glm::vec2 pixelScale = glm::vec2(camera.resolution) / glm::vec2(width, height);
+
+	int nCamera = width * height;
+	std::vector<Ray> bounces(nCamera);
+	std::vector<uint8_t> hasBounce(nCamera, 0);
+	replay.rays.resize(nCamera);
+	replay.nCamera = nCamera;
+	pool.parallelFor(height, 4, [&](int64_t begin, int64_t end, int threadIndex) {
+		RayCounters counters;
+		for (int64_t y = begin; y < end; ++y)
+		{
+			for (int x = 0; x < width; ++x)
+			{
+				uint32_t index = y * width + x;
+				float pixelX = (x + hash01(seed, index, 0)) * pixelScale.x;
+				float pixelY = (y + hash01(seed, index, 1)) * pixelScale.y;
+				Ray& ray = replay.rays[index];
+				ray.origin = camera.position;
+				ray.direction = glm::normalize(view
+					- right * camera.pixelLength.x * (pixelX - (float)camera.resolution.x * 0.5f)
+					- up * camera.pixelLength.y * (pixelY - (float)camera.resolution.y * 0.5f));
+				float t;
+				int hit = countingIntersect(ray, nodes, triangles, &t, counters);
+				if (hit < 0)
+					continue;
+
+				glm::vec3 p = ray.origin + t * ray.direction;
+				glm::vec3 n = triangles[hit].getNormal();
+				if (glm::dot(n, ray.direction) > 0.f)
+					n = -n;
+				bounces[index].origin = p + n * 1e-3f;
+				bounces[index].direction = cosineHemisphere(n, hash01(seed, index, 2), hash01(seed, index, 3));
+				hasBounce[index] = 1;
+			}
+		}
+	});
+	for (int i = 0; i < nCamera; ++i)
+	{
+		if (hasBounce[i])
+			replay.rays.push_back(bounces[i]);
+	}
+}
+
+void replayBVHRays(BVHStats& stats, const LinearBVHNode* nodes, const Triangle* triangles, const ReplayRays& replay, ThreadPool& pool)
+{
+	std::vector<RayCounters> cameraCounters(pool.size()), diffuseCounters(pool.size());
+	pool.parallelFor(replay.rays.size(), 256, [&](int64_t begin, int64_t end, int threadIndex) {
+		for (int64_t i = begin; i < end; ++i)
+		{
+			float t;
+			RayCounters& counters = i < replay.nCamera ? cameraCounters[threadIndex] : diffuseCounters[threadIndex];
+			countingIntersect(replay.rays[i], nodes, triangles, &t, counters);
+		}
+	});
+
+	RayCounters cameraTotal, diffuseTotal;
+	for (int i = 0; i < pool.size(); ++i)
+	{
+		cameraTotal.nodeVisits += cameraCounters[i].nodeVisits;
+		cameraTotal.triangleTests += cameraCounters[i].triangleTests;
+		cameraTotal.rays += cameraCounters[i].rays;
+		cameraTotal.hits += cameraCounters[i].hits;
+		diffuseTotal.nodeVisits += diffuseCounters[i].nodeVisits;
+		diffuseTotal.triangleTests += diffuseCounters[i].triangleTests;
+		diffuseTotal.rays += diffuseCounters[i].rays;
+		diffuseTotal.hits += diffuseCounters[i].hits;
+	}
+	uint64_t nRays = cameraTotal.rays + diffuseTotal.rays;
+	stats.nCameraRays = cameraTotal.rays;
+	stats.nDiffuseRays = diffuseTotal.rays;
+	stats.cameraHitRate = cameraTotal.rays ? (float)cameraTotal.hits / cameraTotal.rays : 0.f;
+	stats.diffuseHitRate = diffuseTotal.rays ? (float)diffuseTotal.hits / diffuseTotal.rays : 0.f;
+	stats.cameraNodeVisits = cameraTotal.rays ? (float)cameraTotal.nodeVisits / cameraTotal.rays : 0.f;
+	stats.cameraTriangleTests = cameraTotal.rays ? (float)cameraTotal.triangleTests / cameraTotal.rays : 0.f;
+	stats.diffuseNodeVisits = diffuseTotal.rays ? (float)diffuseTotal.nodeVisits / diffuseTotal.rays : 0.f;
+	stats.diffuseTriangleTests = diffuseTotal.rays ? (float)diffuseTotal.triangleTests / diffuseTotal.rays : 0.f;
+	stats.avgNodeVisits = nRays ? (float)(cameraTotal.nodeVisits + diffuseTotal.nodeVisits) / nRays : 0.f;
+	stats.avgTriangleTests = nRays ? (float)(cameraTotal.triangleTests + diffuseTotal.triangleTests) / nRays : 0.f;
+}
+
+std::string BVHStats::toJSON() const
+{
+	json j;
+	j["nodes"] = nNodes;
+	j["interiorNodes"] = nInterior;
+	j["leaves"] = nLeaves;
+	j["triangles"] = nTriangles;
+	j["maxDepth"] = maxDepth;
+	j["avgLeafSize"] = avgLeafSize;
+	j["avgLeafDepth"] = avgLeafDepth;
+	j["sahCost"] = sahCost;
+	j["avgChildOverlap"] = avgChildOverlap;
+	j["epo"] = epo;
+	j["leafSizeHistogram"] = leafSizeHistogram;
+	j["depthHistogram"] = depthHistogram;
+	j["rays"] = {
+		{ "camera", { { "count", nCameraRays }, { "hitRate", cameraHitRate }, { "nodeVisits", cameraNodeVisits }, { "triangleTests", cameraTriangleTests } } },
+		{ "diffuse", { { "count", nDiffuseRays }, { "hitRate", diffuseHitRate }, { "nodeVisits", diffuseNodeVisits }, { "triangleTests", diffuseTriangleTests } } },
+		{ "avgNodeVisits", avgNodeVisits },
+		{ "avgTriangleTests", avgTriangleTests }
+	};
+	return j.dump(2);
+}
+
+void BVHStats::print() const
+{
+	printf("BVH stats: %d nodes (%d interior, %d leaves), %d triangles\n", nNodes, nInterior, nLeaves, nTriangles);
+	printf("  SAH cost %.3f | EPO %.3f | child overlap %.3f\n", sahCost, epo, avgChildOverlap);
+	printf("  max depth %d | avg leaf depth %.2f | avg leaf size %.2f\n", maxDepth, avgLeafDepth, avgLeafSize);
+	printf("  leaf sizes:");
+	for (size_t i = 1; i < leafSizeHistogram.size(); ++i)
+		printf(" %zu%s:%d", i, i == maxHistogramLeafSize ? "+" : "", leafSizeHistogram[i]);
+	printf("\n");
+	if (nCameraRays > 0)
+	{
+		printf("  camera rays %d: hit %.1f%%, %.1f nodes, %.1f triangles per ray\n", nCameraRays, 100.f * cameraHitRate, cameraNodeVisits, cameraTriangleTests);
+		printf("  diffuse rays %d: hit %.1f%%, %.1f nodes, %.1f triangles per ray\n", nDiffuseRays, 100.f * diffuseHitRate, diffuseNodeVisits, diffuseTriangleTests);
+	}
+}
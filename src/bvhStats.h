@@ -0,0 +1,55 @@
+#pragma once
+#include "bvh.h"
+#include <string>
+
+// Host side quality report for a flattened BVH, used to compare builders and catch regressions.
+// Costs use the same constants as the SAH builder: 0.125 per node visit and 1 per triangle test,
+// normalized by the root surface area.
+struct BVHStats
+{
+	int nNodes = 0;
+	int nInterior = 0;
+	int nLeaves = 0;
+	int nTriangles = 0;
+	int maxDepth = 0;
+	float avgLeafSize = 0.f;
+	float avgLeafDepth = 0.f;
+	float sahCost = 0.f;
+	// mean over interior nodes of area(child0 & child1) / area(node)
+	float avgChildOverlap = 0.f;
+	// effective parent overlap: cost weighted area of triangles inside boxes of nodes that don't own them
+	float epo = 0.f;
+	std::vector<int> leafSizeHistogram; // [nPrimitives]
+	std::vector<int> depthHistogram;    // [depth] leaves per depth
+
+	// deterministic camera + one diffuse bounce replay
+	int nCameraRays = 0;
+	int nDiffuseRays = 0;
+	float cameraHitRate = 0.f;
+	float diffuseHitRate = 0.f;
+	float avgNodeVisits = 0.f;     // nodes whose box was tested, per ray
+	float avgTriangleTests = 0.f;  // per ray
+	float cameraNodeVisits = 0.f;
+	float cameraTriangleTests = 0.f;
+	float diffuseNodeVisits = 0.f;
+	float diffuseTriangleTests = 0.f;
+
+	std::string toJSON() const;
+	void print() const;
+};
+
+// tree shape, SAH cost, overlap and EPO
+void computeBVHStats(BVHStats& stats, const LinearBVHNode* nodes, int nNodes, const Triangle* triangles, int nTriangles, ThreadPool& pool);
+
+// Deterministic ray set: a width x height grid of jittered camera rays followed by one cosine
+// weighted bounce from every camera hit found with the binary BVH. Shared by the BVH benchmarks.
+struct ReplayRays
+{
+	std::vector<Ray> rays;
+	int nCamera = 0;
+};
+void makeReplayRays(ReplayRays& replay, const LinearBVHNode* nodes, const Triangle* triangles, const Camera& camera,
+	int width, int height, ThreadPool& pool, uint32_t seed = 565);
+
+// node visits and triangle tests for every ray in replay
+void replayBVHRays(BVHStats& stats, const LinearBVHNode* nodes, const Triangle* triangles, const ReplayRays& replay, ThreadPool& pool);
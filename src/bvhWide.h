@@ -0,0 +1,312 @@
+#pragma once
+#include "bvh.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BVH_WIDE_SSE
+#endif
+
+// N-wide BVH collapsed from the binary LinearBVHNode tree, for host side traversal.
+// Child bounds are stored SoA so one node fetch tests all N children with 4-wide SSE
+// (two passes for N = 8). Unused slots have child == -1 and are skipped after the box test.
+template<int N>
+struct alignas(64) WideBVHNode
+{
+	static_assert(N % 4 == 0, "WideBVHNode width must be a multiple of 4");
+	float minX[N], minY[N], minZ[N];
+	float maxX[N], maxY[N], maxZ[N];
+	int child[N];           // interior: node index, leaf: first triangle, empty: -1
+	uint16_t nPrimitives[N]; // 0 -> interior child
+};
+
+// writes 1 into hitMask[i] and the entry distance into tNear[i] for every child the ray hits before tMax
+template<int N>
+inline void WideBVHIntersectChildren(const WideBVHNode<N>& node, const glm::vec3& origin, const glm::vec3& invDir, float tMax,
+	int* hitMask, float* tNear);
+
+// closest hit over a wide tree, returns the triangle slot or -1; tHit is only written on a hit.
+// Tri is Triangle or TriangleHit, like BVHClosestHit.
+template<int N, typename Tri>
+int WideBVHClosestHit(const Ray& ray, const WideBVHNode<N>* nodes, const Tri* triangles, float* tHit);
+
+// any hit in (0, tMax) over a wide tree, like BVHOccluded
+template<int N, typename Tri>
+bool WideBVHOccluded(const Ray& ray, const WideBVHNode<N>* nodes, const Tri* triangles, float tMax);
+
+template<int N>
+class WideBVH
+{
+public:
+	std::vector<WideBVHNode<N>> nodes;
+
+	// collapses a flattened binary BVH, the triangle order is unchanged
+	void collapse(const LinearBVHNode* binaryNodes, int nBinaryNodes);
+	// copies the boxes of binary nodes [first, last] after BVHAccel::refit, the topology is kept
+	void update(const LinearBVHNode* binaryNodes, int first, int last);
+
+	// closest hit, fills isect like BVHIntersect
+	bool intersect(const Ray& ray, const Triangle* triangles, ShadeableIntersection* isect = nullptr) const;
+
+	size_t memoryBytes() const { return nodes.size() * sizeof(WideBVHNode<N>); }
+
+private:
+	std::vector<int> slotOfBinary; // binary node -> node * N + slot holding its box, -1 once collapsed away
+	int collapseNode(const LinearBVHNode* binaryNodes, int binaryIndex);
+	void setSlotBounds(int node, int slot, const AABB& bounds);
+};
+
+template<int N>
+void WideBVH<N>::collapse(const LinearBVHNode* binaryNodes, int nBinaryNodes)
+{
+	nodes.clear();
+	slotOfBinary.assign(nBinaryNodes, -1);
+	if (nBinaryNodes == 0)
+		return;
+	nodes.reserve(nBinaryNodes / (N - 1) + 1);
+	collapseNode(binaryNodes, 0);
+}
+
+template<int N>
+void WideBVH<N>::update(const LinearBVHNode* binaryNodes, int first, int last)
+{
+	for (int i = first; i <= last; ++i)
+	{
+		if (slotOfBinary[i] >= 0)
+			setSlotBounds(slotOfBinary[i] / N, slotOfBinary[i] % N, binaryNodes[i].bounds);
+	}
+}
+
+template<int N>
+void WideBVH<N>::setSlotBounds(int node, int slot, const AABB& bounds)
+{
+	WideBVHNode<N>& n = nodes[node];
+	n.minX[slot] = bounds.min.x; n.minY[slot] = bounds.min.y; n.minZ[slot] = bounds.min.z;
+	n.maxX[slot] = bounds.max.x; n.maxY[slot] = bounds.max.y; n.maxZ[slot] = bounds.max.z;
+}
+
+// Greedy collapse: start from the two children of a binary node and keep replacing the interior
+// child with the largest surface area by its own children until N slots are used.
+template<int N>
+int WideBVH<N>::collapseNode(const LinearBVHNode* binaryNodes, int binaryIndex)
+{
+	int slots[N];
+	int nSlots = 0;
+	const LinearBVHNode& root = binaryNodes[binaryIndex];
+	if (root.nPrimitives > 0)
+		slots[nSlots++] = binaryIndex;
+	else
+	{
+		slots[nSlots++] = binaryIndex + 1;
+		slots[nSlots++] = root.secondChildOffset;
+	}
+	while (nSlots < N)
+	{
+		int best = -1;
+		float bestArea = -1.f;
+		for (int i = 0; i < nSlots; ++i)
+		{
+			const LinearBVHNode& c = binaryNodes[slots[i]];
+			if (c.nPrimitives == 0 && c.bounds.SurfaceArea() > bestArea)
+			{
+				best = i;
+				bestArea = c.bounds.SurfaceArea();
+			}
+		}
+		if (best < 0)
+			break;
+		int opened = slots[best];
+		slots[best] = opened + 1;
+		slots[nSlots++] = binaryNodes[opened].secondChildOffset;
+	}
+
+	int nodeIndex = nodes.size();
+	nodes.emplace_back();
+	for (int i = 0; i < N; ++i)
+	{
+		WideBVHNode<N>& node = nodes[nodeIndex];
+		if (i >= nSlots)
+		{
+			node.minX[i] = node.minY[i] = node.minZ[i] = FLT_MAX;
+			node.maxX[i] = node.maxY[i] = node.maxZ[i] = -FLT_MAX;
+			node.child[i] = -1;
+			node.nPrimitives[i] = 0;
+			continue;
+		}
+		const LinearBVHNode& c = binaryNodes[slots[i]];
+		setSlotBounds(nodeIndex, i, c.bounds);
+		slotOfBinary[slots[i]] = nodeIndex * N + i;
+		node.nPrimitives[i] = c.nPrimitives;
+		if (c.nPrimitives > 0)
+			node.child[i] = c.primitivesOffset;
+		else
+		{
+			// nodes may reallocate while the child is collapsed, so write through the index afterwards
+			int childIndex = collapseNode(binaryNodes, slots[i]);
+			nodes[nodeIndex].child[i] = childIndex;
+		}
+	}
+	return nodeIndex;
+}
+
+template<int N>
+inline void WideBVHIntersectChildren(const WideBVHNode<N>& node, const glm::vec3& origin, const glm::vec3& invDir, float tMax,
+	int* hitMask, float* tNear)
+{
+	// same widening of the far distance as AABB::IntersectP
+	const float farScale = 1 + 2 * gamma(3);
+#ifdef BVH_WIDE_SSE
+	const __m128 ox = _mm_set1_ps(origin.x), oy = _mm_set1_ps(origin.y), oz = _mm_set1_ps(origin.z);
+	const __m128 ix = _mm_set1_ps(invDir.x), iy = _mm_set1_ps(invDir.y), iz = _mm_set1_ps(invDir.z);
+	for (int base = 0; base < N; base += 4)
+	{
+		__m128 t0x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.minX + base), ox), ix);
+		__m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.maxX + base), ox), ix);
+		__m128 t0y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.minY + base), oy), iy);
+		__m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.maxY + base), oy), iy);
+		__m128 t0z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.minZ + base), oz), iz);
+		__m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.maxZ + base), oz), iz);
+		__m128 tEnter = _mm_max_ps(_mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)),
+			_mm_max_ps(_mm_min_ps(t0z, t1z), _mm_setzero_ps()));
+		__m128 tExit = _mm_min_ps(_mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)), _mm_max_ps(t0z, t1z));
+		tExit = _mm_min_ps(_mm_mul_ps(tExit, _mm_set1_ps(farScale)), _mm_set1_ps(tMax));
+		int mask = _mm_movemask_ps(_mm_cmple_ps(tEnter, tExit));
+		_mm_storeu_ps(tNear + base, tEnter);
+		for (int i = 0; i < 4; ++i)
+			hitMask[base + i] = (mask >> i) & 1;
+	}
+#else
+	const float* mins[3] = { node.minX, node.minY, node.minZ };
+	const float* maxs[3] = { node.maxX, node.maxY, node.maxZ };
+	for (int i = 0; i < N; ++i)
+	{
+		float tEnter = 0.f, tExit = FLT_MAX;
+		for (int a = 0; a < 3; ++a)
+		{
+			float t0 = (mins[a][i] - origin[a]) * invDir[a];
+			float t1 = (maxs[a][i] - origin[a]) * invDir[a];
+			tEnter = std::max(tEnter, std::min(t0, t1));
+			tExit = std::min(tExit, std::max(t0, t1));
+		}
+		tExit = std::min(tExit * farScale, tMax);
+		tNear[i] = tEnter;
+		hitMask[i] = tEnter <= tExit;
+	}
+#endif
+}
+
+template<int N, typename Tri>
+int WideBVHClosestHit(const Ray& ray, const WideBVHNode<N>* nodes, const Tri* triangles, float* tHit)
+{
+	glm::vec3 invDir(1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z);
+	float tmin = FLT_MAX;
+	int hitTriangle = -1;
+
+	// every slot can push one node, so depth * (N - 1) + 1 entries are enough
+	struct StackEntry { int node; float tNear; };
+	StackEntry stack[64 * (N - 1) + 1];
+	int stackSize = 0;
+	stack[stackSize++] = { 0, 0.f };
+	while (stackSize > 0)
+	{
+		StackEntry entry = stack[--stackSize];
+		if (entry.tNear > tmin)
+			continue;
+		const WideBVHNode<N>& node = nodes[entry.node];
+		int hitMask[N];
+		float tNear[N];
+		// AABB::IntersectP clips boxes at t = 2000, keep the same range as the binary traversal
+		WideBVHIntersectChildren(node, ray.origin, invDir, std::min(tmin, 2000.f), hitMask, tNear);
+
+		// leaves first, then push interior children far to near so the nearest is popped next
+		int order[N];
+		int nInterior = 0;
+		for (int i = 0; i < N; ++i)
+		{
+			if (!hitMask[i] || node.child[i] < 0)
+				continue;
+			if (node.nPrimitives[i] > 0)
+			{
+				for (int k = 0; k < node.nPrimitives[i]; ++k)
+				{
+					float t = triangles[node.child[i] + k].intersect(ray);
+					if (t > 0 && t < tmin)
+					{
+						tmin = t;
+						hitTriangle = node.child[i] + k;
+					}
+				}
+			}
+			else
+			{
+				int j = nInterior++;
+				while (j > 0 && tNear[order[j - 1]] < tNear[i])
+				{
+					order[j] = order[j - 1];
+					--j;
+				}
+				order[j] = i;
+			}
+		}
+		for (int j = 0; j < nInterior; ++j)
+			stack[stackSize++] = { node.child[order[j]], tNear[order[j]] };
+	}
+
+	if (hitTriangle >= 0)
+		*tHit = tmin;
+	return hitTriangle;
+}
+
+template<int N, typename Tri>
+bool WideBVHOccluded(const Ray& ray, const WideBVHNode<N>* nodes, const Tri* triangles, float tMax)
+{
+	glm::vec3 invDir(1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z);
+	int stack[64 * (N - 1) + 1];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+	while (stackSize > 0)
+	{
+		const WideBVHNode<N>& node = nodes[stack[--stackSize]];
+		int hitMask[N];
+		float tNear[N];
+		WideBVHIntersectChildren(node, ray.origin, invDir, std::min(tMax, 2000.f), hitMask, tNear);
+		// any blocker ends the query, so no ordering
+		for (int i = 0; i < N; ++i)
+		{
+			if (!hitMask[i] || node.child[i] < 0 || tNear[i] >= tMax)
+				continue;
+			if (node.nPrimitives[i] > 0)
+			{
+				for (int k = 0; k < node.nPrimitives[i]; ++k)
+				{
+					float t = triangles[node.child[i] + k].intersect(ray);
+					if (t > 0 && t < tMax)
+						return true;
+				}
+			}
+			else
+				stack[stackSize++] = node.child[i];
+		}
+	}
+	return false;
+}
+
+template<int N>
+bool WideBVH<N>::intersect(const Ray& ray, const Triangle* triangles, ShadeableIntersection* isect) const
+{
+	if (nodes.empty())
+		return false;
+	float tmin = FLT_MAX;
+	int hitTriangle = WideBVHClosestHit(ray, nodes.data(), triangles, &tmin);
+	if (hitTriangle < 0)
+		return false;
+	if (isect && (tmin < isect->t || isect->t == -1.f))
+	{
+		const Triangle& tri = triangles[hitTriangle];
+		isect->t = tmin;
+		isect->surfaceNormal = tri.getNormal(ray.origin + ray.direction * tmin);
+		isect->uv = tri.getUV(ray.origin + ray.direction * tmin);
+		isect->materialId = tri.materialid;
+		isect->lightId = tri.lightid;
+	}
+	return true;
+}
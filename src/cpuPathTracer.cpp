@@ -0,0 +1,172 @@
+#include "cpuPathTracer.h"
+#include "interactions.h"
+#include "light.h"
+#include "wavefront.h"
+#include <algorithm>
+#include <cmath>
+
+CpuPathTracer::CpuPathTracer(Scene* scene, int nThreads, SamplerType samplerType, float adaptiveThreshold) : scene(scene), pool(nThreads)
+{
+	accel = scene->hostAccel();
+	envMap = scene->envMap != NULL ? scene->envMap->view() : EnvMap();
+	numLights = envMap.valid() ? scene->lights.size() + 1 : scene->lights.size();
+	lightSampler = scene->lightBVH.hostView();
+
+	const Camera& cam = scene->state.camera;
+	sampler = makeSampler(samplerType, scene->state.iterations, cam.resolution.x);
+	if (adaptiveThreshold < 0.0f)
+		adaptiveThreshold = scene->state.adaptiveThreshold;
+	adaptive = makeAdaptiveSampling(adaptiveThreshold, scene->state.iterations, cam.resolution.x, cam.resolution.y);
+	if (adaptive.enabled())
+	{
+		scene->state.sampleCounts.resize(cam.resolution.x * cam.resolution.y);
+		adaptive = adaptiveStorage.view(adaptive, scene->state.sampleCounts);
+		pixelWantsSample.resize(cam.resolution.x * cam.resolution.y);
+		sampler.pixelSamples = adaptive.samples;
+	}
+	pathStorage.resize(cam.resolution.x * cam.resolution.y);
+	paths = pathStorage.view();
+	tilesX = (cam.resolution.x + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+	tilesY = (cam.resolution.y + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+
+	scratch.resize(pool.size());
+	for (TileScratch& tileScratch : scratch)
+	{
+		tileScratch.active.resize(CPU_TILE_SIZE * CPU_TILE_SIZE);
+		tileScratch.intersections.resize(CPU_TILE_SIZE * CPU_TILE_SIZE);
+	}
+}
+
+int CpuPathTracer::pathtrace(int iter)
+{
+	for (TileScratch& tileScratch : scratch)
+		tileScratch.samples = 0;
+	// a pixel looks at its neighbours' statistics, which the tiles update, so every pixel decides first
+	if (adaptive.enabled())
+	{
+		pool.parallelFor(pixelWantsSample.size(), 4096, [&](int64_t p0, int64_t p1, int threadIndex) {
+			for (int64_t p = p0; p < p1; ++p)
+				pixelWantsSample[p] = adaptive.wantsSample(p);
+		});
+	}
+	pool.parallelFor(tilesX * tilesY, 1, [&](int64_t t0, int64_t t1, int threadIndex) {
+		for (int64_t t = t0; t < t1; ++t)
+			traceTile(t, iter, threadIndex);
+	});
+	int samples = 0;
+	for (const TileScratch& tileScratch : scratch)
+		samples += tileScratch.samples;
+	return samples;
+}
+
+void CpuPathTracer::traceTile(int tile, int iter, int threadIndex)
+{
+	RenderState& state = scene->state;
+	const Camera& cam = state.camera;
+	const Material* materials = scene->materials.data();
+	Light* lights = scene->lights.data();
+	int* active = scratch[threadIndex].active.data();
+	ShadeableIntersection* intersections = scratch[threadIndex].intersections.data();
+
+	const int x0 = (tile % tilesX) * CPU_TILE_SIZE;
+	const int y0 = (tile / tilesX) * CPU_TILE_SIZE;
+	const int x1 = std::min(x0 + CPU_TILE_SIZE, cam.resolution.x);
+	const int y1 = std::min(y0 + CPU_TILE_SIZE, cam.resolution.y);
+
+	// generateRayFromCamera
+	int nActive = 0;
+	for (int y = y0; y < y1; ++y)
+	{
+		for (int x = x0; x < x1; ++x)
+		{
+			int slot = x + y * cam.resolution.x;
+			if (adaptive.enabled() && !pixelWantsSample[slot])
+			{
+				paths.remainingBounces[slot] = PIXEL_SKIPPED;
+				continue;
+			}
+			PathSampler rng(sampler, slot, iter - 1, 0, SAMPLE_CAMERA);
+			paths.initPath(slot, cameraRay(cam, x, y, rng), state.traceDepth);
+			active[nActive++] = slot;
+		}
+	}
+	scratch[threadIndex].samples += nActive;
+
+	int depth = 0;
+	while (nActive > 0 && depth < state.traceDepth)
+	{
+		depth++;
+
+		// computeIntersections
+		for (int i = 0; i < nActive; ++i)
+		{
+			int slot = active[i];
+			ShadeableIntersection& intersection = intersections[i];
+			intersection = ShadeableIntersection();
+			intersection.hitBVH = 0;
+			Ray ray = paths.loadRay(slot);
+			intersection.directLightPmf = 0.0f;
+			if (!SceneIntersect(ray, accel, &intersection) || intersection.t <= 0.0f)
+			{
+				intersection.t = -1.0f;
+				continue;
+			}
+			PathSampler rng(sampler, slot, iter - 1, depth, SAMPLE_LIGHT_PICK);
+			intersection.directLightId = lightSampler.sample(getPointOnRay(ray, intersection.t),
+				thrust::uniform_real_distribution<float>(0, 1)(rng), intersection.directLightPmf);
+		}
+
+		// shadeMaterialNaive
+		for (int i = 0; i < nActive; ++i)
+		{
+			const ShadeableIntersection& intersection = intersections[i];
+			int slot = active[i];
+			PathSegment pathSegment = paths.load(slot);
+			if (intersection.t > 0.0f)
+			{
+				PathSampler rng(sampler, slot, iter - 1, depth, SAMPLE_BSDF);
+				const Material& material = materials[intersection.materialId];
+				if (material.emittance > 0.0f)
+				{
+					pathSegment.remainingBounces = 0;
+					float weight = emitterMISWeight(pathSegment.ray, intersection, pathSegment.bsdfPdf, lightSampler, lights);
+					pathSegment.accumLight += pathSegment.throughput * material.color * material.emittance * weight;
+				}
+				else
+				{
+					MIS(pathSegment, intersection, getPointOnRay(pathSegment.ray, intersection.t), material, rng, numLights, accel, lights, envMap,
+						depth, depth == 1);
+				}
+			}
+			else
+			{
+				pathSegment.accumLight += pathSegment.throughput * getEscapedRadiance(pathSegment.ray, pathSegment.bsdfPdf, lightSampler, envMap);
+				pathSegment.remainingBounces = 0;
+			}
+			paths.store(slot, pathSegment);
+		}
+
+		nActive = std::remove_if(active, active + nActive, PathTerminated{ paths }) - active;
+	}
+
+	// finalGather, every pixel of the tile belongs to this thread
+	for (int y = y0; y < y1; ++y)
+	{
+		for (int x = x0; x < x1; ++x)
+		{
+			int slot = x + y * cam.resolution.x;
+			if (adaptive.enabled())
+			{
+				if (paths.remainingBounces[slot] != PIXEL_SKIPPED)
+					adaptive.addSample(slot, paths.accumLight[slot], paths.albedo[slot], paths.normal[slot]);
+				adaptive.resolve(slot, iter, state.image.data(), state.albedo.data(), state.normal.data());
+				continue;
+			}
+			glm::vec3 col = paths.accumLight[slot];
+			if (std::isfinite(col.x) && std::isfinite(col.y) && std::isfinite(col.z))
+				state.image[slot] += col;
+			state.albedo[slot] += paths.albedo[slot];
+			state.normal[slot] += paths.normal[slot];
+		}
+	}
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include "scene.h"
+#include "adaptiveSampling.h"
+#include "pathState.h"
+#include "sampler.h"
+#include "texture.h"
+#include "threadPool.h"
+
+// Host backend for the whole of pathtrace(): camera rays, SceneIntersect, the light BVH, MIS with
+// the Disney BSDFs, the lights and the environment map, then finalGather, through the same __host__
+// __device__ code the kernels run. The image is cut into CPU_TILE_SIZE tiles that are the work
+// items of the ThreadPool, so threads that run out of tiles steal them from the others. Each tile
+// runs the bounces as its own small wavefront (intersect, shade, compact) over the PathState slots
+// of its pixels. Random numbers are dimensions of the pixel's sample rather than of an active path
+// index, so the image doesn't depend on the thread count; it matches the device image statistically.
+// With adaptive sampling the pixels that have converged are left out of a tile's wavefront.
+class CpuPathTracer
+{
+public:
+	// scene has to be built with createBVH(false), nThreads <= 0 uses every hardware thread,
+	// adaptiveThreshold 0 gives every pixel a sample each iteration, < 0 takes the scene's
+	CpuPathTracer(Scene* scene, int nThreads = 0, SamplerType samplerType = SAMPLER, float adaptiveThreshold = -1.0f);
+
+	// traces one sample for each pixel that wants one and adds it to the scene's image, albedo and
+	// normal, returns how many pixels took a sample
+	int pathtrace(int iter);
+
+	int threadCount() const { return pool.size(); }
+
+private:
+	void traceTile(int tile, int iter, int threadIndex);
+
+	// active slots and their intersections for the tile a thread is on
+	struct TileScratch
+	{
+		std::vector<int> active;
+		std::vector<ShadeableIntersection> intersections;
+		int samples = 0; // pixels that took a sample this iteration
+	};
+
+	Scene* scene;
+	ThreadPool pool;
+	SceneAccel accel;
+	EnvMap envMap;
+	int numLights; // scene lights plus the environment map, as the shading kernels count them
+	LightSampler lightSampler; // host view of the scene's light BVH
+	Sampler sampler; // sized for the scene's iterations
+	AdaptiveSampling adaptive;
+	HostAdaptiveSampling adaptiveStorage;
+	std::vector<uint8_t> pixelWantsSample; // this iteration's AdaptiveSampling::wantsSample of every pixel
+	HostPathState pathStorage;
+	PathState paths;
+	int tilesX;
+	int tilesY;
+	std::vector<TileScratch> scratch; // one per thread
+};
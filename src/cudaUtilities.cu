@@ -1,7 +1,7 @@
 #pragma once
 #include "cudaUtilities.h"
 
-Triangle* dev_triangles = NULL;
+TriangleHit* dev_triangleHits = NULL;
 Geom * dev_geoms = NULL;
 int dev_numGeoms = 2;
 Material* dev_materials = NULL;
@@ -20,11 +20,11 @@ void checkCUDAError(const char* msg)
 }
 
 
-void initSceneCuda(Geom* geoms, Material* materials, Triangle* triangles, Light* lights, int numGeoms, int numMaterials, int numTriangles, int numLights)
+void initSceneCuda(Geom* geoms, Material* materials, TriangleHit* triangleHits, Light* lights, int numGeoms, int numMaterials, int numTriangles, int numLights)
 {
 	cudaMalloc(&dev_geoms, numGeoms * sizeof(Geom));
 	cudaMalloc(&dev_materials, numMaterials * sizeof(Material));
-	cudaMalloc(&dev_triangles, numTriangles * sizeof(Triangle));
+	cudaMalloc(&dev_triangleHits, numTriangles * sizeof(TriangleHit));
 	cudaMalloc(&dev_lights, numLights * sizeof(Light));
 	//cudaMalloc(&dev_triTransforms, numTriangles * sizeof(int));
 	checkCUDAError("initSceneCuda");
@@ -32,7 +32,7 @@ void initSceneCuda(Geom* geoms, Material* materials, Triangle* triangles, Light*
 	dev_numGeoms = numGeoms;
 	cudaMemcpy(dev_geoms, geoms, numGeoms * sizeof(Geom), cudaMemcpyHostToDevice);
 	cudaMemcpy(dev_materials, materials, numMaterials * sizeof(Material), cudaMemcpyHostToDevice);
-	cudaMemcpy(dev_triangles, triangles, numTriangles * sizeof(Triangle), cudaMemcpyHostToDevice);
+	uploadTriangleRange(triangleHits, 0, numTriangles - 1);
 	cudaMemcpy(dev_lights, lights, numLights * sizeof(Light), cudaMemcpyHostToDevice);
 
 	// print dev_lights info
@@ -99,11 +99,18 @@ void initSceneCuda(Geom* geoms, Material* materials, Triangle* triangles, Light*
 //}
 
 
+void uploadTriangleRange(const TriangleHit* triangleHits, int first, int last)
+{
+	if (last < first)
+		return;
+	cudaMemcpy(dev_triangleHits + first, triangleHits + first, (last - first + 1) * sizeof(TriangleHit), cudaMemcpyHostToDevice);
+}
+
 void freeSceneCuda()
 {
 	cudaFree(dev_geoms);
 	cudaFree(dev_materials);
-	cudaFree(dev_triangles);
+	cudaFree(dev_triangleHits);
 }
 
 void printGeoms()
@@ -2,14 +2,16 @@
 #include "utilities.h"
 #include "sceneStructs.h"
 
-extern Triangle* dev_triangles;
+extern TriangleHit* dev_triangleHits;
 extern Geom* dev_geoms;
 extern int dev_numGeoms;
 extern Material* dev_materials;
 extern int* dev_triTransforms;
 extern Light* dev_lights;
 
-void initSceneCuda(Geom* geoms, Material* materials, Triangle* triangles, Light* lights, int numGeoms, int numMaterials, int numTriangles, int numLights);
+void initSceneCuda(Geom* geoms, Material* materials, TriangleHit* triangleHits, Light* lights, int numGeoms, int numMaterials, int numTriangles, int numLights);
+// copies triangleHits [first, last] into dev_triangleHits, shading data lives in the mesh pool
+void uploadTriangleRange(const TriangleHit* triangleHits, int first, int last);
 //__global__ void updateTriangleTransformIndex(Geom* dev_geoms, int* dev_triTransforms, int numGeoms);
 //__global__ void updateTriangleTransform(Geom* dev_geoms, Triangle* dev_triangles, int* dev_triTransforms, int numGeoms, int numTriangles);
 
@@ -1,28 +1,31 @@
 #pragma once
 #include "utilities.h"
+#include "sceneStructs.h"
+#include "sampler.h"
+#include <thrust/random.h>
 
-__inline__ __device__ float pow5(float x) {
+__inline__ __host__ __device__ float pow5(float x) {
 	return x * x * x * x * x;
 }
 
-__inline__ __device__ float smithG_GGX_aniso(float NdotV, float VdotX, float VdotY, float ax, float ay)
+__inline__ __host__ __device__ float smithG_GGX_aniso(float NdotV, float VdotX, float VdotY, float ax, float ay)
 {
-	return 1 / (NdotV + sqrt(Square(VdotX * ax) + Square(VdotY * ay) + Square(NdotV)));
+	return 1 / (NdotV + glm::sqrt(Square(VdotX * ax) + Square(VdotY * ay) + Square(NdotV)));
 }
 
-__inline__ __device__ glm::vec3 SchlickFresnel(const glm::vec3& F0, float cosTheta)
+__inline__ __host__ __device__ glm::vec3 SchlickFresnel(const glm::vec3& F0, float cosTheta)
 {
 	return F0 + (glm::vec3(1.0f) - F0) * pow5(1.0f - cosTheta);
 }
 
-__inline__ __device__ // Cosine-weighted hemisphere sampling implementation
-glm::vec3 cosineSampleHemisphere(thrust::default_random_engine& rng) {
+__inline__ __host__ __device__ // Cosine-weighted hemisphere sampling implementation
+glm::vec3 cosineSampleHemisphere(PathSampler& rng) {
 	glm::vec3 normal = glm::vec3(0, 0, 1);
 	thrust::uniform_real_distribution<float> u01(0, 1);
 
 	// The random generated direction is cosine weighted by sqrt the random number
-	float up = sqrt(u01(rng)); // cos(theta)
-	float over = sqrt(1 - up * up); // sin(theta)
+	float up = glm::sqrt(u01(rng)); // cos(theta)
+	float over = glm::sqrt(1 - up * up); // sin(theta)
 	float around = u01(rng) * TWO_PI;
 
 	// Find a direction that is not the normal based off of whether or not the
@@ -31,11 +34,11 @@ glm::vec3 cosineSampleHemisphere(thrust::default_random_engine& rng) {
 	// Peter Kutz.
 
 	glm::vec3 directionNotNormal;
-	if (abs(normal.x) < SQRT_OF_ONE_THIRD)
+	if (glm::abs(normal.x) < SQRT_OF_ONE_THIRD)
 	{
 		directionNotNormal = glm::vec3(1, 0, 0);
 	}
-	else if (abs(normal.y) < SQRT_OF_ONE_THIRD)
+	else if (glm::abs(normal.y) < SQRT_OF_ONE_THIRD)
 	{
 		directionNotNormal = glm::vec3(0, 1, 0);
 	}
@@ -52,17 +55,17 @@ glm::vec3 cosineSampleHemisphere(thrust::default_random_engine& rng) {
 
 	// the final direction is a combination of a linear combination of the two perpendicular directions and the normal
 	return up * normal
-		+ cos(around) * over * perpendicularDirection1
-		+ sin(around) * over * perpendicularDirection2;
+		+ glm::cos(around) * over * perpendicularDirection1
+		+ glm::sin(around) * over * perpendicularDirection2;
 }
 
 // diffuse
-__inline__ __device__ float pdf_baseDiffuse(const glm::vec3& wi)
+__inline__ __host__ __device__ float pdf_baseDiffuse(const glm::vec3& wi)
 {
 	return AbsCosTheta(wi) / PI;
 }
 
-__inline__ __device__ glm::vec3 Sample_baseDiffuse(const Material& m, const glm::vec3& wo, const glm::vec3& wh, const glm::vec3& wi)
+__inline__ __host__ __device__ glm::vec3 Sample_baseDiffuse(const Material& m, const glm::vec3& wo, const glm::vec3& wh, const glm::vec3& wi)
 {
 	glm::vec3 F0 = glm::vec3(0.5) + 2 * m.roughness * Square(glm::dot(wh, wi));
 	return m.color / PI * SchlickFresnel(F0, AbsCosTheta(wi)) * SchlickFresnel(F0, AbsCosTheta(wo)) * AbsCosTheta(wi);
@@ -70,12 +73,12 @@ __inline__ __device__ glm::vec3 Sample_baseDiffuse(const Material& m, const glm:
 
 
 // Lommel-Seeliger subsurface scattering approximation  
-__inline__ __device__ float Base_subsurface(float roughness, const glm::vec3& wi, const glm::vec3& wh)
+__inline__ __host__ __device__ float Base_subsurface(float roughness, const glm::vec3& wi, const glm::vec3& wh)
 {
 	return roughness * Square(AbsDot(wi, wh));
 }
 
-__inline__ __device__ glm::vec3 Sample_subsurface(const Material& m, const glm::vec3& wo, const glm::vec3& wh, const glm::vec3& wi)
+__inline__ __host__ __device__ glm::vec3 Sample_subsurface(const Material& m, const glm::vec3& wo, const glm::vec3& wh, const glm::vec3& wi)
 {
 	glm::vec3 F0(Base_subsurface(m.roughness, wi, wh));
 	return 1.65f * m.color / PI 
@@ -87,52 +90,52 @@ __inline__ __device__ glm::vec3 Sample_subsurface(const Material& m, const glm::
 
 
 // calculate microfacet normal
-__inline__ __device__ glm::vec3 sampleGGXVNDF(glm::vec3 Ve, float alpha_x, float alpha_y, float U1, float U2)
+__inline__ __host__ __device__ glm::vec3 sampleGGXVNDF(glm::vec3 Ve, float alpha_x, float alpha_y, float U1, float U2)
 {
 	// Section 3.2: transforming the view direction to the hemisphere configuration
 	glm::vec3 Vh = normalize(glm::vec3(alpha_x * Ve.x, alpha_y * Ve.y, Ve.z));
 	// Section 4.1: orthonormal basis (with special case if cross product is zero)
 	float lensq = Vh.x * Vh.x + Vh.y * Vh.y;
-	glm::vec3 T1 = lensq > 0 ? glm::vec3(-Vh.y, Vh.x, 0) * 1.0f/ sqrt(lensq) : glm::vec3(1, 0, 0);
+	glm::vec3 T1 = lensq > 0 ? glm::vec3(-Vh.y, Vh.x, 0) * 1.0f/ glm::sqrt(lensq) : glm::vec3(1, 0, 0);
 	glm::vec3 T2 = cross(Vh, T1);
 	// Section 4.2: parameterization of the projected area
-	float r = sqrt(U1);
+	float r = glm::sqrt(U1);
 	float phi = 2.0 * PI * U2;
-	float t1 = r * cos(phi);
-	float t2 = r * sin(phi);
+	float t1 = r * glm::cos(phi);
+	float t2 = r * glm::sin(phi);
 	float s = 0.5 * (1.0 + Vh.z);
-	t2 = (1.0 - s) * sqrt(1.0 - t1 * t1) + s * t2;
+	t2 = (1.0 - s) * glm::sqrt(1.0 - t1 * t1) + s * t2;
 	// Section 4.3: reprojection onto hemisphere
-	glm::vec3 Nh = t1 * T1 + t2 * T2 + sqrt(glm::max(0.0f, 1.0f - t1 * t1 - t2 * t2)) * Vh;
+	glm::vec3 Nh = t1 * T1 + t2 * T2 + glm::sqrt(glm::max(0.0f, 1.0f - t1 * t1 - t2 * t2)) * Vh;
 	// Section 3.4: transforming the normal back to the ellipsoid configuration
 	glm::vec3 Ne = normalize(glm::vec3(alpha_x * Nh.x, alpha_y * Nh.y, glm::max(0.0f, Nh.z)));
 	return Ne;
 }
 
-__inline__ __device__ float GGX_Distribution(const glm::vec3& wh, float ax, float ay)
+__inline__ __host__ __device__ float GGX_Distribution(const glm::vec3& wh, float ax, float ay)
 {
 	
 	return 1.0f / (PI * ax * ay * Square(Square(wh.x / ax) + Square(wh.y / ay) + Square(wh.z)));
 }
 
-__inline__ __device__ float GGX_Smith(float ax, float ay, const glm::vec3& wl)
+__inline__ __host__ __device__ float GGX_Smith(float ax, float ay, const glm::vec3& wl)
 {
-	float a2 = (sqrt((1.0f + (Square(wl.x * ax) + Square(wl.y * ay)) / Square(wl.z)) + 1.0f) - 1.0f) / 2.0f;
+	float a2 = (glm::sqrt((1.0f + (Square(wl.x * ax) + Square(wl.y * ay)) / Square(wl.z)) + 1.0f) - 1.0f) / 2.0f;
 	return 1.0f / (1.0f + a2);
 }
 
-__inline__ __device__ float GGX_Geometry(const glm::vec3& wo, const glm::vec3& wi, float ax, float ay)
+__inline__ __host__ __device__ float GGX_Geometry(const glm::vec3& wo, const glm::vec3& wi, float ax, float ay)
 {
 	return smithG_GGX_aniso(wi.z, wi.x, wi.y, ax, ay) * smithG_GGX_aniso(wo.z, wo.x, wo.y, ax, ay);
 }
 
 // microfacet reflection pdf
-__inline__ __device__ float pdf_microfacet(float D, float G, const glm::vec3 & wi, const glm::vec3& h)
+__inline__ __host__ __device__ float pdf_microfacet(float D, float G, const glm::vec3 & wi, const glm::vec3& h)
 {
 	return D * G / (4 * AbsDot(wi, h));
 }
 
-__inline__ __device__ void axay(float roughness, float anisotropic, float& ax, float& ay)
+__inline__ __host__ __device__ void axay(float roughness, float anisotropic, float& ax, float& ay)
 {
 	float roughnessSquared = roughness * roughness;
 
@@ -145,8 +148,8 @@ __inline__ __device__ void axay(float roughness, float anisotropic, float& ax, f
 
 
 // integrate the BRDF
-__inline__ __device__ glm::vec3 Sample_disneyBSDF(const Material& m, const glm::vec3& woW, const glm::vec2& xi, glm::vec3& wi, const glm::mat3& ltw, const glm::mat3& wtl, float& pdf,
-	thrust::default_random_engine& rng)
+__inline__ __host__ __device__ glm::vec3 Sample_disneyBSDF(const Material& m, const glm::vec3& woW, const glm::vec2& xi, glm::vec3& wi, const glm::mat3& ltw, const glm::mat3& wtl, float& pdf,
+	PathSampler& rng)
 {
 	glm::vec3 n = glm::vec3(0, 0, 1);
 	glm::vec3 wo = normalize(wtl * woW);
@@ -181,7 +184,7 @@ __inline__ __device__ glm::vec3 Sample_disneyBSDF(const Material& m, const glm::
 
 // btdf
 
-__inline__ __device__ bool Refract(const glm::vec3 wi, float eta, glm::vec3& wt) {
+__inline__ __host__ __device__ bool Refract(const glm::vec3 wi, float eta, glm::vec3& wt) {
 	// Compute cos theta using Snell's law
 	float cosThetaI = glm::dot(wi, glm::vec3(0, 0, 1));
 	float sin2ThetaI = glm::max(float(0), float(1 - cosThetaI * cosThetaI));
@@ -189,26 +192,26 @@ __inline__ __device__ bool Refract(const glm::vec3 wi, float eta, glm::vec3& wt)
 
 	// Handle total internal reflection for transmission
 	if (sin2ThetaT >= 1) return false;
-	float cosThetaT = sqrt(1 - sin2ThetaT);
+	float cosThetaT = glm::sqrt(1 - sin2ThetaT);
 	glm::vec3 normal = cosThetaI > 0 ? glm::vec3(0, 0, 1) : glm::vec3(0, 0, -1);
 	wt = eta * -wi + (eta * cosThetaI - cosThetaT)* normal;
 	return true;
 }
 
 
-__inline__ __device__ glm::vec3 Sample_f_specular_trans(const Material& m, const glm::vec3& wi, bool refract)
+__inline__ __host__ __device__ glm::vec3 Sample_f_specular_trans(const Material& m, const glm::vec3& wi, bool refract)
 {
 	return refract ? m.color / AbsCosTheta(wi) : glm::vec3(0.0f);
 }
 
 
-__inline__ __device__ glm::vec3 Sample_f_specular_refl(const Material& m, const glm::vec3 wi)
+__inline__ __host__ __device__ glm::vec3 Sample_f_specular_refl(const Material& m, const glm::vec3 wi)
 {
 	return m.color / AbsCosTheta(wi);
 }
 
 
-__inline__ __device__ glm::vec3 FresnelDielectricEval(float ior, float cosThetaI) {
+__inline__ __host__ __device__ glm::vec3 FresnelDielectricEval(float ior, float cosThetaI) {
 	// We will hard-code the indices of refraction to be
 	// those of glass
 	float etaI = 1.;
@@ -221,16 +224,16 @@ __inline__ __device__ glm::vec3 FresnelDielectricEval(float ior, float cosThetaI
 		float t = etaI;
 		etaI = etaT;
 		etaT = t;
-		cosThetaI = abs(cosThetaI);
+		cosThetaI = glm::abs(cosThetaI);
 	}
 
 	// compute cosThetaT
-	float sinThetaI = sqrt(glm::max(0.f, 1.f - cosThetaI * cosThetaI));
+	float sinThetaI = glm::sqrt(glm::max(0.f, 1.f - cosThetaI * cosThetaI));
 	float sinThetaT = etaI / etaT * sinThetaI;
 	if (sinThetaT >= 1)
 		return glm::vec3(1.);
 
-	float cosThetaT = sqrt(glm::max(0.f, 1.f - sinThetaT * sinThetaT));
+	float cosThetaT = glm::sqrt(glm::max(0.f, 1.f - sinThetaT * sinThetaT));
 
 	// compute reflectance
 	float Rparl = ((etaT * cosThetaI) - (etaI * cosThetaT)) /
@@ -241,7 +244,7 @@ __inline__ __device__ glm::vec3 FresnelDielectricEval(float ior, float cosThetaI
 }
 
 
-__inline__ __device__ glm::vec3 Sample_btdf(const Material& m, const glm::vec3& wo, const glm::vec3& wi, float& pdf, const bool refract, const bool reflect)
+__inline__ __host__ __device__ glm::vec3 Sample_btdf(const Material& m, const glm::vec3& wo, const glm::vec3& wi, float& pdf, const bool refract, const bool reflect)
 {
 
 	if (reflect)
@@ -267,14 +270,14 @@ __inline__ __device__ glm::vec3 Sample_btdf(const Material& m, const glm::vec3&
 
 
 // Disney BRDF
-__inline__ __device__ float SchlickFresnel(float u)
+__inline__ __host__ __device__ float SchlickFresnel(float u)
 {
 	float m = Clamp(1.f - u, 0.f, 1.f);
 	float m2 = m * m;
 	return m2 * m2 * m; // pow(m,5)
 }
 
-__inline__ __device__ float GTR1(float NdotH, float a)
+__inline__ __host__ __device__ float GTR1(float NdotH, float a)
 {
 	if (a >= 1) return 1 / PI;
 	float a2 = a * a;
@@ -282,33 +285,33 @@ __inline__ __device__ float GTR1(float NdotH, float a)
 	return (a2 - 1) / (PI * log(a2) * t);
 }
 
-__inline__ __device__ float GTR2(float NdotH, float a)
+__inline__ __host__ __device__ float GTR2(float NdotH, float a)
 {
 	float a2 = a * a;
 	float t = 1 + (a2 - 1) * NdotH * NdotH;
 	return a2 / (PI * t * t);
 }
 
-__inline__ __device__ float GTR2_aniso(float NdotH, float HdotX, float HdotY, float ax, float ay)
+__inline__ __host__ __device__ float GTR2_aniso(float NdotH, float HdotX, float HdotY, float ax, float ay)
 {
 	return 1 / (PI * ax * ay * Square(Square(HdotX / ax) + Square(HdotY / ay) + NdotH * NdotH));
 }
 
-__inline__ __device__ float smithG_GGX(float NdotV, float alphaG)
+__inline__ __host__ __device__ float smithG_GGX(float NdotV, float alphaG)
 {
 	float a = alphaG * alphaG;
 	float b = NdotV * NdotV;
-	return 1 / (NdotV + sqrt(a + b - a * b));
+	return 1 / (NdotV + glm::sqrt(a + b - a * b));
 }
 
 
 
-__inline__ __device__ glm::vec3 mon2lin(const glm::vec3& x)
+__inline__ __host__ __device__ glm::vec3 mon2lin(const glm::vec3& x)
 {
 	return glm::vec3(pow(x[0], 2.2), pow(x[1], 2.2), pow(x[2], 2.2));
 }
 
-__inline__ __device__ glm::vec3 BRDF(const Material& m, const glm::vec3& L, const glm::vec3& V, const glm::vec3& N, const glm::vec3& X, const glm::vec3& Y, float& pdf)
+__inline__ __host__ __device__ glm::vec3 BRDF(const Material& m, const glm::vec3& L, const glm::vec3& V, const glm::vec3& N, const glm::vec3& X, const glm::vec3& Y, float& pdf)
 {
 	float NdotL = dot(N, L);
 	float NdotV = dot(N, V);
@@ -339,7 +342,7 @@ __inline__ __device__ glm::vec3 BRDF(const Material& m, const glm::vec3& L, cons
 	float ss = 1.25 * (Fss * (1 / (NdotL + NdotV) - .5) + .5);
 
 	// specular
-	float aspect = sqrt(1 - m.anisotropic * .9);
+	float aspect = glm::sqrt(1 - m.anisotropic * .9);
 	float ax = glm::max(.001f, Square(m.roughness) / aspect);
 	float ay = glm::max(.001f, Square(m.roughness) * aspect);
 	float Ds = GTR2_aniso(NdotH, dot(H, X), dot(H, Y), ax, ay);
@@ -377,7 +380,7 @@ __inline__ __device__ glm::vec3 BRDF(const Material& m, const glm::vec3& L, cons
 		glm::vec3 H = normalize(L + V);
 		float HdotV = dot(H, V);
 		float D = Ds; // Use the already computed Ds from your BRDF
-		pdf_specular = D * NdotH / (4.0f * abs(HdotV));
+		pdf_specular = D * NdotH / (4.0f * glm::abs(HdotV));
 
 		// Compute weights (example: based on the Fresnel terms or albedo)
 		float weight_diffuse = (1.0f - m.metallic) * (1.0f - m.specular);
@@ -399,7 +402,7 @@ __inline__ __device__ glm::vec3 BRDF(const Material& m, const glm::vec3& L, cons
 		+ Gs * Fs * Ds + .25f * m.clearcoat * Gr * Fr * Dr;
 }
 
-__inline__ __device__ glm::vec3 Sample_microfacet(const Material& m, const glm::vec3& wo, const glm::vec3& wh, const glm::vec3& wi, float& pdf)
+__inline__ __host__ __device__ glm::vec3 Sample_microfacet(const Material& m, const glm::vec3& wo, const glm::vec3& wh, const glm::vec3& wi, float& pdf)
 {
 	float ax, ay; ax = ay = 0.0f;
 	glm::vec3 F0(m.metallic);
@@ -419,57 +422,80 @@ __inline__ __device__ glm::vec3 Sample_microfacet(const Material& m, const glm::
 	return fd + D * F * G / (4 * AbsCosTheta(wi) * AbsCosTheta(wo));
 }
 
-__inline__ __device__ void BSDF_setUp(const Material& m, glm::vec3& wi, const glm::vec3& wo, thrust::default_random_engine& rng, bool& isRefract, bool& isReflect)
+// The BSDF of each MaterialType on its own, so a shading routine specialized on the type only
+// compiles that material's code. BSDF_setUp and Evaluate_disneyBSDF below dispatch on m.type.
+template<MaterialType type>
+__inline__ __host__ __device__ void BSDF_setUp(const Material& m, glm::vec3& wi, const glm::vec3& wo, PathSampler& rng, bool& isRefract, bool& isReflect)
 {
 	isRefract = false;
 	isReflect = false;
-	if (m.type == MaterialType::DIFFUSE)
-	{
-		wi = glm::normalize(cosineSampleHemisphere(rng));
-	}
-	else if (m.type == MaterialType::TRANSMIT)
+	glm::vec2 xi = glm::vec2(thrust::uniform_real_distribution<float>(0, 1)(rng), thrust::uniform_real_distribution<float>(0, 1)(rng));
+	float ax, ay; ax = ay = 0.0f;
+	axay(m.roughness, m.anisotropic, ax, ay);
+	glm::vec3 wh_d = normalize(sampleGGXVNDF(wo, ax, ay, xi.x, xi.y));
+	wi = glm::normalize(reflect(-wo, wh_d));
+}
+
+template<>
+__inline__ __host__ __device__ void BSDF_setUp<MaterialType::DIFFUSE>(const Material& m, glm::vec3& wi, const glm::vec3& wo, PathSampler& rng, bool& isRefract, bool& isReflect)
+{
+	isRefract = false;
+	isReflect = false;
+	wi = glm::normalize(cosineSampleHemisphere(rng));
+}
+
+template<>
+__inline__ __host__ __device__ void BSDF_setUp<MaterialType::TRANSMIT>(const Material& m, glm::vec3& wi, const glm::vec3& wo, PathSampler& rng, bool& isRefract, bool& isReflect)
+{
+	isRefract = false;
+	isReflect = false;
+	float u01 = thrust::uniform_real_distribution<float>(0, 1)(rng);
+	if (u01 < 0.5)
 	{
-		float u01 = thrust::uniform_real_distribution<float>(0, 1)(rng);
-		if (u01 < 0.5)
-		{
-			wi = glm::reflect(-wo, glm::vec3(0, 0, 1));
-			isReflect = true;
-		}
-		else
-		{
-			float eta = glm::dot(wo, glm::vec3(0, 0, 1)) < 0 ? m.ior / 1.0f : 1.0f / m.ior;
-			isRefract = Refract(wo, eta, wi);
-		}
+		wi = glm::reflect(-wo, glm::vec3(0, 0, 1));
+		isReflect = true;
 	}
 	else
 	{
-		glm::vec2 xi = glm::vec2(thrust::uniform_real_distribution<float>(0, 1)(rng), thrust::uniform_real_distribution<float>(0, 1)(rng));
-		float ax, ay; ax = ay = 0.0f;
-		axay(m.roughness, m.anisotropic, ax, ay);
-		glm::vec3 wh_d = normalize(sampleGGXVNDF(wo, ax, ay, xi.x, xi.y));
-		wi = glm::normalize(reflect(-wo, wh_d));
+		float eta = glm::dot(wo, glm::vec3(0, 0, 1)) < 0 ? m.ior / 1.0f : 1.0f / m.ior;
+		isRefract = Refract(wo, eta, wi);
 	}
-	
-	
 }
 
-__inline__ __device__ glm::vec3 Evaluate_disneyBSDF(const Material& m, const glm::vec3& wi, const glm::vec3& wo, float& pdf, bool refract, bool reflect)
+template<MaterialType type>
+__inline__ __host__ __device__ glm::vec3 Evaluate_disneyBSDF(const Material& m, const glm::vec3& wi, const glm::vec3& wo, float& pdf, bool refract, bool reflect)
 {
-	if (m.type == MaterialType::DIFFUSE)
-	{
-		pdf = AbsCosTheta(wi) / PI;
-		return m.color / PI;
+	return BRDF(m, wi, wo, glm::vec3(0, 0, 1), glm::vec3(1, 0, 0), glm::vec3(0, 1, 0), pdf);
+}
 
-	}
-	else if (m.type == MaterialType::TRANSMIT)
-	{
+template<>
+__inline__ __host__ __device__ glm::vec3 Evaluate_disneyBSDF<MaterialType::DIFFUSE>(const Material& m, const glm::vec3& wi, const glm::vec3& wo, float& pdf, bool refract, bool reflect)
+{
+	pdf = AbsCosTheta(wi) / PI;
+	return m.color / PI;
+}
 
-		return Sample_btdf(m, wo, wi, pdf, refract, reflect);
-	}
+template<>
+__inline__ __host__ __device__ glm::vec3 Evaluate_disneyBSDF<MaterialType::TRANSMIT>(const Material& m, const glm::vec3& wi, const glm::vec3& wo, float& pdf, bool refract, bool reflect)
+{
+	return Sample_btdf(m, wo, wi, pdf, refract, reflect);
+}
+
+__inline__ __host__ __device__ void BSDF_setUp(const Material& m, glm::vec3& wi, const glm::vec3& wo, PathSampler& rng, bool& isRefract, bool& isReflect)
+{
+	if (m.type == MaterialType::DIFFUSE)
+		BSDF_setUp<MaterialType::DIFFUSE>(m, wi, wo, rng, isRefract, isReflect);
+	else if (m.type == MaterialType::TRANSMIT)
+		BSDF_setUp<MaterialType::TRANSMIT>(m, wi, wo, rng, isRefract, isReflect);
 	else
-	{
-		return BRDF(m, wi, wo, glm::vec3(0, 0, 1), glm::vec3(1, 0, 0), glm::vec3(0, 1, 0), pdf);
-	}
-	pdf = 0;
-	return glm::vec3(0.);
+		BSDF_setUp<MaterialType::MICROFACET>(m, wi, wo, rng, isRefract, isReflect);
+}
+
+__inline__ __host__ __device__ glm::vec3 Evaluate_disneyBSDF(const Material& m, const glm::vec3& wi, const glm::vec3& wo, float& pdf, bool refract, bool reflect)
+{
+	if (m.type == MaterialType::DIFFUSE)
+		return Evaluate_disneyBSDF<MaterialType::DIFFUSE>(m, wi, wo, pdf, refract, reflect);
+	else if (m.type == MaterialType::TRANSMIT)
+		return Evaluate_disneyBSDF<MaterialType::TRANSMIT>(m, wi, wo, pdf, refract, reflect);
+	return Evaluate_disneyBSDF<MaterialType::MICROFACET>(m, wi, wo, pdf, refract, reflect);
 }
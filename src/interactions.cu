@@ -5,13 +5,13 @@
 
 __host__ __device__ glm::vec3 calculateRandomDirectionInHemisphere(
     glm::vec3 normal,
-    thrust::default_random_engine &rng)
+    PathSampler &rng)
 {
     thrust::uniform_real_distribution<float> u01(0, 1);
 
 	// The random generated direction is cosine weighted by sqrt the random number
-    float up = sqrt(u01(rng)); // cos(theta)
-    float over = sqrt(1 - up * up); // sin(theta)
+    float up = glm::sqrt(u01(rng)); // cos(theta)
+    float over = glm::sqrt(1 - up * up); // sin(theta)
     float around = u01(rng) * TWO_PI;
 
     // Find a direction that is not the normal based off of whether or not the
@@ -20,11 +20,11 @@ __host__ __device__ glm::vec3 calculateRandomDirectionInHemisphere(
     // Peter Kutz.
 
     glm::vec3 directionNotNormal;
-    if (abs(normal.x) < SQRT_OF_ONE_THIRD)
+    if (glm::abs(normal.x) < SQRT_OF_ONE_THIRD)
     {
         directionNotNormal = glm::vec3(1, 0, 0);
     }
-    else if (abs(normal.y) < SQRT_OF_ONE_THIRD)
+    else if (glm::abs(normal.y) < SQRT_OF_ONE_THIRD)
     {
         directionNotNormal = glm::vec3(0, 1, 0);
     }
@@ -41,23 +41,22 @@ __host__ __device__ glm::vec3 calculateRandomDirectionInHemisphere(
 
 	// the final direction is a combination of a linear combination of the two perpendicular directions and the normal
     return up * normal
-        + cos(around) * over * perpendicularDirection1
-        + sin(around) * over * perpendicularDirection2;
+        + glm::cos(around) * over * perpendicularDirection1
+        + glm::sin(around) * over * perpendicularDirection2;
 }
 
 
 
-__device__ void scatterRay(
+__host__ __device__ void scatterRay(
     PathSegment& pathSegment,
 	const ShadeableIntersection& intersection,
     const glm::vec3& intersect,
     const Material &m,
-    thrust::default_random_engine &rng,
+    PathSampler &rng,
     int num_lights,
-    LinearBVHNode* dev_nodes,
-    Triangle* dev_triangles,
+    const SceneAccel& accel,
     Light* dev_lights,
-    cudaTextureObject_t envMap)
+    const EnvMap& envMap)
 {
     glm::vec3 wi = calculateRandomDirectionInHemisphere(intersection.surfaceNormal, rng);
 	float pdf = 0.f;
@@ -83,17 +82,17 @@ __device__ void scatterRay(
     pathSegment.throughput *= bsdf;
 }
 
-__device__ void MIS(
+template<MaterialType type>
+__host__ __device__ void MIS(
     PathSegment& pathSegment,
     const ShadeableIntersection& intersection,
     const glm::vec3& intersect,
     const Material& m,
-    thrust::default_random_engine& rng,
+    PathSampler& rng,
     int num_lights,
-    LinearBVHNode* dev_nodes,
-    Triangle* dev_triangles,
+    const SceneAccel& accel,
     Light* dev_lights,
-    cudaTextureObject_t envMap,
+    const EnvMap& envMap,
     int depth,
     bool firstBounce)
 {
@@ -110,7 +109,6 @@ __device__ void MIS(
 
     //normal = glm::dot(normal, wo) > 0 ? normal : -normal;
     // disney bsdf
-    glm::vec2 xi = glm::vec2(u01(rng), u01(rng));
     glm::mat3 ltw = LocalToWorld(normal);
     glm::mat3 wtl = glm::transpose(ltw);
 
@@ -119,9 +117,10 @@ __device__ void MIS(
 
 	glm::vec3 wol(wtl * wo);
     bool isRefract(false), isReflect(false), isInternal(glm::dot(normal, wo) < 0);
-	BSDF_setUp(m, wi_disney, wol, rng, isRefract, isReflect);
+    rng.startDimension(depth, SAMPLE_BSDF);
+	BSDF_setUp<type>(m, wi_disney, wol, rng, isRefract, isReflect);
 
-    glm::vec3 Li_disney = Evaluate_disneyBSDF(m, wi_disney, wol, pdf_disney, isRefract, isReflect);
+    glm::vec3 Li_disney = Evaluate_disneyBSDF<type>(m, wi_disney, wol, pdf_disney, isRefract, isReflect);
 
 
 	if (pdf_disney <= 1e-6) {
@@ -130,28 +129,32 @@ __device__ void MIS(
 	}
     
 
-    glm::vec3 currAccum = pathSegment.accumLight;
-
-    if (num_lights > 0)
+    if (intersection.directLightPmf > 0.f)
     {
         // direct lighting
-        int light_id = 0;
+        int light_id = intersection.directLightId;
         float pdf_direct = 0.f;
         glm::vec3 wi_direct = glm::vec3(0.f);
-        glm::vec3 Li_direct = Sample_Li(intersect, normal, wi_direct, pdf_direct, intersection.directLightId, num_lights, envMap, rng, dev_nodes, dev_triangles, dev_lights, ltw, wtl);
+        rng.startDimension(depth, SAMPLE_LIGHT);
+        glm::vec3 Li_direct = Sample_Li(intersect, normal, wi_direct, pdf_direct, light_id, intersection.directLightPmf, num_lights, envMap, rng, accel, dev_lights, ltw, wtl);
 
         //MIS
         float pdf_disney_for_direct = 0;
         float pdf_direct_for_disney = 0;
         glm::vec3 bsdf_direct = glm::vec3(0.f);
-        bsdf_direct = Evaluate_disneyBSDF(m, wtl * wi_direct, wol, pdf_disney_for_direct, false, false);
+        bsdf_direct = Evaluate_disneyBSDF<type>(m, wtl * wi_direct, wol, pdf_disney_for_direct, false, false);
 
-        float weight_direct = PowerHeuristic(1, pdf_direct, 1, pdf_disney_for_direct);
+        // the light pdf includes picking the light, as getEscapedRadiance and emitterMISWeight weigh the bsdf samples,
+        // point and directional lights can't be hit by them
+        bool deltaLight = !(envMap.valid() && light_id == num_lights - 1) &&
+            (dev_lights[light_id].lightType == POINTLIGHT || dev_lights[light_id].lightType == DIRECTIONALLIGHT);
+        float weight_direct = deltaLight ? 1.f : PowerHeuristic(1, pdf_direct * intersection.directLightPmf, 1, pdf_disney_for_direct);
 
         if (pdf_direct > 1e-6f)
         {
             glm::vec3 radiance = pathSegment.throughput * Li_direct * AbsDot(wi_direct, normal) / pdf_direct * weight_direct * bsdf_direct;
-            currAccum += radiance.x < 0 || radiance.y < 0 || radiance.z < 0 ? glm::vec3(0) : radiance;
+            radiance = radiance.x < 0 || radiance.y < 0 || radiance.z < 0 ? glm::vec3(0) : radiance;
+            pathSegment.accumLight += radiance;
         }
 
         //pathSegment.accumLight += bsdf_direct * AbsDot(wi_direct, normal) / pdf_disney_for_direct;
@@ -159,6 +162,8 @@ __device__ void MIS(
     }
 
     pathSegment.remainingBounces--;
+    // what delta lobes hit can't be light sampled, and without a light sample here nothing is weighted
+    pathSegment.bsdfPdf = type != MaterialType::TRANSMIT && intersection.directLightPmf > 0.f ? pdf_disney : 0.0f;
     glm::vec3 offset = normal * (isInternal ? 1e-3f : -(1e-3f));
     //pathSegment.accumLight = currAccum;
     
@@ -171,12 +176,44 @@ __device__ void MIS(
         pathSegment.normal = (normal + 1.0f) / 2.0f;
 		pathSegment.albedo = pathSegment.throughput;
     }
-    // russian roulette
-    float isSurvive = u01(rng);
-    if (isSurvive > glm::max(0.1f, 1.f - dot(currAccum, { 0.2126, 0.7152, 0.0722 }) / 0.8f))
+    // russian roulette on the throughput, survivors carry the light of the paths it ends and stay at
+    // most 1, so a path that goes on never makes a firefly of what it finds later
+    float pSurvive = glm::min(1.f, glm::max(pathSegment.throughput.x, glm::max(pathSegment.throughput.y, pathSegment.throughput.z)));
+    rng.startDimension(depth, SAMPLE_ROULETTE);
+    if (u01(rng) >= pSurvive)
     {
         pathSegment.remainingBounces = 0;
         return;
     }
+    pathSegment.throughput /= pSurvive;
+
+}
+
+// instantiated here for the queue kernels in pathtrace.cu
+template __host__ __device__ void MIS<MaterialType::DIFFUSE>(PathSegment&, const ShadeableIntersection&, const glm::vec3&, const Material&, PathSampler&,
+    int, const SceneAccel&, Light*, const EnvMap&, int, bool);
+template __host__ __device__ void MIS<MaterialType::MICROFACET>(PathSegment&, const ShadeableIntersection&, const glm::vec3&, const Material&, PathSampler&,
+    int, const SceneAccel&, Light*, const EnvMap&, int, bool);
+template __host__ __device__ void MIS<MaterialType::TRANSMIT>(PathSegment&, const ShadeableIntersection&, const glm::vec3&, const Material&, PathSampler&,
+    int, const SceneAccel&, Light*, const EnvMap&, int, bool);
 
-}
\ No newline at end of file
+__host__ __device__ void MIS(
+    PathSegment& pathSegment,
+    const ShadeableIntersection& intersection,
+    const glm::vec3& intersect,
+    const Material& m,
+    PathSampler& rng,
+    int num_lights,
+    const SceneAccel& accel,
+    Light* dev_lights,
+    const EnvMap& envMap,
+    int depth,
+    bool firstBounce)
+{
+    if (m.type == MaterialType::DIFFUSE)
+        MIS<MaterialType::DIFFUSE>(pathSegment, intersection, intersect, m, rng, num_lights, accel, dev_lights, envMap, depth, firstBounce);
+    else if (m.type == MaterialType::TRANSMIT)
+        MIS<MaterialType::TRANSMIT>(pathSegment, intersection, intersect, m, rng, num_lights, accel, dev_lights, envMap, depth, firstBounce);
+    else
+        MIS<MaterialType::MICROFACET>(pathSegment, intersection, intersect, m, rng, num_lights, accel, dev_lights, envMap, depth, firstBounce);
+}
@@ -4,8 +4,10 @@
 #include <glm/glm.hpp>
 #include <thrust/random.h>
 #include "PTDirectives.h"
+#include "sampler.h"
 #include "utilities.h"
-#include "bvh.h"
+#include "bvhInstance.h"
+#include "texture.h"
 
 // CHECKITOUT
 /**
@@ -14,7 +16,7 @@
  */
 __host__ __device__ glm::vec3 calculateRandomDirectionInHemisphere(
     glm::vec3 normal, 
-    thrust::default_random_engine& rng);
+    PathSampler& rng);
 
 /**
  * Scatter a ray with some probabilities according to the material properties.
@@ -41,29 +43,42 @@ __host__ __device__ glm::vec3 calculateRandomDirectionInHemisphere(
  *
  * You may need to change the parameter list for your purposes!
  */
-__device__ void scatterRay(
+__host__ __device__ void scatterRay(
     PathSegment& pathSegment,
     const ShadeableIntersection& intersection,
     const glm::vec3& intersect,
     const Material& m,
-    thrust::default_random_engine& rng,
+    PathSampler& rng,
     int num_lights,
-    LinearBVHNode* dev_nodes,
-    Triangle* dev_triangles,
+    const SceneAccel& accel,
     Light* dev_lights,
-    cudaTextureObject_t envMap);
+    const EnvMap& envMap);
 
 
-__device__ void MIS(
+__host__ __device__ void MIS(
     PathSegment& pathSegment,
     const ShadeableIntersection& intersection,
     const glm::vec3& intersect,
     const Material& m,
-    thrust::default_random_engine& rng,
+    PathSampler& rng,
     int num_lights,
-    LinearBVHNode* dev_nodes,
-    Triangle* dev_triangles,
+    const SceneAccel& accel,
     Light* dev_lights,
-    cudaTextureObject_t envMap,
+    const EnvMap& envMap,
     int depth,
-    bool firstBounce);
\ No newline at end of file
+    bool firstBounce);
+
+// MIS with the BSDF of one MaterialType, for the per material shading queues
+template<MaterialType type>
+__host__ __device__ void MIS(
+    PathSegment& pathSegment,
+    const ShadeableIntersection& intersection,
+    const glm::vec3& intersect,
+    const Material& m,
+    PathSampler& rng,
+    int num_lights,
+    const SceneAccel& accel,
+    Light* dev_lights,
+    const EnvMap& envMap,
+    int depth,
+    bool firstBounce);
@@ -2,19 +2,32 @@
 #include "utilities.h"
 #include <thrust/random.h>
 #include "sceneStructs.h"
-#include "bvh.h"
+#include "bvhInstance.h"
+#include "texture.h"
+#include "lightBVH.h"
+#include "sampler.h"
 
+// normal of the light space square of an area light
+__inline__ __host__ __device__ glm::vec3 areaLightNormal(const Light& light)
+{
+	return glm::normalize(glm::cross(glm::vec3(light.transform[0]), glm::vec3(light.transform[1])));
+}
+
+// solid angle pdf of a uniform point on an area light, r away and seen at cosTheta to its normal
+__inline__ __host__ __device__ float areaLightPdf(float r, float cosTheta, const Light& light)
+{
+	return r * r / (cosTheta * light.area + 0.001f);
+}
 
-__inline__ __device__ glm::vec3 DirectSampleAreaLight(
+__inline__ __host__ __device__ glm::vec3 DirectSampleAreaLight(
 	int idx,
 	const glm::vec3& view_point,
 	const glm::vec3& view_nor,
-	int num_lights,
+	float lightPmf,
 	glm::vec3& wiW,
 	float& pdf,
-	thrust::default_random_engine& rng,
-	LinearBVHNode* dev_nodes,
-	Triangle* dev_triangles,
+	PathSampler& rng,
+	const SceneAccel& accel,
 	const Light& light)
 {
 	Ray shadowRay;
@@ -24,114 +37,154 @@ __inline__ __device__ glm::vec3 DirectSampleAreaLight(
 	glm::vec4 vpl = light.inverseTransform * glm::vec4(view_point, 1.0f);
 	glm::vec3 wi = xi - glm::vec3(vpl);
 
-	// compute cosTheta and distance
-	float cosTheta = AbsDot(glm::vec3(0, 0, 1), normalize(-wi));
+	// compute cosTheta and distance in world space, the light's scale isn't uniform
 	wiW = glm::vec3(light.transform * glm::vec4(wi, 0.));
 	float r = length(wiW);
+	wiW = normalize(wiW);
+	float cosTheta = AbsDot(areaLightNormal(light), wiW);
 
 	// compute pdf da
-	pdf = r * r / (cosTheta * light.area  + 0.001);
-	wiW = normalize(wiW);
+	pdf = areaLightPdf(r, cosTheta, light);
 
 	// check if there is block
-	ShadeableIntersection isect;
 	Ray ray{ view_point, wiW };
-	if (BVHIntersect(ray, dev_nodes, dev_triangles, &isect) && isect.lightId == idx)
+	if (light.lightType == AREALIGHT)
+	{
+		// the sample lies on the square, only a blocker before it matters
+		if (SceneOccluded(ray, accel, r * (1.f - SHADOW_RAY_EPSILON)))
+			return glm::vec3(0.0f);
+		return light.emission / lightPmf;
+	}
+	// an AreaSphere disc doesn't cover the whole sampled square, so the closest hit has to be the light itself
+	ShadeableIntersection isect;
+	if (SceneIntersect(ray, accel, &isect) && isect.lightId == idx)
 	{
 		//return glm::vec3(cosTheta);
-		return (float)num_lights * light.emission;
+		return light.emission / lightPmf;
 	}
 	return glm::vec3(0.0f, 0.f, 0.f);
 }
 
-__inline__ __device__ glm::vec3 getEnvironmentalRadiance(const glm::vec3& direction, cudaTextureObject_t envMap) {
-	float theta = acosf(direction.y);         // θ
-	float phi = atan2f(direction.z, direction.x); // φ
-	if (phi < 0) phi += 2.0f * PI;
+__inline__ __host__ __device__ glm::vec3 getEnvironmentalRadiance(const glm::vec3& direction, const EnvMap& envMap) {
+	if (!envMap.valid()) return glm::vec3(0.0f); // return black if no envMap (for debugging purposes
+	glm::vec2 uv = EnvMap::directionToUV(direction);
+	return envMap.lookup(uv.x, uv.y);
+}
+
+// solid angle pdf of Sample_Li picking direction on the environment light
+__inline__ __host__ __device__ float environmentPdf(const glm::vec3& direction, const EnvMap& envMap) {
+	return envMap.canSample() ? envMap.pdf(direction) : 1.0f / (2.0f * PI);
+}
+
+// Light a path that leaves the scene gathers. When the bounce before it also sampled a light
+// (bsdfPdf > 0) the two strategies are weighted with the power heuristic, otherwise bright texels
+// are clamped as they always were to keep fireflies out of camera rays and delta bounces.
+__inline__ __host__ __device__ glm::vec3 getEscapedRadiance(const Ray& ray, float bsdfPdf, const LightSampler& lightSampler, const EnvMap& envMap) {
+	glm::vec3 radiance = getEnvironmentalRadiance(ray.direction, envMap);
+	if (bsdfPdf > 0.0f)
+		return radiance * PowerHeuristic(1, bsdfPdf, 1, environmentPdf(ray.direction, envMap) * lightSampler.pmf(ray.origin, lightSampler.numLights));
+	float maxRadiance = glm::max(radiance.x, glm::max(radiance.y, radiance.z));
+	return radiance * (maxRadiance > 1.1f ? 1.1f / maxRadiance : 1.0f);
+}
 
-	float u = phi / (2.0f * PI);            // [0, 1]
-	float v = theta / PI;                   // [0, 1]
-	if (envMap == NULL) return glm::vec3(0.0f); // return black if no envMap (for debugging purposes
-	float4 texel = tex2D<float4>(envMap, u, v);
-	return glm::vec3(texel.x, texel.y, texel.z);
+// MIS weight of an emitter a BSDF sample from ray.origin hit, against sampling it as a light from there.
+// Emissive materials that aren't lights can only be hit.
+__inline__ __host__ __device__ float emitterMISWeight(const Ray& ray, const ShadeableIntersection& isect, float bsdfPdf,
+	const LightSampler& lightSampler, const Light* lights)
+{
+	if (bsdfPdf <= 0.0f || isect.lightId >= lightSampler.numLights)
+		return 1.0f;
+	const Light& light = lights[isect.lightId];
+	float lightPdf = areaLightPdf(isect.t, AbsDot(areaLightNormal(light), ray.direction), light);
+	return PowerHeuristic(1, bsdfPdf, 1, lightSampler.pmf(ray.origin, isect.lightId) * lightPdf);
 }
 
-__inline__ __device__ glm::vec3 Sample_Li(
+__inline__ __host__ __device__ glm::vec3 Sample_Li(
     const glm::vec3& view_point,
 	const glm::vec3& nor,
     glm::vec3& wiW,
     float& pdf,
     int randomLightIdx,
+    float lightPmf,
     int N_LIGHTS,
-    cudaTextureObject_t envMap,
-    thrust::default_random_engine& rng,
-	LinearBVHNode* dev_nodes,
-	Triangle* dev_triangles,
+    const EnvMap& envMap,
+    PathSampler& rng,
+	const SceneAccel& accel,
 	Light* dev_lights,
 	const glm::mat3& ltw,
 	const glm::mat3& wtl)
 {
-    // Choose a random light from among all of the
-    // light sources in the scene, including the environment light
+    // the light was chosen in computeIntersections with probability lightPmf,
+    // the environment light comes after the scene's lights
     int num_lights = N_LIGHTS;
-    // choose a random light
-	ShadeableIntersection isect;
-	if (envMap != NULL && randomLightIdx == num_lights - 1)
+	if (envMap.valid() && randomLightIdx == num_lights - 1)
 	{
-		// sample the environment map
-		float x = thrust::uniform_real_distribution<float>(-1.0f, 1.0f)(rng);
-		float y = thrust::uniform_real_distribution<float>(-1.0f, 1.0f)(rng);
-
-		glm::vec3 wi = glm::normalize(glm::vec3(x, y, 1.0));
-		wiW = ltw * normalize(wi);
-		pdf = 1.0f / (2.0f * PI);
-		if (BVHIntersect(Ray{ view_point, wiW }, dev_nodes, dev_triangles, &isect)) return glm::vec3(0.0f);
-		return getEnvironmentalRadiance(wiW, envMap) * (float)num_lights;
+		if (envMap.canSample())
+		{
+			// importance sample the map, directions below the surface carry no light
+			glm::vec2 xi(thrust::uniform_real_distribution<float>(0.0f, 1.0f)(rng), thrust::uniform_real_distribution<float>(0.0f, 1.0f)(rng));
+			wiW = envMap.sample(xi, pdf);
+			if (pdf <= 0.0f || glm::dot(wiW, nor) <= 0.0f) return glm::vec3(0.0f);
+		}
+		else
+		{
+			// sample the environment map
+			float x = thrust::uniform_real_distribution<float>(-1.0f, 1.0f)(rng);
+			float y = thrust::uniform_real_distribution<float>(-1.0f, 1.0f)(rng);
+
+			glm::vec3 wi = glm::normalize(glm::vec3(x, y, 1.0));
+			wiW = ltw * normalize(wi);
+			pdf = 1.0f / (2.0f * PI);
+		}
+		if (SceneOccluded(Ray{ view_point, wiW }, accel)) return glm::vec3(0.0f);
+		return getEnvironmentalRadiance(wiW, envMap) / lightPmf;
 	}
 
 	Light light = dev_lights[randomLightIdx];
 	if (light.lightType == AREALIGHT)
 	{
-		return DirectSampleAreaLight(randomLightIdx, view_point, nor, N_LIGHTS, wiW, pdf, rng, dev_nodes, dev_triangles, light);
+		return DirectSampleAreaLight(randomLightIdx, view_point, nor, lightPmf, wiW, pdf, rng, accel, light);
 	}
 	else if (light.lightType == POINTLIGHT)
 	{
 		wiW = (glm::vec3(light.transform * glm::vec4(0, 0, 0, 1)) - view_point);
-		pdf = 1.0f * Square(length(wiW));
+		float r = length(wiW);
+		pdf = 1.0f * Square(r);
 		wiW = normalize(wiW);
-		return light.emission * (float)num_lights;
+		if (SceneOccluded(Ray{ view_point, wiW }, accel, r * (1.f - SHADOW_RAY_EPSILON))) return glm::vec3(0.0f);
+		return light.emission / lightPmf;
 	}
 	else if (light.lightType == DIRECTIONALLIGHT)
 	{
-		wiW = glm::vec3(light.transform * glm::vec4(0, 0, 1, 0));
+		wiW = normalize(glm::vec3(light.transform * glm::vec4(0, 0, 1, 0)));
 		pdf = 1.0f;
-		if (BVHIntersect(Ray{ view_point, wiW }, dev_nodes, dev_triangles)) return glm::vec3(0.0f);
-		return light.emission * (float)num_lights;
+		if (SceneOccluded(Ray{ view_point, wiW }, accel)) return glm::vec3(0.0f);
+		return light.emission / lightPmf;
 	}
     // choose an area light
-	return DirectSampleAreaLight(randomLightIdx, view_point, nor, N_LIGHTS, wiW, pdf, rng, dev_nodes, dev_triangles, light);
+	return DirectSampleAreaLight(randomLightIdx, view_point, nor, lightPmf, wiW, pdf, rng, accel, light);
 }
 
-__inline__ __device__ glm::vec3 Evaluate_Li(
+__inline__ __host__ __device__ glm::vec3 Evaluate_Li(
 	const glm::vec3& wiW,
 	const glm::vec3& view_point,
 	float& pdf,
 	int randomLightIdx,
+	float lightPmf,
 	int N_LIGHTS,
-	cudaTextureObject_t envMap,
-	LinearBVHNode* dev_nodes,
-	Triangle* dev_triangles,
+	const EnvMap& envMap,
+	const SceneAccel& accel,
 	Light* dev_lights)
 {
-	if (envMap != NULL && randomLightIdx == N_LIGHTS - 1)
+	if (envMap.valid() && randomLightIdx == N_LIGHTS - 1)
 	{
-		pdf = 1.0f / (2.0f * PI);
-		return getEnvironmentalRadiance(wiW, envMap) * (float)N_LIGHTS;
+		pdf = environmentPdf(wiW, envMap);
+		return getEnvironmentalRadiance(wiW, envMap) / lightPmf;
 	}
 
 	Light light = dev_lights[randomLightIdx];
 	ShadeableIntersection isect;
-	if (!BVHIntersect(Ray{ view_point, wiW }, dev_nodes, dev_triangles, &isect) || isect.lightId == (uint8_t)(-1))
+	if (!SceneIntersect(Ray{ view_point, wiW }, accel, &isect) || isect.lightId == (uint16_t)(-1))
 	{
 		return glm::vec3(0.0f, 0.f, 0.f);
 	}
@@ -144,14 +197,13 @@ __inline__ __device__ glm::vec3 Evaluate_Li(
 
 	if (light.lightType == AREALIGHT)
 	{
-		float r = isect.t;
-		pdf = r * r / (AbsDot(isect.surfaceNormal, wiW) * light.area + 0.001);
-		return (float)N_LIGHTS * light.emission;
+		pdf = areaLightPdf(isect.t, AbsDot(areaLightNormal(light), wiW), light);
+		return light.emission / lightPmf;
 	}
 	else if (light.lightType == POINTLIGHT)
 	{
 		pdf = 1.0f * Square(length(wiW));
-		return light.emission * (float)N_LIGHTS;
+		return light.emission / lightPmf;
 	}
 	pdf = 0.f;
 	return glm::vec3(0.0f);
@@ -0,0 +1,340 @@
+#include "lightBVH.h"
+#include "cudaUtilities.h"
+#include <algorithm>
+
+LightSampler dev_lightSampler;
+
+namespace
+{
+	constexpr int LIGHT_BVH_BUCKETS = 12;
+	// past this depth nodes are split at the median light so bit trails stay within 64 bits
+	constexpr int LIGHT_BVH_MEDIAN_DEPTH = 40;
+
+	float luminance(const glm::vec3& c)
+	{
+		return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+	}
+
+	float safeAcos(float x)
+	{
+		return std::acos(glm::clamp(x, -1.0f, 1.0f));
+	}
+
+	// pbrt-v4's M_Omega, the solid angle a cone of normals can light, weighted by cosine
+	float orientationCost(float cosThetaO, float cosThetaE)
+	{
+		float thetaO = safeAcos(cosThetaO);
+		float thetaE = safeAcos(cosThetaE);
+		float thetaW = std::min(thetaO + thetaE, PI);
+		float sinThetaO = std::sqrt(std::max(0.0f, 1.0f - cosThetaO * cosThetaO));
+		return TWO_PI * (1.0f - cosThetaO) +
+			PI / 2.0f * (2.0f * thetaW * sinThetaO - std::cos(thetaO - 2.0f * thetaW) - 2.0f * thetaO * sinThetaO + cosThetaO);
+	}
+}
+
+// radiance of the environment map integrated over the sphere, the texels of a row cover sinTheta of its solid angle
+static float environmentRadiance(const EnvMap& envMap)
+{
+	double sum = 0.0;
+	for (int y = 0; y < envMap.height; ++y)
+	{
+		double row = 0.0;
+		for (int x = 0; x < envMap.width; ++x)
+			row += glm::max(luminance(envMap.texel(x, y)), 0.0f);
+		sum += row * std::sin(PI * (y + 0.5f) / envMap.height);
+	}
+	return (float)(sum * (2.0 * PI / envMap.width) * (PI / envMap.height));
+}
+
+// the smallest cone around both cones, the union of the bounds and the sum of the power
+template<typename Bounds>
+static Bounds unite(const Bounds& a, const Bounds& b)
+{
+	if (a.phi == 0.0f) return b;
+	if (b.phi == 0.0f) return a;
+	Bounds ret = a;
+	ret.bounds = AABB::Union(a.bounds, b.bounds);
+	ret.phi = a.phi + b.phi;
+	ret.cosThetaE = std::min(a.cosThetaE, b.cosThetaE);
+	ret.twoSided = a.twoSided || b.twoSided;
+
+	float thetaA = safeAcos(a.cosThetaO);
+	float thetaB = safeAcos(b.cosThetaO);
+	float thetaD = safeAcos(glm::dot(a.w, b.w));
+	if (std::min(thetaD + thetaB, PI) <= thetaA)
+		return ret;
+	if (std::min(thetaD + thetaA, PI) <= thetaB)
+	{
+		ret.w = b.w;
+		ret.cosThetaO = b.cosThetaO;
+		return ret;
+	}
+	float thetaO = (thetaA + thetaD + thetaB) / 2.0f;
+	glm::vec3 axis = glm::cross(a.w, b.w);
+	if (thetaO >= PI || glm::dot(axis, axis) < 1e-12f)
+	{
+		ret.cosThetaO = -1.0f;
+		return ret;
+	}
+	// turn a.w towards b.w by the difference, it is perpendicular to the axis
+	float thetaR = thetaO - thetaA;
+	axis = glm::normalize(axis);
+	ret.w = glm::normalize(a.w * std::cos(thetaR) + glm::cross(axis, a.w) * std::sin(thetaR));
+	ret.cosThetaO = std::cos(thetaO);
+	return ret;
+}
+
+void LightBVH::build(const std::vector<Light>& lights, const EnvMap& envMap, const AABB& sceneBounds, Strategy strategy)
+{
+	nodes.clear();
+	topBins.clear();
+	topLights.clear();
+	numLights = lights.size();
+	bitTrails.assign(numLights + 1, 0);
+	treeDepth = 0;
+
+	// bounds and power of every light with a position
+	std::vector<BuildLight> positioned;
+	AABB bounds = sceneBounds;
+	for (int i = 0; i < numLights; ++i)
+	{
+		const Light& light = lights[i];
+		if (light.lightType == DIRECTIONALLIGHT)
+			continue;
+
+		BuildLight b;
+		b.index = i;
+		b.twoSided = false;
+		if (light.lightType == POINTLIGHT)
+		{
+			glm::vec3 p(light.transform * glm::vec4(0, 0, 0, 1));
+			b.bounds = AABB::Union(AABB(), p);
+			b.w = glm::vec3(0, 0, 1);
+			b.phi = 4.0f * PI * luminance(light.emission);
+			b.cosThetaO = -1.0f;
+			b.cosThetaE = 0.0f;
+		}
+		else
+		{
+			// area lights, discs and spot lights are all sampled over the light space square [-1, 1]^2, from both sides
+			for (int corner = 0; corner < 4; ++corner)
+				b.bounds = AABB::Union(b.bounds, glm::vec3(light.transform * glm::vec4(corner & 1 ? 1 : -1, corner & 2 ? 1 : -1, 0, 1)));
+			glm::vec3 normal = glm::cross(glm::vec3(light.transform[0]), glm::vec3(light.transform[1]));
+			b.w = glm::normalize(normal);
+			b.phi = 2.0f * PI * light.area * luminance(light.emission);
+			b.cosThetaO = 1.0f;
+			b.cosThetaE = 0.0f;
+			b.twoSided = true;
+		}
+		bounds = AABB::Union(bounds, b.bounds);
+		positioned.push_back(b);
+	}
+
+	// lights at infinity send their radiance through the disc the scene's bounding sphere casts
+	glm::vec3 diagonal = bounds.min.x <= bounds.max.x ? bounds.max - bounds.min : glm::vec3(0.0f);
+	float sceneDisc = PI * 0.25f * glm::max(glm::dot(diagonal, diagonal), 1e-6f);
+	std::vector<BuildLight> buildLights;
+	std::vector<float> topWeights;
+	auto addTop = [&](int light, float power) {
+		topLights.push_back(light);
+		topWeights.push_back(strategy == Strategy::Uniform ? 1.0f : power);
+	};
+	for (int i = 0, next = 0; i < numLights; ++i)
+	{
+		if (lights[i].lightType == DIRECTIONALLIGHT)
+		{
+			addTop(i, sceneDisc * luminance(lights[i].emission));
+			continue;
+		}
+		const BuildLight& b = positioned[next++];
+		if (strategy != Strategy::BVH)
+			addTop(i, b.phi);
+		else if (b.phi > 0.0f)
+			buildLights.push_back(b);
+	}
+	if (envMap.valid())
+		addTop(numLights, sceneDisc * environmentRadiance(envMap));
+	float treePower = 0.0f;
+	for (const BuildLight& b : buildLights)
+		treePower += b.phi;
+	if (!buildLights.empty())
+		addTop(LightSampler::TREE, treePower);
+
+	topBins = buildAliasTable(topWeights);
+	if (topBins.empty())
+		topLights.clear();
+	treePmf = 0.0f;
+	for (size_t i = 0; i < topBins.size(); ++i)
+	{
+		if (topLights[i] == LightSampler::TREE)
+			treePmf = topBins[i].pmf;
+		else if (topBins[i].pmf > 0.0f)
+			bitTrails[topLights[i]] = LightSampler::TOP | i;
+	}
+	if (treePmf > 0.0f)
+	{
+		nodes.reserve(2 * buildLights.size() - 1);
+		buildNode(buildLights, 0, buildLights.size(), 0, 0);
+	}
+}
+
+int LightBVH::buildNode(std::vector<BuildLight>& buildLights, int start, int end, uint64_t bitTrail, int depth)
+{
+	treeDepth = std::max(treeDepth, depth);
+	int nodeIndex = nodes.size();
+	nodes.push_back(LightBVHNode());
+	if (end - start == 1)
+	{
+		const BuildLight& b = buildLights[start];
+		LightBVHNode& leaf = nodes[nodeIndex];
+		leaf.bounds = b.bounds;
+		leaf.w = b.w;
+		leaf.phi = b.phi;
+		leaf.cosThetaO = b.cosThetaO;
+		leaf.cosThetaE = b.cosThetaE;
+		leaf.childOrLight = b.index;
+		leaf.isLeaf = 1;
+		leaf.twoSided = b.twoSided;
+		bitTrails[b.index] = bitTrail | (1ull << depth);
+		return nodeIndex;
+	}
+
+	BuildLight all;
+	all.phi = 0.0f;
+	AABB centroidBounds;
+	for (int i = start; i < end; ++i)
+	{
+		all = unite(all, buildLights[i]);
+		centroidBounds = AABB::Union(centroidBounds, buildLights[i].bounds.centroid());
+	}
+
+	// pbrt-v4's surface area orientation heuristic over buckets of light centroids
+	glm::vec3 extent = all.bounds.max - all.bounds.min;
+	float maxExtent = std::max(extent.x, std::max(extent.y, extent.z));
+	float minCost = FLT_MAX;
+	int minDim = -1, minBucket = -1;
+	for (int dim = 0; dim < 3 && depth < LIGHT_BVH_MEDIAN_DEPTH; ++dim)
+	{
+		if (centroidBounds.max[dim] == centroidBounds.min[dim])
+			continue;
+		BuildLight buckets[LIGHT_BVH_BUCKETS];
+		for (BuildLight& bucket : buckets)
+			bucket.phi = 0.0f;
+		for (int i = start; i < end; ++i)
+		{
+			int b = (int)(LIGHT_BVH_BUCKETS * centroidBounds.Offset(buildLights[i].bounds.centroid())[dim]);
+			b = glm::clamp(b, 0, LIGHT_BVH_BUCKETS - 1);
+			buckets[b] = unite(buckets[b], buildLights[i]);
+		}
+
+		auto cost = [&](const BuildLight& b) {
+			if (b.phi == 0.0f)
+				return 0.0f;
+			return b.phi * orientationCost(b.cosThetaO, b.cosThetaE) * maxExtent / extent[dim] * b.bounds.SurfaceArea();
+		};
+		for (int split = 0; split < LIGHT_BVH_BUCKETS - 1; ++split)
+		{
+			BuildLight below, above;
+			below.phi = above.phi = 0.0f;
+			for (int b = 0; b <= split; ++b)
+				below = unite(below, buckets[b]);
+			for (int b = split + 1; b < LIGHT_BVH_BUCKETS; ++b)
+				above = unite(above, buckets[b]);
+			float splitCost = cost(below) + cost(above);
+			if (splitCost > 0.0f && splitCost < minCost)
+			{
+				minCost = splitCost;
+				minDim = dim;
+				minBucket = split;
+			}
+		}
+	}
+
+	int mid = start;
+	if (minDim >= 0)
+	{
+		mid = std::partition(buildLights.begin() + start, buildLights.begin() + end, [&](const BuildLight& b) {
+			int bucket = (int)(LIGHT_BVH_BUCKETS * centroidBounds.Offset(b.bounds.centroid())[minDim]);
+			return glm::clamp(bucket, 0, LIGHT_BVH_BUCKETS - 1) <= minBucket;
+		}) - buildLights.begin();
+	}
+	if (mid == start || mid == end)
+	{
+		// coincident centroids or too deep, split the lights in half along the widest centroid extent
+		int dim = centroidBounds.maxExtent();
+		mid = (start + end) / 2;
+		std::nth_element(buildLights.begin() + start, buildLights.begin() + mid, buildLights.begin() + end,
+			[dim](const BuildLight& a, const BuildLight& b) { return a.bounds.centroid()[dim] < b.bounds.centroid()[dim]; });
+	}
+
+	buildNode(buildLights, start, mid, bitTrail, depth + 1);
+	int secondChild = buildNode(buildLights, mid, end, bitTrail | (1ull << depth), depth + 1);
+
+	LightBVHNode& node = nodes[nodeIndex];
+	node.bounds = all.bounds;
+	node.w = all.w;
+	node.phi = all.phi;
+	node.cosThetaO = all.cosThetaO;
+	node.cosThetaE = all.cosThetaE;
+	node.childOrLight = secondChild;
+	node.isLeaf = 0;
+	node.twoSided = all.twoSided;
+	return nodeIndex;
+}
+
+int LightBVH::depth() const
+{
+	return treeDepth;
+}
+
+size_t LightBVH::memoryBytes() const
+{
+	return nodes.size() * sizeof(LightBVHNode) + topBins.size() * (sizeof(AliasBin) + sizeof(int)) + bitTrails.size() * sizeof(uint64_t);
+}
+
+LightSampler LightBVH::hostView()
+{
+	LightSampler sampler;
+	sampler.nodes = nodes.data();
+	sampler.numNodes = nodes.size();
+	sampler.topBins = topBins.data();
+	sampler.topLights = topLights.data();
+	sampler.numTop = topBins.size();
+	sampler.treePmf = treePmf;
+	sampler.bitTrails = bitTrails.data();
+	sampler.numLights = numLights;
+	return sampler;
+}
+
+void LightBVH::upload(LightSampler& sampler) const
+{
+	free(sampler);
+	sampler.numNodes = nodes.size();
+	sampler.numTop = topBins.size();
+	sampler.treePmf = treePmf;
+	sampler.numLights = numLights;
+	if (!nodes.empty())
+	{
+		cudaMalloc(&sampler.nodes, nodes.size() * sizeof(LightBVHNode));
+		cudaMemcpy(sampler.nodes, nodes.data(), nodes.size() * sizeof(LightBVHNode), cudaMemcpyHostToDevice);
+	}
+	if (!topBins.empty())
+	{
+		cudaMalloc(&sampler.topBins, topBins.size() * sizeof(AliasBin));
+		cudaMemcpy(sampler.topBins, topBins.data(), topBins.size() * sizeof(AliasBin), cudaMemcpyHostToDevice);
+		cudaMalloc(&sampler.topLights, topLights.size() * sizeof(int));
+		cudaMemcpy(sampler.topLights, topLights.data(), topLights.size() * sizeof(int), cudaMemcpyHostToDevice);
+	}
+	cudaMalloc(&sampler.bitTrails, bitTrails.size() * sizeof(uint64_t));
+	cudaMemcpy(sampler.bitTrails, bitTrails.data(), bitTrails.size() * sizeof(uint64_t), cudaMemcpyHostToDevice);
+	checkCUDAError("LightBVH::upload");
+}
+
+void LightBVH::free(LightSampler& sampler)
+{
+	cudaFree(sampler.nodes);
+	cudaFree(sampler.topBins);
+	cudaFree(sampler.topLights);
+	cudaFree(sampler.bitTrails);
+	sampler = LightSampler();
+}
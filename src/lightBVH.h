@@ -0,0 +1,189 @@
+#pragma once
+#include "aliasTable.h"
+#include "sceneStructs.h"
+#include "texture.h"
+#include "utilities.h"
+#include <vector>
+
+// Light hierarchy that picks the light a shading point samples, after pbrt-v4's BVHLightSampler.
+// Every light with a position (area, disc, point and spot lights) is a leaf bounded by a box, its
+// power and a cone of emission directions: its normals are within thetaO of w and light leaves the
+// surface at up to thetaE from them. A shading point walks down from the root picking each child in
+// proportion to a bound on the light it can receive from it, so the pmf of a light is the product of
+// the choices on its way down, which pmf() retraces from the light's bit trail. The bound only uses
+// the point, not its normal, so the pmf of a light a BSDF sample hits follows from the ray origin.
+// Directional lights and the environment map can't be bounded, they are picked next to the tree,
+// which is one more entry of an alias table over the power of each. Without USE_LIGHT_BVH every
+// light is an entry of that table, with USE_POWER_LIGHT_SELECTION by power, otherwise uniformly.
+struct LightBVHNode
+{
+	AABB bounds;
+	glm::vec3 w;      // axis of the normal cone
+	float phi;        // power of the lights below
+	float cosThetaO;  // spread of the normals around w
+	float cosThetaE;  // emission angle past the normals
+	int childOrLight; // interior: second child, the first one is the next node. leaf: light index
+	uint8_t isLeaf;
+	uint8_t twoSided;
+
+	// upper bound of the light p receives from below this node
+	__inline__ __host__ __device__ float importance(const glm::vec3& p) const
+	{
+		glm::vec3 pc = (bounds.min + bounds.max) * 0.5f;
+		float d2 = glm::max(glm::dot(p - pc, p - pc), glm::length(bounds.max - bounds.min) * 0.5f);
+
+		// angle between w and the direction to p, and the angle the bounds subtend from p
+		glm::vec3 wi = p == pc ? w : glm::normalize(p - pc);
+		float cosThetaW = glm::dot(w, wi);
+		if (twoSided) cosThetaW = glm::abs(cosThetaW);
+		float sinThetaW = glm::sqrt(glm::max(0.0f, 1.0f - cosThetaW * cosThetaW));
+
+		float cosThetaB = -1.0f;
+		float radius2 = 0.25f * glm::dot(bounds.max - bounds.min, bounds.max - bounds.min);
+		float distance2 = glm::dot(p - pc, p - pc);
+		if (distance2 > radius2)
+			cosThetaB = glm::sqrt(glm::max(0.0f, 1.0f - radius2 / distance2));
+		float sinThetaB = glm::sqrt(glm::max(0.0f, 1.0f - cosThetaB * cosThetaB));
+
+		// cos(max(0, thetaW - thetaO - thetaB)), the smallest angle any normal below can make with p
+		float sinThetaO = glm::sqrt(glm::max(0.0f, 1.0f - cosThetaO * cosThetaO));
+		float cosThetaX = cosThetaW > cosThetaO ? 1.0f : cosThetaW * cosThetaO + sinThetaW * sinThetaO;
+		float sinThetaX = cosThetaW > cosThetaO ? 0.0f : sinThetaW * cosThetaO - cosThetaW * sinThetaO;
+		float cosThetaP = cosThetaX > cosThetaB ? 1.0f : cosThetaX * cosThetaB + sinThetaX * sinThetaB;
+		if (cosThetaP <= cosThetaE)
+			return 0.0f;
+		return phi * cosThetaP / d2;
+	}
+};
+
+// Light picking for the kernels and the host backend, passed by value like SceneAccel. Light ids
+// are indices into the scene's lights, the environment map is light numLights.
+struct LightSampler
+{
+	LightBVHNode* nodes = nullptr;
+	int numNodes = 0;
+	AliasBin* topBins = nullptr; // the lights outside the tree and the tree itself
+	int* topLights = nullptr;    // light of each bin, TREE for the tree
+	int numTop = 0;
+	float treePmf = 0.0f;        // probability of the tree's bin
+	uint64_t* bitTrails = nullptr; // per light, 0: never picked, TOP | bin: outside the tree, else the path from the root above a marker bit
+	int numLights = 0;
+
+	static constexpr int TREE = -1;
+	static constexpr uint64_t TOP = 1ull << 63;
+
+	// picks a light for p with u in [0, 1), returns -1 when no light can reach it
+	__inline__ __host__ __device__ int sample(const glm::vec3& p, float u, float& pmf) const
+	{
+		pmf = 0.0f;
+		if (numTop == 0)
+			return -1;
+		float topPmf;
+		int top = sampleAlias(topBins, numTop, u, topPmf, &u);
+		if (topLights[top] != TREE)
+		{
+			pmf = topPmf;
+			return topLights[top];
+		}
+
+		const float oneMinusEpsilon = 0.99999994f; // largest float below 1
+		float nodePmf = topPmf;
+		int nodeIndex = 0;
+		while (!nodes[nodeIndex].isLeaf)
+		{
+			const LightBVHNode& node = nodes[nodeIndex];
+			float importance0 = nodes[nodeIndex + 1].importance(p);
+			float importance1 = nodes[node.childOrLight].importance(p);
+			if (importance0 == 0.0f && importance1 == 0.0f)
+				return -1;
+			float p0 = importance0 / (importance0 + importance1);
+			if (u < p0)
+			{
+				nodeIndex = nodeIndex + 1;
+				u = glm::min(u / p0, oneMinusEpsilon);
+				nodePmf *= p0;
+			}
+			else
+			{
+				nodeIndex = node.childOrLight;
+				u = glm::min((u - p0) / (1.0f - p0), oneMinusEpsilon);
+				nodePmf *= 1.0f - p0;
+			}
+		}
+		// a single light is a leaf root, it still has to be able to reach p
+		if (nodeIndex == 0 && nodes[0].importance(p) == 0.0f)
+			return -1;
+		pmf = nodePmf;
+		return nodes[nodeIndex].childOrLight;
+	}
+
+	// probability of sample(p, ...) returning light
+	__inline__ __host__ __device__ float pmf(const glm::vec3& p, int light) const
+	{
+		if (light < 0 || light > numLights)
+			return 0.0f;
+		uint64_t trail = bitTrails[light];
+		if (trail == 0)
+			return 0.0f;
+		if (trail & TOP)
+			return topBins[trail & ~TOP].pmf;
+
+		float nodePmf = treePmf;
+		int nodeIndex = 0;
+		while (!nodes[nodeIndex].isLeaf)
+		{
+			const LightBVHNode& node = nodes[nodeIndex];
+			float importance0 = nodes[nodeIndex + 1].importance(p);
+			float importance1 = nodes[node.childOrLight].importance(p);
+			if (importance0 == 0.0f && importance1 == 0.0f)
+				return 0.0f;
+			float p0 = importance0 / (importance0 + importance1);
+			nodePmf *= (trail & 1) ? 1.0f - p0 : p0;
+			nodeIndex = (trail & 1) ? node.childOrLight : nodeIndex + 1;
+			trail >>= 1;
+		}
+		if (nodeIndex == 0 && nodes[0].importance(p) == 0.0f)
+			return 0.0f;
+		return nodePmf;
+	}
+};
+extern LightSampler dev_lightSampler;
+
+// Host side light hierarchy, built by Scene::createBVH
+class LightBVH
+{
+public:
+	// how sample() picks a light: Uniform and Power put every light in the alias table, weighted
+	// the same or by power, BVH puts the lights with a position in the tree
+	enum class Strategy { Uniform, Power, BVH };
+
+	std::vector<LightBVHNode> nodes;
+	std::vector<AliasBin> topBins;
+	std::vector<int> topLights;
+	std::vector<uint64_t> bitTrails;
+	float treePmf = 0.0f;
+	int numLights = 0;
+
+	// sceneBounds sizes the disc that directional lights and the environment map shine through for their power
+	void build(const std::vector<Light>& lights, const EnvMap& envMap, const AABB& sceneBounds, Strategy strategy = Strategy::BVH);
+	int depth() const;
+	size_t memoryBytes() const;
+	// host view for the CPU backend and tools, the device pointers in dev_lightSampler come from upload()
+	LightSampler hostView();
+	void upload(LightSampler& sampler) const;
+	static void free(LightSampler& sampler);
+
+private:
+	struct BuildLight
+	{
+		int index;
+		AABB bounds;
+		glm::vec3 w;
+		float phi;
+		float cosThetaO;
+		float cosThetaE;
+		bool twoSided;
+	};
+	int buildNode(std::vector<BuildLight>& buildLights, int start, int end, uint64_t bitTrail, int depth);
+	int treeDepth = 0;
+};
@@ -1,7 +1,15 @@
 #include "main.h"
 #include "preview.h"
+#include "benchmark.h"
+#include "cpuPathTracer.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
 #include <cstring>
+#include <memory>
 #include <OpenImageDenoise/oidn.hpp>
+#include <stb_image.h>
 
 static std::string startTimeString;
 
@@ -25,30 +33,159 @@ GuiDataContainer* guiData;
 RenderState* renderState;
 
 int iteration;
+static int64_t samplesTaken = 0; // since the last reset, a render spends ITERATIONS samples per pixel
+static bool samplesWanted = true; // false once adaptive sampling has no pixel left that wants one
 
 int width;
 int height;
 OIDNDevice oidnDevice;
 bool shadeSimple = false;
+
+struct HeadlessOptions
+{
+    int iterations = -1; // the scene's ITERATIONS
+    const char* timingFile = NULL;
+    bool cpu = false;    // CpuPathTracer instead of the CUDA pipeline
+    int threads = 0;     // CPU backend threads, 0 : every hardware thread
+    const char* hdrFile = NULL;     // also save the averaged image unclamped, as FILE.hdr
+    const char* compareFile = NULL; // .hdr from another run (e.g. the other backend), mean and RMSE against it go into the timing
+    float adaptive = -1.f; // adaptive sampling threshold, < 0 : the scene's
+    // with compareFile, the run fails when the mean or the RMSE exceeds this fraction of the reference mean, < 0 : never
+    float tolerance = -1.f;
+    float rmseTolerance = -1.f;
+};
+static int runHeadless(const char* sceneFile, const HeadlessOptions& options);
+
+static void printUsage(const char* program)
+{
+    printf("Usage: %s SCENEFILE.json [--headless [--iterations N] [--timing FILE.json] [--backend cuda|cpu] [--threads N]"
+        " [--save-hdr FILE] [--compare FILE.hdr [--tolerance T] [--rmse-tolerance T]] [--adaptive T]]\n", program);
+}
+
+// the whole of s as a number, false for anything else
+static bool parseInt(const char* s, int* value)
+{
+    char* end;
+    long v = strtol(s, &end, 10);
+    if (end == s || *end != '\0')
+        return false;
+    *value = (int)v;
+    return true;
+}
+
+static bool parseFloat(const char* s, float* value)
+{
+    char* end;
+    float v = strtof(s, &end);
+    if (end == s || *end != '\0')
+        return false;
+    *value = v;
+    return true;
+}
+
 //-------------------------------
 //-------------MAIN--------------
 //-------------------------------
 
 int main(int argc, char** argv)
 {
-    startTimeString = currentTimeString();
-    int sharedMemoryPerBlock;
-    cudaDeviceGetAttribute(&sharedMemoryPerBlock, cudaDevAttrMaxSharedMemoryPerBlock, 0);
-    printf("Max shared memory per block: %d bytes\n", sharedMemoryPerBlock);
-    if (argc < 2)
+    if (argc >= 3 && strcmp(argv[1], "--bench") == 0)
     {
-        printf("Usage: %s SCENEFILE.json\n", argv[0]);
+        return runBenchmark(argv[2], argc - 3, argv + 3);
+    }
+
+    if (argc < 2 || strncmp(argv[1], "--", 2) == 0)
+    {
+        printUsage(argv[0]);
         return 1;
     }
 
     const char* sceneFile = argv[1];
+    bool headless = false;
+    HeadlessOptions headlessOptions;
+    const char* headlessOption = NULL; // the first option given, every one of them needs --headless
+    for (int i = 2; i < argc; i++)
+    {
+        const char* option = argv[i];
+        if (strcmp(option, "--headless") == 0)
+        {
+            headless = true;
+            continue;
+        }
+        bool known = strcmp(option, "--iterations") == 0 || strcmp(option, "--timing") == 0 || strcmp(option, "--backend") == 0 ||
+            strcmp(option, "--threads") == 0 || strcmp(option, "--save-hdr") == 0 || strcmp(option, "--compare") == 0 ||
+            strcmp(option, "--adaptive") == 0 || strcmp(option, "--tolerance") == 0 || strcmp(option, "--rmse-tolerance") == 0;
+        if (!known)
+        {
+            printf("Unknown argument %s\n", option);
+            printUsage(argv[0]);
+            return 1;
+        }
+        if (i + 1 >= argc)
+        {
+            printf("%s needs a value\n", option);
+            printUsage(argv[0]);
+            return 1;
+        }
+        const char* value = argv[++i];
+        if (headlessOption == NULL)
+            headlessOption = option;
+
+        bool valid = true;
+        if (strcmp(option, "--iterations") == 0)
+            valid = parseInt(value, &headlessOptions.iterations) && headlessOptions.iterations > 0;
+        else if (strcmp(option, "--timing") == 0)
+            headlessOptions.timingFile = value;
+        else if (strcmp(option, "--backend") == 0)
+        {
+            valid = strcmp(value, "cpu") == 0 || strcmp(value, "cuda") == 0;
+            headlessOptions.cpu = strcmp(value, "cpu") == 0;
+        }
+        else if (strcmp(option, "--threads") == 0)
+            valid = parseInt(value, &headlessOptions.threads) && headlessOptions.threads >= 0;
+        else if (strcmp(option, "--save-hdr") == 0)
+            headlessOptions.hdrFile = value;
+        else if (strcmp(option, "--compare") == 0)
+            headlessOptions.compareFile = value;
+        else if (strcmp(option, "--adaptive") == 0)
+            valid = parseFloat(value, &headlessOptions.adaptive) && headlessOptions.adaptive >= 0.f;
+        else if (strcmp(option, "--tolerance") == 0)
+            valid = parseFloat(value, &headlessOptions.tolerance) && headlessOptions.tolerance >= 0.f;
+        else if (strcmp(option, "--rmse-tolerance") == 0)
+            valid = parseFloat(value, &headlessOptions.rmseTolerance) && headlessOptions.rmseTolerance >= 0.f;
+        if (!valid)
+        {
+            printf("Invalid value %s for %s\n", value, option);
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if ((headlessOptions.tolerance >= 0.f || headlessOptions.rmseTolerance >= 0.f) && headlessOptions.compareFile == NULL)
+    {
+        printf("--tolerance and --rmse-tolerance need --compare\n");
+        printUsage(argv[0]);
+        return 1;
+    }
+    if (!headless && headlessOption != NULL)
+    {
+        printf("%s only applies with --headless\n", headlessOption);
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    startTimeString = currentTimeString();
+    // the CPU backend never touches the device
+    if (!headless || !headlessOptions.cpu)
+    {
+        int sharedMemoryPerBlock = 0;
+        cudaDeviceGetAttribute(&sharedMemoryPerBlock, cudaDevAttrMaxSharedMemoryPerBlock, 0);
+        printf("Max shared memory per block: %d bytes\n", sharedMemoryPerBlock);
+    }
+    if (headless)
+        return runHeadless(sceneFile, headlessOptions);
+
     // Load scene file
-    scene = new Scene("D:\\Fall2024\\CIS5650\\Project3-CUDA-Path-Tracer\\scenes\\PT_veachScene.json");
+    scene = new Scene(sceneFile);
     //scene->createBRDFDisplay();
     // test loading obj
     Material newMaterial(glm::vec3(15, 154, 255) / 255.f);
@@ -97,9 +234,9 @@ int main(int argc, char** argv)
     scene->createBVH();
 
 #endif
-    initSceneCuda(scene->geoms.data(), scene->materials.data(), scene->triangles.data(), scene->lights.data(), scene->geoms.size(), scene->materials.size(), scene->triangles.size(), scene->lights.size());
+    initSceneCuda(scene->geoms.data(), scene->materials.data(), scene->triangleHits.data(), scene->lights.data(), scene->geoms.size(), scene->materials.size(), scene->triangleHits.size(), scene->lights.size());
     gpuInfo = new GPUInfo();
-    gpuInfo->triangleCount = scene->triangles.size();
+    gpuInfo->triangleCount = scene->triangleHits.size();
 
     // Initialize ImGui Data
     InitImguiData(guiData);
@@ -115,8 +252,195 @@ int main(int argc, char** argv)
     return 0;
 }
 
+static float elapsedMs(std::chrono::high_resolution_clock::time_point start)
+{
+    return std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+// Batch render without GLFW, GL or ImGui: loads the scene, traces the iterations straight into
+// the device accumulation buffer (or the host image with the CPU backend), saves the image the
+// same way the viewer does on exit and prints the timings as one JSON object on the last line.
+static int runHeadless(const char* sceneFile, const HeadlessOptions& options)
+{
+    using Clock = std::chrono::high_resolution_clock;
+
+    Clock::time_point start = Clock::now();
+    scene = new Scene(sceneFile);
+    // the CPU backend filters the host pixels, only the kernels need the texture
+    scene->loadEnvMap(!options.cpu);
+    float loadMs = elapsedMs(start);
+
+    renderState = &scene->state;
+    int iterations = options.iterations < 0 ? renderState->iterations : options.iterations;
+    renderState->iterations = iterations; // the sampler and adaptive sampling are sized for it
+    if (options.adaptive >= 0.f)
+        renderState->adaptiveThreshold = options.adaptive;
+    // the viewer rebuilds the basis from its orbit camera, here the scene file's camera is used as is
+    Camera& cam = renderState->camera;
+    cam.view = glm::normalize(cam.lookAt - cam.position);
+    cam.right = glm::normalize(glm::cross(cam.view, cam.up));
+    cam.up = glm::cross(cam.right, cam.view);
+    width = cam.resolution.x;
+    height = cam.resolution.y;
+
+    // the CPU backend always traverses the BVH and keeps it on the host
+    float bvhMs = 0.f;
+    start = Clock::now();
+    if (options.cpu)
+        scene->createBVH(false);
+#ifdef USE_BVH
+    else
+        scene->createBVH();
+#endif
+    bvhMs = elapsedMs(start);
+
+    start = Clock::now();
+    std::unique_ptr<CpuPathTracer> cpuTracer;
+    if (options.cpu)
+    {
+        cpuTracer.reset(new CpuPathTracer(scene, options.threads));
+    }
+    else
+    {
+        initSceneCuda(scene->geoms.data(), scene->materials.data(), scene->triangleHits.data(), scene->lights.data(), scene->geoms.size(), scene->materials.size(), scene->triangleHits.size(), scene->lights.size());
+        gpuInfo = new GPUInfo();
+        gpuInfo->triangleCount = scene->triangleHits.size();
+        pathtraceInit(scene);
+        cudaDeviceSynchronize();
+    }
+    float initMs = elapsedMs(start);
+
+    oidnDevice = oidnNewDevice(OIDN_DEVICE_TYPE_DEFAULT);
+    oidnCommitDevice(oidnDevice);
+
+    // no PBOs, pathtrace only accumulates. Every pixel takes a sample each iteration unless adaptive
+    // sampling leaves the converged ones out, then the iterations go on until as many samples are
+    // spent or no pixel wants one
+    std::vector<float> iterationMs;
+    iterationMs.reserve(iterations);
+    float renderMs = 0.f;
+    const int64_t sampleBudget = (int64_t)iterations * width * height;
+    samplesTaken = 0;
+    for (iteration = 1; samplesTaken < sampleBudget; iteration++)
+    {
+        start = Clock::now();
+        int samples;
+        if (cpuTracer)
+        {
+            samples = cpuTracer->pathtrace(iteration);
+        }
+        else
+        {
+            samples = pathtrace(NULL, NULL, 0, iteration, shadeSimple);
+            cudaDeviceSynchronize();
+        }
+        iterationMs.push_back(elapsedMs(start));
+        renderMs += iterationMs.back();
+        samplesTaken += samples;
+        if (samples == 0)
+            break;
+    }
+    iteration = iterationMs.size();
+
+    start = Clock::now();
+    saveImage();
+    float saveMs = elapsedMs(start);
+    if (!cpuTracer)
+        checkCUDAError("headless render");
+
+    // the averaged image as saveImage lays it out, unclamped
+    std::vector<glm::vec3> pixels(width * height);
+    for (int x = 0; x < width; x++)
+        for (int y = 0; y < height; y++)
+            pixels[y * width + width - 1 - x] = renderState->image[x + y * width] / (float)iteration;
+    if (options.hdrFile)
+    {
+        Image hdr(width, height);
+        for (int x = 0; x < width; x++)
+            for (int y = 0; y < height; y++)
+                hdr.setPixel(x, y, pixels[y * width + x]);
+        hdr.saveHDR(options.hdrFile);
+    }
+    double mean = 0.0, referenceMean = 0.0, rmse = -1.0;
+    bool withinTolerance = true;
+    if (options.compareFile)
+    {
+        int refWidth, refHeight, refChannels;
+        float* reference = stbi_loadf(options.compareFile, &refWidth, &refHeight, &refChannels, 3);
+        if (reference == NULL || refWidth != width || refHeight != height)
+        {
+            printf("Cannot compare against %s: not a %dx%d image\n", options.compareFile, width, height);
+            withinTolerance = options.tolerance < 0.f && options.rmseTolerance < 0.f;
+        }
+        else
+        {
+            double squaredError = 0.0;
+            for (int i = 0; i < width * height; i++)
+            {
+                for (int c = 0; c < 3; c++)
+                {
+                    double a = pixels[i][c], b = reference[3 * i + c];
+                    mean += a;
+                    referenceMean += b;
+                    squaredError += (a - b) * (a - b);
+                }
+            }
+            mean /= 3.0 * width * height;
+            referenceMean /= 3.0 * width * height;
+            rmse = std::sqrt(squaredError / (3.0 * width * height));
+            printf("Compared with %s: mean %.5f against %.5f (%+.2f%%), RMSE %.5f\n", options.compareFile, mean, referenceMean,
+                referenceMean > 0.0 ? 100.0 * (mean - referenceMean) / referenceMean : 0.0, rmse);
+            if (options.tolerance >= 0.f && std::abs(mean - referenceMean) > options.tolerance * referenceMean)
+            {
+                printf("Mean differs by more than %.2f%% of the reference mean\n", 100.0 * options.tolerance);
+                withinTolerance = false;
+            }
+            if (options.rmseTolerance >= 0.f && rmse > options.rmseTolerance * referenceMean)
+            {
+                printf("RMSE is more than %.2f%% of the reference mean\n", 100.0 * options.rmseTolerance);
+                withinTolerance = false;
+            }
+        }
+        stbi_image_free(reference);
+    }
+
+    std::ostringstream timing;
+    timing << "{\"scene\": \"" << scene->sceneFile << "\", \"backend\": \"" << (cpuTracer ? "cpu" : "cuda") << "\"";
+    if (cpuTracer)
+        timing << ", \"threads\": " << cpuTracer->threadCount();
+    timing << ", \"width\": " << width << ", \"height\": " << height
+        << ", \"iterations\": " << iteration << ", \"samples\": " << samplesTaken << ", \"triangles\": " << scene->triangleHits.size()
+        << ", \"load_ms\": " << loadMs << ", \"bvh_build_ms\": " << bvhMs << ", \"init_ms\": " << initMs
+        << ", \"render_ms\": " << renderMs << ", \"save_ms\": " << saveMs;
+    if (rmse >= 0.0)
+        timing << ", \"mean\": " << mean << ", \"reference_mean\": " << referenceMean << ", \"rmse\": " << rmse
+            << ", \"within_tolerance\": " << (withinTolerance ? "true" : "false");
+    timing << ", \"iteration_ms\": [";
+    for (size_t i = 0; i < iterationMs.size(); i++)
+        timing << (i ? ", " : "") << iterationMs[i];
+    timing << "]}";
+    printf("%s\n", timing.str().c_str());
+    if (options.timingFile)
+        std::ofstream(options.timingFile) << timing.str() << std::endl;
+
+    oidnReleaseDevice(oidnDevice);
+    if (cpuTracer)
+    {
+        cpuTracer.reset();
+        delete scene;
+        return withinTolerance ? 0 : 1;
+    }
+    pathtraceFree();
+    delete gpuInfo;
+    gpuInfo = nullptr;
+    delete scene;
+    cudaDeviceReset();
+    return withinTolerance ? 0 : 1;
+}
+
 void saveImage()
 {
+    pathtraceReadback();
     float samples = iteration;
     // output image file
     Image img(width, height);
@@ -142,6 +466,30 @@ void saveImage()
     // CHECKITOUT
     img.savePNG(filename);
     //img.saveHDR(filename);  // Save a Radiance HDR file
+
+    // where adaptive sampling spent the samples, black through blue, red and yellow to white at the most any pixel took
+    const std::vector<int>& sampleCounts = renderState->sampleCounts;
+    if (!sampleCounts.empty())
+    {
+        const glm::vec3 ramp[5] = { glm::vec3(0.f), glm::vec3(0.f, 0.f, 1.f), glm::vec3(1.f, 0.f, 0.f), glm::vec3(1.f, 1.f, 0.f), glm::vec3(1.f) };
+        int maxSamples = std::max(*std::max_element(sampleCounts.begin(), sampleCounts.end()), 1);
+        int64_t totalSamples = 0;
+        Image heatMap(width, height);
+        for (int x = 0; x < width; x++)
+        {
+            for (int y = 0; y < height; y++)
+            {
+                int index = x + (y * width);
+                totalSamples += sampleCounts[index];
+                float t = 4.f * sampleCounts[index] / maxSamples;
+                int k = std::min((int)t, 3);
+                heatMap.setPixel(width - 1 - x, y, glm::mix(ramp[k], ramp[k + 1], t - k));
+            }
+        }
+        printf("Samples per pixel: %d min, %.1f mean, %d max\n", *std::min_element(sampleCounts.begin(), sampleCounts.end()),
+            (double)totalSamples / sampleCounts.size(), maxSamples);
+        heatMap.savePNG(filename + "_samples");
+    }
    
 	// Denoise
 #ifdef OIDN_DENOSIER
@@ -235,14 +583,16 @@ void runCuda()
     // Map OpenGL buffer object for writing from CUDA on a single GPU
     // No data is moved (Win & Linux). When mapped to CUDA, OpenGL should not use this buffer
 
+    // buffers come from the pool, a reset only clears the accumulated image
     if (iteration == 0)
     {
-        pathtraceFree();
         pathtraceInit(scene);
+        samplesTaken = 0;
+        samplesWanted = true;
     }
 
 #ifndef debug
-    if (iteration < renderState->iterations)
+    if (samplesTaken < (int64_t)renderState->iterations * width * height && samplesWanted)
 #else
     if (iteration <= 4)
 #endif
@@ -257,7 +607,9 @@ void runCuda()
         // execute the kernel
         int frame = 0;
 
-        pathtrace(pbo_dptr, pbo_post_dptr, frame, iteration, shadeSimple);
+        int samples = pathtrace(pbo_dptr, pbo_post_dptr, frame, iteration, shadeSimple);
+        samplesTaken += samples;
+        samplesWanted = samples > 0;
         // unmap buffer object
         cudaGLUnmapBufferObject(pbo);
 		cudaGLUnmapBufferObject(pbo_post);
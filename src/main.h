@@ -35,6 +35,7 @@ extern int height;
 extern bool shadeSimple;
 
 void runCuda();
+void saveImage();
 void keyCallback(GLFWwindow *window, int key, int scancode, int action, int mods);
 void mousePositionCallback(GLFWwindow* window, double xpos, double ypos);
 void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
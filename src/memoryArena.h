@@ -65,6 +65,8 @@ public:
             // Move the current block to the usedBlocks list if valid.
             if (currentBlock) {
                 usedBlocks.push_back(std::make_pair(currentAllocSize, currentBlock));
+                currentBlock = nullptr;
+                currentAllocSize = 0;
             }
 
             // Try to get a new block from availableBlocks or allocate a new one.
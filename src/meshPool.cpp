@@ -0,0 +1,107 @@
+#include "meshPool.h"
+#include "cudaUtilities.h"
+#include <glm/gtc/matrix_inverse.hpp>
+
+int MeshPool::append(const IndexedMesh& mesh, const glm::mat4& transform, uint8_t materialid, uint16_t lightid)
+{
+	int base = positions.size();
+	glm::mat4 invTranspose = glm::inverseTranspose(transform);
+	for (size_t i = 0; i < mesh.positions.size(); ++i)
+	{
+		positions.push_back(glm::vec3(transform * glm::vec4(mesh.positions[i], 1.0f)));
+		// corners without a normal index keep their zero normal instead of normalizing it to NaN
+		bool hasNormal = mesh.hasNormals && glm::dot(mesh.normals[i], mesh.normals[i]) > 0.f;
+		normals.push_back(hasNormal ? glm::normalize(glm::vec3(invTranspose * glm::vec4(mesh.normals[i], 0.0f))) : mesh.normals[i]);
+		uvs.push_back(mesh.uvs[i]);
+	}
+	for (size_t f = 0; f < mesh.indices.size(); f += 3)
+	{
+		TriangleIndices tri;
+		for (int j = 0; j < 3; ++j)
+			tri.v[j] = base + mesh.indices[f + j];
+		tri.materialid = materialid;
+		tri.lightid = lightid;
+		tri.hasNormals = mesh.hasNormals;
+		triangles.push_back(tri);
+	}
+	return base;
+}
+
+void MeshPool::transformVertices(int first, const std::vector<glm::vec3>& objectPositions, const std::vector<glm::vec3>& objectNormals,
+	const glm::mat4& transform)
+{
+	glm::mat4 invTranspose = glm::inverseTranspose(transform);
+	for (size_t i = 0; i < objectPositions.size(); ++i)
+	{
+		positions[first + i] = glm::vec3(transform * glm::vec4(objectPositions[i], 1.0f));
+		if (glm::dot(objectNormals[i], objectNormals[i]) > 0.f)
+			normals[first + i] = glm::normalize(glm::vec3(invTranspose * glm::vec4(objectNormals[i], 0.0f)));
+	}
+}
+
+void MeshPool::expand(int first, int last, std::vector<Triangle>& out) const
+{
+	MeshPoolView view = hostView();
+	for (int i = first; i < last; ++i)
+		out.push_back(view.getTriangle(i));
+}
+
+void MeshPool::reorder(const std::vector<uint32_t>& order, int first)
+{
+	std::vector<TriangleIndices> ordered(order.size());
+	for (size_t i = 0; i < order.size(); ++i)
+		ordered[i] = triangles[first + order[i]];
+	std::copy(ordered.begin(), ordered.end(), triangles.begin() + first);
+}
+
+void MeshPool::restoreOrder(const std::vector<uint32_t>& order, int first)
+{
+	std::vector<TriangleIndices> loadOrder(order.size());
+	for (size_t i = 0; i < order.size(); ++i)
+		loadOrder[order[i]] = triangles[first + i];
+	std::copy(loadOrder.begin(), loadOrder.end(), triangles.begin() + first);
+}
+
+size_t MeshPool::memoryBytes() const
+{
+	return positions.size() * (2 * sizeof(glm::vec3) + sizeof(glm::vec2)) + triangles.size() * sizeof(TriangleIndices);
+}
+
+MeshPoolView MeshPool::hostView() const
+{
+	MeshPoolView view;
+	view.positions = const_cast<glm::vec3*>(positions.data());
+	view.normals = const_cast<glm::vec3*>(normals.data());
+	view.uvs = const_cast<glm::vec2*>(uvs.data());
+	view.triangles = const_cast<TriangleIndices*>(triangles.data());
+	return view;
+}
+
+void MeshPool::upload(MeshPoolView& view) const
+{
+	// a rebuild reorders the triangles, replace the previous copy
+	cudaFree(view.positions);
+	cudaFree(view.normals);
+	cudaFree(view.uvs);
+	cudaFree(view.triangles);
+	view = MeshPoolView();
+	if (triangles.empty())
+		return;
+	cudaMalloc(&view.positions, positions.size() * sizeof(glm::vec3));
+	cudaMalloc(&view.normals, normals.size() * sizeof(glm::vec3));
+	cudaMalloc(&view.uvs, uvs.size() * sizeof(glm::vec2));
+	cudaMalloc(&view.triangles, triangles.size() * sizeof(TriangleIndices));
+	uploadVertexRange(view, 0, positions.size() - 1);
+	cudaMemcpy(view.triangles, triangles.data(), triangles.size() * sizeof(TriangleIndices), cudaMemcpyHostToDevice);
+	checkCUDAError("MeshPool::upload");
+}
+
+void MeshPool::uploadVertexRange(MeshPoolView& view, int first, int last) const
+{
+	if (last < first)
+		return;
+	int count = last - first + 1;
+	cudaMemcpy(view.positions + first, positions.data() + first, count * sizeof(glm::vec3), cudaMemcpyHostToDevice);
+	cudaMemcpy(view.normals + first, normals.data() + first, count * sizeof(glm::vec3), cudaMemcpyHostToDevice);
+	cudaMemcpy(view.uvs + first, uvs.data() + first, count * sizeof(glm::vec2), cudaMemcpyHostToDevice);
+}
@@ -0,0 +1,114 @@
+#pragma once
+#include "sceneStructs.h"
+#include <vector>
+
+// Indexed triangle storage. A vertex is one unique (position, normal, uv) corner of an obj shape,
+// so on smooth meshes each vertex is shared by about six triangles instead of being copied into
+// every Triangle. The BVH builders still take Triangle arrays, Scene::createBVH expands one from the
+// pool for the build and keeps only the 36 byte TriangleHit traversal copy.
+//     Triangle: 100 bytes per triangle
+//     indexed: 16 bytes per triangle + 32 bytes per vertex
+struct TriangleIndices
+{
+	uint32_t v[3];
+	uint8_t materialid;
+	uint8_t hasNormals;
+	uint16_t lightid;
+};
+
+// Pool pointers, host or device, passed to kernels by value inside SceneAccel
+struct MeshPoolView
+{
+	glm::vec3* positions = nullptr;
+	glm::vec3* normals = nullptr;
+	glm::vec2* uvs = nullptr;
+	TriangleIndices* triangles = nullptr;
+
+	// same as Triangle::getBarycentricCoordinates
+	__inline__ __host__ __device__ glm::vec3 getBarycentricCoordinates(const TriangleIndices& tri, glm::vec3 insectPoint) const
+	{
+		glm::vec3 v0 = positions[tri.v[0]];
+		glm::vec3 e1 = positions[tri.v[1]] - v0;
+		glm::vec3 e2 = positions[tri.v[2]] - v0;
+		glm::vec3 ei = insectPoint - v0;
+		float s = glm::length(glm::cross(e1, e2)) / 2.0;
+		float u = glm::length(glm::cross(ei, e2)) / 2.0 / s;
+		float v = glm::length(glm::cross(e1, ei)) / 2.0 / s;
+		return glm::vec3(1.0f - u - v, u, v);
+	}
+
+	__inline__ __host__ __device__ glm::vec3 getNormal(const TriangleIndices& tri, glm::vec3 insectPoint) const
+	{
+		if (!tri.hasNormals)
+		{
+			glm::vec3 v0 = positions[tri.v[0]];
+			return glm::normalize(glm::cross(positions[tri.v[1]] - v0, positions[tri.v[2]] - v0));
+		}
+		glm::vec3 barycentric = getBarycentricCoordinates(tri, insectPoint);
+		return barycentric.x * normals[tri.v[0]] + barycentric.y * normals[tri.v[1]] + barycentric.z * normals[tri.v[2]];
+	}
+
+	__inline__ __host__ __device__ glm::vec2 getUV(const TriangleIndices& tri, glm::vec3 insectPoint) const
+	{
+		glm::vec3 barycentric = getBarycentricCoordinates(tri, insectPoint);
+		return barycentric.x * uvs[tri.v[0]] + barycentric.y * uvs[tri.v[1]] + barycentric.z * uvs[tri.v[2]];
+	}
+
+	__inline__ __host__ __device__ Triangle getTriangle(int i) const
+	{
+		const TriangleIndices& indices = triangles[i];
+		Triangle tri;
+		for (int j = 0; j < 3; ++j)
+		{
+			tri.vertices[j] = positions[indices.v[j]];
+			tri.normals[j] = normals[indices.v[j]];
+			tri.uvs[j] = uvs[indices.v[j]];
+		}
+		tri.hasNormals = indices.hasNormals;
+		tri.materialid = indices.materialid;
+		tri.lightid = indices.lightid;
+		return tri;
+	}
+};
+
+// One obj shape in object space, corners deduplicated by (position, normal, uv) index
+struct IndexedMesh
+{
+	std::vector<glm::vec3> positions;
+	std::vector<glm::vec3> normals; // zero when the obj has none
+	std::vector<glm::vec2> uvs;     // zero when the obj has none
+	std::vector<uint32_t> indices;  // 3 per triangle
+	bool hasNormals = false;
+	int numTriangles() const { return indices.size() / 3; }
+};
+
+// Host side pools, shared by every mesh appended to them
+class MeshPool
+{
+public:
+	std::vector<glm::vec3> positions;
+	std::vector<glm::vec3> normals;
+	std::vector<glm::vec2> uvs;
+	std::vector<TriangleIndices> triangles;
+
+	// Appends mesh with its vertices moved by transform, returns the first new vertex.
+	// The new triangles start at triangles.size() before the call.
+	int append(const IndexedMesh& mesh, const glm::mat4& transform, uint8_t materialid, uint16_t lightid);
+	// rewrites vertices [first, first + objectPositions.size()) from object space copies
+	void transformVertices(int first, const std::vector<glm::vec3>& objectPositions, const std::vector<glm::vec3>& objectNormals,
+		const glm::mat4& transform);
+	// appends triangles [first, last) in Triangle form
+	void expand(int first, int last, std::vector<Triangle>& out) const;
+	// triangles[first + i] = old triangles[first + order[i]], the permutation BVHAccel::build applies to its input
+	void reorder(const std::vector<uint32_t>& order, int first = 0);
+	// inverse of reorder
+	void restoreOrder(const std::vector<uint32_t>& order, int first = 0);
+
+	int numVertices() const { return positions.size(); }
+	size_t memoryBytes() const;
+	// host view for tools, the device view comes from upload()
+	MeshPoolView hostView() const;
+	// frees the arrays view points to and uploads the whole pool
+	void upload(MeshPoolView& view) const;
+	void uploadVertexRange(MeshPoolView& view, int first, int last) const;
+};
@@ -0,0 +1,154 @@
+#pragma once
+#include "sceneStructs.h"
+#include <vector>
+
+// Structure of arrays path state for the wavefront loop. A path keeps the slot it was generated
+// in (its pixel) for the whole iteration and the active paths are a list of slots, so compaction
+// moves 4 byte indices and terminated paths are gathered in place. Each stage goes through its
+// own accessor and only touches the arrays it needs:
+//     camera     initPath       every array
+//     intersect  loadRay        origin, direction
+//     shade      load / store   every array, MIS and scatterRay work on a PathSegment
+//     compact    isTerminated   remainingBounces
+//     miss       direction, throughput, accumLight, bsdfPdf
+//     gather     accumLight, albedo, normal
+// PathSegment::color is never set past the camera, pixelIndex is the slot and distTraveled is
+// never read, so none of them are stored.
+struct PathState
+{
+	glm::vec3* origin = nullptr;
+	glm::vec3* direction = nullptr;
+	glm::vec3* throughput = nullptr;
+	glm::vec3* accumLight = nullptr;
+	glm::vec3* albedo = nullptr;
+	glm::vec3* normal = nullptr;
+	int* remainingBounces = nullptr;
+	float* bsdfPdf = nullptr;
+
+	static constexpr size_t rayBytes = 2 * sizeof(glm::vec3);
+	static constexpr size_t bytesPerPath = 6 * sizeof(glm::vec3) + sizeof(int) + sizeof(float);
+
+	__inline__ __host__ __device__ void initPath(int slot, const Ray& ray, int traceDepth) const
+	{
+		origin[slot] = ray.origin;
+		direction[slot] = ray.direction;
+		throughput[slot] = glm::vec3(1.0f);
+		accumLight[slot] = glm::vec3(0.0f);
+		albedo[slot] = glm::vec3(0.0f);
+		normal[slot] = glm::vec3(0.0f);
+		remainingBounces[slot] = traceDepth;
+		bsdfPdf[slot] = 0.0f;
+	}
+
+	__inline__ __host__ __device__ Ray loadRay(int slot) const
+	{
+		Ray ray;
+		ray.origin = origin[slot];
+		ray.direction = direction[slot];
+		return ray;
+	}
+
+	__inline__ __host__ __device__ PathSegment load(int slot) const
+	{
+		PathSegment segment;
+		segment.ray = loadRay(slot);
+		segment.throughput = throughput[slot];
+		segment.accumLight = accumLight[slot];
+		segment.albedo = albedo[slot];
+		segment.normal = normal[slot];
+		segment.remainingBounces = remainingBounces[slot];
+		segment.bsdfPdf = bsdfPdf[slot];
+		segment.pixelIndex = slot;
+		return segment;
+	}
+
+	__inline__ __host__ __device__ void store(int slot, const PathSegment& segment) const
+	{
+		origin[slot] = segment.ray.origin;
+		direction[slot] = segment.ray.direction;
+		throughput[slot] = segment.throughput;
+		accumLight[slot] = segment.accumLight;
+		albedo[slot] = segment.albedo;
+		normal[slot] = segment.normal;
+		remainingBounces[slot] = segment.remainingBounces;
+		bsdfPdf[slot] = segment.bsdfPdf;
+	}
+
+	__inline__ __host__ __device__ bool isTerminated(int slot) const
+	{
+		return remainingBounces[slot] <= 0;
+	}
+};
+
+// compaction predicate over the active slot list
+struct PathTerminated
+{
+	PathState paths;
+	__host__ __device__ bool operator()(int slot) const { return paths.isTerminated(slot); }
+};
+
+// Shading order key of a path: misses last, hits grouped by material type and then by material,
+// so a warp of the shading kernel mostly runs one BSDF. Kept to 30 bits like the morton codes so
+// the host side can reuse BVHAccel::ParallelRadixSort.
+__inline__ __host__ __device__ uint32_t materialSortKey(const ShadeableIntersection& isect, const Material* materials)
+{
+	if (isect.t <= 0.0f)
+		return (1u << 30) - 1;
+	return ((uint32_t)materials[isect.materialId].type << 8) | isect.materialId;
+}
+
+// Shading queues: one per MaterialType for the hits that scatter, and one for misses and emitters,
+// which only add light and end the path
+constexpr int NUM_SHADE_QUEUES = 4;
+constexpr int SHADE_QUEUE_TERMINAL = 3;
+
+__inline__ __host__ __device__ int shadeQueueIndex(const ShadeableIntersection& isect, const Material* materials)
+{
+	if (isect.t <= 0.0f || materials[isect.materialId].emittance > 0.0f)
+		return SHADE_QUEUE_TERMINAL;
+	return (int)materials[isect.materialId].type;
+}
+
+// direction of the camera ray through a (possibly jittered) pixel position
+__inline__ __host__ __device__ glm::vec3 cameraRayDirection(const Camera& cam, float pixelX, float pixelY)
+{
+	return glm::normalize(cam.view
+		- cam.right * cam.pixelLength.x * (pixelX - (float)cam.resolution.x * 0.5f)
+		- cam.up * cam.pixelLength.y * (pixelY - (float)cam.resolution.y * 0.5f));
+}
+
+// Host storage behind a PathState, for the CPU wavefront stages
+class HostPathState
+{
+public:
+	void resize(int nPaths)
+	{
+		origin.resize(nPaths);
+		direction.resize(nPaths);
+		throughput.resize(nPaths);
+		accumLight.resize(nPaths);
+		albedo.resize(nPaths);
+		normal.resize(nPaths);
+		remainingBounces.resize(nPaths);
+		bsdfPdf.resize(nPaths);
+	}
+
+	PathState view()
+	{
+		PathState paths;
+		paths.origin = origin.data();
+		paths.direction = direction.data();
+		paths.throughput = throughput.data();
+		paths.accumLight = accumLight.data();
+		paths.albedo = albedo.data();
+		paths.normal = normal.data();
+		paths.remainingBounces = remainingBounces.data();
+		paths.bsdfPdf = bsdfPdf.data();
+		return paths;
+	}
+
+private:
+	std::vector<glm::vec3> origin, direction, throughput, accumLight, albedo, normal;
+	std::vector<int> remainingBounces;
+	std::vector<float> bsdfPdf;
+};
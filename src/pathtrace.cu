@@ -1,14 +1,18 @@
 #include "pathtrace.h"
 
 #include <cstdio>
+#include <cstring>
 #include <cuda.h>
 #include <cmath>
+#include <utility>
 #include <thrust/execution_policy.h>
 #include <thrust/random.h>
 #include <thrust/remove.h>
 #include <thrust/device_vector.h>
 #include <thrust/host_vector.h>
 #include <thrust/partition.h>
+#include <thrust/sort.h>
+#include <thrust/iterator/zip_iterator.h>
 
 #include "sceneStructs.h"
 #include "scene.h"
@@ -18,6 +22,10 @@
 #include "intersections.h"
 #include "interactions.h"
 #include "light.h"
+#include "pathState.h"
+#include "sampler.h"
+#include "adaptiveSampling.h"
+#include "bufferPool.h"
 
 #define ERRORCHECK 1
 
@@ -46,13 +54,6 @@ void checkCUDAErrorFn(const char* msg, const char* file, int line)
 #endif // ERRORCHECK
 }
 
-__host__ __device__
-thrust::default_random_engine makeSeededRandomEngine(int iter, int index, int depth)
-{
-    int h = utilhash((1 << 31) | (depth << 22) | iter) ^ utilhash(index);
-    return thrust::default_random_engine(h);
-}
-
 // post process the image
 __device__ inline glm::vec3 postProcess(glm::vec3 x)
 {
@@ -100,13 +101,36 @@ static glm::vec3* dev_image = NULL;
 static glm::vec3* dev_image_post = NULL;
 static glm::vec3* dev_albedo = NULL;
 static glm::vec3* dev_normal = NULL;
-static PathSegment* dev_paths = NULL;
-static PathSegment* dev_terminated_paths = NULL;
+static PathState dev_paths;
+static int* dev_active_paths = NULL; // slots of the paths still bouncing
+static int* dev_next_active_paths = NULL; // compaction target, swapped with dev_active_paths every bounce
 static ShadeableIntersection* dev_intersections = NULL;
-
-static thrust::device_ptr<PathSegment> dev_thrust_paths;
-static thrust::device_ptr<PathSegment> dev_thrust_terminated_paths;
-static cudaTextureObject_t envMap = NULL;
+static uint32_t* dev_material_keys = NULL; // materialSortKey of each active path
+static int* dev_shade_queues = NULL; // NUM_SHADE_QUEUES lists of intersection indices, pixelcount each
+static int* dev_shade_queue_counts = NULL;
+
+static EnvMap envMap;
+static Sampler sampler; // the sequence the kernels draw every path's random numbers from
+static AdaptiveSampling adaptive; // per pixel sample counts and statistics, threshold 0 without adaptive sampling
+// owns every buffer above, they stay allocated across pathtraceInit calls until pathtraceFree
+static DeviceBufferPool bufferPool;
+
+// The host copies of the image, albedo and normal are only needed to save or checkpoint. A
+// readback snapshots the three buffers on the device and copies the snapshot into pinned memory
+// on its own stream while the next iterations render. Two slots, so a new snapshot never waits
+// for the previous transfer.
+struct ReadbackSlot
+{
+    glm::vec3* dev[3] = {}; // image, albedo, normal snapshots
+    glm::vec3* host[3] = {}; // pinned
+    cudaEvent_t done = NULL;
+    bool pending = false;
+};
+static ReadbackSlot readbackSlots[2];
+static int readbackNext = 0; // slot the next snapshot goes to, the other one is older
+static int readbackPixels = 0;
+static cudaStream_t readbackStream = NULL;
+static cudaEvent_t readbackSnapshot = NULL;
 
 void InitDataContainer(GuiDataContainer* imGuiData)
 {
@@ -120,26 +144,101 @@ void pathtraceInit(Scene* scene)
     const Camera& cam = hst_scene->state.camera;
     const int pixelcount = cam.resolution.x * cam.resolution.y;
 
-    cudaMalloc(&dev_image, pixelcount * sizeof(glm::vec3));
+    // same resolution as last time: every acquire is a lookup, only the accumulation buffers are cleared
+    dev_image = bufferPool.acquire<glm::vec3>("image", pixelcount);
+	dev_image_post = bufferPool.acquire<glm::vec3>("imagePost", pixelcount);
+    dev_paths.origin = bufferPool.acquire<glm::vec3>("paths.origin", pixelcount);
+    dev_paths.direction = bufferPool.acquire<glm::vec3>("paths.direction", pixelcount);
+    dev_paths.throughput = bufferPool.acquire<glm::vec3>("paths.throughput", pixelcount);
+    dev_paths.accumLight = bufferPool.acquire<glm::vec3>("paths.accumLight", pixelcount);
+    dev_paths.albedo = bufferPool.acquire<glm::vec3>("paths.albedo", pixelcount);
+    dev_paths.normal = bufferPool.acquire<glm::vec3>("paths.normal", pixelcount);
+    dev_paths.remainingBounces = bufferPool.acquire<int>("paths.remainingBounces", pixelcount);
+    dev_paths.bsdfPdf = bufferPool.acquire<float>("paths.bsdfPdf", pixelcount);
+	dev_active_paths = bufferPool.acquire<int>("activePaths", pixelcount);
+	dev_next_active_paths = bufferPool.acquire<int>("nextActivePaths", pixelcount);
+    dev_intersections = bufferPool.acquire<ShadeableIntersection>("intersections", pixelcount);
+	dev_material_keys = bufferPool.acquire<uint32_t>("materialKeys", pixelcount);
+	dev_shade_queues = bufferPool.acquire<int>("shadeQueues", NUM_SHADE_QUEUES * pixelcount);
+	dev_shade_queue_counts = bufferPool.acquire<int>("shadeQueueCounts", NUM_SHADE_QUEUES);
+	dev_albedo = bufferPool.acquire<glm::vec3>("albedo", pixelcount);
+	dev_normal = bufferPool.acquire<glm::vec3>("normal", pixelcount);
+
     cudaMemset(dev_image, 0, pixelcount * sizeof(glm::vec3));
-	cudaMalloc(&dev_image_post, pixelcount * sizeof(glm::vec3));
 	cudaMemset(dev_image_post, 0, pixelcount * sizeof(glm::vec3));
-    cudaMalloc(&dev_paths, pixelcount * sizeof(PathSegment));
-	cudaMalloc(&dev_terminated_paths, pixelcount * sizeof(PathSegment));
-    cudaMalloc(&dev_intersections, pixelcount * sizeof(ShadeableIntersection));
-    cudaMemset(dev_intersections, 0, pixelcount * sizeof(ShadeableIntersection));
-
-
-	cudaMalloc(&dev_albedo, pixelcount * sizeof(glm::vec3));
 	cudaMemset(dev_albedo, 0, pixelcount * sizeof(glm::vec3));
-	cudaMalloc(&dev_normal, pixelcount * sizeof(glm::vec3));
 	cudaMemset(dev_normal, 0, pixelcount * sizeof(glm::vec3));
 
+	// pinned staging for the readback, copies of the previous render are dropped
+	if (readbackStream == NULL)
+	{
+		cudaStreamCreateWithFlags(&readbackStream, cudaStreamNonBlocking);
+		cudaEventCreateWithFlags(&readbackSnapshot, cudaEventDisableTiming);
+		for (ReadbackSlot& slot : readbackSlots)
+			cudaEventCreateWithFlags(&slot.done, cudaEventDisableTiming);
+	}
+	cudaStreamSynchronize(readbackStream);
+	for (int i = 0; i < 2; ++i)
+	{
+		ReadbackSlot& slot = readbackSlots[i];
+		const char* names[3] = { "readback.image", "readback.albedo", "readback.normal" };
+		for (int k = 0; k < 3; ++k)
+		{
+			slot.dev[k] = bufferPool.acquire<glm::vec3>(std::string(names[k]) + char('0' + i), pixelcount);
+			if (readbackPixels != pixelcount)
+			{
+				cudaFreeHost(slot.host[k]);
+				cudaMallocHost(&slot.host[k], pixelcount * sizeof(glm::vec3));
+			}
+		}
+		slot.pending = false;
+	}
+	readbackPixels = pixelcount;
+
+	if (gpuInfo != NULL)
+	{
+		const DeviceBufferPool::Stats& poolStats = bufferPool.getStats();
+		gpuInfo->bufferAllocations = poolStats.allocations;
+		gpuInfo->bufferReuses = poolStats.reuses;
+		gpuInfo->bufferBytes = poolStats.bytes;
+	}
+
     // TODO: initialize any extra device memeory you need
-	dev_thrust_paths = thrust::device_ptr<PathSegment>(dev_paths);
-	dev_thrust_terminated_paths = thrust::device_ptr<PathSegment>(dev_terminated_paths);
-	if (scene->envMap != NULL)
-	    envMap = scene->envMap->texObj;
+	envMap = scene->envMap != NULL ? scene->envMap->view() : EnvMap();
+
+	// a render's iterations are the samples of each pixel, the strata and lattice are sized for them
+	sampler = makeSampler(SAMPLER, hst_scene->state.iterations, cam.resolution.x);
+	if (sampler.type == SamplerType::BlueNoise)
+	{
+		float* dev_blueNoise = bufferPool.acquire<float>("blueNoise", BLUE_NOISE_SIZE * BLUE_NOISE_SIZE);
+		cudaMemcpy(dev_blueNoise, sampler.hostBlueNoise, BLUE_NOISE_SIZE * BLUE_NOISE_SIZE * sizeof(float), cudaMemcpyHostToDevice);
+		sampler.deviceBlueNoise = dev_blueNoise;
+	}
+
+	// the statistics start over with the image
+	adaptive = makeAdaptiveSampling(hst_scene->state.adaptiveThreshold, hst_scene->state.iterations, cam.resolution.x, cam.resolution.y);
+	if (adaptive.enabled())
+	{
+		adaptive.samples = bufferPool.acquire<int>("adaptive.samples", pixelcount);
+		adaptive.mean = bufferPool.acquire<float>("adaptive.mean", pixelcount);
+		adaptive.m2 = bufferPool.acquire<float>("adaptive.m2", pixelcount);
+		adaptive.radiance = bufferPool.acquire<glm::vec3>("adaptive.radiance", pixelcount);
+		adaptive.albedo = bufferPool.acquire<glm::vec3>("adaptive.albedo", pixelcount);
+		adaptive.normal = bufferPool.acquire<glm::vec3>("adaptive.normal", pixelcount);
+		cudaMemset(adaptive.samples, 0, pixelcount * sizeof(int));
+		cudaMemset(adaptive.mean, 0, pixelcount * sizeof(float));
+		cudaMemset(adaptive.m2, 0, pixelcount * sizeof(float));
+		cudaMemset(adaptive.radiance, 0, pixelcount * sizeof(glm::vec3));
+		cudaMemset(adaptive.albedo, 0, pixelcount * sizeof(glm::vec3));
+		cudaMemset(adaptive.normal, 0, pixelcount * sizeof(glm::vec3));
+		sampler.pixelSamples = adaptive.samples;
+		hst_scene->state.sampleCounts.resize(pixelcount);
+	}
+
+	// the mesh pool and instance arrays of dev_accel are filled by Scene::createBVH
+	dev_accel.nodes = dev_nodes;
+	dev_accel.triangleHits = dev_triangleHits;
+	dev_accel.numTriangles = hst_scene->triangleHits.size();
 
 	//cudaMalloc(&dev_materials, hst_scene->materials.size() * sizeof(Material));
 	//cudaMemcpy(dev_materials, hst_scene->materials.data(), hst_scene->materials.size() * sizeof(Material), cudaMemcpyHostToDevice);
@@ -163,14 +262,25 @@ void pathtraceInit(Scene* scene)
 
 void pathtraceFree()
 {
-    cudaFree(dev_image);
-    cudaFree(dev_paths);
-    cudaFree(dev_intersections);
-	cudaFree(dev_terminated_paths);
-	cudaFree(dev_image_post);
-
-	cudaFree(dev_albedo);
-	cudaFree(dev_normal);
+    if (readbackStream != NULL)
+    {
+        cudaStreamSynchronize(readbackStream);
+        for (ReadbackSlot& slot : readbackSlots)
+        {
+            for (glm::vec3*& host : slot.host)
+            {
+                cudaFreeHost(host);
+                host = NULL;
+            }
+            cudaEventDestroy(slot.done);
+            slot.pending = false;
+        }
+        cudaEventDestroy(readbackSnapshot);
+        cudaStreamDestroy(readbackStream);
+        readbackStream = NULL;
+        readbackPixels = 0;
+    }
+    bufferPool.releaseAll();
 	//cudaFree(dev_materials);
 	//cudaFree(dev_geoms);
 	//cudaFree(dev_triangles);
@@ -178,6 +288,83 @@ void pathtraceFree()
     checkCUDAError("pathtraceFree");
 }
 
+// Copies finished readbacks, oldest first, into the scene's host images; wait blocks until every
+// pending one is done
+static void pollReadback(bool wait)
+{
+    const size_t bytes = readbackPixels * sizeof(glm::vec3);
+    glm::vec3* targets[3] = { hst_scene->state.image.data(), hst_scene->state.albedo.data(), hst_scene->state.normal.data() };
+    for (int i = 0; i < 2; ++i)
+    {
+        ReadbackSlot& slot = readbackSlots[(readbackNext + i) % 2];
+        if (!slot.pending)
+            continue;
+        if (wait)
+            cudaEventSynchronize(slot.done);
+        else if (cudaEventQuery(slot.done) != cudaSuccess)
+            break; // the newer slot was queued behind this one
+        for (int k = 0; k < 3; ++k)
+            memcpy(targets[k], slot.host[k], bytes);
+        slot.pending = false;
+    }
+}
+
+// Snapshots image, albedo and normal into the next slot and queues the transfer, returns the bytes
+// it will move. Skipped when that slot's previous transfer hasn't finished.
+static size_t requestReadback(const glm::vec3* image)
+{
+    pollReadback(false);
+    ReadbackSlot& slot = readbackSlots[readbackNext];
+    if (slot.pending)
+        return 0;
+    const size_t bytes = readbackPixels * sizeof(glm::vec3);
+    const glm::vec3* sources[3] = { image, dev_albedo, dev_normal };
+    for (int k = 0; k < 3; ++k)
+        cudaMemcpyAsync(slot.dev[k], sources[k], bytes, cudaMemcpyDeviceToDevice, 0);
+    cudaEventRecord(readbackSnapshot, 0);
+    cudaStreamWaitEvent(readbackStream, readbackSnapshot, 0);
+    for (int k = 0; k < 3; ++k)
+        cudaMemcpyAsync(slot.host[k], slot.dev[k], bytes, cudaMemcpyDeviceToHost, readbackStream);
+    cudaEventRecord(slot.done, readbackStream);
+    slot.pending = true;
+    readbackNext = 1 - readbackNext;
+    return 3 * bytes;
+}
+
+// the image saveImage expects
+static const glm::vec3* readbackImage()
+{
+#ifdef POSTPROCESS
+    return dev_image_post;
+#else
+    return dev_image;
+#endif
+}
+
+void pathtraceReadback()
+{
+    if (readbackStream == NULL)
+        return;
+    size_t bytes = requestReadback(readbackImage());
+    pollReadback(true);
+    if (bytes == 0)
+    {
+        // both slots were busy with older snapshots, take a fresh one now that they are done
+        bytes = requestReadback(readbackImage());
+        pollReadback(true);
+    }
+    // the sample counts are only read for the heat map next to a saved image, a plain copy does
+    if (adaptive.enabled())
+    {
+        std::vector<int>& sampleCounts = hst_scene->state.sampleCounts;
+        cudaMemcpy(sampleCounts.data(), adaptive.samples, sampleCounts.size() * sizeof(int), cudaMemcpyDeviceToHost);
+        bytes += sampleCounts.size() * sizeof(int);
+    }
+    if (gpuInfo != NULL)
+        gpuInfo->readbackBytesTotal += bytes;
+    checkCUDAError("pathtraceReadback");
+}
+
 /**
 * Generate PathSegments with rays from the camera through the screen into the
 * scene, which is the first bounce of rays.
@@ -186,40 +373,38 @@ void pathtraceFree()
 * motion blur - jitter rays "in time"
 * lens effect - jitter ray origin positions based on a lens
 */
-__global__ void generateRayFromCamera(Camera cam, int iter, int traceDepth, PathSegment* pathSegments)
+__global__ void generateRayFromCamera(Camera cam, int iter, int traceDepth, PathState paths, int* activePaths, Sampler sampler,
+    AdaptiveSampling adaptive)
 {
     int x = (blockIdx.x * blockDim.x) + threadIdx.x;
     int y = (blockIdx.y * blockDim.y) + threadIdx.y;
 
     if (x < cam.resolution.x && y < cam.resolution.y) {
         int index = x + (y * cam.resolution.x);
-        PathSegment& segment = pathSegments[index];
-
-        segment.ray.origin = cam.position;
-        segment.color = glm::vec3(0.f);
+        // a converged pixel is compacted out of the slot list before the first bounce
+        if (adaptive.enabled() && !adaptive.wantsSample(index))
+        {
+            paths.remainingBounces[index] = PIXEL_SKIPPED;
+            activePaths[index] = index;
+            return;
+        }
+        Ray ray;
+        ray.origin = cam.position;
 
         // TODO: implement antialiasing by jittering the ray
 		float pixelX = float(x);
 		float pixelY = float(y);
         
 #ifdef JITTER
-		thrust::default_random_engine rng = makeSeededRandomEngine(iter, index, 0);
+		PathSampler rng(sampler, index, iter - 1, 0, SAMPLE_CAMERA);
 		thrust::uniform_real_distribution<float> u01(-JITTER, JITTER);
 		pixelX += u01(rng);
 		pixelY += u01(rng);
 #endif
-        segment.ray.direction = glm::normalize(cam.view
-            - cam.right * cam.pixelLength.x * (pixelX - (float)cam.resolution.x * 0.5f)
-            - cam.up * cam.pixelLength.y * (pixelY - (float)cam.resolution.y * 0.5f)
-        );
+        ray.direction = cameraRayDirection(cam, pixelX, pixelY);
 
-        segment.pixelIndex = index;
-        segment.remainingBounces = traceDepth;
-		segment.throughput = glm::vec3(1.0f);
-		segment.accumLight = glm::vec3(0.0f);
-		segment.albedo = glm::vec3(0.0f);
-		segment.normal = glm::vec3(0.0f);
-		segment.distTraveled = 0.0f;
+        paths.initPath(index, ray, traceDepth);
+        activePaths[index] = index;
     }
 }
 
@@ -230,21 +415,22 @@ __global__ void generateRayFromCamera(Camera cam, int iter, int traceDepth, Path
 __global__ void computeIntersections(
     int depth,
     int num_paths,
-    PathSegment* pathSegments,
+    const int* activePaths,
+    PathState paths,
     Geom* geoms,
     int geoms_size,
-    Triangle* dev_triangles,
-	int triangles_size,
-	LinearBVHNode* dev_nodes,
+    SceneAccel accel,
     ShadeableIntersection* intersections,
-    int num_lights,
+    LightSampler lightSampler,
+    Sampler sampler,
     int iter)
 {
     int path_index = blockIdx.x * blockDim.x + threadIdx.x;
 
     if (path_index < num_paths)
     {
-        PathSegment pathSegment = pathSegments[path_index];
+        // only the ray is read here
+        Ray ray = paths.loadRay(activePaths[path_index]);
 		ShadeableIntersection& intersection = intersections[path_index];
 
 
@@ -254,7 +440,7 @@ __global__ void computeIntersections(
 		ShadeableIntersection bvhIntersection;
 		bvhIntersection.t = -1.0f;
         bvhIntersection.hitBVH = 0;
-        if (triangles_size > 0 && BVHIntersect(pathSegment.ray, dev_nodes, dev_triangles, &bvhIntersection) && bvhIntersection.t > 0.0f && bvhIntersection.t < t_min)
+        if (SceneIntersect(ray, accel, &bvhIntersection) && bvhIntersection.t > 0.0f && bvhIntersection.t < t_min)
             intersection = bvhIntersection;
 #ifdef DEBUG_BVH
         else intersection = bvhIntersection;
@@ -268,21 +454,21 @@ __global__ void computeIntersections(
 
         glm::vec3 tmp_intersect;
         glm::vec3 tmp_normal;
-        for (int i = 0; i < triangles_size; i++)
+        for (int i = 0; i < accel.numTriangles; i++)
         {
-            Triangle triangle = dev_triangles[i];
-            float t = triangle.intersect(pathSegment.ray);
+            const TriangleHit& triangle = accel.triangleHits[i];
+            float t = triangle.intersect(ray);
             /*if (t > 0 && t < t_min)
             {
                 t_min = t;
-                normal = triangle.getNormal();
+                normal = glm::normalize(glm::cross(triangle.e1, triangle.e2));
             }*/
             if (t > 0.0f && t_min > t)
             {
                 t_min = t;
                 hit_geom_index = i;
                 intersect_point = tmp_intersect;
-                normal = triangle.getNormal();
+                normal = glm::normalize(glm::cross(triangle.e1, triangle.e2));
             }
         }
         if (hit_geom_index == -1)
@@ -293,12 +479,18 @@ __global__ void computeIntersections(
         {
             // The ray hits something
             intersection.t = t_min;
-            intersection.materialId = dev_triangles[hit_geom_index].materialid;
+            intersection.materialId = accel.mesh.triangles[hit_geom_index].materialid;
             intersection.surfaceNormal = normal;
         }
 #endif
-        thrust::default_random_engine rng = makeSeededRandomEngine(iter, path_index, 0);
-        intersection.directLightId = num_lights == 1 ? 0 : thrust::uniform_int_distribution<int>(0, num_lights - 1)(rng);
+        // pick the light MIS samples at the hit
+        intersection.directLightPmf = 0.0f;
+        if (intersection.t > 0.0f)
+        {
+            PathSampler rng(sampler, activePaths[path_index], iter - 1, depth, SAMPLE_LIGHT_PICK);
+            int light = lightSampler.sample(getPointOnRay(ray, intersection.t), thrust::uniform_real_distribution<float>(0, 1)(rng), intersection.directLightPmf);
+            intersection.directLightId = light;
+        }
     }
 }
 
@@ -306,13 +498,14 @@ __global__ void shadeMaterialSimple(
     int iter,
     int num_paths,
     ShadeableIntersection* shadeableIntersections,
-    PathSegment* pathSegments,
+    const int* activePaths,
+    PathState paths,
     Material* materials,
-    cudaTextureObject_t envMap,
+    EnvMap envMap,
     int num_lights,
-    LinearBVHNode* dev_nodes,
-    Triangle* dev_triangles,
+    SceneAccel accel,
     Light* dev_lights,
+    Sampler sampler,
     int depth,
     bool firstBounce)
 {
@@ -320,7 +513,8 @@ __global__ void shadeMaterialSimple(
     if (idx < num_paths)
     {
         ShadeableIntersection intersection = shadeableIntersections[idx];
-        PathSegment pathSegment = pathSegments[idx];
+        int slot = activePaths[idx];
+        PathSegment pathSegment = paths.load(slot);
 #ifdef DEBUG_BVH
         //scatterRay(pathSegment, getPointOnRay(pathSegment.ray, intersection.t), intersection.t, intersection.surfaceNormal, intersection.uv, material, rng);
         pathSegment.accumLight += glm::vec3(intersection.hitBVH);
@@ -330,13 +524,12 @@ __global__ void shadeMaterialSimple(
 
         if (intersection.t > 0.0f) // if the intersection exists...
         {
-            thrust::default_random_engine rng = makeSeededRandomEngine(iter, idx, 0);
+            PathSampler rng(sampler, slot, iter - 1, depth, SAMPLE_BSDF);
             thrust::uniform_real_distribution<float> u01(0, 1);
 
             Material material = materials[intersection.materialId];
             glm::vec3 materialColor = material.color;
 
-            pathSegment.distTraveled += intersection.t;
             // If the material indicates that the object was a light, "light" the ray
             if (material.emittance > 0.0f) {
                 pathSegment.remainingBounces = 0;
@@ -344,8 +537,8 @@ __global__ void shadeMaterialSimple(
             }
             else
             {
-                scatterRay(pathSegment, intersection, getPointOnRay(pathSegment.ray, intersection.t), material, rng, num_lights, dev_nodes, dev_triangles, dev_lights, envMap);
-                //MIS(pathSegment, intersection, getPointOnRay(pathSegment.ray, intersection.t), material, rng, num_lights, dev_nodes, dev_triangles, dev_lights, envMap, depth, firstBounce);
+                scatterRay(pathSegment, intersection, getPointOnRay(pathSegment.ray, intersection.t), material, rng, num_lights, accel, dev_lights, envMap);
+                //MIS(pathSegment, intersection, getPointOnRay(pathSegment.ray, intersection.t), material, rng, num_lights, accel, dev_lights, envMap, depth, firstBounce);
             }
 
         }
@@ -357,7 +550,7 @@ __global__ void shadeMaterialSimple(
         }
 #endif
 
-        pathSegments[idx] = pathSegment;
+        paths.store(slot, pathSegment);
     }
 }
 
@@ -366,13 +559,15 @@ __global__ void shadeMaterialNaive(
 	int iter,
 	int num_paths,
 	ShadeableIntersection* shadeableIntersections,
-	PathSegment* pathSegments,
+	const int* activePaths,
+	PathState paths,
 	Material* materials,
-    cudaTextureObject_t envMap,
+    EnvMap envMap,
     int num_lights,
-    LinearBVHNode* dev_nodes,
-    Triangle* dev_triangles,
+    LightSampler lightSampler,
+    SceneAccel accel,
     Light* dev_lights,
+    Sampler sampler,
     int depth,
     bool firstBounce)
 {
@@ -380,7 +575,8 @@ __global__ void shadeMaterialNaive(
     if (idx < num_paths)
     {
         ShadeableIntersection intersection = shadeableIntersections[idx];
-		PathSegment pathSegment = pathSegments[idx];
+		int slot = activePaths[idx];
+		PathSegment pathSegment = paths.load(slot);
 #ifdef DEBUG_BVH
         //scatterRay(pathSegment, getPointOnRay(pathSegment.ray, intersection.t), intersection.t, intersection.surfaceNormal, intersection.uv, material, rng);
         pathSegment.accumLight += glm::vec3(intersection.hitBVH);
@@ -393,99 +589,168 @@ __global__ void shadeMaterialNaive(
         //Material material = materials[intersection.materialId];
         //glm::vec3 materialColor = material.color;
 
-        //MIS(pathSegment, intersection, getPointOnRay(pathSegment.ray, intersection.t), material, rng, num_lights, dev_nodes, dev_triangles, dev_lights, envMap);
+        //MIS(pathSegment, intersection, getPointOnRay(pathSegment.ray, intersection.t), material, rng, num_lights, accel, dev_lights, envMap);
 
         if (intersection.t > 0.0f) // if the intersection exists...
         {
-            // Set up the RNG
-            // LOOK: this is how you use thrust's RNG! Please look at
-            // makeSeededRandomEngine as well.
-            thrust::default_random_engine rng = makeSeededRandomEngine(iter, idx, 0);
+            // the path's dimensions of this bounce, MIS moves to each purpose's own
+            PathSampler rng(sampler, slot, iter - 1, depth, SAMPLE_BSDF);
             thrust::uniform_real_distribution<float> u01(0, 1);
 
             Material material = materials[intersection.materialId];
             glm::vec3 materialColor = material.color;
 
-			pathSegment.distTraveled += intersection.t;
             // If the material indicates that the object was a light, "light" the ray
             if (material.emittance > 0.0f) {
                 pathSegment.remainingBounces = 0;
-                glm::vec3 radiance = pathSegment.throughput * materialColor * material.emittance + pathSegment.accumLight;
+                float weight = emitterMISWeight(pathSegment.ray, intersection, pathSegment.bsdfPdf, lightSampler, dev_lights);
+                glm::vec3 radiance = pathSegment.throughput * materialColor * material.emittance * weight + pathSegment.accumLight;
                 //float maxRadiance = glm::max(radiance.x, glm::max(radiance.y, radiance.z));
                 //radiance *= maxRadiance > 0.97f ? 0.97f / maxRadiance : 1.0;
 				pathSegment.accumLight = radiance;
             }
             else
             {
-				//scatterRay(pathSegment, intersection, getPointOnRay(pathSegment.ray, intersection.t), material, rng, num_lights, dev_nodes, dev_triangles, dev_lights, envMap);
-				MIS(pathSegment, intersection, getPointOnRay(pathSegment.ray, intersection.t), material, rng, num_lights, dev_nodes, dev_triangles, dev_lights, envMap, depth, firstBounce);
+				//scatterRay(pathSegment, intersection, getPointOnRay(pathSegment.ray, intersection.t), material, rng, num_lights, accel, dev_lights, envMap);
+				MIS(pathSegment, intersection, getPointOnRay(pathSegment.ray, intersection.t), material, rng, num_lights, accel, dev_lights, envMap, depth, firstBounce);
             }
 
         }
         else {
 			//pathSegment.color += getEnvironmentalRadiance(pathSegment.ray.direction, envMap);
-			glm::vec3 radiance = getEnvironmentalRadiance(pathSegment.ray.direction, envMap);
-			float maxRadiance = glm::max(radiance.x, glm::max(radiance.y, radiance.z));
-            radiance *= maxRadiance > 1.1f ? 1.1f / maxRadiance : 1.0;
+			glm::vec3 radiance = getEscapedRadiance(pathSegment.ray, pathSegment.bsdfPdf, lightSampler, envMap);
 
 			pathSegment.accumLight += pathSegment.throughput * radiance;
             pathSegment.remainingBounces = 0;
         }
 #endif
 
-		pathSegments[idx] = pathSegment;
+		paths.store(slot, pathSegment);
     }
 }
 
-// Add the current iteration's output to the overall image
-__global__ void finalGather(int nPaths, glm::vec3* image, PathSegment* iterationPaths, glm::vec3* albedo, glm::vec3* normal)
+// Appends every active path to the shading queue of its material type
+__global__ void pushShadeQueues(int num_paths, const ShadeableIntersection* intersections, const Material* materials,
+    int* queues, int* queueCounts, int queueCapacity)
+{
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx < num_paths)
+    {
+        int queue = shadeQueueIndex(intersections[idx], materials);
+        int position = atomicAdd(&queueCounts[queue], 1);
+        queues[queue * queueCapacity + position] = idx;
+    }
+}
+
+// shadeMaterialNaive for the hits of one MaterialType, MIS is compiled with that type's BSDF only
+template<MaterialType type>
+__global__ void shadeMaterialQueue(
+    int iter,
+    int num_paths,
+    const int* queue,
+    ShadeableIntersection* shadeableIntersections,
+    const int* activePaths,
+    PathState paths,
+    Material* materials,
+    EnvMap envMap,
+    int num_lights,
+    SceneAccel accel,
+    Light* dev_lights,
+    Sampler sampler,
+    int depth,
+    bool firstBounce)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i < num_paths)
+    {
+        int idx = queue[i];
+        ShadeableIntersection intersection = shadeableIntersections[idx];
+        int slot = activePaths[idx];
+        PathSegment pathSegment = paths.load(slot);
+        PathSampler rng(sampler, slot, iter - 1, depth, SAMPLE_BSDF);
+        Material material = materials[intersection.materialId];
+        MIS<type>(pathSegment, intersection, getPointOnRay(pathSegment.ray, intersection.t), material, rng, num_lights, accel, dev_lights, envMap, depth, firstBounce);
+        paths.store(slot, pathSegment);
+    }
+}
+
+// shadeMaterialNaive for misses and emitters: add their light and end the path
+__global__ void shadeTerminalQueue(
+    int num_paths,
+    const int* queue,
+    ShadeableIntersection* shadeableIntersections,
+    const int* activePaths,
+    PathState paths,
+    Material* materials,
+    EnvMap envMap,
+    LightSampler lightSampler,
+    Light* dev_lights)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i < num_paths)
+    {
+        int idx = queue[i];
+        ShadeableIntersection intersection = shadeableIntersections[idx];
+        int slot = activePaths[idx];
+        glm::vec3 radiance;
+        if (intersection.t > 0.0f)
+        {
+            Material material = materials[intersection.materialId];
+            radiance = material.color * material.emittance * emitterMISWeight(paths.loadRay(slot), intersection, paths.bsdfPdf[slot], lightSampler, dev_lights);
+        }
+        else
+        {
+            radiance = getEscapedRadiance(paths.loadRay(slot), paths.bsdfPdf[slot], lightSampler, envMap);
+        }
+        paths.accumLight[slot] += paths.throughput[slot] * radiance;
+        paths.remainingBounces[slot] = 0;
+    }
+}
+
+// Add the current iteration's output to the overall image, path slots are pixel indices
+__global__ void finalGather(int nPaths, int iter, glm::vec3* image, PathState paths, glm::vec3* albedo, glm::vec3* normal, AdaptiveSampling adaptive)
 {
     int index = (blockIdx.x * blockDim.x) + threadIdx.x;
 
     if (index < nPaths)
     {
-        PathSegment iterationPath = iterationPaths[index];
-		glm::vec3 col = iterationPath.accumLight;
+        // the pixel's sums take its new sample, and the image its mean as if every pixel had iter samples
+        if (adaptive.enabled())
+        {
+            if (paths.remainingBounces[index] != PIXEL_SKIPPED)
+                adaptive.addSample(index, paths.accumLight[index], paths.albedo[index], paths.normal[index]);
+            adaptive.resolve(index, iter, image, albedo, normal);
+            return;
+        }
+		glm::vec3 col = paths.accumLight[index];
 
 #ifdef DEBUG_THROUGHPUT
-        image[iterationPath.pixelIndex] += glm::length(iterationPath.throughput) / 1.732;
+        image[index] += glm::length(paths.throughput[index]) / 1.732;
 #elif defined DEBUG_RADIANCE
-		image[iterationPath.pixelIndex] += glm::length(iterationPath.color) / 1.732;
+		// PathSegment::color is not kept in PathState, it never left zero
+		image[index] += glm::length(col) / 1.732;
 #else
         if (isfinite(col.x) && isfinite(col.y) && isfinite(col.z) &&
             !isnan(col.x) && !isnan(col.y) && !isnan(col.z))
-            image[iterationPath.pixelIndex] += col;
-        //image[iterationPath.pixelIndex] += iterationPath.color * iterationPath.throughput;
+            image[index] += col;
 #endif
-		albedo[iterationPath.pixelIndex] += iterationPath.albedo;
-		normal[iterationPath.pixelIndex] += iterationPath.normal;
+		albedo[index] += paths.albedo[index];
+		normal[index] += paths.normal[index];
     }
 }
 
-
-
-struct isValid
+__global__ void computeMaterialKeys(int num_paths, const ShadeableIntersection* intersections, const Material* materials, uint32_t* keys)
 {
-    __host__ __device__ bool operator() (const PathSegment& segment) {
-        return segment.isTerminated();
-    }
-
-};
-
-// first look at intersection, then direct lighting idex, then material id
-struct sortByIsectDIMat
-{
-	__host__ __device__ bool operator() (const ShadeableIntersection& a, const ShadeableIntersection& b) const {
-		if (a.directLightId < b.directLightId) return true;
-		else if (a.directLightId == b.directLightId && a.materialId < b.materialId) return true;
-	}
-};
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx < num_paths)
+        keys[idx] = materialSortKey(intersections[idx], materials);
+}
 
 /**
  * Wrapper for the __global__ call that sets up the kernel calls and does a ton
  * of memory management
  */
-void pathtrace(uchar4* pbo, uchar4* pbo_post, int frame, int iter, bool shadeSimple)
+int pathtrace(uchar4* pbo, uchar4* pbo_post, int frame, int iter, bool shadeSimple)
 {
     
 
@@ -504,21 +769,32 @@ void pathtrace(uchar4* pbo, uchar4* pbo_post, int frame, int iter, bool shadeSim
 
     // TODO: perform one iteration of path tracing
 
-    generateRayFromCamera<<<blocksPerGrid2d, blockSize2d>>>(cam, iter, traceDepth, dev_paths);
+    generateRayFromCamera<<<blocksPerGrid2d, blockSize2d>>>(cam, iter, traceDepth, dev_paths, dev_active_paths, sampler, adaptive);
     checkCUDAError("generate camera ray");
 
     int depth = 0;
 	int curr_paths = pixelcount;
-	thrust::device_ptr<PathSegment> dev_thrust_terminated_paths_end = dev_thrust_terminated_paths;
+	if (adaptive.enabled())
+	{
+		thrust::device_ptr<int> active(dev_active_paths);
+		thrust::device_ptr<int> paths_end = thrust::remove_copy_if(active, active + curr_paths,
+			thrust::device_ptr<int>(dev_next_active_paths), PathTerminated{ dev_paths });
+		curr_paths = paths_end - thrust::device_ptr<int>(dev_next_active_paths);
+		std::swap(dev_active_paths, dev_next_active_paths);
+	}
+	const int samples = curr_paths;
     // --- PathSegment Tracing Stage ---
     // Shoot ray into scene, bounce between objects, push shading chunks
 
-    bool iterationComplete = false;
+    bool iterationComplete = curr_paths == 0;
 
 
 	float totalElapsedTime = 0.0f;
 	int iteration = 0;
     float totalPaths = 0;
+	gpuInfo->bouncePaths.clear();
+	gpuInfo->bounceSortMs.clear();
+	gpuInfo->bounceShadeMs.clear();
     while (!iterationComplete)
     {
 		totalPaths += curr_paths;
@@ -534,22 +810,35 @@ void pathtrace(uchar4* pbo, uchar4* pbo_post, int frame, int iter, bool shadeSim
         computeIntersections << <numblocksPathSegmentTracing, blockSize1d >> > (
             depth,
             curr_paths,
+            dev_active_paths,
             dev_paths,
             dev_geoms,
             hst_scene->geoms.size(),
-            dev_triangles,
-            hst_scene->triangles.size(),
-            dev_nodes,
+            dev_accel,
             dev_intersections,
-			hst_scene->lights.size(),
+			dev_lightSampler,
+			sampler,
 			iter
         );
         
 
        
-		// sort by intersection, then direct lighting index, then material id
-		//thrust::sort_by_key(thrust::device, dev_intersections, dev_intersections + curr_paths, dev_paths, sortByIsectDIMat());
-        
+		// sort the slots and their intersections by (hit, material type, material) so each warp of the
+		// shading kernel mostly takes one BSDF branch; thrust radix sorts the integer keys. Small
+		// bounces are shaded as they are, the sort costs more than the divergence it saves.
+		float sortTime = 0.0f;
+#ifdef SORT_BY_MATERIAL
+		if (curr_paths >= SORT_BY_MATERIAL)
+		{
+			cudaEventRecord(gpuInfo->start);
+			computeMaterialKeys << <numblocksPathSegmentTracing, blockSize1d >> > (curr_paths, dev_intersections, dev_materials, dev_material_keys);
+			thrust::sort_by_key(thrust::device, dev_material_keys, dev_material_keys + curr_paths,
+				thrust::make_zip_iterator(thrust::make_tuple(dev_active_paths, dev_intersections)));
+			cudaEventRecord(gpuInfo->stop);
+			cudaEventSynchronize(gpuInfo->stop);
+			cudaEventElapsedTime(&sortTime, gpuInfo->start, gpuInfo->stop);
+		}
+#endif
 
         cudaEventRecord(gpuInfo->start);
 
@@ -559,33 +848,62 @@ void pathtrace(uchar4* pbo, uchar4* pbo_post, int frame, int iter, bool shadeSim
                 iter,
                 curr_paths,
                 dev_intersections,
+                dev_active_paths,
                 dev_paths,
                 dev_materials,
                 envMap,
-                envMap == NULL ? hst_scene->lights.size() : hst_scene->lights.size() + 1,
-                dev_nodes,
-                dev_triangles,
+                !envMap.valid() ? hst_scene->lights.size() : hst_scene->lights.size() + 1,
+                dev_accel,
                 dev_lights,
+                sampler,
                 depth,
                 depth == 1
                 );
         }
         else
         {
+#if defined SHADE_MATERIAL_QUEUES && !defined DEBUG_BVH
+            // the counts come back to size each queue's launch
+            int queueCounts[NUM_SHADE_QUEUES];
+            cudaMemset(dev_shade_queue_counts, 0, NUM_SHADE_QUEUES * sizeof(int));
+            pushShadeQueues << <numblocksPathSegmentTracing, blockSize1d >> > (curr_paths, dev_intersections, dev_materials,
+                dev_shade_queues, dev_shade_queue_counts, pixelcount);
+            cudaMemcpy(queueCounts, dev_shade_queue_counts, NUM_SHADE_QUEUES * sizeof(int), cudaMemcpyDeviceToHost);
+            int num_lights = !envMap.valid() ? hst_scene->lights.size() : hst_scene->lights.size() + 1;
+            auto queueBlocks = [&](int queue) { return (queueCounts[queue] + blockSize1d - 1) / blockSize1d; };
+            if (queueCounts[(int)MaterialType::DIFFUSE] > 0)
+                shadeMaterialQueue<MaterialType::DIFFUSE> << <queueBlocks((int)MaterialType::DIFFUSE), blockSize1d >> > (iter,
+                    queueCounts[(int)MaterialType::DIFFUSE], dev_shade_queues + (int)MaterialType::DIFFUSE * pixelcount, dev_intersections,
+                    dev_active_paths, dev_paths, dev_materials, envMap, num_lights, dev_accel, dev_lights, sampler, depth, depth == 1);
+            if (queueCounts[(int)MaterialType::MICROFACET] > 0)
+                shadeMaterialQueue<MaterialType::MICROFACET> << <queueBlocks((int)MaterialType::MICROFACET), blockSize1d >> > (iter,
+                    queueCounts[(int)MaterialType::MICROFACET], dev_shade_queues + (int)MaterialType::MICROFACET * pixelcount, dev_intersections,
+                    dev_active_paths, dev_paths, dev_materials, envMap, num_lights, dev_accel, dev_lights, sampler, depth, depth == 1);
+            if (queueCounts[(int)MaterialType::TRANSMIT] > 0)
+                shadeMaterialQueue<MaterialType::TRANSMIT> << <queueBlocks((int)MaterialType::TRANSMIT), blockSize1d >> > (iter,
+                    queueCounts[(int)MaterialType::TRANSMIT], dev_shade_queues + (int)MaterialType::TRANSMIT * pixelcount, dev_intersections,
+                    dev_active_paths, dev_paths, dev_materials, envMap, num_lights, dev_accel, dev_lights, sampler, depth, depth == 1);
+            if (queueCounts[SHADE_QUEUE_TERMINAL] > 0)
+                shadeTerminalQueue << <queueBlocks(SHADE_QUEUE_TERMINAL), blockSize1d >> > (queueCounts[SHADE_QUEUE_TERMINAL],
+                    dev_shade_queues + SHADE_QUEUE_TERMINAL * pixelcount, dev_intersections, dev_active_paths, dev_paths, dev_materials, envMap, dev_lightSampler, dev_lights);
+#else
             shadeMaterialNaive << <numblocksPathSegmentTracing, blockSize1d >> > (
                 iter,
                 curr_paths,
                 dev_intersections,
+                dev_active_paths,
                 dev_paths,
                 dev_materials,
                 envMap,
-                envMap == NULL ? hst_scene->lights.size() : hst_scene->lights.size() + 1,
-                dev_nodes,
-                dev_triangles,
+                !envMap.valid() ? hst_scene->lights.size() : hst_scene->lights.size() + 1,
+                dev_lightSampler,
+                dev_accel,
                 dev_lights,
+                sampler,
                 depth,
                 depth == 1
                 );
+#endif
         }
             
         cudaEventRecord(gpuInfo->stop);
@@ -593,12 +911,19 @@ void pathtrace(uchar4* pbo, uchar4* pbo_post, int frame, int iter, bool shadeSim
         float elapsedTime = 0.0f;
         cudaEventElapsedTime(&elapsedTime, gpuInfo->start, gpuInfo->stop);
         totalElapsedTime += elapsedTime;
-
-        // Implement thrust stream compaction
-		dev_thrust_terminated_paths_end = thrust::copy_if(dev_thrust_paths, dev_thrust_paths + curr_paths, dev_thrust_terminated_paths_end, isValid()); // copy terminated paths to the terminated paths array
-		auto paths_end = thrust::remove_if(dev_thrust_paths, dev_thrust_paths + curr_paths, isValid());
-
-        curr_paths = paths_end - dev_thrust_paths;
+		gpuInfo->bouncePaths.push_back(curr_paths);
+		gpuInfo->bounceSortMs.push_back(sortTime);
+		gpuInfo->bounceShadeMs.push_back(elapsedTime);
+
+        // stream compaction on the slot list, terminated paths stay in their slot for finalGather.
+        // remove_copy_if into the second list is one stable partition pass, remove_if in place
+        // would stage the survivors in a temporary and copy them back.
+		thrust::device_ptr<int> active(dev_active_paths);
+		thrust::device_ptr<int> paths_end = thrust::remove_copy_if(active, active + curr_paths,
+			thrust::device_ptr<int>(dev_next_active_paths), PathTerminated{ dev_paths });
+
+        curr_paths = paths_end - thrust::device_ptr<int>(dev_next_active_paths);
+		std::swap(dev_active_paths, dev_next_active_paths);
         iterationComplete = (curr_paths <= 0 || depth >= traceDepth);
 
         if (guiData != NULL)
@@ -606,32 +931,35 @@ void pathtrace(uchar4* pbo, uchar4* pbo_post, int frame, int iter, bool shadeSim
             guiData->TracedDepth = depth;
         }
     }
-	totalElapsedTime /= iteration;
+	totalElapsedTime /= glm::max(iteration, 1);
 	gpuInfo->elapsedTime = totalElapsedTime;
 	gpuInfo->averagePathPerBounce = depth;
 
     // Assemble this iteration and apply it to the image
     dim3 numBlocksPixels = (pixelcount + blockSize1d - 1) / blockSize1d;
-	int num_terminated_paths = dev_thrust_terminated_paths_end - dev_thrust_terminated_paths;
-    finalGather<<<numBlocksPixels, blockSize1d>>>(num_terminated_paths, dev_image, dev_terminated_paths, dev_albedo, dev_normal);
+    finalGather<<<numBlocksPixels, blockSize1d>>>(pixelcount, iter, dev_image, dev_paths, dev_albedo, dev_normal, adaptive);
     checkCUDAError("trace one bounce");
 #ifdef POSTPROCESS
 	cudaMemcpy(dev_image_post, dev_image, pixelcount * sizeof(glm::vec3), cudaMemcpyDeviceToDevice);
-	sendImageToPBO << <blocksPerGrid2d, blockSize2d >> > (pbo_post, cam.resolution, iter, dev_image_post, true);
-	cudaMemcpy(hst_scene->state.image.data(), dev_image_post,
-		pixelcount * sizeof(glm::vec3), cudaMemcpyDeviceToHost);
+	if (pbo_post != NULL)
+		sendImageToPBO << <blocksPerGrid2d, blockSize2d >> > (pbo_post, cam.resolution, iter, dev_image_post, true);
 #else 
-    // Send results to OpenGL buffer for rendering
-    sendImageToPBO << <blocksPerGrid2d, blockSize2d >> > (pbo, cam.resolution, iter, dev_image, false);
-
-    // Retrieve image from GPU
-    cudaMemcpy(hst_scene->state.image.data(), dev_image,
-        pixelcount * sizeof(glm::vec3), cudaMemcpyDeviceToHost);
-	cudaMemcpy(hst_scene->state.albedo.data(), dev_albedo,
-		pixelcount * sizeof(glm::vec3), cudaMemcpyDeviceToHost);
-	cudaMemcpy(hst_scene->state.normal.data(), dev_normal,
-		pixelcount * sizeof(glm::vec3), cudaMemcpyDeviceToHost);
+    // Send results to OpenGL buffer for rendering, headless renders pass no PBO
+    if (pbo != NULL)
+        sendImageToPBO << <blocksPerGrid2d, blockSize2d >> > (pbo, cam.resolution, iter, dev_image, false);
+#endif
+
+    // the host images are read back lazily: on save, and every READBACK_INTERVAL iterations as a checkpoint
+    size_t readbackBytes = 0;
+#if READBACK_INTERVAL > 0
+    if (iter % READBACK_INTERVAL == 0)
+        readbackBytes = requestReadback(readbackImage());
+    else
 #endif
+        pollReadback(false);
+    gpuInfo->readbackBytes = readbackBytes;
+    gpuInfo->readbackBytesTotal += readbackBytes;
 
     checkCUDAError("pathtrace");
+    return samples;
 }
@@ -7,4 +7,7 @@
 void InitDataContainer(GuiDataContainer* guiData);
 void pathtraceInit(Scene *scene);
 void pathtraceFree();
-void pathtrace(uchar4 *pbo, uchar4* pbo_post, int frame, int iteration, bool shadeSimple);
+// traces one sample for each pixel that wants one, returns how many did; every pixel without adaptive sampling
+int pathtrace(uchar4 *pbo, uchar4* pbo_post, int frame, int iteration, bool shadeSimple);
+// copies the accumulated image, albedo and normal into the scene's host images, blocking
+void pathtraceReadback();
@@ -224,6 +224,8 @@ bool UpdateSlider(const char* label, float* value, float min, float max) {
 }
 Material* mat = nullptr;
 int currentItem = 0;
+int currentGeom = 0;
+int currentInstance = 0;
 
 // LOOK: Un-Comment to check ImGui Usage
 void RenderImGui()
@@ -244,6 +246,9 @@ void RenderImGui()
 	gpuInfo->printElapsedTime(ImGui::Text);
 	ImGui::Text("Triangle Count: %d", gpuInfo->triangleCount);
 	ImGui::Text("Average Path Per Bounce: %f", gpuInfo->averagePathPerBounce);
+	gpuInfo->printBufferPool(ImGui::Text);
+	gpuInfo->printReadback(ImGui::Text);
+	gpuInfo->printBounceTimes(ImGui::Text);
     
     // check box for MIS on and off
 	//ImGui::Checkbox("MIS", &MIS);
@@ -327,6 +332,38 @@ void RenderImGui()
         }
     }
 
+    // move a baked mesh, the BVH is refit instead of rebuilt
+    if (!scene->geoms.empty())
+    {
+        ImGui::SliderInt("Geom", &currentGeom, 0, scene->geoms.size() - 1);
+        Geom& geom = scene->geoms[currentGeom];
+        glm::vec3 translation = geom.translation, rotation = geom.rotation, scale = geom.scale;
+        bool moved = ImGui::DragFloat3("Translation", &translation.x, 0.05f);
+        moved |= ImGui::DragFloat3("Rotation", &rotation.x, 0.5f);
+        moved |= ImGui::DragFloat3("Scale", &scale.x, 0.01f);
+        if (moved)
+        {
+            scene->updateGeomTransform(currentGeom, translation, rotation, scale);
+            iteration = 0;
+        }
+    }
+
+    // instanced meshes are not geoms, they move through the TLAS and keep sharing their BLAS
+    if (!scene->instanceAccel.instances.empty())
+    {
+        ImGui::SliderInt("Instance", &currentInstance, 0, scene->instanceAccel.instances.size() - 1);
+        const Geom& placement = scene->instanceAccel.placements[currentInstance];
+        glm::vec3 translation = placement.translation, rotation = placement.rotation, scale = placement.scale;
+        bool moved = ImGui::DragFloat3("Instance Translation", &translation.x, 0.05f);
+        moved |= ImGui::DragFloat3("Instance Rotation", &rotation.x, 0.5f);
+        moved |= ImGui::DragFloat3("Instance Scale", &scale.x, 0.01f);
+        if (moved)
+        {
+            scene->updateInstanceTransform(currentInstance, translation, rotation, scale);
+            iteration = 0;
+        }
+    }
+
     // add a checkbox for shade simple and check if its status changed
 	if (ImGui::Checkbox("Shade Simple", &shadeSimple))
 	{
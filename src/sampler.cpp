@@ -0,0 +1,183 @@
+#include "sampler.h"
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+namespace
+{
+	int gcd(int a, int b)
+	{
+		while (b != 0)
+		{
+			int t = a % b;
+			a = b;
+			b = t;
+		}
+		return a;
+	}
+
+	// Korobov generator of the n point rank-1 lattice with the largest minimum distance between
+	// points on the torus. Past 4096 points the search gets slow and the golden ratio is close enough.
+	uint32_t latticeGenerator(int n)
+	{
+		if (n <= 2)
+			return 1;
+		if (n > 4096)
+		{
+			int g = (int)std::lround(n * 0.6180339887);
+			while (gcd(g, n) != 1)
+				++g;
+			return g;
+		}
+		uint32_t best = 1;
+		int64_t bestDistance2 = 0;
+		for (int g = 1; g <= n / 2; ++g)
+		{
+			if (gcd(g, n) != 1)
+				continue;
+			// the lattice is closed under subtraction, so the closest pair is the shortest point from 0
+			int64_t distance2 = INT64_MAX;
+			for (int i = 1; i < n && distance2 > bestDistance2; ++i)
+			{
+				int64_t y = (int64_t)i * g % n;
+				int64_t dx = std::min<int64_t>(i, n - i);
+				int64_t dy = std::min<int64_t>(y, n - y);
+				distance2 = std::min(distance2, dx * dx + dy * dy);
+			}
+			if (distance2 > bestDistance2)
+			{
+				bestDistance2 = distance2;
+				best = g;
+			}
+		}
+		return best;
+	}
+
+	// Ulichney's void-and-cluster on a torus: settle a few random points into an even spread, then
+	// rank them by taking out the tightest cluster, and the rest by filling in the largest void
+	std::vector<float> makeBlueNoiseMask()
+	{
+		const int size = BLUE_NOISE_SIZE;
+		const int n = size * size;
+		const float sigma = 1.5f;
+		std::vector<float> gaussian(n);
+		for (int y = 0; y < size; ++y)
+		{
+			for (int x = 0; x < size; ++x)
+			{
+				int dx = std::min(x, size - x);
+				int dy = std::min(y, size - y);
+				gaussian[y * size + x] = std::exp(-(dx * dx + dy * dy) / (2.0f * sigma * sigma));
+			}
+		}
+
+		std::vector<uint8_t> on(n, 0);
+		std::vector<float> energy(n, 0.0f);
+		auto toggle = [&](int p, bool value) {
+			on[p] = value;
+			float sign = value ? 1.0f : -1.0f;
+			int px = p % size, py = p / size;
+			for (int y = 0; y < size; ++y)
+			{
+				for (int x = 0; x < size; ++x)
+					energy[y * size + x] += sign * gaussian[((y - py) & (size - 1)) * size + ((x - px) & (size - 1))];
+			}
+		};
+		auto tightestCluster = [&]() {
+			int best = -1;
+			for (int p = 0; p < n; ++p)
+			{
+				if (on[p] && (best < 0 || energy[p] > energy[best]))
+					best = p;
+			}
+			return best;
+		};
+		auto largestVoid = [&]() {
+			int best = -1;
+			for (int p = 0; p < n; ++p)
+			{
+				if (!on[p] && (best < 0 || energy[p] < energy[best]))
+					best = p;
+			}
+			return best;
+		};
+
+		std::mt19937 rng(0xb1);
+		const int initial = n / 10;
+		for (int placed = 0; placed < initial;)
+		{
+			int p = rng() % n;
+			if (!on[p])
+			{
+				toggle(p, true);
+				++placed;
+			}
+		}
+		for (int iteration = 0; iteration < n; ++iteration)
+		{
+			int cluster = tightestCluster();
+			toggle(cluster, false);
+			int hole = largestVoid();
+			toggle(hole, true);
+			if (hole == cluster)
+				break;
+		}
+
+		std::vector<int> rank(n);
+		std::vector<uint8_t> prototype = on;
+		std::vector<float> prototypeEnergy = energy;
+		for (int r = initial - 1; r >= 0; --r)
+		{
+			int cluster = tightestCluster();
+			rank[cluster] = r;
+			toggle(cluster, false);
+		}
+		on.swap(prototype);
+		energy.swap(prototypeEnergy);
+		for (int r = initial; r < n; ++r)
+		{
+			int hole = largestVoid();
+			rank[hole] = r;
+			toggle(hole, true);
+		}
+
+		std::vector<float> mask(n);
+		for (int p = 0; p < n; ++p)
+			mask[p] = (rank[p] + 0.5f) / n;
+		return mask;
+	}
+}
+
+Sampler makeSampler(SamplerType type, int samplesPerPixel, int width)
+{
+	Sampler sampler;
+	sampler.type = type;
+	sampler.samplesPerPixel = std::max(samplesPerPixel, 1);
+	sampler.width = std::max(width, 1);
+	int side = (int)std::lround(std::sqrt((double)sampler.samplesPerPixel));
+	if (type == SamplerType::Stratified && side * side == sampler.samplesPerPixel)
+		sampler.strataPerAxis = side;
+	if (type == SamplerType::BlueNoise)
+	{
+		sampler.latticeGenerator = latticeGenerator(sampler.samplesPerPixel);
+		sampler.hostBlueNoise = blueNoiseMask().data();
+	}
+	return sampler;
+}
+
+const std::vector<float>& blueNoiseMask()
+{
+	static const std::vector<float> mask = makeBlueNoiseMask();
+	return mask;
+}
+
+const char* samplerName(SamplerType type)
+{
+	switch (type)
+	{
+	case SamplerType::Stratified: return "stratified";
+	case SamplerType::Sobol: return "Sobol";
+	case SamplerType::BlueNoise: return "blue noise";
+	default: return "independent";
+	}
+}
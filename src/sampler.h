@@ -0,0 +1,230 @@
+#pragma once
+#include "utilities.h"
+#include <vector>
+
+// Sample sequences for the path tracer. Every random number a path draws is a dimension of its
+// pixel's sample. SampleDimension gives each bounce a block of dimensions with a fixed place for
+// each purpose, so the camera, light and BSDF decisions of a bounce never share a stream and a
+// decision lines up with the same one in the pixel's other samples. Dimensions come in pairs, and
+// every pair is padded with its own scrambling as in pbrt's padded samplers:
+//   Independent  hashed white noise
+//   Stratified   every dimension jittered in samplesPerPixel strata, shuffled per pixel and dimension. When
+//                samplesPerPixel is a square, pairs are correlated multi-jittered (Kensler 2013), a jittered
+//                grid whose columns and rows are also stratified
+//   Sobol        the first two Sobol dimensions, index shuffled and Owen scrambled per pixel and pair (Burley 2020)
+//   BlueNoise    a rank-1 lattice of samplesPerPixel points, shifted per pixel by a blue noise mask so
+//                neighbouring pixels make errors that cancel out at a glance (Heitz and Belcour 2019)
+enum class SamplerType { Independent, Stratified, Sobol, BlueNoise };
+
+enum SampleDimension
+{
+	SAMPLE_CAMERA = 0,     // 2: jitter in the pixel, bounce 0 only
+	SAMPLE_LIGHT_PICK = 2, // 1: the light computeIntersections picks
+	SAMPLE_ROULETTE = 3,   // 1
+	SAMPLE_BSDF = 4,       // 2: lobe or direction of the BSDF sample
+	SAMPLE_LIGHT = 6,      // 2: point on the light or direction to the environment
+	SAMPLE_DIMENSIONS_PER_BOUNCE = 8
+};
+
+#define BLUE_NOISE_SIZE 64 // texels per side of the tiled blue noise mask
+
+namespace sampling
+{
+	// pbrt's MixBits, a 64 bit finalizer
+	__inline__ __host__ __device__ uint64_t mixBits(uint64_t v)
+	{
+		v ^= v >> 31;
+		v *= 0x7fb5d329728ea185ull;
+		v ^= v >> 27;
+		v *= 0x81dadef4bc2dd44dull;
+		v ^= v >> 33;
+		return v;
+	}
+
+	__inline__ __host__ __device__ uint32_t hash(uint32_t a, uint32_t b, uint32_t c = 0)
+	{
+		return (uint32_t)(mixBits(mixBits(((uint64_t)a << 32) | b) ^ (c * 0x9e3779b97f4a7c15ull)) >> 32);
+	}
+
+	__inline__ __host__ __device__ uint32_t reverseBits(uint32_t v)
+	{
+#ifdef __CUDA_ARCH__
+		return __brev(v);
+#else
+		v = ((v >> 1) & 0x55555555u) | ((v & 0x55555555u) << 1);
+		v = ((v >> 2) & 0x33333333u) | ((v & 0x33333333u) << 2);
+		v = ((v >> 4) & 0x0f0f0f0fu) | ((v & 0x0f0f0f0fu) << 4);
+		v = ((v >> 8) & 0x00ff00ffu) | ((v & 0x00ff00ffu) << 8);
+		return (v >> 16) | (v << 16);
+#endif
+	}
+
+	// Owen scrambling of the bits of v from the top, with the Laine-Karras hash of Burley 2020
+	__inline__ __host__ __device__ uint32_t owenScramble(uint32_t v, uint32_t seed)
+	{
+		v = reverseBits(v);
+		v += seed;
+		v ^= v * 0x6c50b47cu;
+		v ^= v * 0xb82f1e52u;
+		v ^= v * 0xc7afe638u;
+		v ^= v * 0x8d22f6e6u;
+		return reverseBits(v);
+	}
+
+	// second Sobol dimension, its direction numbers are v_k = v_k-1 ^ (v_k-1 >> 1); the first is reverseBits
+	__inline__ __host__ __device__ uint32_t sobol1(uint32_t index)
+	{
+		uint32_t result = 0;
+		for (uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1)
+		{
+			if (index & 1)
+				result ^= v;
+		}
+		return result;
+	}
+
+	// element i of a random permutation of [0, n) chosen by seed, Kensler's cycle walking hash
+	__inline__ __host__ __device__ uint32_t permutationElement(uint32_t i, uint32_t n, uint32_t seed)
+	{
+		uint32_t w = n - 1;
+		w |= w >> 1;
+		w |= w >> 2;
+		w |= w >> 4;
+		w |= w >> 8;
+		w |= w >> 16;
+		do
+		{
+			i ^= seed;
+			i *= 0xe170893du;
+			i ^= seed >> 16;
+			i ^= (i & w) >> 4;
+			i ^= seed >> 8;
+			i *= 0x0929eb3fu;
+			i ^= seed >> 23;
+			i ^= (i & w) >> 1;
+			i *= 1 | seed >> 27;
+			i *= 0x6935fa69u;
+			i ^= (i & w) >> 11;
+			i *= 0x74dcb303u;
+			i ^= (i & w) >> 2;
+			i *= 0x9e501cc3u;
+			i ^= (i & w) >> 2;
+			i *= 0xc860a3dfu;
+			i &= w;
+			i ^= i >> 5;
+		} while (i >= n);
+		return (i + seed) % n;
+	}
+}
+
+// The sample sequence of every pixel, passed to the kernels by value. Samples past samplesPerPixel
+// start over with new strata shuffles and lattice shifts.
+struct Sampler
+{
+	SamplerType type = SamplerType::Independent;
+	int samplesPerPixel = 1;       // strata of Stratified, points of the BlueNoise lattice
+	uint32_t latticeGenerator = 1; // the BlueNoise lattice's points are (i, i * latticeGenerator) / samplesPerPixel
+	uint32_t strataPerAxis = 0;    // Stratified: the square root of samplesPerPixel, 0 when it isn't a square
+	int width = 1;                 // of the image, pixel indices are x + y * width
+	const float* hostBlueNoise = nullptr;   // BLUE_NOISE_SIZE^2 ranks in [0, 1), read by host code
+	const float* deviceBlueNoise = nullptr; // read by the kernels
+	const int* pixelSamples = nullptr;      // with adaptive sampling a pixel's sample index is the count of samples it took, not the iteration
+
+	// dimension of sample sampleIndex of pixel as a fraction of 2^32
+	__host__ __device__ uint32_t bits(uint32_t pixel, uint32_t sampleIndex, uint32_t dimension) const
+	{
+		uint32_t pair = dimension >> 1;
+		uint32_t component = dimension & 1;
+		uint32_t n = samplesPerPixel;
+		switch (type)
+		{
+		case SamplerType::Stratified:
+		{
+			uint32_t stratum;
+			if (strataPerAxis > 1)
+			{
+				// cell (column, row) of the grid, and the column or row of its stratum inside the cell
+				uint32_t m = strataPerAxis;
+				uint32_t cell = sampling::permutationElement(sampleIndex % n, n, sampling::hash(pixel, pair, sampleIndex / n));
+				uint32_t major = component == 0 ? cell % m : cell / m;
+				uint32_t minor = component == 0 ? cell / m : cell % m;
+				stratum = major * m + sampling::permutationElement(minor, m, sampling::hash(pixel, dimension, sampleIndex / n));
+			}
+			else
+			{
+				stratum = sampling::permutationElement(sampleIndex % n, n, sampling::hash(pixel, dimension, sampleIndex / n));
+			}
+			uint32_t jitter = sampling::hash(pixel, sampleIndex, dimension);
+			return (uint32_t)((((uint64_t)stratum << 32) | jitter) / n);
+		}
+		case SamplerType::Sobol:
+		{
+			uint32_t seed = sampling::hash(pixel, pair, 0x50b01u);
+			uint32_t index = sampling::owenScramble(sampleIndex, seed);
+			uint32_t v = component == 0 ? sampling::reverseBits(index) : sampling::sobol1(index);
+			return sampling::owenScramble(v, sampling::hash(seed, component));
+		}
+		case SamplerType::BlueNoise:
+		{
+			// every pixel walks the lattice in the same order, only the shift differs
+			uint32_t period = sampleIndex / n;
+			uint32_t point = sampling::permutationElement(sampleIndex % n, n, sampling::hash(pair, period, 0xb1u));
+			uint32_t coordinate = component == 0 ? point : (uint32_t)((uint64_t)point * latticeGenerator % n);
+			uint32_t offset = sampling::hash(dimension, period, 0xb2u);
+			uint32_t x = (pixel % width + offset) % BLUE_NOISE_SIZE;
+			uint32_t y = (pixel / width + (offset >> 16)) % BLUE_NOISE_SIZE;
+#ifdef __CUDA_ARCH__
+			float rank = deviceBlueNoise[y * BLUE_NOISE_SIZE + x];
+#else
+			float rank = hostBlueNoise[y * BLUE_NOISE_SIZE + x];
+#endif
+			return (uint32_t)(((uint64_t)coordinate << 32) / n) + (uint32_t)(rank * 4294967296.0f);
+		}
+		default:
+			return sampling::hash(pixel, sampleIndex, dimension);
+		}
+	}
+
+	__host__ __device__ float get(uint32_t pixel, uint32_t sampleIndex, uint32_t dimension) const
+	{
+		return (bits(pixel, sampleIndex, dimension) >> 8) * (1.0f / 16777216.0f);
+	}
+};
+
+// Sampler of type for renders of samplesPerPixel samples width pixels wide. The device blue noise
+// mask is left to the caller, the kernels need a copy of blueNoiseMask() for BlueNoise.
+Sampler makeSampler(SamplerType type, int samplesPerPixel, int width);
+// void-and-cluster ranks, BLUE_NOISE_SIZE^2 of them in [0, 1), made on first use
+const std::vector<float>& blueNoiseMask();
+const char* samplerName(SamplerType type);
+
+// The random numbers of one path. It is a UniformRandomNumberGenerator the way thrust's
+// distributions use one, so thrust::uniform_real_distribution draws the path's next dimension.
+// startDimension moves to the dimensions of a bounce and purpose.
+struct PathSampler
+{
+	typedef uint32_t result_type;
+	static const result_type min = 0;
+	static const result_type max = (1u << 24) - 1; // floats made from 24 bits stay below 1
+
+	Sampler sampler;
+	uint32_t pixel;
+	uint32_t sampleIndex;
+	uint32_t dimension;
+
+	__host__ __device__ PathSampler(const Sampler& sampler, int pixel, int sampleIndex, int bounce, int purpose)
+		: sampler(sampler), pixel(pixel), sampleIndex(sampler.pixelSamples ? sampler.pixelSamples[pixel] : sampleIndex),
+		dimension(bounce * SAMPLE_DIMENSIONS_PER_BOUNCE + purpose)
+	{
+	}
+
+	__host__ __device__ void startDimension(int bounce, int purpose)
+	{
+		dimension = bounce * SAMPLE_DIMENSIONS_PER_BOUNCE + purpose;
+	}
+
+	__host__ __device__ result_type operator()()
+	{
+		return sampler.bits(pixel, sampleIndex, dimension++) >> 8;
+	}
+};
@@ -1,5 +1,6 @@
 ﻿#include <iostream>
 #include <cstring>
+#include <algorithm>
 #include <glm/gtc/matrix_inverse.hpp>
 #include <glm/gtx/string_cast.hpp>
 #include <unordered_map>
@@ -9,7 +10,8 @@ using json = nlohmann::json;
 
 std::vector<std::string>  materialIdx;
 
-Scene::Scene(string filename) : envMap(nullptr), bvh(nullptr)
+Scene::Scene(string filename) : envMap(nullptr), bvh(nullptr), sceneFile(filename),
+	bvhSplitMethod(BVHAccel::SplitMethod::HLBVH), bvhSAHBins(BVH_SAH_BINS)
 {
     cout << "Reading scene from " << filename << " ..." << endl;
     cout << " " << endl;
@@ -26,6 +28,17 @@ Scene::Scene(string filename) : envMap(nullptr), bvh(nullptr)
     }
 }
 
+std::string Scene::resolvePath(const std::string& path) const
+{
+	// absolute: "/...", "\\..." or a drive letter
+	if (path.empty() || path[0] == '/' || path[0] == '\\' || (path.size() > 1 && path[1] == ':'))
+		return path;
+	size_t slash = sceneFile.find_last_of("/\\");
+	if (slash == string::npos)
+		return path;
+	return sceneFile.substr(0, slash + 1) + path;
+}
+
 Scene::~Scene()
 {
 	delete envMap;
@@ -141,6 +154,7 @@ void Scene::loadFromJSON(const std::string& jsonName)
     float fovy = cameraData["FOVY"];
     state.iterations = cameraData["ITERATIONS"];
     state.traceDepth = cameraData["DEPTH"];
+    state.adaptiveThreshold = cameraData.contains("ADAPTIVE") ? (float)cameraData["ADAPTIVE"] : (float)ADAPTIVE_SAMPLING;
     state.imageName = cameraData["FILE"];
     const auto& pos = cameraData["EYE"];
     const auto& lookat = cameraData["LOOKAT"];
@@ -172,7 +186,24 @@ void Scene::loadFromJSON(const std::string& jsonName)
 	if (data.contains("Environment"))
 	{
 		const auto& env = data["Environment"];
-		this->envMapPath = env["FILENAME"];
+		this->envMapPath = resolvePath(env["FILENAME"]);
+	}
+
+	// BVH builder, "HLBVH" (default) or "SAH"
+	if (data.contains("BVH"))
+	{
+		const auto& bvhData = data["BVH"];
+		if (bvhData.contains("BUILDER"))
+		{
+			std::string builder(bvhData["BUILDER"]);
+			if (builder == "SAH")
+				bvhSplitMethod = BVHAccel::SplitMethod::SAH;
+			else if (builder == "HLBVH")
+				bvhSplitMethod = BVHAccel::SplitMethod::HLBVH;
+			else
+				cout << "Unknown BVH builder " << builder << ", using HLBVH" << endl;
+		}
+		if (bvhData.contains("BINS")) bvhSAHBins = bvhData["BINS"];
 	}
 
 	// set up lights
@@ -208,70 +239,48 @@ void Scene::loadFromJSON(const std::string& jsonName)
 				mat.emittance = 1.0f;
 			}
 			newLight.lightid = lights.size();
-			addMaterial(mat);
+			// lights that look the same share their material, scenes can have far more lights than material ids
+			auto sameLight = std::find_if(materials.begin(), materials.end(), [&mat](const Material& m) {
+				return m.isLight && m.color == mat.color && m.emittance == mat.emittance && m.roughness == mat.roughness;
+			});
+			if (sameLight != materials.end())
+				mat.materialId = sameLight->materialId;
+			else
+				addMaterial(mat);
 			
 			newLight.materialid = mat.materialId;
 			newLight.triangleStartIdx = newLight.triangleEndIdx = -1;
 			if (type == "Area")
 			{
-				newLight.triangleStartIdx = triangles.size();
-				newLight.triangleEndIdx = triangles.size() + 2;
-
 				// create a square and add to triangles
-				Triangle tri1;
-				tri1.vertices[0] = glm::vec3(-1, 1, 0);
-				tri1.vertices[1] = glm::vec3(-1, -1, 0);
-				tri1.vertices[2] = glm::vec3(1, -1, 0);
-				tri1.normals[0] = glm::vec3(0, 0, 1);
-				tri1.normals[1] = glm::vec3(0, 0, 1);
-				tri1.normals[2] = glm::vec3(0, 0, 1);
-				tri1.hasNormals = false;
-
-				Triangle tri2;
-				tri2.vertices[0] = glm::vec3(-1, 1, 0);
-				tri2.vertices[1] = glm::vec3(1, -1, 0);
-				tri2.vertices[2] = glm::vec3(1, 1, 0);
-				tri2.normals[0] = glm::vec3(0, 0, 1);
-				tri2.normals[1] = glm::vec3(0, 0, 1);
-				tri2.normals[2] = glm::vec3(0, 0, 1);
-				tri2.hasNormals = false;
-
-				triangles.push_back(std::move(tri1));
-				triangles.push_back(std::move(tri2));
-
-				updateTriangleTransform(newLight, triangles);
+				IndexedMesh square;
+				square.positions = { glm::vec3(-1, 1, 0), glm::vec3(-1, -1, 0), glm::vec3(1, -1, 0), glm::vec3(1, 1, 0) };
+				square.normals.resize(square.positions.size());
+				square.uvs.resize(square.positions.size());
+				square.indices = { 0, 1, 2, 0, 2, 3 };
+				addGeomMesh(newLight, square);
 
 				light.lightType = AREALIGHT;
 			}
 			else if (type == "AreaSphere")
 			{
-				glm::vec3 indices[16];
-				indices[0] = { 0, 0, 0 };
+				// a fan of 15 triangles around the center vertex
+				IndexedMesh disc;
+				disc.positions.push_back(glm::vec3(0, 0, 0));
 				for (int i = 1; i < 16; ++i)
 				{
 					float theta = 2 * PI * i / 15;
-					indices[i] = { cos(theta), sin(theta) , 0};
+					disc.positions.push_back(glm::vec3(cos(theta), sin(theta), 0));
 				}
-				newLight.triangleStartIdx = triangles.size();
-				newLight.triangleEndIdx = triangles.size() + 15;
-				
-				for (int i = 1; i < 15; ++i)
+				disc.normals.resize(disc.positions.size());
+				disc.uvs.resize(disc.positions.size());
+				for (int i = 1; i < 16; ++i)
 				{
-					Triangle tri;
-					tri.vertices[0] = indices[i];
-					tri.vertices[1] = indices[0];
-					tri.vertices[2] = indices[i + 1];
-					tri.hasNormals = false;
-					triangles.push_back(std::move(tri));
+					disc.indices.push_back(i);
+					disc.indices.push_back(0);
+					disc.indices.push_back(i < 15 ? i + 1 : 1);
 				}
-				Triangle ltri;
-				ltri.vertices[0] = indices[15];
-				ltri.vertices[1] = indices[0];
-				ltri.vertices[2] = indices[1];
-				ltri.hasNormals = false;
-				triangles.push_back(std::move(ltri));
-
-				updateTriangleTransform(newLight, triangles);
+				addGeomMesh(newLight, disc);
 				light.area = 2 * PI;
 				light.lightType = AREASPHERE;
 			}
@@ -291,7 +300,7 @@ void Scene::loadFromJSON(const std::string& jsonName)
 			light.transform = newLight.transform;
 			light.inverseTransform = newLight.inverseTransform;
 			light.emission = mat.color * mat.emittance;
-			light.area = (float)scale[0] * (float)scale[1];
+			light.area = 4.0f * (float)scale[0] * (float)scale[1];
 			// print light info
 			printf("Light %s\n", type.c_str());
 			// print light transform
@@ -308,19 +317,61 @@ void Scene::createCube(uint32_t materialid, glm::vec3 translation, glm::vec3 rot
 {
     printf("create cube\n");
 
-	loadObj("D:/Fall2024/CIS5650/Project3-CUDA-Path-Tracer/scenes/objs/cube.obj", materialid, translation, rotation, scale);
+	loadObj("objs/cube.obj", materialid, translation, rotation, scale);
 }
 
 void Scene::createSphere(uint32_t materialid, glm::vec3 translation, glm::vec3 rotation, glm::vec3 scale, int latitudeSegments, int longitudeSegments)
 {
     printf("create sphere\n");
-	loadObj("D:/Fall2024/CIS5650/Project3-CUDA-Path-Tracer/scenes/objs/sphere.obj", materialid, translation, rotation, scale);
+	loadObj("objs/sphere.obj", materialid, translation, rotation, scale);
 }
 
 
 void Scene::loadObj(const std::string& filename, uint32_t materialid, glm::vec3 translation, glm::vec3 rotation, glm::vec3 scale)
 {
-	
+	// meshes are read in finalizeMeshes() once every placement is known, so repeated meshes can be instanced
+	MeshPlacement placement;
+	placement.filename = resolvePath(filename);
+	placement.materialid = materialid;
+	placement.translation = translation;
+	placement.rotation = rotation;
+	placement.scale = scale;
+	pendingMeshes.push_back(placement);
+}
+
+// obj corners that share position, normal and uv indices become one pool vertex
+struct ObjCornerHash
+{
+	size_t operator()(const tinyobj::index_t& idx) const
+	{
+		return ((size_t)idx.vertex_index * 73856093) ^ ((size_t)idx.normal_index * 19349663) ^ ((size_t)idx.texcoord_index * 83492791);
+	}
+};
+struct ObjCornerEqual
+{
+	bool operator()(const tinyobj::index_t& a, const tinyobj::index_t& b) const
+	{
+		return a.vertex_index == b.vertex_index && a.normal_index == b.normal_index && a.texcoord_index == b.texcoord_index;
+	}
+};
+
+// maps every attribute index to the first index holding the same values; exporters often write
+// one normal per face corner, this lets those corners share a vertex again
+static std::vector<int> dedupeAttributes(const std::vector<tinyobj::real_t>& values, int stride)
+{
+	std::unordered_map<std::string, int> firstIndex;
+	std::vector<int> remap(values.size() / stride);
+	for (size_t i = 0; i < remap.size(); ++i)
+	{
+		std::string key((const char*)&values[i * stride], stride * sizeof(tinyobj::real_t));
+		remap[i] = firstIndex.emplace(key, (int)i).first->second;
+	}
+	return remap;
+}
+
+// object space indexed mesh of every shape in an obj file
+static void readObjShapes(const std::string& filename, std::vector<IndexedMesh>& meshShapes)
+{
 	printf("load obj\n");
 	tinyobj::attrib_t attrib;
 	std::vector<tinyobj::shape_t> shapes;
@@ -333,60 +384,141 @@ void Scene::loadObj(const std::string& filename, uint32_t materialid, glm::vec3
 		throw std::runtime_error(warn + err);
 	}
     printf("material size: %d\n", meshMaterials.size());
+	std::vector<int> normalRemap = dedupeAttributes(attrib.normals, 3);
+	std::vector<int> texcoordRemap = dedupeAttributes(attrib.texcoords, 2);
 	for (const auto& shape : shapes)
 	{
-		Geom newMesh;
-		newMesh.type = MESH;
-		newMesh.materialid = materialid;
-        Scene::updateTransform(newMesh, translation, rotation, scale);
-		
-
         if (shape.mesh.num_face_vertices[0] != 3)
         {
             throw std::runtime_error("Only triangles are supported");
         }
 
-		newMesh.triangleStartIdx = triangles.size();
-        newMesh.triangleEndIdx = triangles.size();
+		meshShapes.emplace_back();
+		IndexedMesh& mesh = meshShapes.back();
+		mesh.hasNormals = attrib.normals.size() > 0;
+		std::unordered_map<tinyobj::index_t, uint32_t, ObjCornerHash, ObjCornerEqual> corners;
         // assume only triangles
-		for (size_t f = 0; f < shape.mesh.indices.size(); f += 3)
+		for (tinyobj::index_t idx : shape.mesh.indices)
 		{
-			Triangle tri;
-			for (size_t v = 0; v < 3; v++)
+			if (idx.normal_index >= 0)
+				idx.normal_index = normalRemap[idx.normal_index];
+			if (idx.texcoord_index >= 0)
+				idx.texcoord_index = texcoordRemap[idx.texcoord_index];
+			auto corner = corners.find(idx);
+			if (corner == corners.end())
 			{
-				const auto& idx = shape.mesh.indices[f + v];
-				tri.vertices[v] = glm::vec3(
+				corner = corners.emplace(idx, (uint32_t)mesh.positions.size()).first;
+				mesh.positions.push_back(glm::vec3(
 					attrib.vertices[3 * idx.vertex_index + 0],
 					attrib.vertices[3 * idx.vertex_index + 1],
 					attrib.vertices[3 * idx.vertex_index + 2]
-				);
-				if (attrib.normals.size() > 0)
+				));
+				glm::vec3 normal(0.0f);
+				if (attrib.normals.size() > 0 && idx.normal_index >= 0)
 				{
-					tri.normals[v] = glm::vec3(
+					normal = glm::vec3(
 						attrib.normals[3 * idx.normal_index + 0],
 						attrib.normals[3 * idx.normal_index + 1],
 						attrib.normals[3 * idx.normal_index + 2]
 					);
 				}
-				if (attrib.texcoords.size() > 0)
+				mesh.normals.push_back(normal);
+				glm::vec2 uv(0.0f);
+				if (attrib.texcoords.size() > 0 && idx.texcoord_index >= 0)
 				{
-					tri.uvs[v] = glm::vec2(
+					uv = glm::vec2(
 						attrib.texcoords[2 * idx.texcoord_index + 0],
 						attrib.texcoords[2 * idx.texcoord_index + 1]
 					);
 				}
-				tri.hasNormals = attrib.normals.size() > 0;
+				mesh.uvs.push_back(uv);
 			}
-            triangles.push_back(std::move(tri));
-			newMesh.triangleEndIdx++;
+			mesh.indices.push_back(corner->second);
 		}
-		printf("Loaded %s with %d triangles\n", filename.c_str(), newMesh.triangleEndIdx - newMesh.triangleStartIdx);
+		printf("Loaded %s with %d triangles, %d vertices\n", filename.c_str(), mesh.numTriangles(), (int)mesh.positions.size());
+	}
+}
 
-		updateTriangleTransform(newMesh, triangles);
-		geoms.push_back(newMesh);
+void Scene::finalizeMeshes()
+{
+	if (pendingMeshes.empty())
+		return;
+	std::unordered_map<std::string, std::vector<const MeshPlacement*>> placementsByFile;
+	std::vector<std::string> files;
+	for (const MeshPlacement& placement : pendingMeshes)
+	{
+		auto& placements = placementsByFile[placement.filename];
+		if (placements.empty())
+			files.push_back(placement.filename);
+		placements.push_back(&placement);
+	}
+
+	size_t bakedEquivalent = 0;
+	int nInstancedMeshes = 0;
+	for (const std::string& file : files)
+	{
+		const auto& placements = placementsByFile[file];
+		std::vector<IndexedMesh> meshShapes;
+		readObjShapes(file, meshShapes);
+
+#ifdef USE_INSTANCING
+		// small meshes are cheaper baked than behind a TLAS hop, and instanced triangles carry no light id,
+		// so a placement with an emissive material keeps the whole file baked
+		int nObjectTriangles = 0;
+		for (const IndexedMesh& shape : meshShapes)
+			nObjectTriangles += shape.numTriangles();
+		bool emissive = std::any_of(placements.begin(), placements.end(), [this](const MeshPlacement* placement) {
+			return materials[placement->materialid].emittance > 0.f;
+		});
+		if (placements.size() > 1 && nObjectTriangles >= INSTANCING_MIN_TRIANGLES && !emissive)
+		{
+			// one object space BLAS for the whole file, one instance per placement
+			AABB objectBounds;
+			int blasRoot = instanceAccel.addMesh(meshShapes, objectBounds);
+			for (const MeshPlacement* placement : placements)
+			{
+				Geom instance;
+				Scene::updateTransform(instance, placement->translation, placement->rotation, placement->scale);
+				instanceAccel.addInstance(blasRoot, objectBounds, instance, placement->materialid);
+			}
+			bakedEquivalent += placements.size() * nObjectTriangles;
+			++nInstancedMeshes;
+			continue;
+		}
+#endif
+
+		for (const MeshPlacement* placement : placements)
+		{
+			for (const IndexedMesh& shape : meshShapes)
+			{
+				Geom newMesh;
+				newMesh.type = MESH;
+				newMesh.materialid = placement->materialid;
+				Scene::updateTransform(newMesh, placement->translation, placement->rotation, placement->scale);
+				addGeomMesh(newMesh, shape);
+				geoms.push_back(newMesh);
+			}
+		}
+	}
+	pendingMeshes.clear();
+
+	if (!instanceAccel.instances.empty())
+	{
+		instanceAccel.buildTLAS();
+		printf("Instancing: %d instances of %d meshes, %zu BLAS triangles instead of %zu baked, %.2f MB\n",
+			(int)instanceAccel.instances.size(), nInstancedMeshes, instanceAccel.blasTriangleHits.size(), bakedEquivalent,
+			instanceAccel.memoryBytes() / (1024.f * 1024.f));
 	}
 }
 
+void Scene::addGeomMesh(Geom& geom, const IndexedMesh& mesh)
+{
+	geom.triangleStartIdx = meshPool.triangles.size();
+	geom.vertexStartIdx = meshPool.append(mesh, geom.transform, geom.materialid, geom.lightid);
+	geom.vertexEndIdx = meshPool.numVertices();
+	geom.triangleEndIdx = meshPool.triangles.size();
+}
+
 void Scene::addMaterial(Material& m, const std::string& name)
 {
 	m.materialId = materials.size();
@@ -394,21 +526,21 @@ void Scene::addMaterial(Material& m, const std::string& name)
 	materialIdx.push_back(name);
 }
 
-void Scene::loadEnvMap() {
+void Scene::loadEnvMap(bool upload) {
 	if (envMapPath == "")
 	{
 		printf("No environment map specified\n");
 		return;
 	}
-	loadEnvMap(envMapPath.c_str());
+	loadEnvMap(envMapPath.c_str(), upload);
 }
 
-void Scene::loadEnvMap(const char* filename)
+void Scene::loadEnvMap(const char* filename, bool upload)
 {
     if (envMap)
         delete envMap;
     envMap = nullptr;
-	envMap = new Texture(filename);
+	envMap = new Texture(filename, upload);
 	printf("Loaded environment map %s\n", filename);
     //printf("cuda texture object created: %d\n", envMap->texObj);
 }
@@ -424,32 +556,194 @@ void Scene::updateTransform(Geom& geom, glm::vec3 translation, glm::vec3 rotatio
     geom.invTranspose = glm::inverseTranspose(geom.transform);
 }
 
-void Scene::updateTriangleTransform(const Geom& geom, std::vector<Triangle>& triangles)
-{
-    for (int i = geom.triangleStartIdx; i < geom.triangleEndIdx; ++i)
-    {
-        auto& tri = triangles[i];
-        for (int j = 0; j < 3; ++j)
-        {
-            tri.vertices[j] = glm::vec3(geom.transform * glm::vec4(tri.vertices[j], 1.0f));
-			
-            tri.normals[j] = glm::normalize(glm::vec3(geom.invTranspose * glm::vec4(tri.normals[j], 0.0f)));
-        }
-		tri.materialid = geom.materialid;
-		tri.lightid = geom.lightid;
-    }
-}
-
 
-void Scene::createBVH()
+void Scene::createBVH(bool upload, bool useCache)
 {
+	finalizeMeshes();
     if (bvh != nullptr)
     {
+		// back to load order so geom triangle ranges stay valid after the new build
+		meshPool.restoreOrder(bvh->triangleOrder);
         delete bvh;
     }
-    bvh = new BVHAccel(this->triangles, this->triangles.size(), 4);
-	bvh->build(this->triangles, this->triangles.size());
+	// the builders work on Triangles, the expanded copy only lives for the build
+	std::vector<Triangle> triangles = expandTriangles();
+    bvh = new BVHAccel(triangles, triangles.size(), 4);
+	if (useCache)
+		bvh->cachePath = sceneFile + ".bvhcache";
+	bvh->splitMethod = bvhSplitMethod;
+	bvh->nSAHBins = bvhSAHBins;
+	bvh->mortonScratch = &mortonScratch;
+	bvh->build(triangles, triangles.size());
+	bvh->primitives.clear(); // points into triangles
+	// keep the pool triangles at the slots the build moved their Triangle copies to
+	meshPool.reorder(bvh->triangleOrder);
+	triangleHits.resize(triangles.size());
+	for (size_t i = 0; i < triangles.size(); ++i)
+		triangleHits[i] = TriangleHit(triangles[i]);
+#ifdef QUANTIZED_BVH
+	quantizedBVH.compress(bvh->nodes, bvh->bvhNodes);
+#endif
+#if CPU_BVH_WIDTH > 0
+	// only the host traverses it
+	wideBVH.collapse(bvh->nodes, upload ? 0 : bvh->bvhNodes);
+#endif
+	// the power of lights at infinity depends on how large the scene is
+	AABB sceneBounds;
+	if (!triangleHits.empty())
+		sceneBounds = bvh->nodes[0].bounds;
+	if (!instanceAccel.tlasNodes.empty())
+		sceneBounds = AABB::Union(sceneBounds, instanceAccel.tlasNodes[0].bounds);
+#if defined(USE_LIGHT_BVH)
+	lightBVH.build(lights, envMap != nullptr ? envMap->view() : EnvMap(), sceneBounds, LightBVH::Strategy::BVH);
+#elif defined(USE_POWER_LIGHT_SELECTION)
+	lightBVH.build(lights, envMap != nullptr ? envMap->view() : EnvMap(), sceneBounds, LightBVH::Strategy::Power);
+#else
+	lightBVH.build(lights, envMap != nullptr ? envMap->view() : EnvMap(), sceneBounds, LightBVH::Strategy::Uniform);
+#endif
+	if (upload)
+	{
+		lightBVH.upload(dev_lightSampler);
+#ifdef QUANTIZED_BVH
+		quantizedBVH.upload(dev_accel.quantizedNodes);
+#else
+		bvh->uploadNodes();
+#endif
+		meshPool.upload(dev_accel.mesh);
+		// instances don't change when the world BVH is rebuilt
+		if (dev_accel.instances == nullptr)
+			instanceAccel.upload(dev_accel);
+	}
     printf("BVH created\n");
+	// everything below is kept on the host, and mirrored on the device when uploaded
+	const float MB = 1024.f * 1024.f;
+	size_t poolBytes = meshPool.memoryBytes();
+	size_t hitBytes = triangleHits.size() * sizeof(TriangleHit);
+	size_t nodeBytes = bvh->bvhNodes * sizeof(BVHAccel::LinearBVHNode);
+	size_t instanceBytes = instanceAccel.memoryBytes();
+	size_t hostBytes = poolBytes + hitBytes + nodeBytes + instanceBytes;
+	size_t deviceBytes = hostBytes;
+	printf("Scene geometry: %zu triangles, mesh pool %.2f MB, traversal triangles %.2f MB, BVH nodes %.2f MB, instancing %.2f MB\n",
+		triangleHits.size(), poolBytes / MB, hitBytes / MB, nodeBytes / MB, instanceBytes / MB);
+#ifdef QUANTIZED_BVH
+	// only the compressed nodes go to the device, the binary ones stay for refits
+	hostBytes += quantizedBVH.memoryBytes();
+	deviceBytes += quantizedBVH.memoryBytes() - nodeBytes;
+	printf("Scene geometry: quantized BVH nodes %.2f MB\n", quantizedBVH.memoryBytes() / MB);
+#endif
+#if CPU_BVH_WIDTH > 0
+	if (!wideBVH.nodes.empty())
+	{
+		hostBytes += wideBVH.memoryBytes();
+		printf("Scene geometry: %d-wide BVH nodes %.2f MB\n", CPU_BVH_WIDTH, wideBVH.memoryBytes() / MB);
+	}
+#endif
+	printf("Scene geometry: %.2f MB on the host, %.2f MB on the device\n", hostBytes / MB, upload ? deviceBytes / MB : 0.f);
+}
+
+bool Scene::updateGeomTransform(int geomIndex, glm::vec3 translation, glm::vec3 rotation, glm::vec3 scale, bool upload)
+{
+	Geom& geom = geoms[geomIndex];
+	if (bvh)
+		bvh->prepareRefit();
+	// geom triangle ranges index the load order, the BVH build moved every triangle to a new slot
+	std::vector<int> slots;
+	for (int i = geom.triangleStartIdx; i < geom.triangleEndIdx; ++i)
+		slots.push_back(bvh ? bvh->slotOfTriangle[i] : i);
+
+	auto cached = objectSpaceVertices.find(geomIndex);
+	if (cached == objectSpaceVertices.end())
+	{
+		// undo the transform baked by MeshPool::append once, later moves start from this copy
+		IndexedMesh& object = objectSpaceVertices[geomIndex];
+		glm::mat3 normalToObject = glm::transpose(glm::mat3(geom.transform));
+		for (int i = geom.vertexStartIdx; i < geom.vertexEndIdx; ++i)
+		{
+			object.positions.push_back(glm::vec3(geom.inverseTransform * glm::vec4(meshPool.positions[i], 1.0f)));
+			object.normals.push_back(normalToObject * meshPool.normals[i]);
+		}
+		cached = objectSpaceVertices.find(geomIndex);
+	}
+
+	Scene::updateTransform(geom, translation, rotation, scale);
+	meshPool.transformVertices(geom.vertexStartIdx, cached->second.positions, cached->second.normals, geom.transform);
+	// pool triangles sit at the same slots as their traversal copies
+	MeshPoolView pool = meshPool.hostView();
+	for (int slot : slots)
+		triangleHits[slot] = TriangleHit(pool.getTriangle(slot));
+
+	if (bvh && bvh->bvhNodes > 0)
+	{
+		int firstNode, lastNode;
+		bvh->refit(triangleHits.data(), slots, &firstNode, &lastNode);
+		float cost = bvh->sahCost();
+		if (cost > bvh->builtSAHCost * BVH_REFIT_REBUILD_RATIO)
+		{
+			printf("BVH refit SAH cost %.2f is past %.2f x %.2f, rebuilding\n", cost, BVH_REFIT_REBUILD_RATIO, bvh->builtSAHCost);
+			// moved geometry never matches the scene file, keep the cache for the layout on disk
+			createBVH(upload, false);
+			if (upload)
+				uploadTriangleRange(triangleHits.data(), 0, triangleHits.size() - 1);
+			return true;
+		}
+#ifdef QUANTIZED_BVH
+		int firstQuantized, lastQuantized;
+		quantizedBVH.update(bvh->nodes, firstNode, lastNode, &firstQuantized, &lastQuantized);
+		if (upload)
+			quantizedBVH.uploadRange(dev_accel.quantizedNodes, firstQuantized, lastQuantized);
+#else
+		if (upload)
+			bvh->uploadNodeRange(firstNode, lastNode);
+#endif
+#if CPU_BVH_WIDTH > 0
+		if (!wideBVH.nodes.empty())
+			wideBVH.update(bvh->nodes, firstNode, lastNode);
+#endif
+	}
+
+	if (upload && !slots.empty())
+	{
+		// the moved triangles are scattered over the slots, copy the span that covers them
+		int firstSlot = *std::min_element(slots.begin(), slots.end());
+		int lastSlot = *std::max_element(slots.begin(), slots.end());
+		uploadTriangleRange(triangleHits.data(), firstSlot, lastSlot);
+		meshPool.uploadVertexRange(dev_accel.mesh, geom.vertexStartIdx, geom.vertexEndIdx - 1);
+		checkCUDAError("Scene::updateGeomTransform");
+	}
+	return false;
+}
+
+void Scene::updateInstanceTransform(int instanceIndex, glm::vec3 translation, glm::vec3 rotation, glm::vec3 scale, bool upload)
+{
+	Geom placement = instanceAccel.placements[instanceIndex];
+	Scene::updateTransform(placement, translation, rotation, scale);
+	instanceAccel.setInstanceTransform(instanceIndex, placement);
+	if (upload)
+		instanceAccel.uploadTransforms(dev_accel);
+}
+
+SceneAccel Scene::hostAccel() const
+{
+	SceneAccel accel = instanceAccel.hostView();
+	accel.nodes = bvh->nodes;
+#ifdef QUANTIZED_BVH
+	accel.quantizedNodes = const_cast<QuantizedBVHNode<QUANTIZED_BVH>*>(quantizedBVH.nodes.data());
+#endif
+#if CPU_BVH_WIDTH > 0
+	if (!wideBVH.nodes.empty())
+		accel.wideNodes = wideBVH.nodes.data();
+#endif
+	accel.triangleHits = const_cast<TriangleHit*>(triangleHits.data());
+	accel.mesh = meshPool.hostView();
+	accel.numTriangles = triangleHits.size();
+	return accel;
+}
+
+std::vector<Triangle> Scene::expandTriangles() const
+{
+	std::vector<Triangle> triangles;
+	meshPool.expand(0, meshPool.triangles.size(), triangles);
+	return triangles;
 }
 
 BVHAccel::LinearBVHNode* Scene::getLBVHRoot()
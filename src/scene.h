@@ -11,6 +11,8 @@
 #include "texture.h"
 #include "cudaUtilities.h"
 #include "bvh.h"
+#include "bvhInstance.h"
+#include "lightBVH.h"
 #include <unordered_map>
 
 using namespace std;
@@ -25,7 +27,18 @@ struct GPUInfo {
 	int counter;
 	int triangleCount;
 	float averagePathPerBounce;
-	GPUInfo() : counter(0), averagePathPerBounce(0)
+	// per bounce of the last iteration: active paths, material sort and shading time
+	std::vector<int> bouncePaths;
+	std::vector<float> bounceSortMs;
+	std::vector<float> bounceShadeMs;
+	// device buffer pool behind pathtraceInit
+	int bufferAllocations;
+	int bufferReuses;
+	size_t bufferBytes;
+	// device to host image readback
+	size_t readbackBytes; // last frame
+	size_t readbackBytesTotal;
+	GPUInfo() : counter(0), averagePathPerBounce(0), bufferAllocations(0), bufferReuses(0), bufferBytes(0), readbackBytes(0), readbackBytesTotal(0)
 
 	{
 		cudaGetDeviceProperties(&prop, 0);
@@ -51,16 +64,48 @@ struct GPUInfo {
 	{
 		printer("Elapsed time: %f ms\n", elapsedTime);
 	}
+
+	void printBufferPool(PrintFunction printer)
+	{
+		printer("Buffer pool: %d allocations, %d reuses, %.1f MB\n", bufferAllocations, bufferReuses, bufferBytes / (1024.0 * 1024.0));
+	}
+
+	void printReadback(PrintFunction printer)
+	{
+		printer("Readback: %zu bytes last frame, %.1f MB total\n", readbackBytes, readbackBytesTotal / (1024.0 * 1024.0));
+	}
+
+	void printBounceTimes(PrintFunction printer)
+	{
+		for (size_t i = 0; i < bouncePaths.size(); ++i)
+			printer("Bounce %zu: %d paths, sort %.3f ms, shade %.3f ms\n", i + 1, bouncePaths[i], bounceSortMs[i], bounceShadeMs[i]);
+	}
 };
 
 extern std::vector<std::string>  materialIdx;
 extern GPUInfo* gpuInfo;
 
+// a loadObj call, resolved into baked triangles or an instance by finalizeMeshes()
+struct MeshPlacement
+{
+	std::string filename;
+	uint32_t materialid;
+	glm::vec3 translation, rotation, scale;
+};
+
 class Scene
 {
 private:
     ifstream fp_in;
     void loadFromJSON(const std::string& jsonName);
+	std::vector<MeshPlacement> pendingMeshes;
+	// reads the obj files of every pending placement, non emissive meshes placed more than once with at least
+	// INSTANCING_MIN_TRIANGLES triangles go to instanceAccel
+	void finalizeMeshes();
+	// appends mesh to meshPool with geom's transform and ids, and sets geom's triangle and vertex ranges
+	void addGeomMesh(Geom& geom, const IndexedMesh& mesh);
+	// object space vertices of every geom that has been moved, so repeated moves don't accumulate error
+	std::unordered_map<int, IndexedMesh> objectSpaceVertices;
 public:
     Scene(string filename);
     ~Scene();
@@ -68,20 +113,46 @@ public:
     std::vector<Geom> geoms;
 	std::vector<Light> lights;
     std::vector<Material> materials;
-	std::vector<Triangle> triangles;
+	std::vector<TriangleHit> triangleHits; // traversal copy of the world triangles in BVH order, filled by createBVH
+	MeshPool meshPool;
 	Texture* envMap;
     RenderState state;
 	BVHAccel* bvh;
+	std::vector<BVHAccel::MortonPrimitive> mortonScratch; // radix sort buffer every rebuild of bvh reuses
+#ifdef QUANTIZED_BVH
+	QuantizedBVH<QUANTIZED_BVH> quantizedBVH; // bvh compressed after every build and refit, bvh's own nodes stay on the host
+#endif
+#if CPU_BVH_WIDTH > 0
+	WideBVH<CPU_BVH_WIDTH> wideBVH; // bvh collapsed for host traversal by a createBVH(false) build, kept through refits
+#endif
+	InstanceAccel instanceAccel;
+	LightBVH lightBVH; // built with the BVH, after the environment map is loaded
 	std::string envMapPath;
+	std::string sceneFile;
+	BVHAccel::SplitMethod bvhSplitMethod;
+	int bvhSAHBins;
     void createCube(uint32_t materialid, glm::vec3 translation, glm::vec3 rotation, glm::vec3 scale);
 	void createSphere(uint32_t materialid, glm::vec3 translation, glm::vec3 rotation, glm::vec3 scale, int latitudeSegments = 40, int longitudeSegments = 20);
 	void loadObj(const std::string& filename, uint32_t materialid = 0, glm::vec3 translation = glm::vec3(0), glm::vec3 rotation = glm::vec3(0), glm::vec3 scale = glm::vec3(1.));
+	// paths in the scene file (and the builtin cube / sphere objs) are relative to its directory
+	std::string resolvePath(const std::string& path) const;
 	void addMaterial(Material& m, const std::string& name = "Light");
-    void loadEnvMap(const char* filename);
-	void loadEnvMap();
+    // upload = false keeps the map on the host, for the CPU backend and the host tools
+    void loadEnvMap(const char* filename, bool upload = true);
+	void loadEnvMap(bool upload = true);
     static void updateTransform(Geom& geom, glm::vec3 translation, glm::vec3 rotation, glm::vec3 scale);
-	static void updateTriangleTransform(const Geom& geom, std::vector<Triangle>& triangles);
-    void createBVH();
+    // upload = false keeps the BVH host only, for tools; useCache = false neither reads nor writes <scene>.bvhcache
+    void createBVH(bool upload = true, bool useCache = true);
+	// Moves a baked mesh and refits the BVH in place, the device copies are patched when upload is set.
+	// Rebuilds instead once the refit SAH cost passes BVH_REFIT_REBUILD_RATIO, returns true in that case.
+	bool updateGeomTransform(int geomIndex, glm::vec3 translation, glm::vec3 rotation, glm::vec3 scale, bool upload = true);
+	// Moves instance instanceIndex of instanceAccel and refits the TLAS, the BLAS it shares with the other
+	// placements of its mesh is untouched
+	void updateInstanceTransform(int instanceIndex, glm::vec3 translation, glm::vec3 rotation, glm::vec3 scale, bool upload = true);
 	BVHAccel::LinearBVHNode* getLBVHRoot();
+	// host view of the world BVH and the instances for a scene built with createBVH(false)
+	SceneAccel hostAccel() const;
+	// the world triangles in Triangle form and BVH order, for the host tools
+	std::vector<Triangle> expandTriangles() const;
 	void createBRDFDisplay();
 };
@@ -87,7 +87,7 @@ struct AABB
 		return 2 * (d.x * d.y + d.x * d.z + d.y * d.z);
 	}
 
-	__inline__ __device__ bool IntersectP(const Ray& ray, float* hitt0 = nullptr,
+	__inline__ __host__ __device__ bool IntersectP(const Ray& ray, float* hitt0 = nullptr,
 		float* hitt1 = nullptr) const {
 		float t0 = 0, t1 = 2000;
 		for (int i = 0; i < 3; ++i) {
@@ -114,6 +114,36 @@ struct AABB
 	}
 };
 
+// Moller-Trumbore algorithm on the first vertex and the two edges leaving it, returns t or -1
+__inline__ __host__ __device__ float intersectTriangle(const glm::vec3& v0, const glm::vec3& e1, const glm::vec3& e2, const Ray& r)
+{
+	glm::vec3 s1 = glm::cross(r.direction, e2);
+	float divisor = glm::dot(s1, e1);
+	if (divisor == 0.0f)
+	{
+		return -1.0f;
+	}
+	float invDivisor = 1.0f / divisor;
+
+	glm::vec3 d = r.origin - v0;
+	float b1 = glm::dot(d, s1) * invDivisor;
+	if (b1 < 0.0f || b1 > 1.0f)
+	{
+		return -1.0f;
+	}
+
+	glm::vec3 s2 = glm::cross(d, e1);
+	float b2 = glm::dot(r.direction, s2) * invDivisor;
+	if (b2 < 0.0f || b1 + b2 > 1.0f)
+	{
+		return -1.0f;
+	}
+
+	float t = glm::dot(e2, s2) * invDivisor;
+
+	return t;
+}
+
 struct Triangle
 {
 	glm::vec3 vertices[3];
@@ -121,41 +151,14 @@ struct Triangle
 	glm::vec2 uvs[3];
 	bool hasNormals;
 	uint8_t materialid;
-	uint8_t lightid;
+	uint16_t lightid;
 	Triangle() : hasNormals(false), materialid(-1), lightid(-1) {}
-	__device__ float intersect(const Ray& r) const
+	__host__ __device__ float intersect(const Ray& r) const
 	{
-		// Moller-Trumbore algorithm
-		glm::vec3 e1 = vertices[1] - vertices[0];
-		glm::vec3 e2 = vertices[2] - vertices[0];
-		glm::vec3 s1 = glm::cross(r.direction, e2);
-		float divisor = glm::dot(s1, e1);
-		if (divisor == 0.0f)
-		{
-			return -1.0f;
-		}
-		float invDivisor = 1.0f / divisor;
-
-		glm::vec3 d = r.origin - vertices[0];
-		float b1 = glm::dot(d, s1) * invDivisor;
-		if (b1 < 0.0f || b1 > 1.0f)
-		{
-			return -1.0f;
-		}
-
-		glm::vec3 s2 = glm::cross(d, e1);
-		float b2 = glm::dot(r.direction, s2) * invDivisor;
-		if (b2 < 0.0f || b1 + b2 > 1.0f)
-		{
-			return -1.0f;
-		}
-
-		float t = glm::dot(e2, s2) * invDivisor;
-
-		return t;
+		return intersectTriangle(vertices[0], vertices[1] - vertices[0], vertices[2] - vertices[0], r);
 	}
 
-	__inline__ __device__ glm::vec3 getBarycentricCoordinates(glm::vec3 insectPoint) const
+	__inline__ __host__ __device__ glm::vec3 getBarycentricCoordinates(glm::vec3 insectPoint) const
 	{
 		// Barycentric coordinates
 		float u, v, w;
@@ -171,11 +174,11 @@ struct Triangle
 		return glm::vec3(w, u, v);
 	}
 
-	__inline__ __device__ glm::vec3 getNormal() const
+	__inline__ __host__ __device__ glm::vec3 getNormal() const
 	{
 		return glm::normalize(glm::cross(vertices[1] - vertices[0], vertices[2] - vertices[0]));
 	}
-	__inline__ __device__ glm::vec3 getNormal(glm::vec3 insectPoint) const
+	__inline__ __host__ __device__ glm::vec3 getNormal(glm::vec3 insectPoint) const
 	{
 		if (!hasNormals)
 			return getNormal();
@@ -183,7 +186,7 @@ struct Triangle
 		return barycentric.x * normals[0] + barycentric.y * normals[1] + barycentric.z * normals[2];
 	}
 
-	__inline__ __device__ glm::vec2 getUV(glm::vec3 insectPoint) const
+	__inline__ __host__ __device__ glm::vec2 getUV(glm::vec3 insectPoint) const
 	{
 		glm::vec3 barycentric = getBarycentricCoordinates(insectPoint);
 		return barycentric.x * uvs[0] + barycentric.y * uvs[1] + barycentric.z * uvs[2];
@@ -204,12 +207,35 @@ struct Triangle
 
 };
 
+// Hot half of a Triangle for BVH traversal: the first vertex and both edges, 36 bytes against the
+// full record's 100. Kept in a parallel array in BVH order; normals, uvs and ids are read from the
+// mesh pool triangle at the same index once a hit is confirmed.
+struct TriangleHit
+{
+	glm::vec3 v0, e1, e2;
+	TriangleHit() = default;
+	__host__ __device__ explicit TriangleHit(const Triangle& tri)
+		: v0(tri.vertices[0]), e1(tri.vertices[1] - tri.vertices[0]), e2(tri.vertices[2] - tri.vertices[0]) {}
+	__host__ __device__ float intersect(const Ray& r) const
+	{
+		return intersectTriangle(v0, e1, e2, r);
+	}
+	__inline__ __host__ AABB getBounds() const
+	{
+		AABB aabb;
+		glm::vec3 v1 = v0 + e1, v2 = v0 + e2;
+		aabb.min = glm::min(v0, glm::min(v1, v2));
+		aabb.max = glm::max(v0, glm::max(v1, v2));
+		return aabb;
+	}
+};
+
 struct Geom
 {
-	Geom() : type(MESH), materialid(-1), lightid(-1),translation(glm::vec3(0.0f)), rotation(glm::vec3(0.0f)), scale(glm::vec3(1.0f)), triangleStartIdx(0), triangleEndIdx(0) {}
+	Geom() : type(MESH), materialid(-1), lightid(-1),translation(glm::vec3(0.0f)), rotation(glm::vec3(0.0f)), scale(glm::vec3(1.0f)), triangleStartIdx(0), triangleEndIdx(0), vertexStartIdx(0), vertexEndIdx(0) {}
     enum GeomType type;
 	uint8_t materialid;
-	uint8_t lightid;
+	uint16_t lightid;
     glm::vec3 translation;
     glm::vec3 rotation;
     glm::vec3 scale;
@@ -219,6 +245,9 @@ struct Geom
 
 	int triangleStartIdx;
 	int triangleEndIdx;
+	// vertices of the geom in the mesh pool
+	int vertexStartIdx;
+	int vertexEndIdx;
 	int getNumTriangles() const { return triangleEndIdx - triangleStartIdx; }
 };
 
@@ -226,7 +255,7 @@ struct Light
 {
 	glm::mat4 transform;
 	glm::mat4 inverseTransform;
-	float area;
+	float area; // of the light space square [-1, 1]^2 the area lights are sampled over
 	enum LightType lightType;
 	glm::vec3 emission;
 };
@@ -289,6 +318,8 @@ struct RenderState
     std::vector<glm::vec3> image;
 	std::vector<glm::vec3> albedo;
 	std::vector<glm::vec3> normal;
+	std::vector<int> sampleCounts; // samples each pixel took, with adaptive sampling
+	float adaptiveThreshold;       // ADAPTIVE_SAMPLING unless the scene sets one, 0 : off
     std::string imageName;
 };
 
@@ -303,7 +334,8 @@ struct alignas(64) PathSegment
 	glm::vec3 albedo;
 	glm::vec3 normal;
 	float distTraveled;
-	__host__ __device__ PathSegment() : color(glm::vec3(0.0f)), throughput(glm::vec3(1.0f)), accumLight(glm::vec3(0.0f)), pixelIndex(-1), remainingBounces(0), distTraveled(0) {}
+	float bsdfPdf; // pdf of the BSDF sample the ray came from, 0 when the light at its end isn't MIS weighted
+	__host__ __device__ PathSegment() : color(glm::vec3(0.0f)), throughput(glm::vec3(1.0f)), accumLight(glm::vec3(0.0f)), pixelIndex(-1), remainingBounces(0), distTraveled(0), bsdfPdf(0) {}
     __host__ __device__ bool isTerminated() const {
         return remainingBounces <= 0;
     }
@@ -317,9 +349,10 @@ struct ShadeableIntersection
   float t;
   glm::vec3 surfaceNormal;
   uint8_t materialId;
-  uint8_t lightId; // if the intersection is a light source
-  uint8_t directLightId; // a random choosen light source for direct lighting
+  uint16_t lightId; // if the intersection is a light source
+  uint16_t directLightId; // a random choosen light source for direct lighting
+  float directLightPmf; // probability of having chosen it, 0 when no light reaches the hit
   glm::vec2 uv;
   float hitBVH;
-  __host__ __device__ ShadeableIntersection() : t(-1), materialId(-1), lightId(-1), hitBVH(-1), directLightId(-1) {}
+  __host__ __device__ ShadeableIntersection() : t(-1), materialId(-1), lightId(-1), directLightId(-1), directLightPmf(0), hitBVH(-1) {}
 };
@@ -2,10 +2,10 @@
 #include <cuda_runtime.h>
 #include <texture_fetch_functions.h>
 
-Texture::Texture(const char* filename){
+Texture::Texture(const char* filename, bool upload) : texObj(0), cuArray(nullptr), img_data(nullptr), width(0), height(0), dev_distribution(nullptr) {
 	// 创建纹理对象
 	printf("Creating texture from file: %s\n", filename);
-	if (!createHdriFromFile(filename, texObj, cuArray)) {
+	if (loadHdriFromFile(filename) && upload && !this->upload()) {
 		// 创建失败，释放资源
 		texObj = 0;
 		cuArray = nullptr;
@@ -13,22 +13,119 @@ Texture::Texture(const char* filename){
 }
 
 Texture::~Texture() {
-	if (texObj) {
-		free();
+	free();
+}
+
+EnvMap Texture::view() const
+{
+	EnvMap envMap;
+	envMap.texObj = texObj;
+	envMap.pixels = reinterpret_cast<const float4*>(img_data);
+	envMap.width = width;
+	envMap.height = height;
+	if (!tables.empty())
+	{
+		envMap.hostDistribution = tables.view();
+		if (dev_distribution)
+		{
+			envMap.deviceDistribution.marginalCdf = dev_distribution;
+			envMap.deviceDistribution.conditionalCdf = dev_distribution + tables.marginalCdf.size();
+			envMap.deviceDistribution.texelPdf = dev_distribution + tables.marginalCdf.size() + tables.conditionalCdf.size();
+		}
 	}
+	return envMap;
+}
+
+bool EnvMapTables::build(const float4* pixels, int width, int height)
+{
+	marginalCdf.clear();
+	conditionalCdf.clear();
+	texelPdf.clear();
+	if (width <= 0 || height <= 0)
+		return false;
+
+	std::vector<float> texelLuminance(width * height);
+	for (int i = 0; i < width * height; ++i)
+		texelLuminance[i] = glm::max(0.2126f * pixels[i].x + 0.7152f * pixels[i].y + 0.0722f * pixels[i].z, 0.f);
+
+	// texel weights and the unnormalized row CDFs, in double so large maps don't lose the small texels.
+	// A texel takes the brightest of its 3x3 neighbourhood: the bilinear lookup spreads every texel
+	// into its neighbours and a bright one next to a dim one would otherwise be drawn with the dim pdf.
+	std::vector<float> weights(width * height);
+	std::vector<double> rowCdf(width + 1);
+	std::vector<double> rowSums(height);
+	std::vector<float> conditional(height * (width + 1));
+	for (int y = 0; y < height; ++y)
+	{
+		float sinTheta = sinf(PI * (y + 0.5f) / height);
+		rowCdf[0] = 0.0;
+		for (int x = 0; x < width; ++x)
+		{
+			float luminance = 0.f;
+			for (int dy = -1; dy <= 1; ++dy)
+			{
+				int ny = glm::clamp(y + dy, 0, height - 1);
+				for (int dx = -1; dx <= 1; ++dx)
+					luminance = glm::max(luminance, texelLuminance[ny * width + (x + dx + width) % width]);
+			}
+			weights[y * width + x] = luminance * sinTheta;
+			rowCdf[x + 1] = rowCdf[x] + weights[y * width + x];
+		}
+		rowSums[y] = rowCdf[width];
+		float* row = &conditional[y * (width + 1)];
+		for (int x = 0; x <= width; ++x)
+			row[x] = rowSums[y] > 0.0 ? (float)(rowCdf[x] / rowSums[y]) : (float)x / width;
+		row[width] = 1.f;
+	}
+
+	std::vector<double> columnCdf(height + 1, 0.0);
+	for (int y = 0; y < height; ++y)
+		columnCdf[y + 1] = columnCdf[y] + rowSums[y];
+	double total = columnCdf[height];
+	if (total <= 0.0)
+		return false;
+
+	marginalCdf.resize(height + 1);
+	for (int y = 0; y <= height; ++y)
+		marginalCdf[y] = (float)(columnCdf[y] / total);
+	marginalCdf[height] = 1.f;
+	conditionalCdf.swap(conditional);
+	// a texel covers 1 / (width * height) of the unit square
+	texelPdf.resize(width * height);
+	for (int i = 0; i < width * height; ++i)
+		texelPdf[i] = (float)(weights[i] * width * height / total);
+	return true;
+}
+
+EnvMapDistribution EnvMapTables::view() const
+{
+	EnvMapDistribution distribution;
+	distribution.marginalCdf = marginalCdf.data();
+	distribution.conditionalCdf = conditionalCdf.data();
+	distribution.texelPdf = texelPdf.data();
+	return distribution;
 }
 
 
-bool Texture::createHdriFromFile(const char* filename, cudaTextureObject_t& texObj, cudaArray_t& cuArray)
+bool Texture::loadHdriFromFile(const char* filename)
 {
 	//free();
 	// load hdri
-	int width, height, channels;
+	int channels;
 	img_data = stbi_loadf(filename, &width, &height, &channels, 4);
 	if (img_data == nullptr) {
 		fprintf(stderr, "Failed to load HDRI file: %s\n", filename);
 		return false;
 	}
+	// importance sampling tables, empty for a black map
+	tables.build(reinterpret_cast<const float4*>(img_data), width, height);
+	return true;
+}
+
+bool Texture::upload()
+{
+	if (img_data == nullptr)
+		return false;
 
 	// create cuda array
 	cudaChannelFormatDesc channelDesc = cudaCreateChannelDesc<float4>();
@@ -51,7 +148,27 @@ bool Texture::createHdriFromFile(const char* filename, cudaTextureObject_t& texO
 	texDesc.readMode = cudaReadModeElementType;
 	texDesc.normalizedCoords = 1;
 
-	cudaCreateTextureObject(&texObj, &resDesc, &texDesc, nullptr);
+	if (cudaCreateTextureObject(&texObj, &resDesc, &texDesc, nullptr) != cudaSuccess)
+		return false;
+
+	// the kernels read a copy of the sampling tables in one allocation
+	if (!tables.empty())
+	{
+		size_t count = tables.marginalCdf.size() + tables.conditionalCdf.size() + tables.texelPdf.size();
+		if (cudaMalloc(&dev_distribution, count * sizeof(float)) == cudaSuccess)
+		{
+			float* dst = dev_distribution;
+			cudaMemcpy(dst, tables.marginalCdf.data(), tables.marginalCdf.size() * sizeof(float), cudaMemcpyHostToDevice);
+			dst += tables.marginalCdf.size();
+			cudaMemcpy(dst, tables.conditionalCdf.data(), tables.conditionalCdf.size() * sizeof(float), cudaMemcpyHostToDevice);
+			dst += tables.conditionalCdf.size();
+			cudaMemcpy(dst, tables.texelPdf.data(), tables.texelPdf.size() * sizeof(float), cudaMemcpyHostToDevice);
+		}
+		else
+		{
+			dev_distribution = nullptr;
+		}
+	}
 	return true;
 }
 
@@ -68,7 +185,7 @@ float* Texture::padToFloat4(const float* data, int width, int height) {
 
 void Texture::free()
 {
-	if (!img_data) stbi_image_free(img_data);
+	if (img_data) stbi_image_free(img_data);
 	img_data = nullptr;
 
 	if (texObj != 0)
@@ -82,4 +199,11 @@ void Texture::free()
 		cudaFreeArray(cuArray);
 		cuArray = nullptr;
 	}
+	// nothing was allocated on the device for a map kept on the host
+	if (dev_distribution != nullptr)
+	{
+		cudaFree(dev_distribution);
+		dev_distribution = nullptr;
+	}
+	tables = EnvMapTables();
 }
\ No newline at end of file
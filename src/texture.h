@@ -2,20 +2,162 @@
 //#include <cuda_runtime.h>  
 #include <texture_types.h>
 #include "utilities.h"
+#include <glm/glm.hpp>
+#include <vector>
+
+// Piecewise constant distribution over the texels of an environment map, proportional to
+// luminance * sin(theta) so that it follows the map's radiance over the sphere rather than over
+// the image. The marginal CDF picks a row and that row's conditional CDF picks the texel.
+struct EnvMapDistribution
+{
+    const float* marginalCdf = nullptr;    // height + 1 entries
+    const float* conditionalCdf = nullptr; // height rows of width + 1 entries
+    const float* texelPdf = nullptr;       // density over (u, v) in [0, 1]^2, per texel
+};
+
+// Host tables behind an EnvMapDistribution. build() leaves them empty for a black map.
+struct EnvMapTables
+{
+    std::vector<float> marginalCdf;
+    std::vector<float> conditionalCdf;
+    std::vector<float> texelPdf;
+
+    bool build(const float4* pixels, int width, int height);
+    bool empty() const { return texelPdf.empty(); }
+    EnvMapDistribution view() const;
+};
+
+// Environment map as the shading code sees it, passed by value: kernels read the CUDA texture and
+// the CPU backend filters the float4 pixels the texture was made from. Null pixels mean no map,
+// a zero texObj a map that was only loaded on the host.
+struct EnvMap
+{
+    cudaTextureObject_t texObj = 0;
+    const float4* pixels = nullptr;
+    int width = 0;
+    int height = 0;
+    EnvMapDistribution hostDistribution;   // read by the CPU backend
+    EnvMapDistribution deviceDistribution; // read by the kernels
+
+    __host__ __device__ bool valid() const { return pixels != nullptr; }
+
+    __host__ __device__ const EnvMapDistribution& distribution() const
+    {
+#ifdef __CUDA_ARCH__
+        return deviceDistribution;
+#else
+        return hostDistribution;
+#endif
+    }
+
+    __host__ __device__ bool canSample() const { return distribution().texelPdf != nullptr; }
+
+    // theta from +y, phi around it from +x towards +z, both scaled to [0, 1]
+    __host__ __device__ static glm::vec2 directionToUV(const glm::vec3& direction)
+    {
+        float theta = acosf(glm::clamp(direction.y, -1.0f, 1.0f));
+        float phi = atan2f(direction.z, direction.x);
+        if (phi < 0) phi += 2.0f * PI;
+        return glm::vec2(phi / (2.0f * PI), theta / PI);
+    }
+
+    // last i in [0, n) with cdf[i] <= u, cdf holds n + 1 ascending entries from 0 to 1
+    __host__ __device__ static int findInterval(const float* cdf, int n, float u)
+    {
+        int lo = 0;
+        int hi = n;
+        while (lo + 1 < hi)
+        {
+            int mid = (lo + hi) / 2;
+            if (cdf[mid] <= u)
+                lo = mid;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+
+    // direction drawn from the distribution for xi in [0, 1)^2, pdf is per solid angle
+    __host__ __device__ glm::vec3 sample(const glm::vec2& xi, float& pdf) const
+    {
+        const EnvMapDistribution& d = distribution();
+        int y = findInterval(d.marginalCdf, height, xi.y);
+        float rowWidth = d.marginalCdf[y + 1] - d.marginalCdf[y];
+        float dv = rowWidth > 0.f ? (xi.y - d.marginalCdf[y]) / rowWidth : 0.5f;
+        const float* row = d.conditionalCdf + y * (width + 1);
+        int x = findInterval(row, width, xi.x);
+        float texelWidth = row[x + 1] - row[x];
+        float du = texelWidth > 0.f ? (xi.x - row[x]) / texelWidth : 0.5f;
+
+        float theta = (y + dv) / height * PI;
+        float phi = (x + du) / width * 2.0f * PI;
+        float sinTheta = sinf(theta);
+        pdf = sinTheta > 0.f ? d.texelPdf[y * width + x] / (2.0f * PI * PI * sinTheta) : 0.f;
+        return glm::vec3(sinTheta * cosf(phi), cosf(theta), sinTheta * sinf(phi));
+    }
+
+    // solid angle density of sample() towards direction
+    __host__ __device__ float pdf(const glm::vec3& direction) const
+    {
+        glm::vec2 uv = directionToUV(direction);
+        float sinTheta = sinf(uv.y * PI);
+        if (sinTheta <= 0.f)
+            return 0.f;
+        int x = glm::min((int)(uv.x * width), width - 1);
+        int y = glm::min((int)(uv.y * height), height - 1);
+        return distribution().texelPdf[y * width + x] / (2.0f * PI * PI * sinTheta);
+    }
+
+    // u, v in [0, 1], bilinear with wrapping like the texture's sampler
+    __host__ __device__ glm::vec3 lookup(float u, float v) const
+    {
+#ifdef __CUDA_ARCH__
+        float4 texel = tex2D<float4>(texObj, u, v);
+        return glm::vec3(texel.x, texel.y, texel.z);
+#else
+        float x = u * width - 0.5f;
+        float y = v * height - 0.5f;
+        int x0 = (int)floorf(x);
+        int y0 = (int)floorf(y);
+        float fx = x - x0;
+        float fy = y - y0;
+        glm::vec3 top = glm::mix(texel(x0, y0), texel(x0 + 1, y0), fx);
+        glm::vec3 bottom = glm::mix(texel(x0, y0 + 1), texel(x0 + 1, y0 + 1), fx);
+        return glm::mix(top, bottom, fy);
+#endif
+    }
+
+    glm::vec3 texel(int x, int y) const
+    {
+        x = ((x % width) + width) % width;
+        y = ((y % height) + height) % height;
+        const float4& p = pixels[y * width + x];
+        return glm::vec3(p.x, p.y, p.z);
+    }
+};
 
 class Texture {
 public:
-    Texture(const char* filename);
+    // upload = false keeps the map on the host, for the CPU backend and the host tools
+    Texture(const char* filename, bool upload = true);
     ~Texture();
     cudaTextureObject_t texObj;
+    EnvMap view() const;
 	bool createTextureFromFile(const char* filename, cudaTextureObject_t& texObj, cudaArray_t& cuArray);
-    bool createHdriFromFile(const char* filename, cudaTextureObject_t& texObj, cudaArray_t& cuArray);
+    // pixels and sampling tables on the host, no CUDA calls
+    bool loadHdriFromFile(const char* filename);
+    // CUDA texture and a device copy of the sampling tables from what loadHdriFromFile read
+    bool upload();
     float* padToFloat4(const float* data, int width, int height);
 	void free();
+	const EnvMapTables& distribution() const { return tables; }
 	//__device__ float4 get(float u, float v);
 private:
     cudaArray_t cuArray;  
     float* img_data;
+    int width, height;
+    EnvMapTables tables;
+    float* dev_distribution; // marginal, conditional and texel pdf tables back to back
     // 禁止拷贝和赋值
     Texture(const Texture&) = delete;
     Texture& operator=(const Texture&) = delete;
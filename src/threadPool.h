@@ -0,0 +1,156 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// A small work-stealing thread pool for host side builds.
+// parallelFor splits [0, count) into chunks that are dealt out to per-thread
+// queues in contiguous runs. Each thread drains its own queue from the front
+// and, once empty, steals from the back of the other queues. The calling
+// thread takes part in the work as thread 0, so a pool of size 1 runs inline.
+class ThreadPool {
+public:
+    using RangeFunc = std::function<void(int64_t begin, int64_t end, int threadIndex)>;
+
+    // nThreads <= 0 uses every hardware thread.
+    explicit ThreadPool(int nThreads = 0) {
+        if (nThreads <= 0)
+            nThreads = std::max(1, (int)std::thread::hardware_concurrency());
+        for (int i = 0; i < nThreads; ++i)
+            queues.emplace_back(new WorkQueue());
+        for (int i = 1; i < nThreads; ++i)
+            workers.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            shutdown = true;
+        }
+        jobCondition.notify_all();
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+    int size() const { return (int)queues.size(); }
+
+    // Runs func(begin, end, threadIndex) over [0, count) and blocks until every chunk is done.
+    // Not reentrant: func must not call parallelFor on the same pool.
+    void parallelFor(int64_t count, int64_t chunkSize, const RangeFunc& func) {
+        if (count <= 0) return;
+        if (chunkSize <= 0) chunkSize = 1;
+        int64_t nChunks = (count + chunkSize - 1) / chunkSize;
+        if (size() == 1 || nChunks == 1) {
+            func(0, count, 0);
+            return;
+        }
+
+        // Deal contiguous runs of chunks to each queue so neighbouring work stays on one thread
+        for (int64_t c = 0; c < nChunks; ++c) {
+            int64_t begin = c * chunkSize;
+            int64_t end = std::min(begin + chunkSize, count);
+            WorkQueue& q = *queues[c * size() / nChunks];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            q.chunks.emplace_back(begin, end);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            job = &func;
+            pendingChunks = nChunks;
+            ++jobGeneration;
+        }
+        jobCondition.notify_all();
+
+        runChunks(0, func);
+
+        std::unique_lock<std::mutex> lock(jobMutex);
+        doneCondition.wait(lock, [this] { return pendingChunks == 0 && activeWorkers == 0; });
+        job = nullptr;
+    }
+
+private:
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<std::pair<int64_t, int64_t>> chunks;
+    };
+
+    bool popChunk(int threadIndex, std::pair<int64_t, int64_t>& chunk) {
+        {
+            WorkQueue& own = *queues[threadIndex];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.chunks.empty()) {
+                chunk = own.chunks.front();
+                own.chunks.pop_front();
+                return true;
+            }
+        }
+        // steal from the back of the other queues
+        for (int i = 1; i < size(); ++i) {
+            WorkQueue& victim = *queues[(threadIndex + i) % size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.chunks.empty()) {
+                chunk = victim.chunks.back();
+                victim.chunks.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void runChunks(int threadIndex, const RangeFunc& func) {
+        std::pair<int64_t, int64_t> chunk;
+        while (popChunk(threadIndex, chunk)) {
+            func(chunk.first, chunk.second, threadIndex);
+            if (--pendingChunks == 0) {
+                std::lock_guard<std::mutex> lock(jobMutex);
+                doneCondition.notify_all();
+            }
+        }
+    }
+
+    void workerLoop(int threadIndex) {
+        uint64_t seenGeneration = 0;
+        while (true) {
+            const RangeFunc* currentJob = nullptr;
+            {
+                std::unique_lock<std::mutex> lock(jobMutex);
+                jobCondition.wait(lock, [&] { return shutdown || jobGeneration != seenGeneration; });
+                if (shutdown) return;
+                seenGeneration = jobGeneration;
+                currentJob = job;
+                if (!currentJob) continue;
+                ++activeWorkers;
+            }
+            runChunks(threadIndex, *currentJob);
+            {
+                std::lock_guard<std::mutex> lock(jobMutex);
+                --activeWorkers;
+            }
+            doneCondition.notify_all();
+        }
+    }
+
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+    std::vector<std::thread> workers;
+
+    std::mutex jobMutex;
+    std::condition_variable jobCondition;
+    std::condition_variable doneCondition;
+    const RangeFunc* job = nullptr;
+    uint64_t jobGeneration = 0;
+    int activeWorkers = 0;
+    std::atomic<int64_t> pendingChunks{ 0 };
+    bool shutdown = false;
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+};
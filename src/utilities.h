@@ -19,6 +19,7 @@
 #define TWO_PI            6.2831853071795864769252867665590057683943f
 #define SQRT_OF_ONE_THIRD 0.5773502691896257645091487805019574556476f
 #define EPSILON           0.00001f
+#define SHADOW_RAY_EPSILON 1e-3f // shadow rays towards a light sample stop this fraction of the distance short of it
 
 
 
@@ -42,23 +43,23 @@ namespace utilityCore
 }
 
 template<typename T>
-__inline__ __device__ T Lerp(const T& a, const T& b, float t) {
+__inline__ __host__ __device__ T Lerp(const T& a, const T& b, float t) {
     return (1.0f - t) * a + t * b;
 }
 
 template<typename T>
-__inline__ __device__ T Clamp(const T& a, const T& edge0, const T& edge1) {
+__inline__ __host__ __device__ T Clamp(const T& a, const T& edge0, const T& edge1) {
 	return glm::clamp(a, edge0, edge1);
 }
 
 template<typename T>
-__inline__ __device__ T Square(const T& a) {
+__inline__ __host__ __device__ T Square(const T& a) {
 	return a * a;
 }
 
 
 // Hash function to generate a random number in [0, 1]
-__inline__ __device__ float hash01(uint32_t seed) {
+__inline__ __host__ __device__ float hash01(uint32_t seed) {
     seed ^= seed >> 21;
     seed ^= seed << 35;
     seed ^= seed >> 4;
@@ -66,7 +67,7 @@ __inline__ __device__ float hash01(uint32_t seed) {
     return (seed & 0xFFFFFF) / float(0xFFFFFF);
 }
 
-__inline__ __device__ glm::mat3 LocalToWorld(const glm::vec3& N) {
+__inline__ __host__ __device__ glm::mat3 LocalToWorld(const glm::vec3& N) {
     glm::vec3 T, B;
 
     glm::vec3 up = glm::abs(N.z) < 0.999f ? glm::vec3(0, 0, 1) : glm::vec3(0, 1, 0);
@@ -78,23 +79,23 @@ __inline__ __device__ glm::mat3 LocalToWorld(const glm::vec3& N) {
     return glm::mat3(T, B, N);
 }
 
-__inline__ __device__ float AbsCosTheta(const glm::vec3& w)
+__inline__ __host__ __device__ float AbsCosTheta(const glm::vec3& w)
 {
 	return fabsf(w.z);
 }
 
-__inline__ __device__ float AbsDot(const glm::vec3& a, const glm::vec3& b)
+__inline__ __host__ __device__ float AbsDot(const glm::vec3& a, const glm::vec3& b)
 {
 	return fabsf(glm::dot(a, b));
 }
 
-__inline__ __device__ float HemisphereDot(const glm::vec3& a, const glm::vec3& b)
+__inline__ __host__ __device__ float HemisphereDot(const glm::vec3& a, const glm::vec3& b)
 {
 	return glm::dot(a, b) > 0 ? glm::dot(a, b) : 0;
 
 }
 
-__inline__ __device__ float PowerHeuristic(int nf, float fPdf, int ng, float gPdf)
+__inline__ __host__ __device__ float PowerHeuristic(int nf, float fPdf, int ng, float gPdf)
 {
 	float f = nf * fPdf, g = ng * gPdf;
 	return (f * f) / (f * f + g * g);
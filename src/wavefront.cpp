@@ -0,0 +1,291 @@
+#include "wavefront.h"
+#include "bvh.h"
+#include "interactions.h"
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+
+using WavefrontClock = std::chrono::high_resolution_clock;
+
+static float msSince(WavefrontClock::time_point start)
+{
+	return std::chrono::duration<float, std::milli>(WavefrontClock::now() - start).count();
+}
+
+Ray cameraRay(const Camera& cam, int x, int y, PathSampler& rng)
+{
+	float pixelX = float(x);
+	float pixelY = float(y);
+#ifdef JITTER
+	thrust::uniform_real_distribution<float> u01(-JITTER, JITTER);
+	pixelX += u01(rng);
+	pixelY += u01(rng);
+#endif
+	Ray ray;
+	ray.origin = cam.position;
+	ray.direction = cameraRayDirection(cam, pixelX, pixelY);
+	return ray;
+}
+
+Ray cameraRay(const Camera& cam, int x, int y, int iter)
+{
+	PathSampler rng(Sampler(), x + y * cam.resolution.x, iter - 1, 0, SAMPLE_CAMERA);
+	return cameraRay(cam, x, y, rng);
+}
+
+int compactActivePaths(ThreadPool& pool, int* active, int nActive, int* scratch, const PathState& paths)
+{
+	const int nBlocks = nActive < 65536 ? 1 : pool.size();
+	const int blockSize = (nActive + nBlocks - 1) / nBlocks;
+	std::vector<int> offsets(nBlocks + 1, 0);
+	pool.parallelFor(nBlocks, 1, [&](int64_t b0, int64_t b1, int threadIndex) {
+		for (int64_t b = b0; b < b1; ++b)
+		{
+			int begin = b * blockSize;
+			int end = std::min(nActive, begin + blockSize);
+			int count = 0;
+			for (int i = begin; i < end; ++i)
+			{
+				if (!paths.isTerminated(active[i]))
+					scratch[begin + count++] = active[i];
+			}
+			offsets[b + 1] = count;
+		}
+	});
+	for (int b = 0; b < nBlocks; ++b)
+		offsets[b + 1] += offsets[b];
+	// every block of active has been read, so the survivors can be moved down in parallel
+	pool.parallelFor(nBlocks, 1, [&](int64_t b0, int64_t b1, int threadIndex) {
+		for (int64_t b = b0; b < b1; ++b)
+			std::copy(scratch + b * blockSize, scratch + b * blockSize + offsets[b + 1] - offsets[b], active + offsets[b]);
+	});
+	return offsets[nBlocks];
+}
+
+// Sorts active and its intersections by materialSortKey with the morton code radix sort
+static void sortByMaterial(ThreadPool& pool, const Material* materials, int nActive, std::vector<int>& active,
+	std::vector<ShadeableIntersection>& intersections, std::vector<BVHAccel::MortonPrimitive>& keys,
+	std::vector<BVHAccel::MortonPrimitive>& keyScratch, std::vector<int>& sortedActive, std::vector<ShadeableIntersection>& sortedIntersections)
+{
+	keys.resize(nActive);
+	pool.parallelFor(nActive, 4096, [&](int64_t begin, int64_t end, int threadIndex) {
+		for (int64_t i = begin; i < end; ++i)
+			keys[i] = { (int)i, materialSortKey(intersections[i], materials) };
+	});
+	BVHAccel::ParallelRadixSort(pool, &keys, keyScratch, 8);
+	pool.parallelFor(nActive, 4096, [&](int64_t begin, int64_t end, int threadIndex) {
+		for (int64_t i = begin; i < end; ++i)
+		{
+			sortedActive[i] = active[keys[i].primitiveIndex];
+			sortedIntersections[i] = intersections[keys[i].primitiveIndex];
+		}
+	});
+	std::copy(sortedActive.begin(), sortedActive.begin() + nActive, active.begin());
+	std::copy(sortedIntersections.begin(), sortedIntersections.begin() + nActive, intersections.begin());
+}
+
+// distinct materials and material types per 32 paths in shading order, misses count as one material
+static void warpCoherence(const Material* materials, int nActive, const std::vector<ShadeableIntersection>& intersections,
+	WavefrontBounce& bounce)
+{
+	int nWarps = 0, nMaterials = 0, nTypes = 0;
+	for (int warp = 0; warp < nActive; warp += 32, ++nWarps)
+	{
+		std::vector<int> warpMaterials, warpTypes;
+		for (int i = warp; i < std::min(nActive, warp + 32); ++i)
+		{
+			const ShadeableIntersection& isect = intersections[i];
+			int material = isect.t > 0.f ? isect.materialId : -1;
+			int type = isect.t > 0.f ? (int)materials[isect.materialId].type : -1;
+			if (std::find(warpMaterials.begin(), warpMaterials.end(), material) == warpMaterials.end())
+				warpMaterials.push_back(material);
+			if (std::find(warpTypes.begin(), warpTypes.end(), type) == warpTypes.end())
+				warpTypes.push_back(type);
+		}
+		nMaterials += warpMaterials.size();
+		nTypes += warpTypes.size();
+	}
+	bounce.materialsPerWarp = nWarps ? (float)nMaterials / nWarps : 0.f;
+	bounce.typesPerWarp = nWarps ? (float)nTypes / nWarps : 0.f;
+}
+
+// diffuse stand-in for MIS, misses end the path without light
+static void shadePath(PathSegment& path, const ShadeableIntersection& isect, const Material* materials, PathSampler& rng)
+{
+	if (isect.t <= 0.f)
+	{
+		path.remainingBounces = 0;
+		return;
+	}
+	const Material& m = materials[isect.materialId];
+	if (m.emittance > 0.f)
+	{
+		path.accumLight += path.throughput * m.color * m.emittance;
+		path.remainingBounces = 0;
+		return;
+	}
+	glm::vec3 normal = glm::dot(isect.surfaceNormal, path.ray.direction) > 0.f ? -isect.surfaceNormal : isect.surfaceNormal;
+	path.ray.origin = getPointOnRay(path.ray, isect.t);
+	path.ray.direction = calculateRandomDirectionInHemisphere(normal, rng);
+	path.throughput *= m.color;
+	path.remainingBounces--;
+}
+
+static WavefrontStats traceAoS(const Camera& cam, const SceneAccel& accel, const Material* materials, int traceDepth, int iter,
+	std::vector<glm::vec3>& image, ThreadPool& pool)
+{
+	WavefrontStats stats;
+	int nPixels = cam.resolution.x * cam.resolution.y;
+	std::vector<PathSegment> paths(nPixels);
+	std::vector<PathSegment> terminated;
+	terminated.reserve(nPixels);
+	std::vector<ShadeableIntersection> intersections(nPixels);
+	for (int y = 0; y < cam.resolution.y; ++y)
+	{
+		for (int x = 0; x < cam.resolution.x; ++x)
+		{
+			PathSegment& path = paths[x + y * cam.resolution.x];
+			path.ray = cameraRay(cam, x, y, iter);
+			path.pixelIndex = x + y * cam.resolution.x;
+			path.remainingBounces = traceDepth;
+		}
+	}
+
+	auto isTerminated = [](const PathSegment& path) { return path.isTerminated(); };
+	int nActive = nPixels;
+	for (int depth = 1; depth <= traceDepth && nActive > 0; ++depth)
+	{
+		stats.bounces++;
+		stats.pathBounces += nActive;
+
+		auto start = WavefrontClock::now();
+		pool.parallelFor(nActive, 256, [&](int64_t begin, int64_t end, int threadIndex) {
+			for (int64_t i = begin; i < end; ++i)
+			{
+				PathSegment path = paths[i];
+				ShadeableIntersection isect;
+				SceneIntersect(path.ray, accel, &isect);
+				intersections[i] = isect;
+			}
+		});
+		stats.intersectMs += msSince(start);
+		stats.intersectBytes += (int64_t)nActive * (sizeof(PathSegment) + sizeof(ShadeableIntersection));
+
+		start = WavefrontClock::now();
+		pool.parallelFor(nActive, 256, [&](int64_t begin, int64_t end, int threadIndex) {
+			for (int64_t i = begin; i < end; ++i)
+			{
+				PathSegment path = paths[i];
+				PathSampler rng(Sampler(), path.pixelIndex, iter - 1, depth, SAMPLE_BSDF);
+				shadePath(path, intersections[i], materials, rng);
+				paths[i] = path;
+			}
+		});
+		stats.shadeMs += msSince(start);
+		stats.shadeBytes += (int64_t)nActive * (2 * sizeof(PathSegment) + sizeof(ShadeableIntersection));
+
+		// copy_if and remove_if each read every record and write the ones they keep
+		start = WavefrontClock::now();
+		size_t nTerminated = terminated.size();
+		std::copy_if(paths.begin(), paths.begin() + nActive, std::back_inserter(terminated), isTerminated);
+		int nRemaining = std::remove_if(paths.begin(), paths.begin() + nActive, isTerminated) - paths.begin();
+		stats.compactMs += msSince(start);
+		stats.compactBytes += (2 * (int64_t)nActive + (terminated.size() - nTerminated) + nRemaining) * sizeof(PathSegment);
+		nActive = nRemaining;
+	}
+
+	for (const PathSegment& path : terminated)
+		image[path.pixelIndex] += path.accumLight;
+	for (int i = 0; i < nActive; ++i)
+		image[paths[i].pixelIndex] += paths[i].accumLight;
+	return stats;
+}
+
+static WavefrontStats traceSoA(const Camera& cam, const SceneAccel& accel, const Material* materials, int traceDepth, int iter,
+	std::vector<glm::vec3>& image, ThreadPool& pool, int sortMinPaths)
+{
+	WavefrontStats stats;
+	int nPixels = cam.resolution.x * cam.resolution.y;
+	HostPathState storage;
+	storage.resize(nPixels);
+	PathState paths = storage.view();
+	std::vector<int> activePaths(nPixels);
+	std::vector<int> scratch(nPixels);
+	std::vector<BVHAccel::MortonPrimitive> keys, keyScratch;
+	std::vector<ShadeableIntersection> sortedIntersections(nPixels);
+	std::vector<ShadeableIntersection> intersections(nPixels);
+	for (int y = 0; y < cam.resolution.y; ++y)
+	{
+		for (int x = 0; x < cam.resolution.x; ++x)
+		{
+			int slot = x + y * cam.resolution.x;
+			paths.initPath(slot, cameraRay(cam, x, y, iter), traceDepth);
+			activePaths[slot] = slot;
+		}
+	}
+
+	int nActive = nPixels;
+	for (int depth = 1; depth <= traceDepth && nActive > 0; ++depth)
+	{
+		stats.bounces++;
+		stats.pathBounces += nActive;
+
+		auto start = WavefrontClock::now();
+		pool.parallelFor(nActive, 256, [&](int64_t begin, int64_t end, int threadIndex) {
+			for (int64_t i = begin; i < end; ++i)
+			{
+				ShadeableIntersection isect;
+				SceneIntersect(paths.loadRay(activePaths[i]), accel, &isect);
+				intersections[i] = isect;
+			}
+		});
+		stats.intersectMs += msSince(start);
+		stats.intersectBytes += (int64_t)nActive * (sizeof(int) + PathState::rayBytes + sizeof(ShadeableIntersection));
+
+		WavefrontBounce bounce;
+		bounce.paths = nActive;
+		if (sortMinPaths >= 0 && nActive >= sortMinPaths)
+		{
+			start = WavefrontClock::now();
+			sortByMaterial(pool, materials, nActive, activePaths, intersections, keys, keyScratch, scratch, sortedIntersections);
+			bounce.sortMs = msSince(start);
+		}
+		warpCoherence(materials, nActive, intersections, bounce);
+
+		start = WavefrontClock::now();
+		pool.parallelFor(nActive, 256, [&](int64_t begin, int64_t end, int threadIndex) {
+			for (int64_t i = begin; i < end; ++i)
+			{
+				int slot = activePaths[i];
+				PathSegment path = paths.load(slot);
+				PathSampler rng(Sampler(), slot, iter - 1, depth, SAMPLE_BSDF);
+				shadePath(path, intersections[i], materials, rng);
+				paths.store(slot, path);
+			}
+		});
+		bounce.shadeMs = msSince(start);
+		stats.shadeMs += bounce.shadeMs;
+		stats.shadeBytes += (int64_t)nActive * (sizeof(int) + sizeof(ShadeableIntersection) + 2 * PathState::bytesPerPath);
+		stats.perBounce.push_back(bounce);
+
+		// reads every slot and its bounce count, the slots it keeps are written to scratch and moved back
+		start = WavefrontClock::now();
+		int nRemaining = compactActivePaths(pool, activePaths.data(), nActive, scratch.data(), paths);
+		stats.compactMs += msSince(start);
+		stats.compactBytes += (int64_t)nActive * (sizeof(int) + sizeof(int)) + (int64_t)nRemaining * 3 * sizeof(int);
+		nActive = nRemaining;
+	}
+
+	for (int slot = 0; slot < nPixels; ++slot)
+		image[slot] += paths.accumLight[slot];
+	return stats;
+}
+
+WavefrontStats traceWavefront(PathLayout layout, const Camera& cam, const SceneAccel& accel, const Material* materials,
+	int traceDepth, int iter, std::vector<glm::vec3>& image, ThreadPool& pool, int sortMinPaths)
+{
+	image.resize(cam.resolution.x * cam.resolution.y, glm::vec3(0.f));
+	if (layout == PathLayout::AoS)
+		return traceAoS(cam, accel, materials, traceDepth, iter, image, pool);
+	return traceSoA(cam, accel, materials, traceDepth, iter, image, pool, sortMinPaths);
+}
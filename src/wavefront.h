@@ -0,0 +1,61 @@
+#pragma once
+#include "bvhInstance.h"
+#include "pathState.h"
+#include "sampler.h"
+#include "threadPool.h"
+
+// Host version of the wavefront loop in pathtrace(): camera, intersect, shade and compact stages
+// over either PathSegment records (compacted with copy_if / remove_if like the old device loop)
+// or PathState (compacted as a slot list). Shading is a cosine weighted bounce off the material
+// color and emitters end the path, so this measures the memory traffic of the loop rather than the
+// final image. CpuPathTracer runs the full shading (MIS, the BSDFs, the environment map) on the host.
+enum class PathLayout
+{
+	AoS,
+	SoA
+};
+
+// one bounce of the loop; materialsPerWarp and typesPerWarp are the distinct materials and
+// material types among each 32 consecutive paths in shading order, averaged over the bounce
+struct WavefrontBounce
+{
+	int paths = 0;
+	float sortMs = 0.f;
+	float shadeMs = 0.f;
+	float materialsPerWarp = 0.f;
+	float typesPerWarp = 0.f;
+};
+
+// bytes each stage reads and writes for the path state, intersections and slot lists; scene
+// traversal is the same for both layouts and is not counted
+struct WavefrontStats
+{
+	int bounces = 0;
+	int64_t pathBounces = 0; // active paths summed over bounces
+	int64_t intersectBytes = 0;
+	int64_t shadeBytes = 0;
+	int64_t compactBytes = 0;
+	float intersectMs = 0.f;
+	float shadeMs = 0.f;
+	float compactMs = 0.f;
+	std::vector<WavefrontBounce> perBounce;
+
+	int64_t totalBytes() const { return intersectBytes + shadeBytes + compactBytes; }
+	float bytesPerPathBounce() const { return pathBounces ? (float)totalBytes() / pathBounces : 0.f; }
+};
+
+// same rays as generateRayFromCamera, the jitter is rng's next two dimensions
+Ray cameraRay(const Camera& cam, int x, int y, PathSampler& rng);
+// independent samples for sample iter - 1 of the pixel
+Ray cameraRay(const Camera& cam, int x, int y, int iter);
+
+// Host stream compaction of the active slot list: keeps the slots of active[0, nActive) that are
+// still bouncing, in order, and returns how many there are. Every thread owns one contiguous
+// block and partitions it into the same range of scratch in a single pass over the slots and
+// their bounce counts; a scan of the block counts then places the survivors back in active.
+int compactActivePaths(ThreadPool& pool, int* active, int nActive, int* scratch, const PathState& paths);
+
+// One sample per pixel of cam, image receives the gathered radiance. With PathState, bounces with
+// at least sortMinPaths active paths are sorted by materialSortKey before shading (-1 never sorts).
+WavefrontStats traceWavefront(PathLayout layout, const Camera& cam, const SceneAccel& accel, const Material* materials,
+	int traceDepth, int iter, std::vector<glm::vec3>& image, ThreadPool& pool, int sortMinPaths = -1);